@@ -15,7 +15,7 @@ set "PATH=%ClangPath%\bin;%VSBasePath%\bin\Hostx64\x64;%PATH%"
 :: Compiler flags
 set INCLUDE_PATHS=-I%ClangInclude% -I"%WinSDKInclude%\ucrt" -I"%WinSDKInclude%\um" -I"%WinSDKInclude%\shared" -I"%VSPath%\include" -I..\src
 set CFLAGS="Please provide a build config: Debug, FastDebug, Release"
-set COMMON_CFLAGS=-Xclang -flto-visibility-public-std -std=gnu++17 -pedantic -g -gcodeview -gno-column-info -march=native -ftime-trace -fdiagnostics-absolute-paths -fopenmp-simd -fms-extensions -Wall -Wextra -Wfatal-errors -Wno-nested-anon-types -Wno-vla-extension -Wno-gnu-anonymous-struct -Wno-missing-braces -Wno-gnu-zero-variadic-macro-arguments
+set COMMON_CFLAGS=-Xclang -flto-visibility-public-std -std=gnu++17 -pedantic -g -gcodeview -gno-column-info -march=x86-64-v2 -ftime-trace -fdiagnostics-absolute-paths -fopenmp-simd -fms-extensions -Wall -Wextra -Wfatal-errors -Wno-nested-anon-types -Wno-vla-extension -Wno-gnu-anonymous-struct -Wno-missing-braces -Wno-gnu-zero-variadic-macro-arguments
 if %1==Release   (set CFLAGS=-O2 -funroll-loops -DNDEBUG -ftree-vectorize)
 if %1==Profile   (set CFLAGS=-Og -funroll-loops -DNDEBUG -ftree-vectorize)
 if %1==FastDebug (set CFLAGS=-Og                -DNDEBUG -ftree-vectorize)
@@ -6,6 +6,12 @@ export COMPILER=clang++
 export OUTPUT=$2
 export INCLUDE_PATHS=-I../src
 
+# Target architecture (the zfp kernels pick AVX2 or AVX-512 versions at run time, see idx2_cpu.h)
+if [ -z "$ARCH" ]
+  then
+    if [ "$(uname -m)" = "x86_64" ]; then export ARCH=x86-64-v2; else export ARCH=native; fi
+fi
+
 # Compiler flags
 export CFLAGS="-std=gnu++17 -fopenmp-simd -Wall -Wextra -Wpedantic -Wno-missing-braces -Wno-gnu-zero-variadic-macro-arguments -g -lpthread"
 
@@ -17,12 +23,12 @@ fi
 
 if [ "$1" = "FastDebug" ]
   then
-    export CFLAGS="$CFLAGS -Og -DNDEBUG -ftree-vectorize -march=native"
+    export CFLAGS="$CFLAGS -Og -DNDEBUG -ftree-vectorize -march=${ARCH}"
 fi
 
 if [ "$1" = "Release" ]
   then
-    export CFLAGS="$CFLAGS -gno-column-info -O2 -DNDEBUG -ftree-vectorize -march=native"
+    export CFLAGS="$CFLAGS -gno-column-info -O2 -DNDEBUG -ftree-vectorize -march=${ARCH}"
 fi
 
 # Compiling
@@ -13,14 +13,14 @@ set "PATH=%VSPath%\bin\Hostx64\x64;%VSBasePath%\bin\Hostx64\x64;%PATH%"
 :: Compiler flags
 set INCLUDE_PATHS=/I"%WinSDKInclude%\ucrt" /I"%WinSDKInclude%\um" /I"%WinSDKInclude%\shared" /I"%VSPath%\include" /I..\src
 set CFLAGS="Please provide a build config: Debug, FastDebug, Profile, Release"
-set COMMON_CFLAGS=/std:c++17 /FC /Zi /nologo /EHsc /GR- /Zo /Oi /W4 /wd4702 /wd4201 /wd4100 /wd4189 /wd4505 /wd4127 /wd4706 /arch:AVX2 /Zc:preprocessor
+set COMMON_CFLAGS=/std:c++17 /FC /Zi /nologo /EHsc /GR- /Zo /Oi /W4 /wd4702 /wd4201 /wd4100 /wd4189 /wd4505 /wd4127 /wd4706 /Zc:preprocessor
 if %1==Release   (set CFLAGS=/O2 /DNDEBUG)
 if %1==Profile   (set CFLAGS=/O2 /DNDEBUG)
 if %1==FastDebug (set CFLAGS=/Ox /DNDEBUG)
 if %1==Debug     (set CFLAGS=/Od /D_DEBUG)
 
 :: Compiler defs
-set COMMON_CDEFS=/D_CRT_SECURE_NO_WARNINGS /Didx2_Avx2
+set COMMON_CDEFS=/D_CRT_SECURE_NO_WARNINGS
 if %1==Release   (set CDEFS=                          )
 if %1==FastDebug (set CDEFS=/Didx2_Slow=1 /Didx2_Verbose=1)
 if %1==Profile   (set CDEFS=                          )
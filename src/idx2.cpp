@@ -31,17 +31,14 @@ ParseParams(int Argc, cstr* Argv) {
   else
     P.OutMode = params::out_mode::WriteToFile;
   if (P.Action == action::Encode) {
+    /* --input - reads the samples from the standard input (the field is described in main) */
+    P.StreamInput = OptExists(Argc, Argv, "--stream") || strcmp(P.InputFile, "-") == 0;
     error Err = ParseMeta(P.InputFile, &P.Meta);
-    if (ErrorExists(Err)) {
+    if (ErrorExists(Err) && strcmp(P.InputFile, "-") != 0) {
       fprintf(stderr, "Error parsing input information\n");
       fprintf(stderr, "%s\n", ToString(Err));
       exit(1);
     }
-    // TODO: provide support for other types
-    if (P.Meta.DType != dtype::float64 && P.Meta.DType != dtype::float32) {
-      fprintf(stderr, "Data type not supported\n");
-      exit(1);
-    }
     if (!OptVal(Argc, Argv, "--brick_size", &P.BrickDims3)) {
       fprintf(stderr, "Provide --brick_size\n");
       fprintf(stderr, "Example: --brick_size 32 32 32\n");
@@ -75,6 +72,7 @@ ParseParams(int Argc, cstr* Argv) {
     OptVal(Argc, Argv, "--quality_levels", &P.RdoLevels);
     OptVal(Argc, Argv, "--version", &P.Version);
     OptVal(Argc, Argv, "--out_dir", &P.OutDir);
+    OptVal(Argc, Argv, "--threads", &P.NThreads);
     char Temp[8];
     cstr TempPtr = Temp;
     if (OptExists(Argc, Argv, "--group_levels")) {
@@ -144,6 +142,30 @@ ParseParams(int Argc, cstr* Argv) {
     /* parse the quality level */
     if (!OptVal(Argc, Argv, "--quality_level", &P.QualityLevel)) {}
     if (!OptVal(Argc, Argv, "--decode_level", &P.DecodeLevel)) {}
+    /* parse the number of decoding threads */
+    if (!OptVal(Argc, Argv, "--threads", &P.NThreads)) {}
+    /* parse the maximum number of files to keep open */
+    if (!OptVal(Argc, Argv, "--max_open_files", &P.MaxOpenFiles)) {}
+    /* map the files in memory instead of reading them */
+    P.MapFiles = OptExists(Argc, Argv, "--mmap");
+    /* parse the memory budget (in MiB) of the chunk cache */
+    f64 CacheMb = 0;
+    if (OptVal(Argc, Argv, "--cache_mb", &CacheMb)) P.CacheBytes = i64(CacheMb * (1 << 20));
+    /* parse the size (in MiB) of the blocks of the arena that holds the chunk caches */
+    f64 ArenaMb = 0;
+    if (OptVal(Argc, Argv, "--arena_mb", &ArenaMb)) P.ArenaBytes = i64(ArenaMb * (1 << 20));
+    if (OptExists(Argc, Argv, "--coalesce_reads")) {
+      char Temp[8];
+      cstr TempPtr = Temp;
+      OptVal(Argc, Argv, "--coalesce_reads", &TempPtr);
+      P.CoalesceReads = strcmp(TempPtr, "yes") == 0;
+    }
+    /* parse the number of bricks whose chunks are prefetched on a separate thread */
+    if (!OptVal(Argc, Argv, "--prefetch", &P.PrefetchDepth)) {}
+    /* decode float32 fields with float32 bricks */
+    P.Float32Bricks = OptExists(Argc, Argv, "--float32_bricks");
+    /* only estimate what the decode would read */
+    P.DryRun = OptExists(Argc, Argv, "--dry_run");
   }
   return P;
 }
@@ -175,6 +197,19 @@ main(int Argc, cstr* Argv) {
   SetHandleAbortSignals();
   /* Read the parameters */
   params P = ParseParams(Argc, Argv);
+  /* use the zfp kernels of the given isa instead of those of the best isa the cpu supports */
+  cstr IsaStr = nullptr;
+  if (OptVal(Argc, Argv, "--isa", &IsaStr)) {
+    isa Isa = StringTo<isa>()(stref(IsaStr));
+    if (Isa == isa::__Invalid__) {
+      fprintf(stderr, "Provide --isa scalar, avx2 or avx512\n");
+      exit(1);
+    }
+    if (SetIsa(Isa) != Isa) {
+      stref UsedStr = ToString(Zfp.Isa);
+      fprintf(stderr, "The cpu does not support %s, using %.*s\n", IsaStr, UsedStr.Size, UsedStr.ConstPtr);
+    }
+  }
   if (P.Action == action::Encode) {
     error MetaOk = ParseMeta(P.InputFile, &P.Meta);
     if (!MetaOk) {
@@ -184,12 +219,16 @@ main(int Argc, cstr* Argv) {
         fprintf(stderr, "Example: --name miranda\n");
         exit(1);
       }
+      stref NameStr = idx2_StRef(P.Meta.Name);
+      Copy(stref(Str), &NameStr);
       Str = P.Meta.Field;
       if (!OptVal(Argc, Argv, "--field", &Str)) {
         fprintf(stderr, "Provide --field\n");
         fprintf(stderr, "Example: --field density\n");
         exit(1);
       }
+      stref FieldStr = idx2_StRef(P.Meta.Field);
+      Copy(stref(Str), &FieldStr);
       if (!OptVal(Argc, Argv, "--dims", &P.Meta.Dims3)) {
         fprintf(stderr, "Provide --dims\n");
         fprintf(stderr, "Example: --dims 96 96 96\n");
@@ -203,6 +242,11 @@ main(int Argc, cstr* Argv) {
       }
       P.Meta.DType = StringTo<dtype>()(Type);
     }
+    // TODO: provide support for other types
+    if (P.Meta.DType != dtype::float64 && P.Meta.DType != dtype::float32) {
+      fprintf(stderr, "Data type not supported\n");
+      exit(1);
+    }
   }
 
   { /* Perform the action */
@@ -211,16 +255,38 @@ main(int Argc, cstr* Argv) {
     if (P.Action == action::Encode) {
 //      RemoveDir(idx2_PrintScratch("%s/%s", P.OutDir, P.Meta.Name));
       idx2_ExitIfError(SetParams(&Idx2, P));
-      idx2_RAII(mmap_volume, Vol, (void)Vol, Unmap(&Vol));
-//      error Result = ReadVolume(P.Meta.File, P.Meta.Dims3, P.Meta.DType, &Vol.Vol);
-      idx2_ExitIfError(MapVolume(P.Meta.File, P.Meta.Dims3, P.Meta.DType, &Vol, map_mode::Read));
-      idx2_ExitIfError(Encode(&Idx2, P, Vol.Vol));
+      if (P.StreamInput) {
+        bool FromStdin = strcmp(P.InputFile, "-") == 0;
+        FILE* Fp = FromStdin ? stdin : fopen(P.Meta.File, "rb");
+        if (!Fp) {
+          fprintf(stderr, "Cannot open %s\n", P.Meta.File);
+          exit(1);
+        }
+        idx2_CleanUp(if (!FromStdin) fclose(Fp));
+        idx2_ExitIfError(EncodeStream(&Idx2, P, Fp));
+      } else {
+        idx2_RAII(mmap_volume, Vol, (void)Vol, Unmap(&Vol));
+//        error Result = ReadVolume(P.Meta.File, P.Meta.Dims3, P.Meta.DType, &Vol.Vol);
+        idx2_ExitIfError(MapVolume(P.Meta.File, P.Meta.Dims3, P.Meta.DType, &Vol, map_mode::Read));
+        idx2_ExitIfError(Encode(&Idx2, P, Vol.Vol));
+      }
     } else if (P.Action == action::Decode) {
       SetDir(&Idx2, P.InDir);
 //      brick_table<f64> BrickTable;
       idx2_ExitIfError(ReadMetaFile(&Idx2, idx2_PrintScratch("%s", P.InputFile)));
       idx2_ExitIfError(Finalize(&Idx2));
-      Decode(Idx2, P);
+      if (P.DryRun) {
+        idx2_RAII(decode_data, D, Init(&D, P.MaxOpenFiles));
+        decode_cost Cost;
+        idx2_ExitIfError(EstimateDecodeCost(Idx2, P, &D, &Cost));
+        printf("output grid         = " idx2_PrStrGrid " (%" PRIi64 " bytes)\n", idx2_PrGrid(Cost.OutGrid), Cost.OutputBytes);
+        printf("bricks              = %" PRIi64 "\n", Cost.NBricks);
+        printf("data files          = %" PRIi64 " chunks = %" PRIi64 " (%" PRIi64 " bytes)\n", Cost.NFiles, Cost.NChunks, Cost.ChunkBytes);
+        printf("exp  files          = %" PRIi64 " chunks = %" PRIi64 " (%" PRIi64 " bytes)\n", Cost.NExpFiles, Cost.NExpChunks, Cost.ExpBytes);
+        printf("index bytes         = %" PRIi64 "\n", Cost.IndexBytes);
+      } else {
+        idx2_ExitIfError(Decode(Idx2, P));
+      }
       // TODO: convert the brick table to a regular volume
     }
     Dealloc(&Idx2);
@@ -1,4 +1,6 @@
 // WARNING: idx2.hpp is auto-generated. Do not modify it manually.
+// The command to generate idx2.hpp is
+// quom idx2/src/idx2_lib.hpp idx2/src/idx2.hpp
 // To use the library, just do the following
 // #define idx2_Implementation
 // #include <idx2.hpp>
@@ -973,8 +975,7 @@ idx2_T(t) bool ErrorExists(const error<t>& Err);
 
 // TODO: think about thread safety
 // TODO: (double-ended) StackAllocator
-// TODO: aligned allocation
-// TODO: pool allocator
+// NOTE: see idx2_pool_allocator.h for a thread-safe pool of aligned blocks
 // TODO: add asserts
 
 #include <stdlib.h>
@@ -1024,6 +1025,10 @@ struct free_list_allocator;
 /* Try to allocate using one allocator first (the Primary), then if that fails,
  * use another allocator (the Secondary). */
 struct fallback_allocator;
+/*
+A linear allocator over a chain of large blocks (taken from some Parent allocator), all of which
+are freed at once by DeallocAll. Dealloc only reclaims the most recent allocation. Not thread-safe. */
+struct arena_allocator;
 
 struct mallocator : public allocator {
   bool Alloc(buffer* Buf, i64 Bytes) override;
@@ -1092,6 +1097,22 @@ struct fallback_allocator : public allocator {
   void DeallocAll() override;
 };
 
+struct arena_allocator : public allocator {
+  struct block { block* Next = nullptr; i64 Bytes = 0; }; // the header of a block
+  static constexpr i64 Align = 16; // the alignment of the allocations
+  linear_allocator Current; // the part of the current block after its header
+  block* Blocks = nullptr; // all the blocks, the most recent first
+  i64 BlockBytes = 0;
+  allocator* Parent = nullptr;
+  i64 NAllocs = 0; // the number of allocations since the last DeallocAll
+  i64 NBlocks = 0; // the number of allocations from Parent since the last DeallocAll
+  arena_allocator();
+  arena_allocator(i64 BlockBytesIn, allocator* ParentIn = &Mallocator());
+  bool Alloc(buffer* Buf, i64 Bytes) override;
+  void Dealloc(buffer* Buf) override;
+  void DeallocAll() override;
+};
+
 void Clone(const buffer& Src, buffer* Dst, allocator* Alloc = &Mallocator());
 
 /* Abstract away memory allocations/deallocations */
@@ -2548,6 +2569,42 @@ Clear(circular_queue<t, N>* Queue) {
 
 } // namespace idx2
 
+/* Detection of the instruction set extensions of the cpu (see zfp_kernels for their use) */
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define idx2_X86 1
+#endif
+
+/*
+The kernels that have a version for each isa are compiled for that isa with idx2_TargetAvx2 or
+idx2_TargetAvx512 (and with idx2_TargetScalar for the scalar version), independently of the flags
+of the build. Everything they call is inlined into them (so it is also compiled for their isa). The
+scalar kernels are compiled for the architecture the build targets. MSVC needs no flags to compile
+intrinsics, so the attributes only force the inlining there. */
+#if defined(idx2_X86) && (defined(__GNUC__) || defined(__clang__))
+#define idx2_TargetScalar __attribute__((flatten))
+#define idx2_TargetAvx2 __attribute__((target("avx2,bmi,bmi2,lzcnt,popcnt"), flatten))
+#define idx2_TargetAvx512 __attribute__((target("avx512f,avx512bw,avx512dq,avx512vl,avx2,bmi,bmi2,lzcnt,popcnt"), flatten))
+#elif defined(__GNUC__) || defined(__clang__)
+#define idx2_TargetScalar __attribute__((flatten))
+#define idx2_TargetAvx2 __attribute__((flatten))
+#define idx2_TargetAvx512 __attribute__((flatten))
+#else
+#define idx2_TargetScalar
+#define idx2_TargetAvx2
+#define idx2_TargetAvx512
+#endif
+
+idx2_Enum(isa, u8, scalar, avx2, avx512)
+
+namespace idx2 {
+
+/* Return the best isa that both the cpu and the operating system support (avx512 means AVX-512 F,
+BW, DQ and VL; the avx2 and avx512 kernels also use BMI1, BMI2 and LZCNT) */
+isa DetectIsa();
+
+} // namespace idx2
+
 // TODO: add RGB types
 
 idx2_Enum(dtype, i8,
@@ -3001,57 +3058,8 @@ operator bool() const { return Ok; }
 
 } // namespace idx2
 
-namespace idx2 {
-
-/* Only support the forward slash '/' separator. */
-struct path {
-  constexpr static int NPartsMax = 64;
-  stref Parts[NPartsMax] = {}; /* e.g. home, dir, file.txt */
-  int NParts = 0;
-  path();
-  path(const stref& Str);
-};
-
-void Init(path* Path, const stref& Str);
-/* Add a part to the end (e.g. "C:/Users" + "Meow" = "C:/Users/Meow"). */
-void Append(path* Path, const stref& Part);
-/* Remove the last part, e.g., removing the file name at the end of a path. */
-stref GetFileName(const stref& Path);
-stref GetDirName(const stref& Path);
-cstr ToString(const path& Path);
-/* Get the directory where the program is launched from. */
-bool IsRelative(const stref& Path);
-bool CreateFullDir(const stref& Path);
-bool DirExists(const stref& Path);
-void RemoveDir(cstr path);
-
-} // namespace idx2
-
-#if defined(__APPLE__)
-#include <fcntl.h>
-#include <unistd.h>
-#include <sys/types.h>
-#include <sys/stat.h>
+/* An LRU cache of files that are open for reading, keyed by a hash of the file path */
 
-inline int // TODO: move to file_utils.cpp
-fallocate(int fd, int mode, off_t offset, off_t len) {
-  (void)mode; // TODO: what to do with mode?
-  //int fd = PR_FileDesc2NativeHandle(aFD);
-  fstore_t store = {F_ALLOCATECONTIG, F_PEOFPOSMODE, offset, len, 0};
-  // Try to get a continous chunk of disk space
-  int ret = fcntl(fd, F_PREALLOCATE, &store);
-    if (-1 == ret){
-    // OK, perhaps we are too fragmented, allocate non-continuous
-    store.fst_flags = F_ALLOCATEALL;
-    ret = fcntl(fd, F_PREALLOCATE, &store);
-    if (-1 == ret)
-      return -1;
-  }
-  if (0 == ftruncate(fd, len))
-    return 0;
-  return -1;
-}
-#endif
 // TODO: inlining some of the functions
 // TODO: move the implementations out of this file into an .inl file
 // TODO: before each operation, check if the table has been init
@@ -3874,199 +3882,6 @@ Clone(const hash_table<k, v>& Src, hash_table<k, v>* Dst) {
 
 } // end namespace idx2
 
-namespace idx2 {
-
-idx2_T(t)
-struct list_node {
-  t Payload;
-  list_node* Next = nullptr;
-};
-
-idx2_T(t)
-struct list {
-  list_node<t>* Head = nullptr;
-  allocator* Alloc = nullptr;
-  i64 Size = 0;
-  list(allocator* Alloc = &Mallocator());
-};
-
-#define idx2_Li list_iterator<t>
-
-idx2_T(t)
-struct list_iterator {
-  list_node<t>* Node = nullptr;
-  list_iterator& operator++();
-  list_node<t>* operator->() const;
-  t& operator*() const;
-  bool operator!=(const list_iterator& Other);
-  bool operator==(const list_iterator& Other);
-};
-
-idx2_T(t) idx2_Li Begin(const list<t>& List);
-idx2_T(t) idx2_Li End  (const list<t>& List);
-idx2_T(t) idx2_Li Insert(list<t>* List, const idx2_Li& Where, const t& Payload);
-idx2_T(t) idx2_Li PushBack(list<t>* List, const t& Payload);
-idx2_T(t) void Dealloc(list<t>* List);
-idx2_T(t) i64 Size(const list<t>& List);
-
-} // namespace idx2
-
-namespace idx2 {
-
-idx2_Ti(t) list<t>::
-list(allocator* Alloc) : Alloc(Alloc) {}
-
-idx2_T(t) idx2_Li
-Insert(list<t>* List, const list_iterator<t>& Where, const t& Payload) {
-  buffer Buf;
-  List->Alloc->Alloc(&Buf, sizeof(list_node<t>));
-  list_node<t>* NewNode = (list_node<t>*)Buf.Data;
-  NewNode->Payload = Payload;
-  NewNode->Next = nullptr;
-  if (Where.Node) {
-    NewNode->Next = Where->Next;
-    Where->Next = NewNode;
-  }
-  ++List->Size;
-  return list_iterator<t>{NewNode};
-}
-
-idx2_T(t) idx2_Li
-PushBack(list<t>* List, const t& Payload) {
-  auto Node = List->Head;
-  list_node<t>* Prev = nullptr;
-  while (Node) {
-    Prev = Node;
-    Node = Node->Next;
-  }
-  auto NewNode = Insert(List, list_iterator<t>{Prev}, Payload);
-  if (!Prev) // this new node is the first node in the list
-    List->Head = NewNode.Node;
-  return NewNode;
-}
-
-idx2_T(t) void
-Dealloc(list<t>* List) {
-  auto Node = List->Head;
-  while (Node) {
-    buffer Buf((byte*)Node, sizeof(list_node<t>), List->Alloc);
-    Node = Node->Next;
-    List->Alloc->Dealloc(&Buf);
-  }
-  List->Head = nullptr;
-  List->Size = 0;
-}
-
-idx2_Ti(t) i64
-Size(const list<t>& List) { return List.Size; }
-
-idx2_Ti(t) list_iterator<t>&
-list_iterator<t>::operator++() {
-  idx2_Assert(Node);
-  Node = Node->Next;
-  return *this;
-}
-
-idx2_Ti(t) list_node<t>*
-list_iterator<t>::operator->() const {
-  idx2_Assert(Node);
-  return const_cast<list_node<t>*>(Node);
-}
-
-idx2_Ti(t) t& idx2_Li::
-operator*() const {
-  idx2_Assert(Node);
-  return const_cast<t&>(Node->Payload);
-}
-
-idx2_Ti(t) bool idx2_Li::
-operator!=(const list_iterator<t>& Other) { return Node != Other.Node; }
-
-idx2_Ti(t) bool idx2_Li::
-operator==(const list_iterator<t>& Other) { return Node == Other.Node; }
-
-idx2_Ti(t) idx2_Li
-Begin(const list<t>& List) { return list_iterator<t>{List.Head}; }
-
-idx2_Ti(t) idx2_Li
-End(const list<t>& List) { (void)List; return list_iterator<t>(); }
-
-#undef idx2_Li
-
-} // namespace idx2
-
-// TODO: add logging levels
-// TODO: multithreading?
-// TODO: per-file buffering mode
-// TODO: do we need more than one logger?
-
-#define idx2_MaxSlots 16
-
-namespace idx2 {
-
-enum class buffer_mode { Full, Line, None };
-
-struct logger {
-  stack_array<FILE*, idx2_MaxSlots> FHandles    = {};
-  stack_array<cstr , idx2_MaxSlots> FNames      = {};
-  stack_array<u32  , idx2_MaxSlots> FNameHashes = {};
-  buffer_mode Mode = buffer_mode::Full;
-};
-
-inline logger GlobalLogger;
-
-void SetBufferMode(logger* Logger, buffer_mode Mode);
-void SetBufferMode(buffer_mode Mode); // set buffer mode for the global logger
-
-} // namespace idx2
-
-/*
-Use the following macro for logging as follows
-idx2_Log("log.txt", "Message %d", A)
-idx2_Log(stderr, "Message %f", B) */
-#define idx2_Log(FileName, Format, ...)
-
-namespace idx2 {
-
-constexpr inline bool
-IsStdErr(cstr Input) {
-  return Input[0] == 's' && Input[1] == 't' && Input[2] == 'd' &&
-         Input[3] == 'e' && Input[4] == 'r' && Input[5] == 'r';
-}
-constexpr inline bool
-IsStdOut(cstr Input) {
-  return Input[0] == 's' && Input[1] == 't' && Input[2] == 'd' &&
-         Input[3] == 'o' && Input[4] == 'u' && Input[5] == 't';
-}
-
-idx2_T(t) constexpr cstr
-CastCStr(t Input) {
-  if constexpr (is_same_type<t, cstr>::Value)
-    return Input;
-  return nullptr;
-}
-
-} // namespace idx2
-
-#undef idx2_Log
-#if defined(idx2_Verbose)
-#define idx2_Log(FileName, Format, ...) {\
-  FILE* Fp = nullptr;\
-  if constexpr (IsStdErr(#FileName))\
-    Fp = stderr;\
-  else if constexpr (IsStdOut(#FileName))\
-    Fp = stdout;\
-  else\
-    Fp = idx2::GetFileHandle(&idx2::GlobalLogger, CastCStr(FileName));\
-  idx2::printer Pr(Fp);\
-  idx2_Print(&Pr, Format, __VA_ARGS__);\
-}
-#else
-#define idx2_Log(FileName, Format, ...)
-#endif
-
-#undef idx2_MaxSlots
-
 // TODO: implement a sliding-window approach, since a file mapping view
 // can be limited in size
 // TODO: add MAP_NORESERVE on Linux
@@ -4171,6 +3986,14 @@ bool TryLock(mutex* Mutex);
 /* Return true if the lock can be released. Return false if something goes wrong. */
 bool Unlock(mutex* Mutex);
 
+struct condition_variable;
+/*
+Release the mutex (which must be held), block until the condition variable is signalled, then
+acquire the mutex again. The wait can end without a signal, so the condition must be checked again. */
+bool Wait(condition_variable* Cond, mutex* Mutex);
+/* Wake up all the threads waiting on the condition variable */
+bool NotifyAll(condition_variable* Cond);
+
 }
 
 #if defined(_WIN32)
@@ -4216,12 +4039,29 @@ Unlock(mutex* Mutex) {
   return true;
 }
 
+struct condition_variable {
+  CONDITION_VARIABLE Cv;
+  condition_variable();
+};
+
+idx2_Inline condition_variable::
+condition_variable() { InitializeConditionVariable(&Cv); }
+
+idx2_Inline bool
+Wait(condition_variable* Cond, mutex* Mutex) { return SleepConditionVariableCS(&Cond->Cv, &Mutex->Crit, INFINITE) != 0; }
+
+idx2_Inline bool
+NotifyAll(condition_variable* Cond) {
+  WakeAllConditionVariable(&Cond->Cv);
+  return true;
+}
+
 } // namespace idx2
 #elif defined(__CYGWIN__) || defined(__linux__) || defined(__APPLE__)
 #include <pthread.h>
 namespace idx2 {
 struct mutex {
-  pthread_mutex_t Mx;
+  pthread_mutex_t Mx = PTHREAD_MUTEX_INITIALIZER;
 };
 
 struct lock {
@@ -4245,9 +4085,368 @@ TryLock(mutex* Mutex) { return pthread_mutex_trylock(&Mutex->Mx) == 0; }
 idx2_Inline bool
 Unlock(mutex* Mutex) { return pthread_mutex_unlock(&Mutex->Mx) == 0; }
 
+struct condition_variable {
+  pthread_cond_t Cv = PTHREAD_COND_INITIALIZER;
+};
+
+idx2_Inline bool
+Wait(condition_variable* Cond, mutex* Mutex) { return pthread_cond_wait(&Cond->Cv, &Mutex->Mx) == 0; }
+
+idx2_Inline bool
+NotifyAll(condition_variable* Cond) { return pthread_cond_broadcast(&Cond->Cv) == 0; }
+
+} // namespace idx2
+#endif
+
+namespace idx2 {
+
+struct fd_entry {
+  file_handle File;
+  i64 Bytes = 0; // size of the file
+  u64 LastUse = 0;
+  int NUsers = 0; // an entry in use is never closed
+};
+
+/*
+The key is a hash of the path since the ids of data, exponent, and rdo files can coincide.
+The files are read with positional reads (pread), so several threads can read from the same file
+at the same time. When there are MaxOpenFiles open files, opening one more file closes the least
+recently used file that is not in use. */
+struct fd_cache {
+  hash_table<u64, fd_entry> Files;
+  int MaxOpenFiles = 256;
+  u64 Clock = 0;
+  i64 NHits = 0;
+  i64 NMisses = 0;
+  mutex Mutex;
+};
+
+void Init(fd_cache* Fc, int MaxOpenFiles);
+/* Close all the files */
+void Dealloc(fd_cache* Fc);
+
+/* The key of a file in the cache (a 64-bit FNV-1a hash of the path) */
+u64 FdKey(cstr FileName);
+/*
+Return the handle of a file (opening it if it is not in the cache) and its size. The file is not
+closed until Release is called. Return false if the file cannot be opened. */
+bool Acquire(fd_cache* Fc, u64 Key, cstr FileName, file_handle* File, i64* Bytes);
+void Release(fd_cache* Fc, u64 Key);
+
+/* Read Bytes bytes starting at Offset. Return false if fewer bytes are read. */
+bool ReadAt(file_handle File, i64 Offset, void* Dst, i64 Bytes);
+
+/* Read the Bytes bytes right before *Where, then move *Where to the start of those bytes */
+idx2_Inline bool
+ReadBackwardAt(file_handle File, i64* Where, void* Dst, i64 Bytes) {
+  *Where -= Bytes;
+  return ReadAt(File, *Where, Dst, Bytes);
+}
+
+idx2_T(t) idx2_Inline bool
+ReadBackwardPOD(file_handle File, i64* Where, t* Val) { return ReadBackwardAt(File, Where, Val, sizeof(t)); }
+
+} // namespace idx2
+
+namespace idx2 {
+
+/* Only support the forward slash '/' separator. */
+struct path {
+  constexpr static int NPartsMax = 64;
+  stref Parts[NPartsMax] = {}; /* e.g. home, dir, file.txt */
+  int NParts = 0;
+  path();
+  path(const stref& Str);
+};
+
+void Init(path* Path, const stref& Str);
+/* Add a part to the end (e.g. "C:/Users" + "Meow" = "C:/Users/Meow"). */
+void Append(path* Path, const stref& Part);
+/* Remove the last part, e.g., removing the file name at the end of a path. */
+stref GetFileName(const stref& Path);
+stref GetDirName(const stref& Path);
+cstr ToString(const path& Path);
+/* Get the directory where the program is launched from. */
+bool IsRelative(const stref& Path);
+bool CreateFullDir(const stref& Path);
+bool DirExists(const stref& Path);
+void RemoveDir(cstr path);
+
+} // namespace idx2
+
+#if defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+inline int // TODO: move to file_utils.cpp
+fallocate(int fd, int mode, off_t offset, off_t len) {
+  (void)mode; // TODO: what to do with mode?
+  //int fd = PR_FileDesc2NativeHandle(aFD);
+  fstore_t store = {F_ALLOCATECONTIG, F_PEOFPOSMODE, offset, len, 0};
+  // Try to get a continous chunk of disk space
+  int ret = fcntl(fd, F_PREALLOCATE, &store);
+    if (-1 == ret){
+    // OK, perhaps we are too fragmented, allocate non-continuous
+    store.fst_flags = F_ALLOCATEALL;
+    ret = fcntl(fd, F_PREALLOCATE, &store);
+    if (-1 == ret)
+      return -1;
+  }
+  if (0 == ftruncate(fd, len))
+    return 0;
+  return -1;
+}
+#endif
+
+namespace idx2 {
+
+idx2_T(t)
+struct list_node {
+  t Payload;
+  list_node* Next = nullptr;
+};
+
+idx2_T(t)
+struct list {
+  list_node<t>* Head = nullptr;
+  allocator* Alloc = nullptr;
+  i64 Size = 0;
+  list(allocator* Alloc = &Mallocator());
+};
+
+#define idx2_Li list_iterator<t>
+
+idx2_T(t)
+struct list_iterator {
+  list_node<t>* Node = nullptr;
+  list_iterator& operator++();
+  list_node<t>* operator->() const;
+  t& operator*() const;
+  bool operator!=(const list_iterator& Other);
+  bool operator==(const list_iterator& Other);
+};
+
+idx2_T(t) idx2_Li Begin(const list<t>& List);
+idx2_T(t) idx2_Li End  (const list<t>& List);
+idx2_T(t) idx2_Li Insert(list<t>* List, const idx2_Li& Where, const t& Payload);
+idx2_T(t) idx2_Li PushBack(list<t>* List, const t& Payload);
+idx2_T(t) void Dealloc(list<t>* List);
+idx2_T(t) i64 Size(const list<t>& List);
+
+} // namespace idx2
+
+namespace idx2 {
+
+idx2_Ti(t) list<t>::
+list(allocator* Alloc) : Alloc(Alloc) {}
+
+idx2_T(t) idx2_Li
+Insert(list<t>* List, const list_iterator<t>& Where, const t& Payload) {
+  buffer Buf;
+  List->Alloc->Alloc(&Buf, sizeof(list_node<t>));
+  list_node<t>* NewNode = (list_node<t>*)Buf.Data;
+  NewNode->Payload = Payload;
+  NewNode->Next = nullptr;
+  if (Where.Node) {
+    NewNode->Next = Where->Next;
+    Where->Next = NewNode;
+  }
+  ++List->Size;
+  return list_iterator<t>{NewNode};
+}
+
+idx2_T(t) idx2_Li
+PushBack(list<t>* List, const t& Payload) {
+  auto Node = List->Head;
+  list_node<t>* Prev = nullptr;
+  while (Node) {
+    Prev = Node;
+    Node = Node->Next;
+  }
+  auto NewNode = Insert(List, list_iterator<t>{Prev}, Payload);
+  if (!Prev) // this new node is the first node in the list
+    List->Head = NewNode.Node;
+  return NewNode;
+}
+
+idx2_T(t) void
+Dealloc(list<t>* List) {
+  auto Node = List->Head;
+  while (Node) {
+    buffer Buf((byte*)Node, sizeof(list_node<t>), List->Alloc);
+    Node = Node->Next;
+    List->Alloc->Dealloc(&Buf);
+  }
+  List->Head = nullptr;
+  List->Size = 0;
+}
+
+idx2_Ti(t) i64
+Size(const list<t>& List) { return List.Size; }
+
+idx2_Ti(t) list_iterator<t>&
+list_iterator<t>::operator++() {
+  idx2_Assert(Node);
+  Node = Node->Next;
+  return *this;
+}
+
+idx2_Ti(t) list_node<t>*
+list_iterator<t>::operator->() const {
+  idx2_Assert(Node);
+  return const_cast<list_node<t>*>(Node);
+}
+
+idx2_Ti(t) t& idx2_Li::
+operator*() const {
+  idx2_Assert(Node);
+  return const_cast<t&>(Node->Payload);
+}
+
+idx2_Ti(t) bool idx2_Li::
+operator!=(const list_iterator<t>& Other) { return Node != Other.Node; }
+
+idx2_Ti(t) bool idx2_Li::
+operator==(const list_iterator<t>& Other) { return Node == Other.Node; }
+
+idx2_Ti(t) idx2_Li
+Begin(const list<t>& List) { return list_iterator<t>{List.Head}; }
+
+idx2_Ti(t) idx2_Li
+End(const list<t>& List) { (void)List; return list_iterator<t>(); }
+
+#undef idx2_Li
+
+} // namespace idx2
+
+// TODO: add logging levels
+// TODO: multithreading?
+// TODO: per-file buffering mode
+// TODO: do we need more than one logger?
+
+#define idx2_MaxSlots 16
+
+namespace idx2 {
+
+enum class buffer_mode { Full, Line, None };
+
+struct logger {
+  stack_array<FILE*, idx2_MaxSlots> FHandles    = {};
+  stack_array<cstr , idx2_MaxSlots> FNames      = {};
+  stack_array<u32  , idx2_MaxSlots> FNameHashes = {};
+  buffer_mode Mode = buffer_mode::Full;
+};
+
+inline logger GlobalLogger;
+
+void SetBufferMode(logger* Logger, buffer_mode Mode);
+void SetBufferMode(buffer_mode Mode); // set buffer mode for the global logger
+
+} // namespace idx2
+
+/*
+Use the following macro for logging as follows
+idx2_Log("log.txt", "Message %d", A)
+idx2_Log(stderr, "Message %f", B) */
+#define idx2_Log(FileName, Format, ...)
+
+namespace idx2 {
+
+constexpr inline bool
+IsStdErr(cstr Input) {
+  return Input[0] == 's' && Input[1] == 't' && Input[2] == 'd' &&
+         Input[3] == 'e' && Input[4] == 'r' && Input[5] == 'r';
+}
+constexpr inline bool
+IsStdOut(cstr Input) {
+  return Input[0] == 's' && Input[1] == 't' && Input[2] == 'd' &&
+         Input[3] == 'o' && Input[4] == 'u' && Input[5] == 't';
+}
+
+idx2_T(t) constexpr cstr
+CastCStr(t Input) {
+  if constexpr (is_same_type<t, cstr>::Value)
+    return Input;
+  return nullptr;
+}
+
 } // namespace idx2
+
+#undef idx2_Log
+#if defined(idx2_Verbose)
+#define idx2_Log(FileName, Format, ...) {\
+  FILE* Fp = nullptr;\
+  if constexpr (IsStdErr(#FileName))\
+    Fp = stderr;\
+  else if constexpr (IsStdOut(#FileName))\
+    Fp = stdout;\
+  else\
+    Fp = idx2::GetFileHandle(&idx2::GlobalLogger, CastCStr(FileName));\
+  idx2::printer Pr(Fp);\
+  idx2_Print(&Pr, Format, __VA_ARGS__);\
+}
+#else
+#define idx2_Log(FileName, Format, ...)
 #endif
 
+#undef idx2_MaxSlots
+
+/* A thread-safe allocator of equally sized blocks (e.g. bricks), with a cache of blocks per thread */
+
+#include <atomic>
+
+namespace idx2 {
+
+constexpr int PoolBlockAlign = 64; // the alignment of the blocks (a cache line, or an avx-512 vector)
+constexpr int PoolBatchSize = 8; // the number of blocks moved at once between a cache and its pool
+
+/*
+The free blocks of a session (an encode, or a decode_data) that are not in the cache of any thread.
+They are kept in batches of up to PoolBatchSize blocks, which form a lock-free stack: a batch is
+pushed with a compare-and-swap, and a batch is taken by taking the whole stack with an exchange and
+pushing the other batches back, so that no thread ever reads a batch that another thread has taken
+(which makes the stack immune to the ABA problem). A thread that finds the stack empty (possibly
+because another thread holds all the batches for a moment) allocates a new block instead. */
+struct block_pool {
+  struct block {
+    block* Next = nullptr; // the next block in the same list (or batch)
+    block* NextBatch = nullptr; // only used by the first block of a batch in the stack
+  };
+  i64 BlockBytes = 0; // rounded up to a multiple of PoolBlockAlign
+  std::atomic<block*> Batches{nullptr};
+  std::atomic<i64> NBlocks{0}; // the number of blocks allocated from the system
+};
+
+/* Blocks can hold up to Bytes bytes */
+void Init(block_pool* Pool, i64 Bytes);
+/* Free the blocks in the pool. Blocks that are in use or in a cache are not freed. */
+void Trim(block_pool* Pool);
+/* Free the blocks, all of which must have been given back (see DeallocAll(pool_allocator*)) */
+void Dealloc(block_pool* Pool);
+
+/*
+The cache of blocks of one thread. Only that thread allocates from it (without synchronization), but
+a block can be deallocated by any thread: the block goes back to the cache it came from, through a
+lock-free list that the cache takes over when it runs out of blocks. A cache holds at most
+2 * PoolBatchSize blocks and gives the rest back to its pool; an empty cache takes a batch from the
+pool. Allocations larger than the blocks of the pool are done with Mallocator(). */
+struct pool_allocator : public allocator {
+  block_pool* Pool = nullptr;
+  block_pool::block* Head = nullptr; // the blocks in the cache
+  int NBlocks = 0; // the number of blocks in Head
+  std::atomic<block_pool::block*> Freed{nullptr}; // the blocks deallocated since the last Alloc
+  bool Alloc(buffer* Buf, i64 Bytes) override;
+  void Dealloc(buffer* Buf) override;
+  /* Give all the blocks in the cache back to the pool. No other thread may use the cache meanwhile. */
+  void DeallocAll() override;
+};
+
+void Init(pool_allocator* Cache, block_pool* Pool);
+
+} // namespace idx2
+
 /*
  * Tiny self-contained version of the PCG Random Number Generation for C++
  * put together from pieces of the much larger C/C++ codebase.
@@ -4516,6 +4715,8 @@ namespace idx2 {
 struct grid;
 struct volume;
 
+// TODO: avoid having too many overloaded functions here
+
 /* Computing errors between two functions */
 idx2_T(t) f64 SqError(const buffer_t<t>& FBuf, const buffer_t<t>& GBuf);
 idx2_T(t) f64 SqError(const grid& FGrid, const volume& FVol, const grid& GGrid, const volume& GVol);
@@ -5456,6 +5657,9 @@ CopyGridGrid(const grid& SGrid, const volume& SVol, const grid& DGrid, volume* D
   } idx2_EndFor3
 }
 
+/* CopyGridGrid between volumes of type f32 or f64, converting the type if needed */
+void CopyGridGrid(const grid& SGrid, const volume& SVol, const grid& DGrid, volume* DVol);
+
 idx2_TT(stype, dtype) void
 CopyExtentExtent(const extent& SGrid, const volume& SVol, const extent& DGrid, volume* DVol) {
   idx2_Assert(Dims(SGrid) == Dims(DGrid));
@@ -5692,6 +5896,25 @@ idx2_T(t) void ILiftCdf53X(const grid& Grid, const v3i& M3, lift_option Opt, vol
 idx2_T(t) void ILiftCdf53Y(const grid& Grid, const v3i& M3, lift_option Opt, volume* Vol);
 idx2_T(t) void ILiftCdf53Z(const grid& Grid, const v3i& M3, lift_option Opt, volume* Vol);
 
+/* Y (Axis = 1) and Z (Axis = 2) lifting with the same results as FLiftCdf53Y/Z and ILiftCdf53Y/Z,
+but the lines next to each other in X are lifted together (in tiles that fit in the L2 cache), so
+that every step of the lifting is vectorized across the lines */
+idx2_T(t) void FLiftCdf53Tiled(int Axis, const grid& Grid, const v3i& M3, lift_option Opt, volume* Vol);
+idx2_T(t) void ILiftCdf53Tiled(int Axis, const grid& Grid, const v3i& M3, lift_option Opt, volume* Vol);
+
+/*
+The lifting of f32 (Lift[Axis][0]) and f64 (Lift[Axis][1]) volumes along each axis, in one version
+per isa (see zfp_kernels). The X kernels are FLiftCdf53X/ILiftCdf53X, and the Y and Z kernels are
+FLiftCdf53Tiled/ILiftCdf53Tiled. SetIsa also sets the kernels of Cdf53. */
+using lift_kernel = void (*)(const grid& Grid, const v3i& M3, lift_option Opt, volume* Vol);
+struct cdf53_kernels {
+  isa Isa = isa::scalar;
+  lift_kernel FLift[3][2];
+  lift_kernel ILift[3][2];
+};
+extern cdf53_kernels Cdf53;
+const cdf53_kernels& GetCdf53Kernels(isa Isa);
+
 /* "In-place" extrapolate a volume to size 2^L+1, which is assumed to be the
 dims of Vol. The original volume is stored in the D3 sub-volume of Vol. */
 void Extrapolate(v3i D3, volume* Vol);
@@ -5718,7 +5941,33 @@ void ExtrapolateCdf53(const transform_details& Td, volume* Vol);
 void ForwardCdf53(const v3i& Dims3, const v3i& M3, int Iter, int NLevels, u64 TformOrder, volume* Vol, bool Normalize = false);
 void InverseCdf53(const v3i& Dims3, const v3i& M3, int Iter, int NLevels, u64 TformOrder, volume* Vol, bool Normalize = false);
 void ForwardCdf53(const v3i& M3, int Iter, const array<subband>& Subbands, const transform_details& Td, volume* Vol, bool Normalize = false);
+/* A lifting pass (with lift_option::Normal) along Axis of Grid */
+struct lift_pass {
+  grid Grid;
+  v3i M3;
+  i8 Axis = 0;
+  bool Inverse = false;
+};
+/* Whether two lifting passes can be done together, one slice of the volume at a time (see LiftCdf53) */
+bool CanFuse(const lift_pass& A, const lift_pass& B);
+/* The normalization of the subbands that ForwardCdf53(M3, Iter, Subbands, Td, Vol, LastIter) does after the lifting */
+void NormalizeCdf53(const v3i& M3, int Iter, const array<subband>& Subbands, const transform_details& Td, volume* Vol, bool LastIter);
+/* Append the lifting passes of ForwardCdf53(M3, Td, Vol) (or InverseCdf53(M3, Td, Vol)) to Passes */
+void PushForwardPasses(const transform_details& Td, const v3i& M3, array<lift_pass>* Passes);
+void PushInversePasses(const transform_details& Td, const v3i& M3, array<lift_pass>* Passes);
+/* Do the lifting passes in order. Two passes in a row on the same grid and axis (where a transform
+ends and the next one starts, e.g. the inverse transform of an extrapolation and the forward
+transform that follows it) are fused into a single sweep through the volume: both are done on a
+slice of the volume (which stays in the cache) before the next slice. */
+void LiftCdf53(const array<lift_pass>& Passes, volume* Vol);
+/* Do the lifting passes as above, then copy the samples in SGrid of Vol to DGrid of OutVol (f32 or
+f64). The copy is fused with the last pass: a slice of SGrid is copied as soon as the last pass is
+done on it. */
+void LiftCdf53(const array<lift_pass>& Passes, volume* Vol, const grid& SGrid, const grid& DGrid, volume* OutVol);
 void InverseCdf53(const v3i& M3, int Iter, const array<subband>& Subbands, const transform_details& Td, volume* Vol, bool Normalize = false);
+/* The inverse normalization that InverseCdf53(M3, Iter, Subbands, Td, Vol, LastIter) does before the
+lifting, skipping the subbands not in SbMask (which must be all zeros) */
+void DenormalizeCdf53(const v3i& M3, int Iter, const array<subband>& Subbands, const transform_details& Td, volume* Vol, bool LastIter, u8 SbMask = 0xFF);
 void ForwardCdf53Old(volume* Vol, int NLevels);
 void InverseCdf53Old(volume* Vol, int NLevels);
 void ForwardCdf53Ext(const extent& Ext, volume* Vol);
@@ -6126,6 +6375,153 @@ idx2_ILiftCdf53(Z, Y, X) // X inverse lifting
 idx2_ILiftCdf53(Z, X, Y) // Y inverse lifting
 idx2_ILiftCdf53(Y, X, Z) // Z inverse lifting
 
+/* The steps of the lifting on the samples of three rows of lines (see FLiftCdf53Lines) */
+idx2_TIi(t, Unit) void
+Cdf53Predict(t* idx2_Restrict C, const t* idx2_Restrict A, const t* idx2_Restrict B, i64 NS, int Sl) {
+  for (i64 I = 0; I < NS; I += (Unit ? 1 : Sl)) C[I] -= (A[I] + B[I]) / 2;
+}
+idx2_TIi(t, Unit) void
+Cdf53InversePredict(t* idx2_Restrict C, const t* idx2_Restrict A, const t* idx2_Restrict B, i64 NS, int Sl) {
+  for (i64 I = 0; I < NS; I += (Unit ? 1 : Sl)) C[I] += (A[I] + B[I]) / 2;
+}
+idx2_TIi(t, Unit) void
+Cdf53Update(t* idx2_Restrict A, t* idx2_Restrict B, const t* idx2_Restrict V, i64 NS, int Sl) {
+  for (i64 I = 0; I < NS; I += (Unit ? 1 : Sl)) { A[I] += V[I] / 4; B[I] += V[I] / 4; }
+}
+idx2_TIi(t, Unit) void
+Cdf53InverseUpdate(t* idx2_Restrict A, t* idx2_Restrict B, const t* idx2_Restrict V, i64 NS, int Sl) {
+  for (i64 I = 0; I < NS; I += (Unit ? 1 : Sl)) { A[I] -= V[I] / 4; B[I] -= V[I] / 4; }
+}
+
+/*
+Lift NL lines at once: the samples of a line are Rs apart, the lines are Sl apart (Sl is 1 if
+Unit), and F points to the first sample of the first line. P, D, S, M are From, Dims, Strd and M3
+along the lifting axis. Each step of FLiftCdf53##x is done on all the lines before the next one,
+which gives the same results, but the loops over the lines vectorize. */
+idx2_TI(t, Unit) void
+FLiftCdf53Lines(t* F, i64 Rs, int Sl, int NL, int P, int D, int S, int M, lift_option Opt) {
+  if (Unit) Sl = 1;
+  i64 NS = i64(NL) * Sl;
+  int x0 = Min(P + S * D, M); /* extrapolated position */
+  int x1 = Min(P + S * (D - 1), M); /* last position */
+  int x2 = P + S * (D - 2); /* second last position */
+  int x3 = P + S * (D - 3); /* third last position */
+  bool Ext = IsEven(D);
+  if (Ext) { /* x0 and x1 can be the same row */
+    const t* A = F + x2 * Rs; const t* B = F + x1 * Rs; t* C = F + x0 * Rs;
+    for (i64 I = 0; I < NS; I += Sl) C[I] = 2 * B[I] - A[I];
+  }
+  /* predict (excluding last odd position) */
+  for (int x = P + S; x < x2; x += 2 * S)
+    Cdf53Predict<t, Unit>(F + x * Rs, F + (x - S) * Rs, F + (x + S) * Rs, NS, Sl);
+  if (!Ext) {
+    Cdf53Predict<t, Unit>(F + x2 * Rs, F + x1 * Rs, F + x3 * Rs, NS, Sl);
+  } else if (x1 < M) {
+    t* C = F + x1 * Rs;
+    for (i64 I = 0; I < NS; I += Sl) C[I] = 0;
+  }
+  /* update (excluding last odd position) */
+  if (Opt == lift_option::NoUpdate)
+    return;
+  for (int x = P + S; x < x2; x += 2 * S)
+    Cdf53Update<t, Unit>(F + (x - S) * Rs, F + (x + S) * Rs, F + x * Rs, NS, Sl);
+  if (!Ext) {
+    if (Opt == lift_option::Normal) {
+      Cdf53Update<t, Unit>(F + x3 * Rs, F + x1 * Rs, F + x2 * Rs, NS, Sl);
+    } else {
+      t* A = F + x3 * Rs; t* B = F + x1 * Rs; const t* V = F + x2 * Rs;
+      for (i64 I = 0; I < NS; I += Sl) A[I] += V[I] / 4;
+      if (Opt == lift_option::PartialUpdateLast)
+        for (i64 I = 0; I < NS; I += Sl) B[I] = V[I] / 4;
+    }
+  }
+}
+
+/* The inverse of FLiftCdf53Lines, in the same way as ILiftCdf53##x */
+idx2_TI(t, Unit) void
+ILiftCdf53Lines(t* F, i64 Rs, int Sl, int NL, int P, int D, int S, int M, lift_option Opt) {
+  if (Unit) Sl = 1;
+  i64 NS = i64(NL) * Sl;
+  int x0 = Min(P + S * D, M); /* extrapolated position */
+  int x1 = Min(P + S * (D - 1), M); /* last position */
+  int x2 = P + S * (D - 2); /* second last position */
+  int x3 = P + S * (D - 3); /* third last position */
+  bool Ext = IsEven(D);
+  /* inverse update (excluding last odd position) */
+  if (Opt != lift_option::NoUpdate) {
+    for (int x = P + S; x < x2; x += 2 * S)
+      Cdf53InverseUpdate<t, Unit>(F + (x - S) * Rs, F + (x + S) * Rs, F + x * Rs, NS, Sl);
+    if (!Ext) {
+      if (Opt == lift_option::Normal) {
+        Cdf53InverseUpdate<t, Unit>(F + x3 * Rs, F + x1 * Rs, F + x2 * Rs, NS, Sl);
+      } else {
+        t* A = F + x3 * Rs; const t* V = F + x2 * Rs;
+        for (i64 I = 0; I < NS; I += Sl) A[I] -= V[I] / 4;
+      }
+    } else { /* x0 and x1 can be the same row */
+      const t* A = F + x0 * Rs; const t* B = F + x2 * Rs; t* C = F + x1 * Rs;
+      for (i64 I = 0; I < NS; I += Sl) C[I] = (A[I] + B[I]) / 2;
+    }
+  }
+  /* inverse predict (excluding last odd position) */
+  for (int x = P + S; x < x2; x += 2 * S)
+    Cdf53InversePredict<t, Unit>(F + x * Rs, F + (x - S) * Rs, F + (x + S) * Rs, NS, Sl);
+  if (!Ext)
+    Cdf53InversePredict<t, Unit>(F + x2 * Rs, F + x1 * Rs, F + x3 * Rs, NS, Sl);
+}
+
+/* The number of lines that FLiftCdf53Tiled and ILiftCdf53Tiled lift together, so that the D rows of
+a tile take about Cdf53TileBytes (a tile is lifted a few times, once per step) */
+constexpr i64 Cdf53TileBytes = i64(128) << 10;
+idx2_T(t) int
+Cdf53TileLines(int D, int Sl) {
+  i64 RowBytes = Min(i64(Sl) * i64(sizeof(t)), i64(64)); /* each line takes at most a cache line */
+  i64 Lines = Cdf53TileBytes / (i64(D) * RowBytes);
+  return int(Max(i64(8), Min(Lines, i64(1024))) & ~i64(7));
+}
+
+/* The lines along Y (Axis = 1) or Z (Axis = 2) that have the same z (or y) are lifted in tiles of
+lines adjacent in X with FLiftCdf53Lines (or ILiftCdf53Lines). The lines whose x is clamped to M.X
+all lift the same samples, so they are lifted one by one, after the others, in the order of
+FLiftCdf53##x. */
+#define idx2_LiftCdf53Tiled(Name, Lines)\
+idx2_T(t) void \
+Name(int Axis, const grid& Grid, const v3i& M, lift_option Opt, volume* Vol) {\
+  v3i P = From(Grid), D = Dims(Grid), S = Strd(Grid), N = Dims(*Vol);\
+  int A = Axis, O = 3 - Axis; /* the lifting axis and the outer axis */\
+  idx2_Assert(A == 1 || A == 2);\
+  if (D[A] == 1) return;\
+  idx2_Assert(M[A] <= N[A]);\
+  idx2_Assert(IsPow2(S.X) && IsPow2(S.Y) && IsPow2(S.Z));\
+  idx2_Assert(D[A] >= 2);\
+  idx2_Assert(IsEven(P[A]));\
+  idx2_Assert(P[A] + S[A] * (D[A] - 2) < M[A]);\
+  idx2_Assert(!IsEven(D[A]) || M[A] < N[A]);\
+  buffer_t<t> Buf(Vol->Buffer);\
+  t* F = Buf.Data;\
+  i64 Rs = A == 1 ? i64(N.X) : i64(N.X) * N.Y;\
+  i64 Os = O == 1 ? i64(N.X) : i64(N.X) * N.Y;\
+  int NLines = P.X > M.X ? 0 : Min(D.X, (M.X - P.X) / S.X + 1); /* the lines not clamped */\
+  int Tile = Cdf53TileLines<t>(D[A], S.X);\
+  for (int z = P[O]; z < P[O] + S[O] * D[O]; z += S[O]) {\
+    t* Fz = F + Min(z, M[O]) * Os;\
+    for (int I = 0; I < NLines; I += Tile) {\
+      t* Fl = Fz + P.X + i64(I) * S.X;\
+      int NL = Min(Tile, NLines - I);\
+      if (S.X == 1)\
+        Lines<t, true>(Fl, Rs, 1, NL, P[A], D[A], S[A], M[A], Opt);\
+      else\
+        Lines<t, false>(Fl, Rs, S.X, NL, P[A], D[A], S[A], M[A], Opt);\
+    }\
+    for (int I = NLines; I < D.X; ++I)\
+      Lines<t, true>(Fz + M.X, Rs, 1, 1, P[A], D[A], S[A], M[A], Opt);\
+  }\
+}
+
+idx2_LiftCdf53Tiled(FLiftCdf53Tiled, FLiftCdf53Lines)
+idx2_LiftCdf53Tiled(ILiftCdf53Tiled, ILiftCdf53Lines)
+#undef idx2_LiftCdf53Tiled
+
 idx2_FLiftCdf53Old(Z, Y, X) // X forward lifting
 idx2_FLiftCdf53Old(Z, X, Y) // Y forward lifting
 idx2_FLiftCdf53Old(Y, X, Z) // Z forward lifting
@@ -6159,6 +6555,57 @@ idx2_ILiftCdf53Const(Y, X, Z) // Z inverse lifting
 #undef idx2_RowY
 #undef idx2_RowZ
 
+/* A write-back cache of the files that the encoder appends to, keyed by a hash of the file path */
+
+namespace idx2 {
+
+struct write_entry {
+  char Path[256] = {};
+  buffer Buf; // the bytes not written yet are Buf[0, Size)
+  i64 Size = 0;
+  file_handle File;
+  bool IsOpen = false;
+  u64 LastUse = 0;
+};
+
+/*
+The bytes appended to a file are kept in a buffer of that file, which is written with a single
+write once it holds FlushBytes bytes. If all buffers together hold more than MaxBytes bytes, they
+are all written. At most MaxOpenFiles files are open; opening one more file closes the least
+recently used one. The directory of a file is created (if needed) before the file is first
+opened, once per directory. A write_cache is used by one thread at a time (each unit of the
+encoder has its own, see EncodeLevels). */
+struct write_cache {
+  hash_table<u64, write_entry> Files;
+  hash_table<u64, bool> Dirs; // the directories known to exist, keyed by a hash of the path
+  int MaxOpenFiles = 64;
+  int NOpenFiles = 0;
+  i64 FlushBytes = i64(1) << 20;
+  i64 MaxBytes = i64(64) << 20;
+  i64 Bytes = 0; // the number of bytes in all buffers
+  u64 Clock = 0;
+  i64 NWrites = 0;
+  i64 NOpens = 0;
+};
+
+void Init(write_cache* Wc, int MaxOpenFiles = 64);
+/* Write what is left in the buffers, close all the files, and free the buffers */
+void Dealloc(write_cache* Wc);
+/* Drop what is left in the buffers (after a write failed) and close all the files */
+void Discard(write_cache* Wc);
+
+/* Append Bytes bytes to a file, which is created if it does not exist. Return false if a write fails. */
+bool Append(write_cache* Wc, const stref& FileName, const void* Data, i64 Bytes);
+/* Append the concatenation of NParts buffers. If they add up to at least FlushBytes and nothing of
+the file is buffered, they are written with a single gather write instead of being copied. */
+bool Append(write_cache* Wc, const stref& FileName, const buffer* Parts, int NParts);
+idx2_T(t) idx2_Inline bool
+AppendPOD(write_cache* Wc, const stref& FileName, const t& Val) { return Append(Wc, FileName, &Val, sizeof(t)); }
+/* Write the buffers of all files and close them. Return false if a write fails. */
+bool Flush(write_cache* Wc);
+
+} // namespace idx2
+
 // TODO: this code currently works only on little-endian machine. make sure it
 // works for both types of endianess
 // TODO: bound checking?
@@ -6496,6 +6943,48 @@ IncreaseCapacity(bitstream* Bs, i64 NewCapacity) {
 
 } // namespace idx2
 
+#include <math.h>
+
+namespace idx2 {
+
+struct stat {
+  f64 MinV = traits<f64>::Max;
+  f64 MaxV = traits<f64>::Min;
+  f64 S = 0;
+  i64 N = 0;
+  f64 SSq = 0;
+
+  idx2_Inline void Add(f64 Val) {
+    MinV = Min(MinV, Val);
+    MaxV = Max(MaxV, Val);
+    S += Val;
+    ++N;
+    SSq += Val * Val;
+  }
+
+  /* combine with the statistics of another (disjoint) set of values */
+  idx2_Inline void Add(const stat& Other) {
+    MinV = Min(MinV, Other.MinV);
+    MaxV = Max(MaxV, Other.MaxV);
+    S += Other.S;
+    N += Other.N;
+    SSq += Other.SSq;
+  }
+
+  idx2_Inline f64 GetMin() const { return MinV; }
+  idx2_Inline f64 GetMax() const { return MaxV; }
+  idx2_Inline f64 Sum() const { return S; }
+  idx2_Inline i64 Count() const { return N; }
+  idx2_Inline f64 SumSq() const { return SSq; }
+  idx2_Inline f64 Avg() const { return S / N; }
+  idx2_Inline f64 AvgSq() const { return SSq / N; }
+  idx2_Inline f64 SqAvg() const { f64 A = Avg(); return A * A; }
+  idx2_Inline f64 Var() const { return AvgSq() - SqAvg(); }
+  idx2_Inline f64 StdDev() const { return sqrt(Var()); }
+};
+
+}
+
 idx2_Enum(action, u8, Encode, Decode)
 idx2_Enum(idx2_file_err_code, u8, idx2_CommonErrs,
   BrickSizeNotPowerOfTwo, BrickSizeTooBig, TooManyLevels, TooManyTransformPassesPerLevel,
@@ -6545,6 +7034,17 @@ struct params {
   bool GroupSubLevels = true;
   array<int> RdoLevels;
   int DecodeLevel = 0;
+  int NThreads = 1; // number of threads that encode (or decode the bricks of a level) concurrently
+  bool StreamInput = false; // read the input in slabs instead of mapping it (see EncodeStream)
+  int MaxOpenFiles = 256; // maximum number of files the decoder keeps open
+  bool MapFiles = false; // decode from memory-mapped files instead of reading them
+  i64 CacheBytes = 0; // the decoder evicts chunks to stay under this many bytes (0 means no limit)
+  i64 ArenaBytes = 0; // if > 0, a one-shot decode allocates its chunk caches in blocks of this size (see arena_allocator)
+  bool CoalesceReads = true; // read the chunks of a batch of bricks ahead of decoding, merging nearby chunks
+  int PrefetchDepth = 0; // if > 0, read the chunks of up to this many bricks ahead on a separate thread
+  bool DryRun = false; // only estimate the cost of the decode (see EstimateDecodeCost)
+  bool KeepBlockStates = false; // keep the zfp state of the decoded blocks so that later decodes only refine them
+  bool Float32Bricks = false; // decode float32 fields with float32 bricks (see GetDecodeBrickType)
   bool WaveletOnly = false;
 //  bool WaveletOnly = true;
 };
@@ -6704,11 +7204,19 @@ struct brick_volume {
 idx2_Inline i64 Size(const brick_volume& B) { return Prod(Dims(B.Vol)) * SizeOf(B.Vol.Type); }
 
 // Each channel corresponds to one (iteration, subband, bit plane) tuple
+/* A byte stream stored in fixed-size segments, so that appending never moves the bytes already written */
+struct segmented_stream {
+  static constexpr i64 SegBytes = 16384;
+  array<buffer> Segs;
+  i64 Bytes = 0; // the bytes written, which span the first (Bytes + SegBytes - 1) / SegBytes segments
+};
+idx2_Inline i64 Size(const segmented_stream& Ss) { return Ss.Bytes; }
+
 struct channel {
   /* brick-related streams, to be reset once per chunk */
   bitstream BrickDeltasStream; // store data for many bricks
   bitstream BrickSzsStream; // store data for many bricks
-  bitstream BrickStream; // store data for many bricks
+  segmented_stream BrickStream; // store data for many bricks
   /* block-related streams, to be reset once per brick */
   bitstream BlockStream; // store data for many blocks
   u64 LastChunk = 0; // current chunk
@@ -6740,9 +7248,24 @@ struct block_sig {
   i16 BitPlane = 0;
 };
 
+/* The state of one bit plane of the subband being encoded (see EncodeSubband) */
+struct channel_slot {
+  channel* Channel = nullptr; // valid if Gen == encode_data::ChannelGen
+  u32 Gen = 0;
+  i32 Sig = -1; // index into encode_data::BlockSigs
+};
+
+/* The first error of a unit of bricks that a thread encodes (see EncodeLevels). The message of an
+error is formatted in a thread_local buffer (see idx2_Error), so it is copied here by that thread,
+and the error is made again by the thread that reports it. */
+struct unit_error {
+  idx2_file_err_code Code = idx2_file_err_code::NoError;
+  char Msg[256] = {};
+};
+
 /* We use this to pass data between different stages of the encoder */
 struct encode_data {
-  allocator* Alloc = nullptr;
+  allocator* Alloc = nullptr; // the cache (see pool_allocator) of the thread that encodes the bricks
   hash_table<u64, brick_volume> BrickPool;
   hash_table<u32, channel> Channels; // each corresponds to (bit plane, iteration, level)
   hash_table<u16, sub_channel> SubChannels; // only consider level and iteration
@@ -6754,19 +7277,39 @@ struct encode_data {
   hash_table<u64, bitstream> ChunkEMaxesMeta; // map from file address to a stream of chunk emax sizes
   bitstream CpresEMaxes;
   bitstream CpresChunkAddrs;
-  bitstream ChunkStream;
+  bitstream ChunkStream; // the header of a chunk (see WriteChunk)
+  array<buffer> ChunkParts; // the parts of a chunk, in order
   /* block emaxes related */
   bitstream ChunkEMaxesStream;
   array<block_sig> BlockSigs;
+  /* [bit plane - lowest bit plane encoded] -> slot, reset for each subband; this saves a lookup in
+  Channels and a search in BlockSigs per block per bit plane */
+  array<channel_slot> ChannelSlots;
+  u32 ChannelGen = 1; // incremented whenever a channel is inserted (which can move the channels)
   array<i16> EMaxes;
   bitstream BlockStream; // only used by v0.1
   array<t2<u32, channel*>> SortedChannels;
   array<rdo_chunk> ChunkRDOs; // list of chunks and their sizes, sorted by bit plane
   hash_table<u64, u32> ChunkRDOLengths;
+  array<u32> ChannelOrder; // channel keys in the order the channels are created
+  v2d ValueRange = v2d(traits<f64>::Max, traits<f64>::Min); // of the samples encoded so far
+  dtype BrickType = dtype::float64; // the type of the bricks (see GetEncodeBrickType)
+  bool OneLevel = false; // the parent bricks are left in the brick pool instead of being encoded (see EncodeLevels)
+  unit_error Error; // the first error of the unit of bricks this encode_data encodes, if any
+  write_cache Writer; // all appends to the data, exponent and rdo files go through this
+  hash_table<u64, array<lift_pass>> BrickLiftPasses; // keyed by the dims of a brick (see GetBrickLiftPasses)
+  /* book-keeping stuffs */
+  stat BrickDeltasStat, BrickSzsStat, BrickStreamStat, ChunkStreamStat;
+  stat BrickEMaxesStat, ChunkEMaxesStat, ChunkEMaxSzsStat;
+  stat BlockStat, BlockEMaxStat;
+  stat CpresChunkAddrsStat, ChunkAddrsStat, ChunkSzsStat;
 };
 
 struct chunk_exp_cache {
   bitstream BrickExpsStream;
+  u64 LastUse = 0;
+  i32 NUsers = 0; // a chunk in use is never evicted
+  bool Loading = false; // being read by a thread (without the cache lock), other threads wait for it
 };
 idx2_Inline i64 Size(const chunk_exp_cache& ChunkExpCache) { return Size(ChunkExpCache.BrickExpsStream.Stream); }
 struct chunk_rdo_cache {
@@ -6776,6 +7319,9 @@ idx2_Inline i64 Size(const chunk_rdo_cache& ChunkRdoCache) { return Size(ChunkRd
 
 struct chunk_cache {
   i32 ChunkPos; // chunk position in the file
+  i32 NUsers = 0; // a chunk in use is never evicted
+  bool Loading = false; // being read by a thread (without the cache lock), other threads wait for it
+  u64 LastUse = 0;
   array<u64> Bricks;
   array<i32> BrickSzs;
   bitstream ChunkStream;
@@ -6784,6 +7330,7 @@ idx2_Inline i64 Size(const chunk_cache& C) { return Size(C.Bricks) * sizeof(u64)
 struct file_exp_cache {
   array<chunk_exp_cache> ChunkExpCaches;
   array<i32> ChunkExpSzs;
+  bool Loading = false; // an empty placeholder while a thread reads the file
 };
 idx2_Inline i64 Size(const file_exp_cache& F) {
   i64 Result = 0;
@@ -6793,6 +7340,7 @@ idx2_Inline i64 Size(const file_exp_cache& F) {
 }
 struct file_rdo_cache {
   array<chunk_rdo_cache> TileRdoCaches;
+  bool Loading = false; // an empty placeholder while a thread reads the file
 };
 idx2_Inline i64 Size(const file_rdo_cache& F) {
   i64 Result = 0;
@@ -6802,6 +7350,7 @@ idx2_Inline i64 Size(const file_rdo_cache& F) {
 struct file_cache {
   array<i64> ChunkSizes; // TODO: 32-bit to store chunk sizes?
   hash_table<u64, chunk_cache> ChunkCaches; // [chunk address] -> chunk cache
+  bool Loading = false; // an empty placeholder while a thread reads the file
 };
 idx2_Inline i64 Size(const file_cache& F) {
   i64 Result = 0;
@@ -6821,10 +7370,63 @@ idx2_Inline i64 Size(const file_cache_table& F) {
   idx2_ForEach(It, F.FileRdoCaches) Result += Size(*It.Val);
   return Result;
 }
+/* A chunk (or exponent chunk) that is in memory */
+struct cached_chunk {
+  chunk_cache* Chunk = nullptr;
+  chunk_exp_cache* ChunkExp = nullptr;
+};
+idx2_Inline i64 Size(const cached_chunk& C) { return C.Chunk ? Size(*C.Chunk) : Size(*C.ChunkExp); }
+
+/* The zfp decoder state of a block after the bit planes decoded so far */
+struct block_state {
+  u64 UInts[4 * 4 * 4] = {}; // the negabinary coefficients
+  i8 N = 0; // the number of coefficients that are significant
+  i8 NBps = 0; // the number of bit planes decoded, starting from the most significant one
+};
+/*
+The block states of a subband of a brick. A decode that continues from these states reads and
+decodes only the bit planes below LowestBp, which were not needed by the earlier decodes. */
+struct subband_state {
+  array<block_state> Blocks; // in the order in which the blocks are decoded
+  i16 LowestBp = traits<i16>::Max; // all bit planes >= LowestBp are in Blocks
+};
+
 struct decode_data {
-  allocator* Alloc = nullptr;
+  allocator* Alloc = nullptr; // &BrickCache, where the bricks are allocated
+  block_pool BrickBlocks; // the memory of the bricks of the main decode_data (see Main)
+  pool_allocator BrickCache; // the cache of BrickBlocks of Main that this decode_data allocates from
   file_cache_table FcTable;
+  /* FcTable and the chunks in it are allocated with CacheAlloc, which is either Mallocator() or, for
+  a one-shot decode with P.ArenaBytes, Arena (which is only accessed under Mutex, and freed at once) */
+  allocator* CacheAlloc = &Mallocator();
+  arena_allocator Arena;
+  /* the chunks in FcTable that are in memory, the least recently used of which are evicted when
+  CacheBytes exceeds MaxCacheBytes (0 means no limit) */
+  array<cached_chunk> ResidentChunks;
+  i64 CacheBytes = 0;
+  i64 PeakCacheBytes = 0;
+  i64 MaxCacheBytes = 0;
+  i64 NEvictions = 0;
+  u64 CacheClock = 0;
+  /* chunks read ahead of decoding, and the (fewer, larger) reads they were merged into */
+  i64 NPlannedChunks = 0;
+  i64 NPlannedBytes = 0;
+  i64 NPlannedReads = 0;
+  i64 NPlannedReadBytes = 0;
+  array<cached_chunk> PinnedChunks; // chunks in use by the subband being decoded (per thread)
+  fd_cache FdCache; // files opened for reading
+  bool MapFiles = false; // if true, files are mapped (once) instead of read through FdCache
+  hash_table<u64, mmap_file> MappedFiles; // [hash of the file path] -> mapped file
   hash_table<u64, brick_volume> BrickPool;
+  bool KeepBlockStates = false;
+  hash_table<u64, subband_state> BlockStates; // [brick key, subband] -> block states
+  /* when decoding with multiple threads, each thread has its own decode_data whose Main points to
+  the decode_data that owns FcTable (and its resident chunks), FdCache, MappedFiles, BrickPool,
+  BlockStates and BrickBlocks (these are only accessed under Mutex, except FdCache which has its own
+  lock, and BrickBlocks which is lock-free) */
+  decode_data* Main = nullptr;
+  mutex Mutex;
+  condition_variable Loaded; // signalled when a file or a chunk that was Loading is in FcTable (or failed to be read)
   i8 Iter = 0;
   i8 Level = 0;
   stack_array<u64, idx2_file::MaxLevels> Brick;
@@ -6833,16 +7435,58 @@ struct decode_data {
   i32 BrickInChunk = 0;
   stack_array<u64, idx2_file::MaxLevels> Offsets = {{}}; // used by v0.0 only
   bitstream BlockStream; // used only by v0.1
-  hash_table<i16, bitstream> Streams;
+  array<bitstream> Streams; // [bit plane - lowest bit plane decoded] -> stream, for the subband being decoded
+  array<i32> StreamSlots; // the entries of Streams in use (the others have no Stream.Data)
   buffer CompressedChunkExps;
+  bitstream ChunkExpStream; // an exponent chunk decompressed without the cache lock
+  array<u64> ChunkBricks; // the bricks of a chunk read without the cache lock
+  array<i32> ChunkBrickSzs;
   bitstream ChunkEMaxSzsStream;
   bitstream ChunkAddrsStream;
   bitstream ChunkSzsStream;
-//  array<t2<u64, u64>> RequestedChunks; // is cleared after each tile
   int QualityLevel = -1;
   int EffIter = 0;
   u64 LastTile = 0;
+  bool IsPrefetcher = false; // the io time of a prefetch thread is hidden behind decoding
+};
+/* What a decode would read and produce, computed without decoding (see EstimateDecodeCost) */
+struct decode_cost {
+  grid OutGrid; // the output grid
+  i64 OutputBytes = 0; // the size of the output volume
+  i64 NBricks = 0; // the number of bricks decoded (over all levels)
+  i64 NFiles = 0; // the number of data files touched
+  i64 NChunks = 0; // the number of bit plane chunks read
+  i64 ChunkBytes = 0; // the compressed size of these chunks
+  i64 ResidentChunkBytes = 0; // the part of ChunkBytes already in the chunk cache (not read again)
+  i64 NExpFiles = 0; // the number of exponent files touched
+  i64 NExpChunks = 0; // the number of exponent chunks read
+  i64 ExpBytes = 0; // the compressed size of these chunks
+  i64 IndexBytes = 0; // the size of the chunk indices of the files that are not yet cached
 };
+
+/* With P.Float32Bricks, the bricks of float32 fields are decoded in float32, which halves the memory
+traffic and the size of the brick pool. The inverse lifting then rounds the coefficients to float32,
+which can add an error of a few float32 ulps of the largest values of the field (this only shows when
+the tolerance is close to the precision of float32). By default the bricks are decoded in float64. */
+idx2_Inline dtype GetDecodeBrickType(const idx2_file& Idx2, const params& P) {
+  bool F32 = P.Float32Bricks && Idx2.Version == v2i(1, 0) && Idx2.DType == dtype::float32;
+  return F32 ? dtype::float32 : dtype::float64;
+}
+
+/* The smallest tolerance, relative to the largest absolute value of a field, at which the encoder
+transforms the bricks of a float32 field in float32 */
+constexpr f64 MinF32BrickAccuracy = 1024 * FLT_EPSILON;
+
+/* The bricks of a float32 field can be transformed in float32, which halves the memory traffic and
+the size of the brick pool. The lifting then rounds the coefficients to float32, which adds an error
+of a few float32 ulps of the largest values of the field, so this is only done when the tolerance
+is far above that. MaxAbs is the largest absolute value of the field, or a negative number if it is
+not known (the bricks are then transformed in float64). */
+idx2_Inline dtype GetEncodeBrickType(const idx2_file& Idx2, f64 MaxAbs) {
+  bool F32 = Idx2.Version == v2i(1, 0) && Idx2.DType == dtype::float32 && MaxAbs >= 0 &&
+             Idx2.Accuracy >= MinF32BrickAccuracy * MaxAbs;
+  return F32 ? dtype::float32 : dtype::float64;
+}
 idx2_Inline i64 SizeBrickPool(const decode_data& D) {
   i64 Result = 0;
   idx2_ForEach(It, D.BrickPool) Result += Size(*It.Val);
@@ -6897,7 +7541,36 @@ void WriteMetaFile(const idx2_file& Idx2, cstr FileName);
 
 // TODO: return an error code?
 error<idx2_file_err_code> Encode(idx2_file* Idx2, const params& P, const volume& Vol);
-void Decode(const idx2_file& Idx2, const params& P, buffer* OutBuf = nullptr);
+/*
+Encode the samples read from Fp (a raw file or a pipe, X varies fastest) in Z slabs one brick thick,
+so the field does not have to fit in memory. The bricks of a slab are copied into the brick pools
+of their level-0 units (which cover whole files, see GetLog2LevelUnit) and the slab buffer is reused
+for the next slab. A unit is encoded (on up to P.NThreads threads) and its files written as soon as
+all of its bricks are read, and so is a unit of a coarser level once its bricks are all filled, so
+only the bricks of the units that straddle the current slab are kept. A level stored in a single
+file is kept until the last slab. The output is the same as that of Encode. With grouped levels or
+v0.x the bricks cannot be split into units, and all of them are kept until the last slab. */
+error<idx2_file_err_code> EncodeStream(idx2_file* Idx2, const params& P, FILE* Fp);
+error<idx2_file_err_code> Decode(const idx2_file& Idx2, const params& P, buffer* OutBuf = nullptr);
+/*
+Decode with the caches of D, which are kept for the next call (D must have been initialized with Init).
+The bricks are all decoded even if some of them fail, and the first error is returned. */
+error<idx2_file_err_code> Decode(const idx2_file& Idx2, const params& P, decode_data* D, buffer* OutBuf);
+/* The bricks are allocated from a pool that D owns (D->BrickBlocks), with a cache per thread.
+With ArenaBytes > 0, the chunk caches are allocated in an arena and freed only by Dealloc, so D
+should be used for a single decode without a cache limit. */
+void Init(decode_data* D, int MaxOpenFiles = 256, i64 ArenaBytes = 0);
+void Dealloc(decode_data* D);
+/*
+Compute what decoding with P would read, without reading any bit plane chunk (only the chunk indices
+of the files and the exponent chunks are read, and they stay in the caches of D) */
+error<idx2_file_err_code> EstimateDecodeCost(const idx2_file& Idx2, const params& P, decode_data* D, decode_cost* Cost);
+/* Drop all the cached file information, chunks and block states of D and close its files */
+void ClearCaches(decode_data* D);
+/* Drop the block states kept by the decodes with P.KeepBlockStates */
+void ClearBlockStates(decode_data* D);
+/* Evict the least recently used chunks of D until at most MaxBytes are cached, and free unused brick memory */
+void TrimCaches(decode_data* D, i64 MaxBytes);
 void EncodeSubbandV0_0(idx2_file* Idx2, encode_data* E, const grid& SbGrid, volume* BrickVol);
 error<idx2_file_err_code> DecodeSubbandV0_0(const idx2_file& Idx2, decode_data* D, const grid& SbGrid, volume* BVol);
 void EncodeSubbandV0_1(idx2_file* Idx2, encode_data* E, const grid& SbGrid, volume* BrickVol);
@@ -6986,7 +7659,9 @@ ReadUnary(bitstream* Bs) {
 
 /* Adapted from the zfp compression library */
 
+#if defined(idx2_X86)
 #include <immintrin.h>
+#endif
 //#include <iostream>
 
 namespace idx2 {
@@ -7012,12 +7687,45 @@ idx2_TT(t, u) void ForwardShuffle(t* IBlock, u* UBlock, int D);
 idx2_TT(t, u) void InverseShuffle(u* UBlock, t* IBlock, int D);
 idx2_TTI(t, u, S) void ForwardShuffle2D(t* IBlock, u* UBlock);
 idx2_TTI(t, u, S) void InverseShuffle2D(u* UBlock, t* IBlock);
+/* ForwardZfp followed by ForwardShuffle (InverseShuffle followed by InverseZfp) of N full 4x4x4
+blocks, stored one after another in IBlocks and UBlocks */
+idx2_I(N) void ForwardZfpBatch(const i64* IBlocks, u64* UBlocks);
+idx2_I(N) void InverseZfpBatch(const u64* UBlocks, i64* IBlocks);
 
 /* Pad partial block of width N < 4 and stride S */
 idx2_T(t) void PadBlock1D(t* P, int N, int S);
 idx2_T(t) void PadBlock2D(t* P, const v2i& N);
 idx2_T(t) void PadBlock3D(t* P, const v3i& N);
 
+/* Copy a full 4x4x4 block between a strided grid of samples and a row-major block. Base points to the
+first sample of the block, and S3 holds the distances (in samples) between neighbors along X, Y, Z.
+The samples are converted if the grid and the block have different types. */
+idx2_TT(t, u) void GatherBlock(const t* Base, const v3<i64>& S3, u* Block);
+idx2_TT(t, u) void ScatterBlock(const u* Block, const v3<i64>& S3, t* Base);
+
+/*
+The kernels of the zfp codec on blocks of 64-bit integers, in one version per isa. Zfp holds the
+versions of the isa chosen with SetIsa (by default, the best isa that the cpu supports). */
+struct zfp_kernels {
+  isa Isa = isa::scalar;
+  void (*ForwardZfp)(i64* P, int D);
+  void (*InverseZfp)(i64* P, int D);
+  void (*ForwardShuffle)(i64* IBlock, u64* UBlock, int D);
+  void (*InverseShuffle)(u64* UBlock, i64* IBlock, int D);
+  void (*Encode)(u64* Block, int NVals, int B, i8& N, bitstream* Bs);
+  void (*Decode)(u64* Block, int NVals, int B, i8& N, bitstream* Bs);
+  void (*DecodeTest)(u64* Block, int NVals, i8& N, bitstream* Bs);
+  void (*TransposeRecursive)(u64* Block, int NBps);
+  int BatchSize; // the number of blocks that ForwardZfpBatch and InverseZfpBatch work on
+  void (*ForwardZfpBatch)(const i64* IBlocks, u64* UBlocks);
+  void (*InverseZfpBatch)(const u64* UBlocks, i64* IBlocks);
+};
+constexpr int ZfpMaxBatchSize = 8;
+extern zfp_kernels Zfp;
+/* Use the kernels of Isa (in Zfp and in Cdf53), or of the best isa the cpu supports if it does not
+support Isa. Return the isa of the kernels used. */
+isa SetIsa(isa Isa);
+
 idx2_T(t) void Encode(t* Block, int NVals, int B, i8& N, bitstream* Bs);
 idx2_T(t) void Decode(t* Block, int NVals, int B, i8& N, bitstream* Bs);
 
@@ -7425,6 +8133,99 @@ InverseShuffle2D(u* UBlock, t* IBlock) {
     IBlock[perm2<S>::Table[I]] = (t)((UBlock[I] ^ Mask) - Mask);
 }
 
+/*
+The batched transforms first lay the N blocks out as a structure of arrays, where the N values of
+a coefficient (one per block) are next to one another. Every lift then works on N lanes with the
+same instructions, which the compiler turns into vector instructions of width N (4 x 64 bits with
+AVX2, 8 x 64 bits with AVX-512). S is N times the distance between the 4 samples of a lift in a
+block. */
+idx2_Ii(N) void
+FLiftBatch(i64* idx2_Restrict P, int S) {
+  for (int L = 0; L < N; ++L) {
+    i64 X = P[0 * S + L], Y = P[1 * S + L], Z = P[2 * S + L], W = P[3 * S + L];
+    X += W; X >>= 1; W -= X;
+    Z += Y; Z >>= 1; Y -= Z;
+    X += Z; X >>= 1; Z -= X;
+    W += Y; W >>= 1; Y -= W;
+    W += Y >> 1; Y -= W >> 1;
+    P[0 * S + L] = X; P[1 * S + L] = Y; P[2 * S + L] = Z; P[3 * S + L] = W;
+  }
+}
+
+idx2_Ii(N) void
+ILiftBatch(i64* idx2_Restrict P, int S) {
+  for (int L = 0; L < N; ++L) {
+    i64 X = P[0 * S + L], Y = P[1 * S + L], Z = P[2 * S + L], W = P[3 * S + L];
+    Y += W >> 1; W -= Y >> 1;
+    Y += W; W <<= 1; W -= Y;
+    Z += X; X <<= 1; X -= Z;
+    Y += Z; Z <<= 1; Z -= Y;
+    W += X; X <<= 1; X -= W;
+    P[0 * S + L] = X; P[1 * S + L] = Y; P[2 * S + L] = Z; P[3 * S + L] = W;
+  }
+}
+
+/* ForwardZfp of N blocks in the structure-of-arrays layout (coefficient I of block L is P[I * N + L]) */
+idx2_Ii(N) void
+ForwardZfpSoA(i64* idx2_Restrict P) {
+  /* transform along X */
+  for (int Z = 0; Z < 4; ++Z)
+    for (int Y = 0; Y < 4; ++Y)
+      FLiftBatch<N>(P + (4 * Y + 16 * Z) * N, 1 * N);
+  /* transform along Y */
+  for (int X = 0; X < 4; ++X)
+    for (int Z = 0; Z < 4; ++Z)
+      FLiftBatch<N>(P + (16 * Z + 1 * X) * N, 4 * N);
+  /* transform along Z */
+  for (int Y = 0; Y < 4; ++Y)
+    for (int X = 0; X < 4; ++X)
+      FLiftBatch<N>(P + (1 * X + 4 * Y) * N, 16 * N);
+}
+
+idx2_Ii(N) void
+InverseZfpSoA(i64* idx2_Restrict P) {
+  /* transform along Z */
+  for (int Y = 0; Y < 4; ++Y)
+    for (int X = 0; X < 4; ++X)
+      ILiftBatch<N>(P + (1 * X + 4 * Y) * N, 16 * N);
+  /* transform along y */
+  for (int X = 0; X < 4; ++X)
+    for (int Z = 0; Z < 4; ++Z)
+      ILiftBatch<N>(P + (16 * Z + 1 * X) * N, 4 * N);
+  /* transform along X */
+  for (int Z = 0; Z < 4; ++Z)
+    for (int Y = 0; Y < 4; ++Y)
+      ILiftBatch<N>(P + (4 * Y + 16 * Z) * N, 1 * N);
+}
+
+/* The kernels of idx2_zfp.cpp transpose between the two layouts with vector shuffles instead */
+idx2_Ii(N) void
+ForwardZfpBatch(const i64* idx2_Restrict IBlocks, u64* idx2_Restrict UBlocks) {
+  alignas(64) i64 P[64 * N];
+  for (int I = 0; I < 64; ++I)
+    for (int L = 0; L < N; ++L)
+      P[I * N + L] = IBlocks[L * 64 + I];
+  ForwardZfpSoA<N>(P);
+  /* shuffle (and convert to negabinary) back into one block after another */
+  auto Mask = traits<u64>::NBinaryMask;
+  for (int I = 0; I < 64; ++I)
+    for (int L = 0; L < N; ++L)
+      UBlocks[L * 64 + I] = (u64(P[Perm3[I] * N + L]) + Mask) ^ Mask;
+}
+
+idx2_Ii(N) void
+InverseZfpBatch(const u64* idx2_Restrict UBlocks, i64* idx2_Restrict IBlocks) {
+  alignas(64) i64 P[64 * N];
+  auto Mask = traits<u64>::NBinaryMask;
+  for (int I = 0; I < 64; ++I)
+    for (int L = 0; L < N; ++L)
+      P[Perm3[I] * N + L] = i64((UBlocks[L * 64 + I] ^ Mask) - Mask);
+  InverseZfpSoA<N>(P);
+  for (int I = 0; I < 64; ++I)
+    for (int L = 0; L < N; ++L)
+      IBlocks[L * 64 + I] = P[I * N + L];
+}
+
 // TODO: this function is only correct for block size 4
 idx2_T(t) void
 PadBlock1D(t* P, int N, int S) {
@@ -7469,6 +8270,64 @@ PadBlock2D(t* P, const v2i& N) {
     PadBlock1D(P + X * 1, N.Y, 4);
 }
 
+/* The stride along X is a template argument so that the compiler can turn the rows into vector
+loads (X == 1) or loads and shuffles (X == 2, the finest subbands) */
+idx2_TTI(t, u, X) idx2_Inline void
+GatherBlockX(const t* Base, i64 Sy, i64 Sz, u* Block) {
+  for (int Z = 0; Z < 4; ++Z) {
+    for (int Y = 0; Y < 4; ++Y) {
+      const t* Row = Base + Z * Sz + Y * Sy;
+      u* B = Block + Z * 16 + Y * 4;
+      B[0] = u(Row[0]); B[1] = u(Row[X]); B[2] = u(Row[2 * X]); B[3] = u(Row[3 * X]);
+    }
+  }
+}
+
+idx2_TTi(t, u) void
+GatherBlock(const t* Base, const v3<i64>& S3, u* Block) {
+  if (S3.X == 1) {
+    GatherBlockX<t, u, 1>(Base, S3.Y, S3.Z, Block);
+  } else if (S3.X == 2) {
+    GatherBlockX<t, u, 2>(Base, S3.Y, S3.Z, Block);
+  } else {
+    for (int Z = 0; Z < 4; ++Z) {
+      for (int Y = 0; Y < 4; ++Y) {
+        const t* Row = Base + Z * S3.Z + Y * S3.Y;
+        u* B = Block + Z * 16 + Y * 4;
+        B[0] = u(Row[0]); B[1] = u(Row[S3.X]); B[2] = u(Row[2 * S3.X]); B[3] = u(Row[3 * S3.X]);
+      }
+    }
+  }
+}
+
+idx2_TTI(t, u, X) idx2_Inline void
+ScatterBlockX(const u* Block, i64 Sy, i64 Sz, t* Base) {
+  for (int Z = 0; Z < 4; ++Z) {
+    for (int Y = 0; Y < 4; ++Y) {
+      t* Row = Base + Z * Sz + Y * Sy;
+      const u* B = Block + Z * 16 + Y * 4;
+      Row[0] = t(B[0]); Row[X] = t(B[1]); Row[2 * X] = t(B[2]); Row[3 * X] = t(B[3]);
+    }
+  }
+}
+
+idx2_TTi(t, u) void
+ScatterBlock(const u* Block, const v3<i64>& S3, t* Base) {
+  if (S3.X == 1) {
+    ScatterBlockX<t, u, 1>(Block, S3.Y, S3.Z, Base);
+  } else if (S3.X == 2) {
+    ScatterBlockX<t, u, 2>(Block, S3.Y, S3.Z, Base);
+  } else {
+    for (int Z = 0; Z < 4; ++Z) {
+      for (int Y = 0; Y < 4; ++Y) {
+        t* Row = Base + Z * S3.Z + Y * S3.Y;
+        const u* B = Block + Z * 16 + Y * 4;
+        Row[0] = t(B[0]); Row[S3.X] = t(B[1]); Row[2 * S3.X] = t(B[2]); Row[3 * S3.X] = t(B[3]);
+      }
+    }
+  }
+}
+
 // D is the dimension, K is the size of the block
 idx2_TII(t, D, K) void
 Encode(t* Block, int B, i64 S, i8& N, bitstream* Bs) {
@@ -7548,15 +8407,12 @@ Decode(t* Block, int B, i64 S, i8& N, bitstream* Bs) {
   ++MyCounter;
 }
 
-// NOTE: this is the one being used
-idx2_T(t) void
-Encode(t* idx2_Restrict Block, int NVals, int B, /*i64 S, */i8& N, bitstream* idx2_Restrict BsIn) {
-  static_assert(is_unsigned<t>::Value);
+/* Encode bit plane X (bit I is the bit of coefficient I) of a block of NVals coefficients, the
+first N of which are already significant */
+idx2_Inline void
+EncodeBitPlane(u64 X, int NVals, i8& N, bitstream* idx2_Restrict BsIn) {
   idx2_Assert(NVals <= 64); // e.g. 4x4x4, 4x4, 8x8
   bitstream Bs = *BsIn;
-  u64 X = 0;
-  for (int I = 0; I < NVals; ++I)
-    X += u64((Block[I] >> B) & 1u) << I;
 //  i8 P = (i8)Min((i64)N, S - BitSize(Bs));
   i8 P = N;
   if (P > 0) {
@@ -7584,134 +8440,86 @@ Encode(t* idx2_Restrict Block, int NVals, int B, /*i64 S, */i8& N, bitstream* id
   *BsIn = Bs;
 }
 
-idx2_Ti(t) void
-TransposeAvx2(u64 X, int B, t* idx2_Restrict Block) {
+// NOTE: this is the one being used (through zfp_kernels::Encode)
+idx2_T(t) void
+Encode(t* idx2_Restrict Block, int NVals, int B, /*i64 S, */i8& N, bitstream* idx2_Restrict BsIn) {
+  static_assert(is_unsigned<t>::Value);
+  idx2_Assert(NVals <= 64); // e.g. 4x4x4, 4x4, 8x8
+  u64 X = 0;
+  for (int I = 0; I < NVals; ++I)
+    X += u64((Block[I] >> B) & 1u) << I;
+  EncodeBitPlane(X, NVals, N, BsIn);
+}
+
+#if defined(idx2_X86)
+/* Add 1 << B to the coefficients whose bits are set in X, 4 coefficients at a time */
+idx2_TargetAvx2 inline void
+TransposeAvx2(u64 X, int B, u64* idx2_Restrict Block) {
   __m256i Minus1 = _mm256_set1_epi64x(-1);
-  __m256i Add = _mm256_set1_epi64x(t(1) << B); // TODO: should be epi64 with t == u64
+  __m256i Add = _mm256_set1_epi64x(i64(u64(1) << B));
   __m256i Mask = _mm256_set_epi64x(0xfffffffffffffff7ll, 0xfffffffffffffffbll, 0xfffffffffffffffdll, 0xfffffffffffffffell);
-  //while (X) {
-    __m256i Val = _mm256_set1_epi64x(X);
+  while (X) {
+    __m256i Val = _mm256_set1_epi64x(i64(X));
     Val = _mm256_or_si256(Val, Mask);
     Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
     _mm256_maskstore_epi64((long long*)Block, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block, Val), Add));
-    //X >>= 4;
-    //Block += 4;
-
-    Val = _mm256_set1_epi64x(X >> 4);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 4, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 4, Val), Add));
-    //X >>= 4;
-    //Block += 4;
-
-    Val = _mm256_set1_epi64x(X >> 8);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 8, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 8, Val), Add));
-
-    Val = _mm256_set1_epi64x(X >> 12);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 12, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 12, Val), Add));
-
-    Val = _mm256_set1_epi64x(X >> 16);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 16, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 16, Val), Add));
-
-    Val = _mm256_set1_epi64x(X >> 20);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 20, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 20, Val), Add));
-
-    Val = _mm256_set1_epi64x(X >> 24);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 24, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 24, Val), Add));
-
-    Val = _mm256_set1_epi64x(X >> 28);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 28, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 28, Val), Add));
-
-    Val = _mm256_set1_epi64x(X >> 32);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 32, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 32, Val), Add));
-
-    Val = _mm256_set1_epi64x(X >> 36);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 36, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 36, Val), Add));
-
-    Val = _mm256_set1_epi64x(X >> 40);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 40, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 40, Val), Add));
-
-    Val = _mm256_set1_epi64x(X >> 44);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 44, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 44, Val), Add));
-
-    Val = _mm256_set1_epi64x(X >> 48);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 48, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 48, Val), Add));
-
-    Val = _mm256_set1_epi64x(X >> 52);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 52, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 52, Val), Add));
-
-    Val = _mm256_set1_epi64x(X >> 56);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 56, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 56, Val), Add));
+    X >>= 4;
+    Block += 4;
+  }
+}
 
-    Val = _mm256_set1_epi64x(X >> 60);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 60, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 60, Val), Add));
-  //}
+/* Add 1 << B to the coefficients whose bits are set in X, 8 coefficients at a time */
+idx2_TargetAvx512 inline void
+TransposeAvx512(u64 X, int B, u64* idx2_Restrict Block) {
+  __m512i Add = _mm512_set1_epi64(i64(u64(1) << B));
+  while (X) {
+    __mmask8 M = __mmask8(X & 0xff);
+    __m512i Val = _mm512_maskz_loadu_epi64(M, Block);
+    _mm512_mask_storeu_epi64(Block, M, _mm512_add_epi64(Val, Add));
+    X >>= 8;
+    Block += 8;
+  }
 }
+#endif
 
+/*
+Decode a bit plane of a block of NVals coefficients, the first N of which are already significant,
+into *Block (bit I is the bit of coefficient I). This reads the same bits as EncodeBitPlane writes,
+but the run of zeros before each newly significant coefficient is skipped with a count of trailing
+zeros on the bit buffer instead of one Read per bit. */
 idx2_Inline void
 DecodeTest(u64* idx2_Restrict Block, int NVals, i8& N, bitstream* idx2_Restrict BsIn) {
   idx2_Assert(NVals <= 64); // e.g. 4x4x4, 4x4, 8x8
   bitstream Bs = *BsIn;
-  i8 P = N;
-  u64 X = P > 0 ? ReadLong(&Bs, P) : 0;
-  for (; N < NVals;) {
-    if (Read(&Bs)) {
-      for (; N + 1 < NVals;)
-        if (Read(&Bs)) break; else ++N;
-      X += 1ull << (N++);
-    } else {
+  int I = N; // the first coefficient that is not significant
+  u64 X = I > 0 ? ReadLong(&Bs, I) : 0;
+  while (I < NVals) {
+    if (!Read(&Bs)) // the remaining coefficients are not significant
       break;
+    /* if the coefficients before the last one are all zeros, the last one is not followed by a 1 */
+    int NZeros = NVals - 1 - I; // the most zeros that can precede the significant coefficient
+    while (NZeros > 0) {
+      Refill(&Bs);
+      int NBits = 64 - Bs.BitPos;
+      int Z = Lsb(Bs.BitBuf >> Bs.BitPos, 64);
+      if (Z < NBits && Z < NZeros) { // the 1 that ends the run is in the buffer
+        I += Z;
+        Consume(&Bs, Z + 1);
+        break;
+      }
+      int Skip = Min(NZeros, NBits);
+      I += Skip;
+      Consume(&Bs, Skip);
+      NZeros -= Skip;
     }
+    X += u64(1) << I++;
   }
+  N = i8(I);
   *Block = X;
   *BsIn = Bs;
 }
 
-// NOTE: This is the one being used
+// NOTE: This is the one being used (through zfp_kernels::Decode)
 idx2_T(t) void
 Decode(t* idx2_Restrict Block, int NVals, int B, /*i64 S, */i8& N, bitstream* idx2_Restrict BsIn) {
   static_assert(is_unsigned<t>::Value);
@@ -7737,27 +8545,13 @@ Decode(t* idx2_Restrict Block, int NVals, int B, /*i64 S, */i8& N, bitstream* id
 //    for (int I = 0; I < K; ++I)
 //      Block[I] += (t)((X >> I) & 1u) << B;
 //  }
-#if defined(idx2_Avx2)
-  __m256i Minus1 = _mm256_set1_epi64x(-1);
-  __m256i Add = _mm256_set1_epi64x(t(1) << B);
-  __m256i Mask = _mm256_set_epi64x(0xfffffffffffffff7ll, 0xfffffffffffffffbll, 0xfffffffffffffffdll, 0xfffffffffffffffell);
-  while (X) {
-    __m256i Val = _mm256_set1_epi64x(X);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((i64*)Block, Val, _mm256_add_epi64(_mm256_maskload_epi64((i64*)Block, Val), Add));
-    X >>= 4;
-    Block += 4;
-  }
-#else
   for (int I = 0; X; ++I, X >>= 1)
     Block[I] += (t)(X & 1u) << B;
-#endif
   *BsIn = Bs;
 }
 
-idx2_TII(t, D, K) void
+#if defined(idx2_X86)
+idx2_TII(t, D, K) idx2_TargetAvx2 void
 Decode4(t* Block, int B, i64 S, i8& N, bitstream* Bs) {
   static_assert(is_unsigned<t>::Value);
   int NVals = power<int, K>::Table[D];
@@ -7798,6 +8592,7 @@ Decode4(t* Block, int B, i64 S, i8& N, bitstream* Bs) {
   }
   ++MyCounter;
 }
+#endif
 
 idx2_Ti(t) void
 TransposeNormal(u64 X, int B, t* idx2_Restrict Block) {
@@ -7821,6 +8616,34 @@ TransposeNormal(u64 X, int B, t* idx2_Restrict Block) {
     (y) ^= v << s; \
   } while (0)
 
+#if defined(idx2_X86)
+/*
+Same as TransposeRecursive, for the bit planes decoded by DecodeTest (Block[K] is bit plane 63 - K,
+and the bit planes from NBps on are zeros). Each bit plane is broadcast and or-ed into the eight
+vectors of coefficients, under masks that are the bytes of the bit plane. */
+idx2_TargetAvx512 inline void
+TransposeBitPlanesAvx512(u64* idx2_Restrict Block, int NBps) {
+  __m512i C0 = _mm512_setzero_si512(), C1 = C0, C2 = C0, C3 = C0, C4 = C0, C5 = C0, C6 = C0, C7 = C0;
+  for (int K = 0; K < NBps; ++K) {
+    u64 X = Block[K];
+    if (!X) continue;
+    __m512i Bit = _mm512_set1_epi64(i64(u64(1) << (63 - K)));
+    C0 = _mm512_mask_or_epi64(C0, __mmask8(X      ), C0, Bit);
+    C1 = _mm512_mask_or_epi64(C1, __mmask8(X >>  8), C1, Bit);
+    C2 = _mm512_mask_or_epi64(C2, __mmask8(X >> 16), C2, Bit);
+    C3 = _mm512_mask_or_epi64(C3, __mmask8(X >> 24), C3, Bit);
+    C4 = _mm512_mask_or_epi64(C4, __mmask8(X >> 32), C4, Bit);
+    C5 = _mm512_mask_or_epi64(C5, __mmask8(X >> 40), C5, Bit);
+    C6 = _mm512_mask_or_epi64(C6, __mmask8(X >> 48), C6, Bit);
+    C7 = _mm512_mask_or_epi64(C7, __mmask8(X >> 56), C7, Bit);
+  }
+  _mm512_storeu_si512(Block +  0, C0); _mm512_storeu_si512(Block +  8, C1);
+  _mm512_storeu_si512(Block + 16, C2); _mm512_storeu_si512(Block + 24, C3);
+  _mm512_storeu_si512(Block + 32, C4); _mm512_storeu_si512(Block + 40, C5);
+  _mm512_storeu_si512(Block + 48, C6); _mm512_storeu_si512(Block + 56, C7);
+}
+#endif
+
 /* compress sequence of 4^3 = 64 unsigned integers */
 idx2_T(t) void
 TransposeRecursive(t* data, int NBps) {
@@ -8456,12 +9279,59 @@ Init(idx2_file* Idx2, const params& P);
 idx2::grid
 GetOutputGrid(const idx2_file& Idx2, const params& P);
 
+/* Set P.NThreads > 1 to decode the bricks of each level on multiple threads */
 error<idx2_file_err_code>
 Decode(idx2_file* Idx2, const params& P, buffer* OutBuf);
 
 error<idx2_file_err_code>
 Destroy(idx2_file* Idx2);
 
+/*
+A decoder keeps the file indices, exponents, rdo information, and chunks it reads across Decode
+calls, so repeated queries against the same field do not read and parse the same files again.
+Idx2 must outlive the decoder, and the decoder must not be copied or moved after Init. */
+struct decoder {
+  const idx2_file* Idx2 = nullptr;
+  decode_data D;
+};
+
+error<idx2_file_err_code>
+Init(decoder* Dec, const idx2_file& Idx2, const params& P);
+
+/* Same as Decode(idx2_file*, ...) but reuses (and keeps) the caches of Dec */
+error<idx2_file_err_code>
+Decode(decoder* Dec, const params& P, buffer* OutBuf);
+
+/*
+Report how many files, chunks, and compressed bytes decoding with P would read, and the size of the
+output, without decoding (only the chunk indices and the exponents are read) */
+error<idx2_file_err_code>
+EstimateDecodeCost(const idx2_file& Idx2, const params& P, decode_cost* Cost);
+
+/* Same as above, but the indices and exponents that are read stay in the caches of Dec (and
+Cost->ResidentChunkBytes tells how much of the data Dec already has) */
+error<idx2_file_err_code>
+EstimateDecodeCost(decoder* Dec, const params& P, decode_cost* Cost);
+
+/*
+Same as Decode(Dec, P, OutBuf), but the zfp state of every decoded block is kept in Dec, so that a
+later Refine of the same region with a smaller P.DecodeAccuracy reads and decodes only the bit planes
+that are missing (a larger P.DecodeAccuracy returns the more accurate result that Dec already has).
+The states take about as much memory as the decoded bricks; Clear drops them. */
+error<idx2_file_err_code>
+Refine(decoder* Dec, const params& P, buffer* OutBuf);
+
+/* Drop everything Dec has cached (e.g. if the files have changed) and close its files */
+void
+Clear(decoder* Dec);
+
+/* Evict cached chunks, least recently used first, until at most MaxBytes remain */
+void
+Trim(decoder* Dec, i64 MaxBytes = 0);
+
+error<idx2_file_err_code>
+Destroy(decoder* Dec);
+
 }
 
 #ifdef idx2_Implementation
@@ -8633,6 +9503,75 @@ void SetHandleAbortSignals(handler& Handler) {
 
 } // namespace idx2
 
+#if defined(idx2_X86)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+namespace idx2 {
+
+#if defined(idx2_X86)
+/* Regs = (EAX, EBX, ECX, EDX) */
+static void
+CpuId(u32 Leaf, u32 SubLeaf, u32 Regs[4]) {
+#if defined(_MSC_VER)
+  int R[4];
+  __cpuidex(R, int(Leaf), int(SubLeaf));
+  idx2_For(int, I, 0, 4) Regs[I] = u32(R[I]);
+#else
+  __cpuid_count(Leaf, SubLeaf, Regs[0], Regs[1], Regs[2], Regs[3]);
+#endif
+}
+
+/* The register state components that the operating system saves on context switches */
+static u64
+XGetBv() {
+#if defined(_MSC_VER)
+  return _xgetbv(0);
+#else
+  u32 Lo, Hi;
+  __asm__ volatile("xgetbv" : "=a"(Lo), "=d"(Hi) : "c"(0));
+  return (u64(Hi) << 32) | Lo;
+#endif
+}
+#endif
+
+isa
+DetectIsa() {
+#if defined(idx2_X86)
+  u32 Regs[4];
+  CpuId(0, 0, Regs);
+  u32 MaxLeaf = Regs[0];
+  if (MaxLeaf < 7)
+    return isa::scalar;
+  CpuId(1, 0, Regs);
+  bool OsXSave = (Regs[2] >> 27) & 1, Avx = (Regs[2] >> 28) & 1, Popcnt = (Regs[2] >> 23) & 1;
+  if (!OsXSave || !Avx || !Popcnt)
+    return isa::scalar;
+  u64 Xcr0 = XGetBv();
+  if ((Xcr0 & 0x6) != 0x6) // the os does not save the xmm and ymm registers
+    return isa::scalar;
+  CpuId(0x80000001, 0, Regs);
+  bool Lzcnt = (Regs[2] >> 5) & 1;
+  CpuId(7, 0, Regs);
+  u32 Ebx = Regs[1];
+  bool Avx2 = (Ebx >> 5) & 1, Bmi1 = (Ebx >> 3) & 1, Bmi2 = (Ebx >> 8) & 1;
+  if (!Avx2 || !Bmi1 || !Bmi2 || !Lzcnt)
+    return isa::scalar;
+  bool Avx512 = ((Ebx >> 16) & 1) && ((Ebx >> 17) & 1) && ((Ebx >> 30) & 1) && ((Ebx >> 31) & 1); // F, DQ, BW, VL
+  if (Avx512 && (Xcr0 & 0xe6) == 0xe6) // the os also saves the opmask and zmm registers
+    return isa::avx512;
+  return isa::avx2;
+#else
+  return isa::scalar;
+#endif
+}
+
+} // namespace idx2
+
 #include <ctype.h>
 #include <stdio.h>
 
@@ -8733,10 +9672,139 @@ ReadMeta(cstr FileName, metadata* Meta) {
 
 } // namespace idx2
 
+namespace idx2 {
+
+static bool
+OpenFd(cstr FileName, file_handle* File, i64* Bytes) {
+#if defined(_WIN32)
+  *File = CreateFileA(FileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (*File == INVALID_HANDLE_VALUE)
+    return false;
+  LARGE_INTEGER FileSize{{0, 0}};
+  if (!GetFileSizeEx(*File, &FileSize)) {
+    CloseHandle(*File);
+    return false;
+  }
+  *Bytes = FileSize.QuadPart;
+#elif defined(__CYGWIN__) || defined(__linux__) || defined(__APPLE__)
+  *File = open(FileName, O_RDONLY);
+  if (*File == -1)
+    return false;
+  struct ::stat Stat;
+  if (fstat(*File, &Stat) == -1) {
+    close(*File);
+    return false;
+  }
+  *Bytes = Stat.st_size;
+#endif
+  return true;
+}
+
+static void
+CloseFd(file_handle File) {
+#if defined(_WIN32)
+  CloseHandle(File);
+#elif defined(__CYGWIN__) || defined(__linux__) || defined(__APPLE__)
+  close(File);
+#endif
+}
+
+/* Hash(cstr) in idx2_hashtable.h is only 32-bit */
+u64
+FdKey(cstr FileName) {
+  u64 H = 0xcbf29ce484222325ull;
+  while (*FileName)
+    H = (u64(u8(*FileName++)) ^ H) * 0x100000001b3ull;
+  return H;
+}
+
+void
+Init(fd_cache* Fc, int MaxOpenFiles) {
+  Fc->MaxOpenFiles = Max(MaxOpenFiles, 1);
+  Init(&Fc->Files, Log2Ceil(Fc->MaxOpenFiles) + 2);
+  Fc->Clock = 0;
+  Fc->NHits = Fc->NMisses = 0;
+}
+
+void
+Dealloc(fd_cache* Fc) {
+  idx2_ForEach(It, Fc->Files) CloseFd(It.Val->File);
+  Dealloc(&Fc->Files);
+}
+
+bool
+Acquire(fd_cache* Fc, u64 Key, cstr FileName, file_handle* File, i64* Bytes) {
+  lock Lock(&Fc->Mutex);
+  auto It = Lookup(&Fc->Files, Key);
+  if (It) {
+    ++Fc->NHits;
+  } else {
+    ++Fc->NMisses;
+    /* close the least recently used file that is not in use */
+    if (Size(Fc->Files) >= Fc->MaxOpenFiles) {
+      u64 LruKey = 0, LruUse = traits<u64>::Max;
+      idx2_ForEach(FIt, Fc->Files) {
+        if (FIt.Val->NUsers == 0 && FIt.Val->LastUse < LruUse) {
+          LruKey = *FIt.Key;
+          LruUse = FIt.Val->LastUse;
+        }
+      }
+      if (LruUse != traits<u64>::Max) {
+        CloseFd(Lookup(&Fc->Files, LruKey).Val->File);
+        Delete(&Fc->Files, LruKey);
+      }
+    }
+    fd_entry Entry;
+    if (!OpenFd(FileName, &Entry.File, &Entry.Bytes))
+      return false;
+    It = Insert(&Fc->Files, Key, Entry);
+  }
+  It.Val->LastUse = ++Fc->Clock;
+  ++It.Val->NUsers;
+  *File = It.Val->File;
+  *Bytes = It.Val->Bytes;
+  return true;
+}
+
+void
+Release(fd_cache* Fc, u64 Key) {
+  lock Lock(&Fc->Mutex);
+  auto It = Lookup(&Fc->Files, Key);
+  idx2_Assert(It && It.Val->NUsers > 0);
+  --It.Val->NUsers;
+}
+
+bool
+ReadAt(file_handle File, i64 Offset, void* Dst, i64 Bytes) {
+#if defined(_WIN32)
+  byte* Ptr = (byte*)Dst;
+  while (Bytes > 0) {
+    OVERLAPPED Ov = {};
+    Ov.Offset = DWORD(Offset & 0xFFFFFFFF);
+    Ov.OffsetHigh = DWORD(Offset >> 32);
+    DWORD Read = 0;
+    if (!::ReadFile(File, Ptr, DWORD(Min(Bytes, i64(1) << 30)), &Read, &Ov) || Read == 0)
+      return false;
+    Ptr += Read; Offset += Read; Bytes -= Read;
+  }
+#elif defined(__CYGWIN__) || defined(__linux__) || defined(__APPLE__)
+  byte* Ptr = (byte*)Dst;
+  while (Bytes > 0) {
+    ssize_t Read = pread(File, Ptr, size_t(Bytes), off_t(Offset));
+    if (Read <= 0)
+      return false;
+    Ptr += Read; Offset += Read; Bytes -= Read;
+  }
+#endif
+  return true;
+}
+
+} // namespace idx2
+
 #include <string.h>
 
 #if defined(_WIN32)
-  /*
+/*
  * Dirent interface for Microsoft Visual Studio
  *
  * Copyright (C) 1998-2019 Toni Ronkko
@@ -10252,10 +11320,10 @@ Alloc(buffer* Buf, i64 Bytes) {
 void linear_allocator::
 Dealloc(buffer* Buf) {
   if (Buf->Data + Buf->Bytes == Block.Data + CurrentBytes) {
+    CurrentBytes -= Buf->Bytes;
     Buf->Data = nullptr;
     Buf->Bytes = 0;
     Buf->Alloc = nullptr;
-    CurrentBytes -= Buf->Bytes;
   }
 }
 
@@ -10351,6 +11419,66 @@ DeallocAll() {
   Secondary->DeallocAll();
 }
 
+arena_allocator::
+arena_allocator() = default;
+
+arena_allocator::
+arena_allocator(i64 BlockBytesIn, allocator* ParentIn)
+  : BlockBytes(BlockBytesIn)
+  , Parent(ParentIn) {}
+
+bool arena_allocator::
+Alloc(buffer* Buf, i64 Bytes) {
+  idx2_Assert(Parent && BlockBytes > 0);
+  idx2_Assert(!Buf->Data || Buf->Bytes == 0, "Buffer not freed before allocating new memory");
+  const i64 HeaderBytes = ((i64)sizeof(block) + Align - 1) / Align * Align;
+  i64 PaddedBytes = (Bytes + Align - 1) / Align * Align;
+  if (!Current.Alloc(Buf, PaddedBytes)) {
+    /* an allocation that does not fit in a block gets a block of its own, and the current block
+    (which may still have room for smaller allocations) stays current */
+    bool OwnBlock = HeaderBytes + PaddedBytes > BlockBytes;
+    buffer BlockBuf;
+    Parent->Alloc(&BlockBuf, OwnBlock ? HeaderBytes + PaddedBytes : BlockBytes);
+    block* B = (block*)BlockBuf.Data;
+    B->Next = Blocks;
+    B->Bytes = BlockBuf.Bytes;
+    Blocks = B;
+    ++NBlocks;
+    buffer Rest = BlockBuf + HeaderBytes;
+    if (OwnBlock) {
+      Buf->Data = Rest.Data;
+    } else {
+      Current = linear_allocator(Rest);
+      Current.Alloc(Buf, PaddedBytes);
+    }
+  }
+  ++NAllocs;
+  Buf->Bytes = Bytes;
+  Buf->Alloc = this;
+  return true;
+}
+
+void arena_allocator::
+Dealloc(buffer* Buf) {
+  buffer PaddedBuf(Buf->Data, (Buf->Bytes + Align - 1) / Align * Align, &Current);
+  Current.Dealloc(&PaddedBuf);
+  Buf->Data = nullptr;
+  Buf->Bytes = 0;
+  Buf->Alloc = nullptr;
+}
+
+void arena_allocator::
+DeallocAll() {
+  while (Blocks) {
+    block* Next = Blocks->Next;
+    buffer BlockBuf((byte*)Blocks, Blocks->Bytes, Parent);
+    Parent->Dealloc(&BlockBuf);
+    Blocks = Next;
+  }
+  Current = linear_allocator();
+  NAllocs = NBlocks = 0;
+}
+
 void
 Clone(const buffer& Src, buffer* Dst, allocator* Alloc) {
   if (Dst->Data && Dst->Bytes != Src.Bytes)
@@ -10420,7 +11548,7 @@ MapFile(mmap_file* MMap, i64 Bytes) {
   MMap->Buf.Bytes = FileSize.QuadPart;
 #elif defined(__CYGWIN__) || defined(__linux__) || defined(__APPLE__)
   size_t FileSize;
-  struct stat Stat;
+  struct ::stat Stat;
   if (Bytes != 0)
     FileSize = Bytes;
   else if (fstat(MMap->File, &Stat) == 0)
@@ -10518,6 +11646,167 @@ CloseFile(mmap_file* MMap) {
 
 } // namespace idx2
 
+#include <stdlib.h>
+
+namespace idx2 {
+
+using block = block_pool::block;
+
+static byte*
+AlignedAlloc(i64 Bytes, int Align) {
+#if defined(_WIN32)
+  return (byte*)_aligned_malloc(size_t(Bytes), size_t(Align));
+#elif defined(__CYGWIN__) || defined(__linux__) || defined(__APPLE__)
+  void* Ptr = nullptr;
+  return posix_memalign(&Ptr, size_t(Align), size_t(Bytes)) == 0 ? (byte*)Ptr : nullptr;
+#endif
+}
+
+static void
+AlignedFree(void* Ptr) {
+#if defined(_WIN32)
+  _aligned_free(Ptr);
+#elif defined(__CYGWIN__) || defined(__linux__) || defined(__APPLE__)
+  free(Ptr);
+#endif
+}
+
+/* Push a list of batches (linked by NextBatch, from First to Last) onto the stack of the pool */
+static void
+PushBatches(block_pool* Pool, block* First, block* Last) {
+  Last->NextBatch = Pool->Batches.load(std::memory_order_relaxed);
+  while (!Pool->Batches.compare_exchange_weak(Last->NextBatch, First, std::memory_order_release, std::memory_order_relaxed)) {}
+}
+
+/* Take a batch from the stack of the pool (or return null if it is empty) */
+static block*
+PopBatch(block_pool* Pool) {
+  block* First = Pool->Batches.exchange(nullptr, std::memory_order_acquire);
+  if (!First)
+    return nullptr;
+  block* Rest = First->NextBatch;
+  if (Rest) {
+    block* Last = Rest;
+    while (Last->NextBatch) Last = Last->NextBatch;
+    PushBatches(Pool, Rest, Last);
+  }
+  First->NextBatch = nullptr;
+  return First;
+}
+
+void
+Init(block_pool* Pool, i64 Bytes) {
+  idx2_Assert(Pool->NBlocks == 0);
+  i64 MinBytes = sizeof(block);
+  Pool->BlockBytes = ((Max(Bytes, MinBytes) + PoolBlockAlign - 1) / PoolBlockAlign) * PoolBlockAlign;
+  Pool->Batches = nullptr;
+}
+
+void
+Trim(block_pool* Pool) {
+  block* Batch = Pool->Batches.exchange(nullptr, std::memory_order_acquire);
+  while (Batch) {
+    block* NextBatch = Batch->NextBatch;
+    for (block* B = Batch; B;) {
+      block* Next = B->Next;
+      AlignedFree(B);
+      --Pool->NBlocks;
+      B = Next;
+    }
+    Batch = NextBatch;
+  }
+}
+
+void
+Dealloc(block_pool* Pool) {
+  Trim(Pool);
+  idx2_Assert(Pool->NBlocks == 0, "%" PRIi64 " blocks are not given back", i64(Pool->NBlocks));
+  Pool->BlockBytes = 0;
+}
+
+void
+Init(pool_allocator* Cache, block_pool* Pool) {
+  idx2_Assert(!Cache->Head && !Cache->Freed.load());
+  Cache->Pool = Pool;
+  Cache->NBlocks = 0;
+}
+
+/* Move the blocks deallocated by any thread into the cache */
+static void
+TakeFreed(pool_allocator* Cache) {
+  block* B = Cache->Freed.exchange(nullptr, std::memory_order_acquire);
+  while (B) {
+    block* Next = B->Next;
+    B->Next = Cache->Head;
+    Cache->Head = B;
+    ++Cache->NBlocks;
+    B = Next;
+  }
+}
+
+/* Give N blocks of the cache back to the pool, as one batch */
+static void
+GiveBatch(pool_allocator* Cache, int N) {
+  idx2_Assert(0 < N && N <= Cache->NBlocks);
+  block* First = Cache->Head;
+  block* Last = First;
+  idx2_For(int, I, 1, N) Last = Last->Next;
+  Cache->Head = Last->Next;
+  Cache->NBlocks -= N;
+  Last->Next = nullptr;
+  PushBatches(Cache->Pool, First, First);
+}
+
+bool pool_allocator::
+Alloc(buffer* Buf, i64 Bytes) {
+  idx2_Assert(Pool && Pool->BlockBytes > 0);
+  if (Bytes > Pool->BlockBytes)
+    return Mallocator().Alloc(Buf, Bytes);
+  if (!Head) {
+    TakeFreed(this);
+    while (NBlocks > 2 * PoolBatchSize) GiveBatch(this, PoolBatchSize);
+  }
+  if (!Head) {
+    Head = PopBatch(Pool);
+    for (block* B = Head; B; B = B->Next) ++NBlocks;
+  }
+  byte* Data = nullptr;
+  if (Head) {
+    Data = (byte*)Head;
+    Head = Head->Next;
+    --NBlocks;
+  } else {
+    Data = AlignedAlloc(Pool->BlockBytes, PoolBlockAlign);
+    idx2_AbortIf(!Data, "Out of memory");
+    ++Pool->NBlocks;
+  }
+  Buf->Data = Data;
+  Buf->Bytes = Bytes;
+  Buf->Alloc = this;
+  return true;
+}
+
+void pool_allocator::
+Dealloc(buffer* Buf) {
+  idx2_Assert(Pool && Buf->Bytes <= Pool->BlockBytes);
+  block* B = (block*)Buf->Data;
+  B->Next = Freed.load(std::memory_order_relaxed);
+  while (!Freed.compare_exchange_weak(B->Next, B, std::memory_order_release, std::memory_order_relaxed)) {}
+  Buf->Data = nullptr;
+  Buf->Bytes = 0;
+  Buf->Alloc = nullptr;
+}
+
+void pool_allocator::
+DeallocAll() {
+  if (!Pool)
+    return;
+  TakeFreed(this);
+  while (NBlocks > 0) GiveBatch(this, Min(NBlocks, PoolBatchSize));
+}
+
+} // namespace idx2
+
 #include <math.h>
 
 namespace idx2 {
@@ -11077,7 +12366,6 @@ Murmur3_32(u8* Key, int Len, u32 Seed) {
 } // namespace idx2
 
 //#include "robinhood/robin_hood.h"
-
 //#pragma GCC diagnostic push
 //#pragma GCC diagnostic ignored "-Wmissing-field-initializers"
 //#pragma GCC diagnostic ignored "-W#warnings"
@@ -11745,19 +13033,183 @@ ExtrapolateCdf53(const v3i& Dims3, u64 TransformOrder, volume* Vol) {
   InverseCdf53(N3, M3, 0, NLevels, TransformOrder, Vol);
 }
 
+/*
+Define the lifting kernels of an isa: FLiftCdf53X/ILiftCdf53X and FLiftCdf53Tiled/ILiftCdf53Tiled
+instantiated for f32 and f64 and compiled for the isa (as in idx2_ZfpKernels) */
+#define idx2_Cdf53Kernels(Suffix, Isa, Target)\
+idx2_T(t) Target static void \
+FLiftX##Suffix(const grid& G, const v3i& M3, lift_option Opt, volume* Vol) { FLiftCdf53X<t>(G, M3, Opt, Vol); }\
+idx2_T(t) Target static void \
+FLiftY##Suffix(const grid& G, const v3i& M3, lift_option Opt, volume* Vol) { FLiftCdf53Tiled<t>(1, G, M3, Opt, Vol); }\
+idx2_T(t) Target static void \
+FLiftZ##Suffix(const grid& G, const v3i& M3, lift_option Opt, volume* Vol) { FLiftCdf53Tiled<t>(2, G, M3, Opt, Vol); }\
+idx2_T(t) Target static void \
+ILiftX##Suffix(const grid& G, const v3i& M3, lift_option Opt, volume* Vol) { ILiftCdf53X<t>(G, M3, Opt, Vol); }\
+idx2_T(t) Target static void \
+ILiftY##Suffix(const grid& G, const v3i& M3, lift_option Opt, volume* Vol) { ILiftCdf53Tiled<t>(1, G, M3, Opt, Vol); }\
+idx2_T(t) Target static void \
+ILiftZ##Suffix(const grid& G, const v3i& M3, lift_option Opt, volume* Vol) { ILiftCdf53Tiled<t>(2, G, M3, Opt, Vol); }\
+static const cdf53_kernels Cdf53Kernels##Suffix = {\
+  Isa,\
+  { { FLiftX##Suffix<f32>, FLiftX##Suffix<f64> },\
+    { FLiftY##Suffix<f32>, FLiftY##Suffix<f64> },\
+    { FLiftZ##Suffix<f32>, FLiftZ##Suffix<f64> } },\
+  { { ILiftX##Suffix<f32>, ILiftX##Suffix<f64> },\
+    { ILiftY##Suffix<f32>, ILiftY##Suffix<f64> },\
+    { ILiftZ##Suffix<f32>, ILiftZ##Suffix<f64> } }\
+};
+
+idx2_Cdf53Kernels(Scalar, isa::scalar, idx2_TargetScalar)
+#if defined(idx2_X86)
+idx2_Cdf53Kernels(Avx2, isa::avx2, idx2_TargetAvx2)
+idx2_Cdf53Kernels(Avx512, isa::avx512, idx2_TargetAvx512)
+#endif
+
+const cdf53_kernels&
+GetCdf53Kernels(isa Isa) {
+#if defined(idx2_X86)
+  if (Isa == isa::avx512)
+    return Cdf53KernelsAvx512;
+  if (Isa == isa::avx2)
+    return Cdf53KernelsAvx2;
+#endif
+  (void)Isa;
+  return Cdf53KernelsScalar;
+}
+
+cdf53_kernels Cdf53 = GetCdf53Kernels(DetectIsa());
+
+/* Forward lifting along axis D (0 = X, 1 = Y, 2 = Z), with the kernels of Cdf53 for f32 and f64 */
+static void
+FLiftCdf53(int D, const grid& Grid, const v3i& M3, lift_option Opt, volume* Vol) {
+  idx2_Assert(D >= 0 && D < 3);
+  if (Vol->Type == dtype::float32 || Vol->Type == dtype::float64) {
+    Cdf53.FLift[D][Vol->Type == dtype::float64](Grid, M3, Opt, Vol);
+    return;
+  }
+  #define Body(type)\
+  switch (D) {\
+    case 0: FLiftCdf53X<type>(Grid, M3, Opt, Vol); break;\
+    case 1: FLiftCdf53Y<type>(Grid, M3, Opt, Vol); break;\
+    case 2: FLiftCdf53Z<type>(Grid, M3, Opt, Vol); break;\
+    default: idx2_Assert(false); break;\
+  };
+  idx2_DispatchOnType(Vol->Type);
+  #undef Body
+}
+
+/* Inverse lifting along axis D (0 = X, 1 = Y, 2 = Z) of a f32 or f64 volume */
+static void
+ILiftCdf53(int D, const grid& Grid, const v3i& M3, lift_option Opt, volume* Vol) {
+  idx2_Assert(D >= 0 && D < 3);
+  idx2_Assert(Vol->Type == dtype::float32 || Vol->Type == dtype::float64, "type not supported");
+  Cdf53.ILift[D][Vol->Type == dtype::float64](Grid, M3, Opt, Vol);
+}
+
+/* The axis along which LiftCdf53 cuts the volume into slices to fuse two passes along Axis (the
+slices of the X and Y passes are XY planes, and those of the Z passes are XZ planes) */
+static int
+SliceAxis(int Axis) { return Axis == 2 ? 1 : 2; }
+
+/* Whether the slices of a pass are lifted independently of each other (none is clamped by M3 to another) */
+static bool
+CanSlice(const lift_pass& L) {
+  int O = SliceAxis(L.Axis);
+  v3i P = From(L.Grid), D = Dims(L.Grid), S = Strd(L.Grid);
+  return P[O] + S[O] * (D[O] - 1) <= L.M3[O];
+}
+
+/* Slice K of Grid along axis O */
+static grid
+GetSlice(const grid& Grid, int O, int K) {
+  v3i P = From(Grid), D = Dims(Grid);
+  P[O] += K * Strd(Grid)[O];
+  D[O] = 1;
+  return grid(P, D, Strd(Grid));
+}
+
+bool
+CanFuse(const lift_pass& A, const lift_pass& B) {
+  return A.Axis == B.Axis && A.Grid == B.Grid && CanSlice(A) && CanSlice(B);
+}
+
+static void
+Lift(const lift_pass& L, const grid& Grid, volume* Vol) {
+  if (L.Inverse)
+    ILiftCdf53(L.Axis, Grid, L.M3, lift_option::Normal, Vol);
+  else
+    FLiftCdf53(L.Axis, Grid, L.M3, lift_option::Normal, Vol);
+}
+
+void
+PushForwardPasses(const transform_details& Td, const v3i& M3, array<lift_pass>* Passes) {
+  idx2_For(int, I, 0, Td.StackSize)
+    PushBack(Passes, lift_pass{ Td.StackGrids[I], M3, i8(Td.StackAxes[I]), false });
+}
+
+void
+PushInversePasses(const transform_details& Td, const v3i& M3, array<lift_pass>* Passes) {
+  int I = Td.StackSize;
+  while (I-- > 0)
+    PushBack(Passes, lift_pass{ Td.StackGrids[I], M3, i8(Td.StackAxes[I]), true });
+}
+
+/* Do the first NPasses passes */
+static void
+LiftCdf53(const array<lift_pass>& Passes, i64 NPasses, volume* Vol) {
+  for (i64 I = 0; I < NPasses; ++I) {
+    const lift_pass& A = Passes[I];
+    if (I + 1 < NPasses && CanFuse(A, Passes[I + 1])) {
+      const lift_pass& B = Passes[++I];
+      int O = SliceAxis(A.Axis);
+      idx2_For(int, K, 0, Dims(A.Grid)[O]) {
+        grid Slice = GetSlice(A.Grid, O, K);
+        Lift(A, Slice, Vol);
+        Lift(B, Slice, Vol);
+      }
+    } else {
+      Lift(A, A.Grid, Vol);
+    }
+  }
+}
+
+void
+LiftCdf53(const array<lift_pass>& Passes, volume* Vol) { LiftCdf53(Passes, Size(Passes), Vol); }
+
+void
+LiftCdf53(const array<lift_pass>& Passes, volume* Vol, const grid& SGrid, const grid& DGrid, volume* OutVol) {
+  i64 N = Size(Passes);
+  if (N == 0 || !CanSlice(Passes[N - 1])) {
+    LiftCdf53(Passes, N, Vol);
+    CopyGridGrid(SGrid, *Vol, DGrid, OutVol);
+    return;
+  }
+  LiftCdf53(Passes, N - 1, Vol);
+  const lift_pass& L = Passes[N - 1];
+  int O = SliceAxis(L.Axis);
+  int P = From(L.Grid)[O], D = Dims(L.Grid)[O], S = Strd(L.Grid)[O];
+  int SP = From(SGrid)[O], SD = Dims(SGrid)[O], SS = Strd(SGrid)[O];
+  idx2_For(int, K, 0, D) {
+    Lift(L, GetSlice(L.Grid, O, K), Vol);
+    int Pos = P + K * S;
+    if (Pos >= SP && (Pos - SP) % SS == 0 && (Pos - SP) / SS < SD) {
+      int J = (Pos - SP) / SS;
+      CopyGridGrid(GetSlice(SGrid, O, J), *Vol, GetSlice(DGrid, O, J), OutVol);
+    }
+  }
+  /* the slices of SGrid that the last pass does not touch */
+  idx2_For(int, J, 0, SD) {
+    int Pos = SP + J * SS;
+    if (!(Pos >= P && (Pos - P) % S == 0 && (Pos - P) / S < D))
+      CopyGridGrid(GetSlice(SGrid, O, J), *Vol, GetSlice(DGrid, O, J), OutVol);
+  }
+}
+
 void
 ForwardCdf53(const v3i& M3, const transform_details& Td, volume* Vol) {
   idx2_For(int, I, 0, Td.StackSize) {
     int D = Td.StackAxes[I];
-    #define Body(type)\
-    switch (D) {\
-      case 0: FLiftCdf53X<type>(Td.StackGrids[I], M3, lift_option::Normal, Vol); break;\
-      case 1: FLiftCdf53Y<type>(Td.StackGrids[I], M3, lift_option::Normal, Vol); break;\
-      case 2: FLiftCdf53Z<type>(Td.StackGrids[I], M3, lift_option::Normal, Vol); break;\
-      default: idx2_Assert(false); break;\
-    };
-    idx2_DispatchOnType(Vol->Type);
-    #undef Body
+    FLiftCdf53(D, Td.StackGrids[I], M3, lift_option::Normal, Vol);
   }
 }
 
@@ -11766,15 +13218,7 @@ InverseCdf53(const v3i& M3, const transform_details& Td, volume* Vol) {
   int I = Td.StackSize;
   while (I-- > 0) {
     int D = Td.StackAxes[I];
-    #define Body(type)\
-    switch (D) {\
-      case 0: ILiftCdf53X<f64>(Td.StackGrids[I], M3, lift_option::Normal, Vol); break;\
-      case 1: ILiftCdf53Y<f64>(Td.StackGrids[I], M3, lift_option::Normal, Vol); break;\
-      case 2: ILiftCdf53Z<f64>(Td.StackGrids[I], M3, lift_option::Normal, Vol); break;\
-      default: idx2_Assert(false); break;\
-    };
-    idx2_DispatchOnType(Vol->Type);
-    #undef Body
+    ILiftCdf53(D, Td.StackGrids[I], M3, lift_option::Normal, Vol);
   }
 }
 
@@ -11815,15 +13259,8 @@ ForwardCdf53(const v3i& Dims3, const v3i& M3, int Iter, int NLevels, u64 TformOr
       R3 = D3;
       ++Level;
     } else {
-      #define Body(type)\
-      switch (D) {\
-        case 0: idx2_Assert(Dims3.X > 1); FLiftCdf53X<type>(G, M3, lift_option::Normal, Vol); break;\
-        case 1: idx2_Assert(Dims3.Y > 1); FLiftCdf53Y<type>(G, M3, lift_option::Normal, Vol); break;\
-        case 2: idx2_Assert(Dims3.Z > 1); FLiftCdf53Z<type>(G, M3, lift_option::Normal, Vol); break;\
-        default: idx2_Assert(false); break;\
-      };
-      idx2_DispatchOnType(Vol->Type);
-      #undef Body
+      idx2_Assert(Dims3[D] > 1);
+      FLiftCdf53(D, G, M3, lift_option::Normal, Vol);
       R3[D] = D3[D] + IsEven(D3[D]);
       SetDims(&G, R3);
       D3[D] = (R3[D] + 1) >> 1;
@@ -11855,18 +13292,13 @@ void
 ForwardCdf53(const v3i& M3, int Iter, const array<subband>& Subbands, const transform_details& Td, volume* Vol, bool LastIter) {
   idx2_For(int, I, 0, Td.StackSize) {
     int D = Td.StackAxes[I];
-    #define Body(type)\
-    switch (D) {\
-      case 0: FLiftCdf53X<type>(Td.StackGrids[I], M3, lift_option::Normal, Vol); break;\
-      case 1: FLiftCdf53Y<type>(Td.StackGrids[I], M3, lift_option::Normal, Vol); break;\
-      case 2: FLiftCdf53Z<type>(Td.StackGrids[I], M3, lift_option::Normal, Vol); break;\
-      default: idx2_Assert(false); break;\
-    };
-    idx2_DispatchOnType(Vol->Type);
-    #undef Body
+    FLiftCdf53(D, Td.StackGrids[I], M3, lift_option::Normal, Vol);
   }
+  NormalizeCdf53(M3, Iter, Subbands, Td, Vol, LastIter);
+}
 
-  /* Optionally normalize */
+void
+NormalizeCdf53(const v3i& M3, int Iter, const array<subband>& Subbands, const transform_details& Td, volume* Vol, bool LastIter) {
   idx2_Assert(IsFloatingPoint(Vol->Type));
   for (int I = 0; I < Size(Subbands); ++I) {
     if (I == 0 && !LastIter) continue; // do not normalize subband 0
@@ -11884,10 +13316,21 @@ ForwardCdf53(const v3i& M3, int Iter, const array<subband>& Subbands, const tran
 }
 void
 InverseCdf53(const v3i& M3, int Iter, const array<subband>& Subbands, const transform_details& Td, volume* Vol, bool LastIter) {
-  /* inverse normalize if required */
+  DenormalizeCdf53(M3, Iter, Subbands, Td, Vol, LastIter);
+  /* perform the inverse transform */
+  int I = Td.StackSize;
+  while (I-- > 0) {
+    int D = Td.StackAxes[I];
+    ILiftCdf53(D, Td.StackGrids[I], M3, lift_option::Normal, Vol);
+  }
+}
+
+void
+DenormalizeCdf53(const v3i& M3, int Iter, const array<subband>& Subbands, const transform_details& Td, volume* Vol, bool LastIter, u8 SbMask) {
   idx2_Assert(IsFloatingPoint(Vol->Type));
   for (int I = 0; I < Size(Subbands); ++I) {
     if (I == 0 && !LastIter) continue; // do not normalize subband 0
+    if (!BitSet(SbMask, I)) continue;
     subband& S = Subbands[I];
     f64 Wx = M3.X == 1 ? 1 : (S.LowHigh3.X == 0 ? Td.BasisNorms.ScalNorms[Iter * Td.NPasses + S.Level3Rev.X - 1] : Td.BasisNorms.WaveNorms[Iter * Td.NPasses + S.Level3Rev.X]);
     f64 Wy = M3.Y == 1 ? 1 : (S.LowHigh3.Y == 0 ? Td.BasisNorms.ScalNorms[Iter * Td.NPasses + S.Level3Rev.Y - 1] : Td.BasisNorms.WaveNorms[Iter * Td.NPasses + S.Level3Rev.Y]);
@@ -11899,21 +13342,6 @@ InverseCdf53(const v3i& M3, int Iter, const array<subband>& Subbands, const tran
     idx2_DispatchOnType(Vol->Type);
     #undef Body
   }
-
-  /* perform the inverse transform */
-  int I = Td.StackSize;
-  while (I-- > 0) {
-    int D = Td.StackAxes[I];
-    #define Body(type)\
-    switch (D) {\
-      case 0: ILiftCdf53X<f64>(Td.StackGrids[I], M3, lift_option::Normal, Vol); break;\
-      case 1: ILiftCdf53Y<f64>(Td.StackGrids[I], M3, lift_option::Normal, Vol); break;\
-      case 2: ILiftCdf53Z<f64>(Td.StackGrids[I], M3, lift_option::Normal, Vol); break;\
-      default: idx2_Assert(false); break;\
-    };
-    idx2_DispatchOnType(Vol->Type);
-    #undef Body
-  }
 }
 
 void
@@ -11974,15 +13402,7 @@ InverseCdf53(const v3i& Dims3, const v3i& M3, int Iter, int NLevels, u64 TformOr
   /* perform the inverse transform */
   while (Iteration-- > 0) {
     int D = StackAxes[Iteration];
-    #define Body(type)\
-    switch (D) {\
-      case 0: ILiftCdf53X<f64>(StackGrids[Iteration], M3, lift_option::Normal, Vol); break;\
-      case 1: ILiftCdf53Y<f64>(StackGrids[Iteration], M3, lift_option::Normal, Vol); break;\
-      case 2: ILiftCdf53Z<f64>(StackGrids[Iteration], M3, lift_option::Normal, Vol); break;\
-      default: idx2_Assert(false); break;\
-    };
-    idx2_DispatchOnType(Vol->Type);
-    #undef Body
+    ILiftCdf53(D, StackGrids[Iteration], M3, lift_option::Normal, Vol);
   }
 }
 
@@ -12600,39 +14020,243 @@ Extrapolate(v3i D3, volume* Vol) {
 
 } // namespace idx2
 
-#include <math.h>
+#if defined(__CYGWIN__) || defined(__linux__) || defined(__APPLE__)
+#include <sys/uio.h>
+#endif
 
 namespace idx2 {
 
-struct stat {
-  f64 MinV = traits<f64>::Max;
-  f64 MaxV = traits<f64>::Min;
-  f64 S = 0;
-  i64 N = 0;
-  f64 SSq = 0;
+static bool
+OpenForAppend(cstr FileName, file_handle* File) {
+#if defined(_WIN32)
+  *File = CreateFileA(FileName, FILE_APPEND_DATA, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  return *File != INVALID_HANDLE_VALUE;
+#elif defined(__CYGWIN__) || defined(__linux__) || defined(__APPLE__)
+  *File = open(FileName, O_WRONLY | O_CREAT | O_APPEND, 0666);
+  return *File != -1;
+#endif
+}
 
-  idx2_Inline void Add(f64 Val) {
-    MinV = Min(MinV, Val);
-    MaxV = Max(MaxV, Val);
-    S += Val;
-    ++N;
-    SSq += Val * Val;
+static void
+CloseFile(file_handle File) {
+#if defined(_WIN32)
+  CloseHandle(File);
+#elif defined(__CYGWIN__) || defined(__linux__) || defined(__APPLE__)
+  close(File);
+#endif
+}
+
+static bool
+WriteAll(file_handle File, const byte* Ptr, i64 Bytes) {
+#if defined(_WIN32)
+  while (Bytes > 0) {
+    DWORD Written = 0;
+    if (!::WriteFile(File, Ptr, DWORD(Min(Bytes, i64(1) << 30)), &Written, NULL) || Written == 0)
+      return false;
+    Ptr += Written; Bytes -= Written;
+  }
+#elif defined(__CYGWIN__) || defined(__linux__) || defined(__APPLE__)
+  while (Bytes > 0) {
+    ssize_t Written = write(File, Ptr, size_t(Bytes));
+    if (Written <= 0)
+      return false;
+    Ptr += Written; Bytes -= Written;
   }
+#endif
+  return true;
+}
 
-  idx2_Inline f64 GetMin() const { return MinV; }
-  idx2_Inline f64 GetMax() const { return MaxV; }
-  idx2_Inline f64 Sum() const { return S; }
-  idx2_Inline i64 Count() const { return N; }
-  idx2_Inline f64 SumSq() const { return SSq; }
-  idx2_Inline f64 Avg() const { return S / N; }
-  idx2_Inline f64 AvgSq() const { return SSq / N; }
-  idx2_Inline f64 SqAvg() const { f64 A = Avg(); return A * A; }
-  idx2_Inline f64 Var() const { return AvgSq() - SqAvg(); }
-  idx2_Inline f64 StdDev() const { return sqrt(Var()); }
-};
+/* Write the concatenation of NParts buffers */
+static bool
+WriteAll(file_handle File, const buffer* Parts, int NParts) {
+#if defined(_WIN32)
+  idx2_For(int, I, 0, NParts) {
+    if (!WriteAll(File, Parts[I].Data, Parts[I].Bytes))
+      return false;
+  }
+#elif defined(__CYGWIN__) || defined(__linux__) || defined(__APPLE__)
+  constexpr int MaxIovs = 64;
+  iovec Iovs[MaxIovs];
+  int I = 0; // the first part not fully written
+  i64 Skip = 0; // the bytes of Parts[I] already written
+  ssize_t Written = 0;
+  while (true) {
+    /* skip the parts that are fully written */
+    while (I < NParts && Written >= Parts[I].Bytes - Skip) {
+      Written -= Parts[I].Bytes - Skip;
+      Skip = 0;
+      ++I;
+    }
+    Skip += Written;
+    if (I == NParts)
+      break;
+    int NIovs = 0;
+    for (int J = I; J < NParts && NIovs < MaxIovs; ++J) {
+      i64 Offset = J == I ? Skip : 0;
+      Iovs[NIovs].iov_base = Parts[J].Data + Offset;
+      Iovs[NIovs].iov_len = size_t(Parts[J].Bytes - Offset);
+      ++NIovs;
+    }
+    Written = writev(File, Iovs, NIovs);
+    if (Written <= 0)
+      return false;
+  }
+#endif
+  return true;
+}
+
+void
+Init(write_cache* Wc, int MaxOpenFiles) {
+  Init(&Wc->Files, 8);
+  Init(&Wc->Dirs, 6);
+  Wc->MaxOpenFiles = Max(MaxOpenFiles, 1);
+  Wc->NOpenFiles = 0;
+  Wc->Bytes = 0;
+  Wc->Clock = 0;
+  Wc->NWrites = Wc->NOpens = 0;
+}
+
+/* Open the file of an entry, closing the least recently used open file if too many are open */
+static bool
+Open(write_cache* Wc, write_entry* Entry) {
+  if (Wc->NOpenFiles >= Wc->MaxOpenFiles) {
+    write_entry* Lru = nullptr;
+    idx2_ForEach(It, Wc->Files) {
+      if (It.Val->IsOpen && (!Lru || It.Val->LastUse < Lru->LastUse))
+        Lru = It.Val;
+    }
+    idx2_Assert(Lru);
+    CloseFile(Lru->File);
+    Lru->IsOpen = false;
+    --Wc->NOpenFiles;
+  }
+  stref Dir = GetDirName(Entry->Path);
+  u64 DirKey = FdKey(ToString(Dir));
+  if (!Lookup(&Wc->Dirs, DirKey)) {
+    CreateFullDir(Dir);
+    Insert(&Wc->Dirs, DirKey, true);
+  }
+  if (!OpenForAppend(Entry->Path, &Entry->File))
+    return false;
+  Entry->IsOpen = true;
+  ++Wc->NOpenFiles;
+  ++Wc->NOpens;
+  return true;
+}
+
+/* Write the buffer of an entry to its file, then free the buffer (most files are written only a
+few times, so keeping the buffers would hold on to memory) */
+static bool
+Flush(write_cache* Wc, write_entry* Entry) {
+  if (Entry->Size == 0)
+    return true;
+  if (!Entry->IsOpen && !Open(Wc, Entry))
+    return false;
+  Entry->LastUse = ++Wc->Clock;
+  bool Ok = WriteAll(Entry->File, Entry->Buf.Data, Entry->Size);
+  ++Wc->NWrites;
+  Wc->Bytes -= Entry->Size;
+  Entry->Size = 0;
+  DeallocBuf(&Entry->Buf);
+  return Ok;
+}
+
+bool
+Flush(write_cache* Wc) {
+  bool Ok = true;
+  idx2_ForEach(It, Wc->Files) {
+    Ok = Flush(Wc, It.Val) && Ok;
+    if (It.Val->IsOpen) {
+      CloseFile(It.Val->File);
+      It.Val->IsOpen = false;
+      --Wc->NOpenFiles;
+    }
+  }
+  idx2_Assert(Wc->NOpenFiles == 0);
+  return Ok;
+}
 
+void
+Dealloc(write_cache* Wc) {
+  Flush(Wc);
+  idx2_ForEach(It, Wc->Files) {
+    if (It.Val->Buf.Data)
+      DeallocBuf(&It.Val->Buf);
+  }
+  Dealloc(&Wc->Files);
+  Dealloc(&Wc->Dirs);
 }
 
+void
+Discard(write_cache* Wc) {
+  idx2_ForEach(It, Wc->Files) {
+    if (It.Val->Buf.Data)
+      DeallocBuf(&It.Val->Buf);
+    It.Val->Size = 0;
+    if (It.Val->IsOpen) {
+      CloseFile(It.Val->File);
+      It.Val->IsOpen = false;
+      --Wc->NOpenFiles;
+    }
+  }
+  Wc->Bytes = 0;
+}
+
+bool
+Append(write_cache* Wc, const stref& FileName, const void* Data, i64 Bytes) {
+  buffer Part((const byte*)Data, Bytes);
+  return Append(Wc, FileName, &Part, 1);
+}
+
+bool
+Append(write_cache* Wc, const stref& FileName, const buffer* Parts, int NParts) {
+  u64 Key = FdKey(ToString(FileName));
+  auto It = Lookup(&Wc->Files, Key);
+  if (!It) {
+    write_entry Entry;
+    idx2_Assert(FileName.Size < (int)sizeof(Entry.Path));
+    snprintf(Entry.Path, sizeof(Entry.Path), "%.*s", FileName.Size, FileName.ConstPtr);
+    Insert(&It, Key, Entry);
+  }
+  write_entry* Entry = It.Val;
+  i64 Bytes = 0;
+  idx2_For(int, I, 0, NParts) Bytes += Parts[I].Bytes;
+  /* large appends bypass the buffer */
+  if (Entry->Size == 0 && Bytes >= Wc->FlushBytes) {
+    if (!Entry->IsOpen && !Open(Wc, Entry))
+      return false;
+    Entry->LastUse = ++Wc->Clock;
+    ++Wc->NWrites;
+    return WriteAll(Entry->File, Parts, NParts);
+  }
+  /* grow the buffer geometrically */
+  if (Entry->Size + Bytes > Entry->Buf.Bytes) {
+    buffer NewBuf;
+    AllocBuf(&NewBuf, Max(Max(Entry->Buf.Bytes * 2, Entry->Size + Bytes), i64(4096)));
+    if (Entry->Size > 0)
+      memcpy(NewBuf.Data, Entry->Buf.Data, size_t(Entry->Size));
+    if (Entry->Buf.Data)
+      DeallocBuf(&Entry->Buf);
+    Entry->Buf = NewBuf;
+  }
+  idx2_For(int, I, 0, NParts) {
+    if (Parts[I].Bytes > 0)
+      memcpy(Entry->Buf.Data + Entry->Size, Parts[I].Data, size_t(Parts[I].Bytes));
+    Entry->Size += Parts[I].Bytes;
+  }
+  Wc->Bytes += Bytes;
+  if (Entry->Size >= Wc->FlushBytes)
+    return Flush(Wc, Entry);
+  if (Wc->Bytes > Wc->MaxBytes) {
+    bool Ok = true;
+    idx2_ForEach(FIt, Wc->Files) Ok = Flush(Wc, FIt.Val) && Ok;
+    return Ok;
+  }
+  return true;
+}
+
+} // namespace idx2
+
 #include <string.h>
 #define __STDC_FORMAT_MACROS
 
@@ -14453,7 +16077,6 @@ FSE_CTable    ct;         // Provided by FSE_buildCTable()
 BIT_CStream_t bitStream;  // bitStream tracking structure
 FSE_CState_t  state;      // State tracking structure (can have several)
 
-
 The first thing to do is to init bitStream and state.
     size_t errorCode = BIT_initCStream(&bitStream, dstBuffer, maxDstSize);
     FSE_initCState(&state, ct);
@@ -40387,6 +42010,8 @@ size_t ZSTD_decompressBlock(ZSTD_DCtx* dctx,
 #endif
 
 #include <algorithm> // TODO: write my own quicksort
+#include <atomic>
+#include <thread>
 
 #if defined(__clang__) || defined(__GNUC__)
 #pragma GCC diagnostic push
@@ -40752,6 +42377,7 @@ SEXPR_DEF SExprResult ParseSExpr(const char* src, size_t len, SExprPool* pool)
 }
 
 #endif
+
 #if defined(__clang__) || defined(__GNUC__)
 #pragma GCC diagnostic pop
 #endif
@@ -40780,16 +42406,23 @@ GetPartialResolution(const v3i& Dims3, u8 Mask, const array<subband>& Subbands)
   return OutDims3;
 }*/
 
-static grid
-GetGrid(const extent& Ext, int Iter, u8 Mask, const array<subband>& Subbands) {
-  v3i Strd3(1); // start with stride (1, 1, 1)
-  idx2_For(int, D, 0, 3) Strd3[D] <<= Iter; // TODO: only work with 1 transform pass per level
+/* Whether (1) or not (0) some subband in Mask is high along each axis */
+static v3i
+GetHighAxes(u8 Mask, const array<subband>& Subbands) {
   v3i Div(0);
   idx2_For(u8, Sb, 0, 8) {
     if (!BitSet(Mask, Sb)) continue;
     v3i Lh3 = Subbands[Sb].LowHigh3;
     idx2_For(int, D, 0, 3) Div[D] = Max(Div[D], Lh3[D]);
   }
+  return Div;
+}
+
+static grid
+GetGrid(const extent& Ext, int Iter, u8 Mask, const array<subband>& Subbands) {
+  v3i Strd3(1); // start with stride (1, 1, 1)
+  idx2_For(int, D, 0, 3) Strd3[D] <<= Iter; // TODO: only work with 1 transform pass per level
+  v3i Div = GetHighAxes(Mask, Subbands);
   idx2_For(int, D, 0, 3) if (Div[D] == 0) Strd3[D] <<= 1;
   v3i First3 = From(Ext), Last3 = Last(Ext);
   First3 = ((First3 + Strd3 - 1) / Strd3) * Strd3;
@@ -40855,8 +42488,6 @@ BitPlaneFromChannelKey(u64 ChannelKey) { return i16(ChannelKey >> 16); }
 idx2_Inline u16
 GetSubChannelKey(i8 Iter, i8 Level) { return (u16(Level) << 4) + Iter; }
 
-static free_list_allocator BrickAlloc_;
-
 void Dealloc(params* P) { Dealloc(&P->RdoLevels); }
 void SetName(idx2_file* Idx2, cstr Name) { snprintf(Idx2->Name, sizeof(Idx2->Name), "%s", Name); }
 void SetField(idx2_file* Idx2, cstr Field) { snprintf(Idx2->Field, sizeof(Idx2->Field), "%s", Field); }
@@ -41282,9 +42913,67 @@ ReadMetaFile(idx2_file* Idx2, cstr FileName) {
   return idx2_Error(idx2_file_err_code::NoError);
 }
 
+static void
+Append(segmented_stream* Ss, const byte* Data, i64 Bytes) {
+  while (Bytes > 0) {
+    i64 Seg = Ss->Bytes / segmented_stream::SegBytes;
+    i64 Offset = Ss->Bytes % segmented_stream::SegBytes;
+    if (Seg == Size(Ss->Segs)) {
+      buffer Buf;
+      AllocBuf(&Buf, segmented_stream::SegBytes);
+      PushBack(&Ss->Segs, Buf);
+    } else if (Ss->Segs[Seg].Bytes < segmented_stream::SegBytes) { // the segment was trimmed
+      buffer Buf;
+      AllocBuf(&Buf, segmented_stream::SegBytes);
+      memcpy(Buf.Data, Ss->Segs[Seg].Data, size_t(Offset));
+      DeallocBuf(&Ss->Segs[Seg]);
+      Ss->Segs[Seg] = Buf;
+    }
+    i64 N = Min(Bytes, segmented_stream::SegBytes - Offset);
+    memcpy(Ss->Segs[Seg].Data + Offset, Data, size_t(N));
+    Ss->Bytes += N;
+    Data += N;
+    Bytes -= N;
+  }
+}
+
+/* The segments are kept for reuse */
+idx2_Inline static void
+Rewind(segmented_stream* Ss) { Ss->Bytes = 0; }
+
+/* Free the segments past the bytes written and shrink the last one to them, for a stream that is
+kept a while before it is written (see TrimUnit); Append grows the last segment back */
+static void
+Trim(segmented_stream* Ss) {
+  i64 NSegs = (Ss->Bytes + segmented_stream::SegBytes - 1) / segmented_stream::SegBytes;
+  idx2_For(i64, Seg, NSegs, Size(Ss->Segs)) DeallocBuf(&Ss->Segs[Seg]);
+  Resize(&Ss->Segs, NSegs);
+  i64 LastBytes = Ss->Bytes - (NSegs - 1) * segmented_stream::SegBytes;
+  if (NSegs > 0 && LastBytes < Ss->Segs[NSegs - 1].Bytes) {
+    buffer Buf;
+    AllocBuf(&Buf, LastBytes);
+    memcpy(Buf.Data, Ss->Segs[NSegs - 1].Data, size_t(LastBytes));
+    DeallocBuf(&Ss->Segs[NSegs - 1]);
+    Ss->Segs[NSegs - 1] = Buf;
+  }
+}
+
+/* Add the written bytes of each segment to Parts */
+static void
+GetParts(const segmented_stream& Ss, array<buffer>* Parts) {
+  for (i64 Begin = 0, Seg = 0; Begin < Ss.Bytes; Begin += segmented_stream::SegBytes, ++Seg)
+    PushBack(Parts, buffer(Ss.Segs[Seg].Data, Min(segmented_stream::SegBytes, Ss.Bytes - Begin)));
+}
+
+static void
+Dealloc(segmented_stream* Ss) {
+  idx2_ForEach(SegIt, Ss->Segs) DeallocBuf(SegIt);
+  Dealloc(&Ss->Segs);
+  Ss->Bytes = 0;
+}
+
 static void
 Init(channel* C) {
-  InitWrite(&C->BrickStream, 16384);
   InitWrite(&C->BrickDeltasStream, 32);
   InitWrite(&C->BrickSzsStream, 256);
   InitWrite(&C->BlockStream, 256);
@@ -41340,7 +43029,6 @@ GetLinearBrick(const idx2_file& Idx2, int Iter, v3i Brick3) {
   return LinearBrick;
 }
 
-/* only used for debugging
 static v3i
 GetSpatialBrick(const idx2_file& Idx2, int Iter, u64 LinearBrick) {
   int Size = Idx2.BrickOrderStrs[Iter].Len;
@@ -41352,7 +43040,7 @@ GetSpatialBrick(const idx2_file& Idx2, int Iter, u64 LinearBrick) {
     Brick3[D] <<= 1;
   }
   return Brick3 >> 1;
-}*/
+}
 
 /* only used for debugging
 static u64
@@ -41524,22 +43212,28 @@ void Dealloc(chunk_meta_info* Cm) {
 }
 
 static void
-Init(encode_data* E, allocator* Alloc = nullptr) {
+Init(encode_data* E, allocator* Alloc) {
   Init(&E->BrickPool, 9);
   Init(&E->Channels, 10);
   Init(&E->SubChannels, 5);
-  E->Alloc = Alloc ? Alloc : &BrickAlloc_;
+  E->Alloc = Alloc;
   Init(&E->ChunkMeta, 8);
   Init(&E->ChunkEMaxesMeta, 5);
   InitWrite(&E->CpresEMaxes, 32768);
   InitWrite(&E->CpresChunkAddrs, 16384);
-  InitWrite(&E->ChunkStream, 16384);
+  InitWrite(&E->ChunkStream, 64);
+  Reserve(&E->ChunkParts, 64);
   InitWrite(&E->ChunkEMaxesStream, 32768);
   Init(&E->ChunkRDOLengths, 10);
+  Init(&E->Writer);
+  Init(&E->BrickLiftPasses, 3);
 }
 
 static void
 Dealloc(encode_data* E) {
+  idx2_ForEach(BrickIt, E->BrickPool) { // the bricks are only left if the encode failed
+    if (BrickIt.Val->Vol.Buffer) Dealloc(&BrickIt.Val->Vol);
+  }
   E->Alloc->DeallocAll();
   Dealloc(&E->BrickPool);
   idx2_ForEach(ChannelIt, E->Channels) Dealloc(ChannelIt.Val);
@@ -41552,12 +43246,22 @@ Dealloc(encode_data* E) {
   Dealloc(&E->CpresEMaxes);
   Dealloc(&E->CpresChunkAddrs);
   Dealloc(&E->ChunkStream);
+  Dealloc(&E->ChunkParts);
   Dealloc(&E->ChunkEMaxesStream);
   Dealloc(&E->BlockSigs);
+  Dealloc(&E->ChannelSlots);
   Dealloc(&E->EMaxes);
   Dealloc(&E->BlockStream);
   Dealloc(&E->ChunkRDOs);
   Dealloc(&E->ChunkRDOLengths);
+  Dealloc(&E->ChannelOrder);
+  Dealloc(&E->ChunkEMaxesMeta);
+  /* the files are all flushed unless the encode failed, in which case nothing more is written (and
+  the message of the error, see idx2_Error, is kept) */
+  Discard(&E->Writer);
+  Dealloc(&E->Writer);
+  idx2_ForEach(PassesIt, E->BrickLiftPasses) Dealloc(PassesIt.Val);
+  Dealloc(&E->BrickLiftPasses);
 }
 
 #define idx2_NextMorton(Morton, Row3, Dims3)\
@@ -41622,37 +43326,36 @@ FlattenBrickTable(
   }
 }
 
-/* book-keeping stuffs */
-static stat BrickDeltasStat;
-static stat BrickSzsStat;
-static stat BrickStreamStat;
-static stat ChunkStreamStat;
-
-// TODO: return error
-static void
+/* A chunk is the number of bricks followed by the brick deltas, the brick sizes, and the brick data.
+The parts are appended to the file as they are, without first being copied into one stream. */
+static error<idx2_file_err_code>
 WriteChunk(const idx2_file& Idx2, encode_data* E, channel* C, i8 Iter, i8 Level, i16 BitPlane) {
-  BrickDeltasStat.Add((f64)Size(C->BrickDeltasStream)); // brick deltas
-  BrickSzsStat.Add((f64)Size(C->BrickSzsStream)); // brick sizes
-  BrickStreamStat.Add((f64)Size(C->BrickStream)); // brick data
-  i64 ChunkSize = Size(C->BrickDeltasStream) + Size(C->BrickSzsStream) + Size(C->BrickStream) + 64;
+  E->BrickDeltasStat.Add((f64)Size(C->BrickDeltasStream)); // brick deltas
+  E->BrickSzsStat.Add((f64)Size(C->BrickSzsStream)); // brick sizes
+  E->BrickStreamStat.Add((f64)Size(C->BrickStream)); // brick data
   Rewind(&E->ChunkStream);
-  GrowToAccomodate(&E->ChunkStream, ChunkSize);
+  GrowToAccomodate(&E->ChunkStream, 16);
   WriteVarByte(&E->ChunkStream, C->NBricks);
-  WriteStream(&E->ChunkStream, &C->BrickDeltasStream);
-  WriteStream(&E->ChunkStream, &C->BrickSzsStream);
-  WriteStream(&E->ChunkStream, &C->BrickStream);
   Flush(&E->ChunkStream);
-  ChunkStreamStat.Add((f64)Size(E->ChunkStream));
+  Flush(&C->BrickDeltasStream);
+  Flush(&C->BrickSzsStream);
+  Clear(&E->ChunkParts);
+  PushBack(&E->ChunkParts, ToBuffer(E->ChunkStream));
+  PushBack(&E->ChunkParts, ToBuffer(C->BrickDeltasStream));
+  PushBack(&E->ChunkParts, ToBuffer(C->BrickSzsStream));
+  GetParts(C->BrickStream, &E->ChunkParts);
+  i64 ChunkSize = Size(E->ChunkStream) + Size(C->BrickDeltasStream) + Size(C->BrickSzsStream) + Size(C->BrickStream);
+  E->ChunkStreamStat.Add((f64)ChunkSize);
+
+  /* write to file */
+  file_id FileId = ConstructFilePath(Idx2, C->LastBrick, Iter, Level, BitPlane);
+  if (!Append(&E->Writer, FileId.Name, Begin(E->ChunkParts), (int)Size(E->ChunkParts)))
+    return idx2_Error(idx2_file_err_code::FileWriteFailed, "%.*s", FileId.Name.Size, FileId.Name.ConstPtr);
 
   /* we are done with these, rewind */
   Rewind(&C->BrickDeltasStream);
   Rewind(&C->BrickSzsStream);
   Rewind(&C->BrickStream);
-
-  /* write to file */
-  file_id FileId = ConstructFilePath(Idx2, C->LastBrick, Iter, Level, BitPlane);
-  idx2_OpenMaybeExistingFile(Fp, FileId.Name.ConstPtr, "ab");
-  WriteBuffer(Fp, ToBuffer(E->ChunkStream));
   /* keep track of the chunk addresses and sizes */
   auto ChunkMetaIt = Lookup(&E->ChunkMeta, FileId.Id);
   if (!ChunkMetaIt) {
@@ -41663,34 +43366,32 @@ WriteChunk(const idx2_file& Idx2, encode_data* E, channel* C, i8 Iter, i8 Level,
   idx2_Assert(ChunkMetaIt);
   chunk_meta_info* ChunkMeta = ChunkMetaIt.Val;
   GrowToAccomodate(&ChunkMeta->Sizes, 4);
-  WriteVarByte(&ChunkMeta->Sizes, Size(E->ChunkStream));
+  WriteVarByte(&ChunkMeta->Sizes, ChunkSize);
   u64 ChunkAddress = GetChunkAddress(Idx2, C->LastBrick, Iter, Level, BitPlane);
   PushBack(&ChunkMeta->Addrs, ChunkAddress);
 //  printf("chunk %x level %d bit plane %d offset %llu size %d\n", ChunkAddress, Level, BitPlane, Where, (i64)Size(Channel->ChunkStream));
-  PushBack(&E->ChunkRDOs, rdo_chunk{ChunkAddress, Size(E->ChunkStream), 0.0});
+  PushBack(&E->ChunkRDOs, rdo_chunk{ChunkAddress, ChunkSize, 0.0});
   Rewind(&E->ChunkStream);
+  return idx2_Error(idx2_file_err_code::NoError);
 }
 
-stat BrickEMaxesStat;
-stat ChunkEMaxesStat;
-
 // Write once per chunk
-static void
+static error<idx2_file_err_code>
 WriteChunkExponents(const idx2_file& Idx2, encode_data* E, sub_channel* Sc, i8 Iter, i8 Level) {
   /* brick exponents */
   Flush(&Sc->BrickEMaxesStream);
-  BrickEMaxesStat.Add((f64)Size(Sc->BrickEMaxesStream));
+  E->BrickEMaxesStat.Add((f64)Size(Sc->BrickEMaxesStream));
   Rewind(&E->ChunkEMaxesStream);
   CompressBufZstd(ToBuffer(Sc->BrickEMaxesStream), &E->ChunkEMaxesStream);
-  ChunkEMaxesStat.Add((f64)Size(E->ChunkEMaxesStream));
+  E->ChunkEMaxesStat.Add((f64)Size(E->ChunkEMaxesStream));
 
   /* rewind */
   Rewind(&Sc->BrickEMaxesStream);
 
   /* write to file */
   file_id FileId = ConstructFilePathExponents(Idx2, Sc->LastBrick, Iter, Level);
-  idx2_OpenMaybeExistingFile(Fp, FileId.Name.ConstPtr, "ab");
-  WriteBuffer(Fp, ToBuffer(E->ChunkEMaxesStream));
+  if (!Append(&E->Writer, FileId.Name, E->ChunkEMaxesStream.Stream.Data, Size(E->ChunkEMaxesStream)))
+    return idx2_Error(idx2_file_err_code::FileWriteFailed, "%.*s", FileId.Name.Size, FileId.Name.ConstPtr);
   /* keep track of the chunk sizes */
   auto ChunkEMaxesMetaIt = Lookup(&E->ChunkEMaxesMeta, FileId.Id);
   if (!ChunkEMaxesMetaIt) {
@@ -41706,6 +43407,7 @@ WriteChunkExponents(const idx2_file& Idx2, encode_data* E, sub_channel* Sc, i8 I
   Insert(&E->ChunkRDOLengths, ChunkAddress, (u32)Size(E->ChunkEMaxesStream));
 
   Rewind(&E->ChunkEMaxesStream);
+  return idx2_Error(idx2_file_err_code::NoError);
 }
 
 struct sub_channel_ptr {
@@ -41718,26 +43420,24 @@ struct sub_channel_ptr {
   }
 };
 
-stat ChunkEMaxSzsStat;
-
 // TODO: check the error path
 error<idx2_file_err_code>
 FlushChunkExponents(const idx2_file& Idx2, encode_data* E) {
   idx2_ForEach(ScIt, E->SubChannels) {
     i8 Iteration = IterationFromChannelKey(*ScIt.Key);
     i8 Level = LevelFromChannelKey(*ScIt.Key);
-    WriteChunkExponents(Idx2, E, ScIt.Val, Iteration, Level);
+    idx2_PropagateIfError(WriteChunkExponents(Idx2, E, ScIt.Val, Iteration, Level));
   }
   idx2_ForEach(CemIt, E->ChunkEMaxesMeta) {
     bitstream* ChunkEMaxSzs = CemIt.Val;
     file_id FileId = ConstructFilePathExponents(Idx2, *CemIt.Key);
     idx2_Assert(FileId.Id == *CemIt.Key);
     /* write chunk emax sizes */
-    idx2_OpenMaybeExistingFile(Fp, FileId.Name.ConstPtr, "ab");
     Flush(ChunkEMaxSzs);
-    ChunkEMaxSzsStat.Add((f64)Size(*ChunkEMaxSzs));
-    WriteBuffer(Fp, ToBuffer(*ChunkEMaxSzs));
-    WritePOD(Fp, (int)Size(*ChunkEMaxSzs));
+    E->ChunkEMaxSzsStat.Add((f64)Size(*ChunkEMaxSzs));
+    if (!Append(&E->Writer, FileId.Name, ChunkEMaxSzs->Stream.Data, Size(*ChunkEMaxSzs)) ||
+        !AppendPOD(&E->Writer, FileId.Name, (int)Size(*ChunkEMaxSzs)))
+      return idx2_Error(idx2_file_err_code::FileWriteFailed, "%.*s", FileId.Name.Size, FileId.Name.ConstPtr);
   }
   return idx2_Error(idx2_file_err_code::NoError);
 }
@@ -41856,9 +43556,10 @@ struct rdo_mini {
 /* Rate distortion optimization is done once per tile and iter/level */
 // TODO: change the word "Chunk" to "Tile" elsewhere where it makes sense
 // TODO: normalize the distortion by the number of samples a chunk has
-static void
+static error<idx2_file_err_code>
 RateDistortionOpt(const idx2_file& Idx2, encode_data* E) {
-  if (Size(Idx2.RdoLevels) == 0) return;
+  if (Size(Idx2.RdoLevels) == 0)
+    return idx2_Error(idx2_file_err_code::NoError);
   constexpr u64 InfInt = 0x7FF0000000000000ull;
   const f64 Inf = *(f64*)(&InfInt);
 
@@ -42003,7 +43704,6 @@ RateDistortionOpt(const idx2_file& Idx2, encode_data* E) {
       u64 FirstBrickAddr = ((FileAddr * Idx2.ChunksPerFiles[Iter]) + 0) * Idx2.BricksPerChunks[Iter] + 0;
       file_id FileId = ConstructFilePathRdos(Idx2, FirstBrickAddr, Iter);
       int NumChunks = 0;
-      idx2_OpenMaybeExistingFile(Fp, FileId.Name.ConstPtr, "ab");
       idx2_ChunkTraverse(
         ++NumChunks;
         u64 ChunkAddr = (FileAddr * Idx2.ChunksPerFiles[Iter]) + ChunkTop.Address;
@@ -42039,9 +43739,10 @@ RateDistortionOpt(const idx2_file& Idx2, encode_data* E) {
       ); // end chunk (tile) traverse
       buffer Buf(Buffer.Buffer.Data, Size(Buffer) * sizeof(i16));
       CompressBufZstd(Buf, &BitStream);
-      WriteBuffer(Fp, buffer{BitStream.Stream.Data, Size(BitStream)});
-      WritePOD(Fp, NumChunks);
-      fclose(Fp);
+      bool Ok = Append(&E->Writer, FileId.Name, BitStream.Stream.Data, Size(BitStream)) &&
+                AppendPOD(&E->Writer, FileId.Name, NumChunks);
+      if (!Ok)
+        return idx2_Error(idx2_file_err_code::FileWriteFailed, "%.*s", FileId.Name.Size, FileId.Name.ConstPtr);
       Clear(&Buffer);
       Rewind(&BitStream);
       , 64
@@ -42053,109 +43754,163 @@ RateDistortionOpt(const idx2_file& Idx2, encode_data* E) {
     );
   } // end level loop
   idx2_Assert(Pos == Size(RdoPrecomputes));
+  return idx2_Error(idx2_file_err_code::NoError);
 }
 
-static stat BlockStat;
-static stat BlockEMaxStat;
+/* The slot of a bit plane of the subband being encoded, whose channel is looked up (or created) only
+if the channels may have moved since the slot was last used */
+static channel_slot*
+GetChannelSlot(encode_data* E, i64 SlotIdx, i16 RealBp) {
+  idx2_Assert(SlotIdx >= 0);
+  if (SlotIdx >= Size(E->ChannelSlots))
+    Resize(&E->ChannelSlots, SlotIdx + 1);
+  channel_slot* Slot = &E->ChannelSlots[SlotIdx];
+  if (Slot->Gen != E->ChannelGen) {
+    u32 ChannelKey = GetChannelKey(RealBp, E->Iter, E->Level);
+    auto ChannelIt = Lookup(&E->Channels, ChannelKey);
+    if (!ChannelIt) {
+      channel Channel; Init(&Channel);
+      Insert(&ChannelIt, ChannelKey, Channel);
+      PushBack(&E->ChannelOrder, ChannelKey);
+      ++E->ChannelGen;
+    }
+    Slot->Channel = ChannelIt.Val;
+    Slot->Gen = E->ChannelGen;
+  }
+  return Slot;
+}
 
-// TODO: return an error code
-static void
+idx2_T(t) static error<idx2_file_err_code>
 EncodeSubband(idx2_file* Idx2, encode_data* E, const grid& SbGrid, volume* BrickVol) {
   u64 Brick = E->Brick[E->Iter];
   v3i SbDims3 = Dims(SbGrid);
   v3i NBlocks3 = (SbDims3 + Idx2->BlockDims3 - 1) / Idx2->BlockDims3;
   u32 LastBlock = EncodeMorton3(v3<u32>(NBlocks3 - 1));
   const i8 NBitPlanes = idx2_BitSizeOf(u64);
+  const i16 BpBase = i16(Exponent(Idx2->Accuracy) + NBitPlanes - 7); // the lowest bit plane encoded (see TooHighPrecision)
+  idx2_ForEach(SigIt, E->BlockSigs) E->ChannelSlots[SigIt->BitPlane - BpBase] = channel_slot{};
   Clear(&E->BlockSigs); Reserve(&E->BlockSigs, NBitPlanes);
   Clear(&E->EMaxes); Reserve(&E->EMaxes, Prod(NBlocks3));
+  /* the distances between neighboring samples of the subband in the brick */
+  v3i BrickDims3 = Dims(*BrickVol), SbFrom3 = From(SbGrid), SbStrd3 = Strd(SbGrid);
+  v3<i64> SampleStrd3(SbStrd3.X, i64(SbStrd3.Y) * BrickDims3.X, i64(SbStrd3.Z) * BrickDims3.X * BrickDims3.Y);
 
   /* query the right sub channel for the block exponents */
   u16 SubChanKey = GetSubChannelKey(E->Iter, E->Level);
   auto ScIt = Lookup(&E->SubChannels, SubChanKey);
   if (!ScIt) {
     sub_channel SubChan; Init(&SubChan);
+    SubChan.LastChunk = Brick >> Log2Ceil(Idx2->BricksPerChunks[E->Iter]);
     Insert(&ScIt, SubChanKey, SubChan);
   }
   idx2_Assert(ScIt);
   sub_channel* Sc = ScIt.Val;
 
-  /* pass 1: compress the blocks */
-  idx2_InclusiveFor(u32, Block, 0, LastBlock) { // zfp block loop
-    v3i Z3(DecodeMorton3(Block));
-    idx2_NextMorton(Block, Z3, NBlocks3);
-    v3i D3 = Z3 * Idx2->BlockDims3;
-    v3i BlockDims3 = Min(Idx2->BlockDims3, SbDims3 - D3);
-    const i8 NDims = (i8)NumDims(BlockDims3);
+  /* encode the bit planes of a transformed block (once a chunk fails to be written, Err holds the error
+  and the other blocks are skipped) */
+  error<idx2_file_err_code> Err = idx2_Error(idx2_file_err_code::NoError);
+  auto EncodeBlock = [&](u32 Block, i16 EMax, i8 NDims, u64* BlockUInts) {
+    if (!Err) return;
     const int NVals = 1 << (2 * NDims);
-    const i8 Prec = NBitPlanes - 1 - NDims;
-    f64 BlockFloats[4 * 4 * 4];
-    buffer_t BufFloats(BlockFloats, NVals);
-    buffer_t BufInts((i64*)BlockFloats, NVals);
-    u64 BlockUInts [4 * 4 * 4];
-    buffer_t BufUInts (BlockUInts , NVals);
-    bool CodedInNextIter = E->Level == 0 && E->Iter + 1 < Idx2->NLevels && BlockDims3 == Idx2->BlockDims3;
-    if (CodedInNextIter) continue;
-    /* copy the samples to the local buffer */
-    v3i S3;
-    int J = 0;
-    v3i From3 = From(SbGrid), Strd3 = Strd(SbGrid);
-    idx2_BeginFor3(S3, v3i(0), BlockDims3, v3i(1)) { // sample loop
-      idx2_Assert(D3 + S3 < SbDims3);
-      BlockFloats[J++] = BrickVol->At<f64>(From3, Strd3, D3 + S3);
-    } idx2_EndFor3 // end sample loop
-    /* zfp transform and shuffle */
-    const i16 EMax = SizeOf(Idx2->DType) > 4 ? (i16)QuantizeF64(Prec, BufFloats, &BufInts) : (i16)QuantizeF32(Prec, BufFloats, &BufInts);
-    PushBack(&E->EMaxes, EMax);
-    ForwardZfp((i64*)BlockFloats, NDims);
-    ForwardShuffle((i64*)BlockFloats, BlockUInts, NDims);
-    /* zfp encode */
     i8 N = 0; // number of significant coefficients in the block so far
     i8 EndBitPlane = Min(i8(BitSizeOf(Idx2->DType) + (24 + NDims)), NBitPlanes); // TODO: why 24 (this is only based on empirical experiments with float32, for other types it might be different)?
     idx2_InclusiveForBackward(i8, Bp, NBitPlanes - 1, NBitPlanes - EndBitPlane) { // bit plane loop
       i16 RealBp = Bp + EMax;
       bool TooHighPrecision = NBitPlanes  - 6 > RealBp - Exponent(Idx2->Accuracy) + 1;
       if (TooHighPrecision) break;
-      u32 ChannelKey = GetChannelKey(RealBp, E->Iter, E->Level);
-      auto ChannelIt = Lookup(&E->Channels, ChannelKey);
-      if (!ChannelIt) {
-        channel Channel; Init(&Channel);
-        Insert(&ChannelIt, ChannelKey, Channel);
-      }
-      idx2_Assert(ChannelIt);
-      channel* C = ChannelIt.Val;
+      channel_slot* Slot = GetChannelSlot(E, RealBp - BpBase, RealBp);
+      channel* C = Slot->Channel;
       /* write block id */
-      // u32 BlockDelta = Block;
-      int I = 0;
-      for (; I < Size(E->BlockSigs); ++I) {
-        if (E->BlockSigs[I].BitPlane == RealBp) {
-          idx2_Assert(Block > E->BlockSigs[I].Block);
-          // BlockDelta = Block - E->BlockSigs[I].Block - 1;
-          E->BlockSigs[I].Block = Block;
-          break;
-        }
+      if (Slot->Sig >= 0) {
+        idx2_Assert(Block > E->BlockSigs[Slot->Sig].Block);
+        E->BlockSigs[Slot->Sig].Block = Block;
       }
       /* write chunk if this brick is after the last chunk */
-      bool FirstSigBlock = I == Size(E->BlockSigs); // first block that becomes significant on this bit plane
+      bool FirstSigBlock = Slot->Sig < 0; // first block that becomes significant on this bit plane
       bool BrickNotEmpty = Size(C->BrickStream) > 0;
       bool NewChunk = Brick >= (C->LastChunk + 1) * Idx2->BricksPerChunks[E->Iter]; // TODO: multiplier?
       if (FirstSigBlock) {
         if (NewChunk) {
-          if (BrickNotEmpty) WriteChunk(*Idx2, E, C, E->Iter, E->Level, RealBp);
+          if (BrickNotEmpty) {
+            Err = WriteChunk(*Idx2, E, C, E->Iter, E->Level, RealBp);
+            if (!Err) return;
+          }
           C->NBricks = 0;
           C->LastChunk = Brick >> Log2Ceil(Idx2->BricksPerChunks[E->Iter]);
         }
+        Slot->Sig = (i32)Size(E->BlockSigs);
         PushBack(&E->BlockSigs, block_sig{Block, RealBp});
       }
       /* encode the block */
       GrowIfTooFull(&C->BlockStream);
-      Encode(BlockUInts, NVals, Bp, N, &C->BlockStream);
+      Zfp.Encode(BlockUInts, NVals, Bp, N, &C->BlockStream);
     } // end bit plane loop
+  };
+
+  /* the full blocks are quantized one by one but transformed Zfp.BatchSize at a time, then coded in
+  the same order as the partial blocks (a partial block first codes the full blocks before it) */
+  i64 BatchInts[ZfpMaxBatchSize * 64] = {};
+  u64 BatchUInts[ZfpMaxBatchSize * 64];
+  u32 BatchBlocks[ZfpMaxBatchSize];
+  i16 BatchEMaxes[ZfpMaxBatchSize];
+  int NBatch = 0;
+  auto EncodeBatch = [&]() {
+    if (NBatch == 0) return;
+    Zfp.ForwardZfpBatch(BatchInts, BatchUInts);
+    idx2_For(int, I, 0, NBatch) EncodeBlock(BatchBlocks[I], BatchEMaxes[I], 3, &BatchUInts[I * 64]);
+    NBatch = 0;
+  };
+
+  /* pass 1: compress the blocks */
+  idx2_InclusiveFor(u32, Block, 0, LastBlock) { // zfp block loop
+    v3i Z3(DecodeMorton3(Block));
+    idx2_NextMorton(Block, Z3, NBlocks3);
+    v3i D3 = Z3 * Idx2->BlockDims3;
+    v3i BlockDims3 = Min(Idx2->BlockDims3, SbDims3 - D3);
+    const i8 NDims = (i8)NumDims(BlockDims3);
+    const int NVals = 1 << (2 * NDims);
+    const i8 Prec = NBitPlanes - 1 - NDims;
+    bool CodedInNextIter = E->Level == 0 && E->Iter + 1 < Idx2->NLevels && BlockDims3 == Idx2->BlockDims3;
+    if (CodedInNextIter) continue;
+    f64 BlockFloats[4 * 4 * 4]; // the samples are quantized in f64 whatever the type of the brick
+    buffer_t BufFloats(BlockFloats, NVals);
+    bool FullBlock = BlockDims3 == v3i(4);
+    i64 BlockInts[4 * 4 * 4];
+    buffer_t BufInts(FullBlock ? &BatchInts[NBatch * 64] : BlockInts, NVals);
+    /* copy the samples to the local buffer */
+    if (FullBlock) {
+      GatherBlock(&BrickVol->At<t>(SbFrom3, SbStrd3, D3), SampleStrd3, BlockFloats);
+    } else { // partial block
+      v3i S3;
+      int J = 0;
+      idx2_BeginFor3(S3, v3i(0), BlockDims3, v3i(1)) { // sample loop
+        idx2_Assert(D3 + S3 < SbDims3);
+        BlockFloats[J++] = BrickVol->At<t>(SbFrom3, SbStrd3, D3 + S3);
+      } idx2_EndFor3 // end sample loop
+    }
+    const i16 EMax = SizeOf(Idx2->DType) > 4 ? (i16)QuantizeF64(Prec, BufFloats, &BufInts) : (i16)QuantizeF32(Prec, BufFloats, &BufInts);
+    PushBack(&E->EMaxes, EMax);
+    if (FullBlock) {
+      BatchBlocks[NBatch] = Block;
+      BatchEMaxes[NBatch] = EMax;
+      if (++NBatch == Zfp.BatchSize) EncodeBatch();
+    } else {
+      EncodeBatch();
+      /* zfp transform and shuffle */
+      u64 BlockUInts[4 * 4 * 4];
+      Zfp.ForwardZfp(BlockInts, NDims);
+      Zfp.ForwardShuffle(BlockInts, BlockUInts, NDims);
+      EncodeBlock(Block, EMax, NDims, BlockUInts);
+    }
   } // end zfp block loop
+  EncodeBatch();
+  if (!Err)
+    return Err;
 
   /* write the last chunk exponents if this is the first brick of the new chunk */
   bool NewChunk = Brick >= (Sc->LastChunk + 1) * Idx2->BricksPerChunks[E->Iter];
   if (NewChunk) {
-    WriteChunkExponents(*Idx2, E, Sc, E->Iter, E->Level);
+    idx2_PropagateIfError(WriteChunkExponents(*Idx2, E, Sc, E->Iter, E->Level));
     Sc->LastChunk = Brick >> Log2Ceil(Idx2->BricksPerChunks[E->Iter]);
   }
   /* write the min emax */
@@ -42168,7 +43923,7 @@ EncodeSubband(idx2_file* Idx2, encode_data* E, const grid& SbGrid, volume* Brick
   i64 BrickEMaxesSz = Size(Sc->BlockEMaxesStream);
   GrowToAccomodate(&Sc->BrickEMaxesStream, BrickEMaxesSz);
   WriteStream(&Sc->BrickEMaxesStream, &Sc->BlockEMaxesStream);
-  BlockEMaxStat.Add((f64)Size(Sc->BlockEMaxesStream));
+  E->BlockEMaxStat.Add((f64)Size(Sc->BlockEMaxesStream));
   Rewind(&Sc->BlockEMaxesStream);
   Sc->LastBrick = Brick;
 
@@ -42184,10 +43939,7 @@ EncodeSubband(idx2_file* Idx2, encode_data* E, const grid& SbGrid, volume* Brick
     idx2_For(int, I, 0, Size(E->BlockSigs)) { // bit plane loop
       i16 RealBp = E->BlockSigs[I].BitPlane;
       if (Block != E->BlockSigs[I].Block) continue;
-      u32 ChannelKey = GetChannelKey(RealBp, E->Iter, E->Level);
-      auto ChannelIt = Lookup(&E->Channels, ChannelKey);
-      idx2_Assert(ChannelIt);
-      channel* C = ChannelIt.Val;
+      channel* C = GetChannelSlot(E, RealBp - BpBase, RealBp)->Channel;
       /* write brick delta */
       if (C->NBricks == 0) {// start of a chunk
         GrowToAccomodate(&C->BrickDeltasStream, 8);
@@ -42201,17 +43953,51 @@ EncodeSubband(idx2_file* Idx2, encode_data* E, const grid& SbGrid, volume* Brick
       GrowToAccomodate(&C->BrickSzsStream, 4);
       WriteVarByte(&C->BrickSzsStream, BrickSize);
       /* write brick data */
-      GrowToAccomodate(&C->BrickStream, BrickSize);
-      WriteStream(&C->BrickStream, &C->BlockStream);
-      BlockStat.Add((f64)Size(C->BlockStream));
+      Flush(&C->BlockStream);
+      Append(&C->BrickStream, C->BlockStream.Stream.Data, BrickSize);
+      E->BlockStat.Add((f64)Size(C->BlockStream));
       Rewind(&C->BlockStream);
       ++C->NBricks;
       C->LastBrick = Brick;
     } // end bit plane loop
   } // end zfp block loop
+  return idx2_Error(idx2_file_err_code::NoError);
 }
 
-static inline void
+/*
+The lifting passes that EncodeBrick does on a brick whose ExtentLocal has dims N3: the
+extrapolation with the transform details of N3 (ExtrapolateCdf53(Td, Vol)), a second extrapolation
+(ExtrapolateCdf53(N3, TformOrder, Vol)), then the forward transform of the brick. They only depend
+on N3, so they are computed once per N3 (all bricks but the ones at the boundary have the same N3),
+and LiftCdf53 fuses the passes where one transform ends and the next starts. */
+static const array<lift_pass>&
+GetBrickLiftPasses(const idx2_file& Idx2, encode_data* E, const v3i& N3) {
+  auto It = Lookup(&E->BrickLiftPasses, Pack3i64(N3));
+  if (It)
+    return *It.Val;
+  v3i B3 = Idx2.BrickDimsExt3;
+  v3i M3(B3.X == 1 ? 1 : B3.X - 1, B3.Y == 1 ? 1 : B3.Y - 1, B3.Z == 1 ? 1 : B3.Z - 1);
+  array<lift_pass> Passes;
+  transform_details Td;
+  if (N3 == Idx2.BrickDims3) {
+    Td = Idx2.TdExtrpolate;
+  } else { // brick at the boundary
+    int NLevels = Log2Floor(Max(Max(N3.X, N3.Y), N3.Z));
+    ComputeTransformDetails(&Td, N3, NLevels, Idx2.TformOrder);
+  }
+  PushForwardPasses(Td, M3, &Passes);
+  PushInversePasses(Td, M3, &Passes);
+  int NLevels = Log2Floor(Max(Max(B3.X, B3.Y), B3.Z));
+  ComputeTransformDetails(&Td, N3, NLevels, Idx2.TformOrder);
+  PushForwardPasses(Td, M3, &Passes);
+  ComputeTransformDetails(&Td, B3, NLevels, Idx2.TformOrder);
+  PushInversePasses(Td, M3, &Passes);
+  PushForwardPasses(Idx2.Td, Idx2.BrickDimsExt3, &Passes);
+  Insert(&It, Pack3i64(N3), Passes);
+  return *It.Val;
+}
+
+idx2_T(t) static inline error<idx2_file_err_code>
 EncodeBrick(idx2_file* Idx2, const params& P, encode_data* E, bool IncIter = false) {
   idx2_Assert(Idx2->NLevels <= idx2_file::MaxLevels);
   i8 Iter = E->Iter += IncIter;
@@ -42221,24 +44007,11 @@ EncodeBrick(idx2_file* Idx2, const params& P, encode_data* E, bool IncIter = fal
   idx2_Assert(BIt);
   volume& BVol = BIt.Val->Vol;
   idx2_Assert(BVol.Buffer);
-  if (Dims(BIt.Val->ExtentLocal) == Idx2->BrickDims3) {
-    ExtrapolateCdf53(Idx2->TdExtrpolate, &BVol);
-  } else { // brick at the boundary
-    v3i N3 = Dims(BIt.Val->ExtentLocal);
-    transform_details Td;
-    int NLevels = Log2Floor(Max(Max(N3.X, N3.Y), N3.Z));
-    ComputeTransformDetails(&Td, N3, NLevels, Idx2->TformOrder);
-    ExtrapolateCdf53(Td, &BVol);
-  }
-  ExtrapolateCdf53(Dims(BIt.Val->ExtentLocal), Idx2->TformOrder, &BVol);
-  if (!P.WaveletOnly) {
-    if (Iter + 1 < Idx2->NLevels)
-      ForwardCdf53(Idx2->BrickDimsExt3, E->Iter, Idx2->Subbands, Idx2->Td, &BVol, false);
-    else
-      ForwardCdf53(Idx2->BrickDimsExt3, E->Iter, Idx2->Subbands, Idx2->Td, &BVol, true);
-  } else {
-    ForwardCdf53(Idx2->BrickDimsExt3, E->Iter, Idx2->Subbands, Idx2->Td, &BVol, false);
-  }
+  idx2_Assert(Dims(BVol) == Idx2->BrickDimsExt3);
+  /* extrapolate the brick, then transform it */
+  LiftCdf53(GetBrickLiftPasses(*Idx2, E, Dims(BIt.Val->ExtentLocal)), &BVol);
+  bool LastIter = !P.WaveletOnly && Iter + 1 >= Idx2->NLevels;
+  NormalizeCdf53(Idx2->BrickDimsExt3, E->Iter, Idx2->Subbands, Idx2->Td, &BVol, LastIter);
   /* recursively encode the brick, one subband at a time */
   idx2_For(i8, Sb, 0, Size(Idx2->Subbands)) { // subband loop
     const subband& S = Idx2->Subbands[Sb];
@@ -42253,8 +44026,8 @@ EncodeBrick(idx2_file* Idx2, const params& P, encode_data* E, bool IncIter = fal
       auto PbIt = Lookup(&E->BrickPool, PKey);
       if (!PbIt) { // instantiate the parent brick in the hash table
         brick_volume PBrickVol;
-        Resize(&PBrickVol.Vol, Idx2->BrickDimsExt3, dtype::float64, E->Alloc);
-        Fill(idx2_Range(f64, PBrickVol.Vol), 0.0);
+        Resize(&PBrickVol.Vol, Idx2->BrickDimsExt3, BVol.Type, E->Alloc);
+        Fill(idx2_Range(t, PBrickVol.Vol), t(0));
         v3i From3 = (Brick3 / Idx2->GroupBrick3) * Idx2->GroupBrick3;
         v3i NChildren3 = Dims(Crop(extent(From3, Idx2->GroupBrick3), extent(Idx2->NBricks3s[Iter])));
         PBrickVol.NChildrenMax = (i8)Prod(NChildren3);
@@ -42265,19 +44038,21 @@ EncodeBrick(idx2_file* Idx2, const params& P, encode_data* E, bool IncIter = fal
       v3i LocalBrickPos3 = Brick3 % Idx2->GroupBrick3;
       grid SbGridNonExt = S.Grid; SetDims(&SbGridNonExt, SbDimsNonExt3);
       extent ToGrid(LocalBrickPos3 * SbDimsNonExt3, SbDimsNonExt3);
-      CopyGridExtent<f64, f64>(SbGridNonExt, BVol, ToGrid, &PbIt.Val->Vol);
+      CopyGridExtent<t, t>(SbGridNonExt, BVol, ToGrid, &PbIt.Val->Vol);
 //      Copy(SbGridNonExt, BVol, ToGrid, &PbIt.Val->Vol);
       bool LastChild = ++PbIt.Val->NChildren == PbIt.Val->NChildrenMax;
-      if (LastChild) EncodeBrick(Idx2, P, E, true);
+      if (LastChild && !E->OneLevel)
+        idx2_PropagateIfError(EncodeBrick<t>(Idx2, P, E, true));
     } // end Sb == 0 && NextIteration < Idx2->NLevels
     E->Level = Sb;
     if      (Idx2->Version == v2i(0, 0)) EncodeSubbandV0_0(Idx2, E, S.Grid, &BVol);
     else if (Idx2->Version == v2i(0, 1)) EncodeSubbandV0_1(Idx2, E, S.Grid, &BVol);
-    else if (Idx2->Version == v2i(1, 0)) EncodeSubband(Idx2, E, S.Grid, &BVol);
+    else if (Idx2->Version == v2i(1, 0)) idx2_PropagateIfError(EncodeSubband<t>(Idx2, E, S.Grid, &BVol));
   } // end subband loop
   Dealloc(&BVol);
   Delete(&E->BrickPool, GetBrickKey(Iter, Brick));
   E->Iter -= IncIter;
+  return idx2_Error(idx2_file_err_code::NoError);
 }
 
 // TODO: return true error code
@@ -42295,9 +44070,6 @@ struct channel_ptr {
   }
 };
 
-static stat CpresChunkAddrsStat;
-static stat ChunkAddrsStat;
-static stat ChunkSzsStat;
 // TODO: check the error path
 error<idx2_file_err_code>
 FlushChunks(const idx2_file& Idx2, encode_data* E) {
@@ -42311,7 +44083,7 @@ FlushChunks(const idx2_file& Idx2, encode_data* E) {
     i8 Iter = IterationFromChannelKey(Ch->First);
     i8 Level = LevelFromChannelKey(Ch->First);
     i16 BitPlane = BitPlaneFromChannelKey(Ch->First);
-    WriteChunk(Idx2, E, Ch->Second, Iter, Level, BitPlane);
+    idx2_PropagateIfError(WriteChunk(Idx2, E, Ch->Second, Iter, Level, BitPlane));
   }
 
   /* write the chunk meta */
@@ -42323,94 +44095,537 @@ FlushChunks(const idx2_file& Idx2, encode_data* E) {
     }
     idx2_Assert(FileId.Id == *CmIt.Key);
     /* compress and write chunk sizes */
-    idx2_OpenMaybeExistingFile(Fp, FileId.Name.ConstPtr, "ab");
     Flush(&Cm->Sizes);
-    WriteBuffer(Fp, ToBuffer(Cm->Sizes));
-    ChunkSzsStat.Add((f64)Size(Cm->Sizes));
-    WritePOD(Fp, (int)Size(Cm->Sizes));
+    E->ChunkSzsStat.Add((f64)Size(Cm->Sizes));
+    bool Ok = Append(&E->Writer, FileId.Name, Cm->Sizes.Stream.Data, Size(Cm->Sizes)) &&
+              AppendPOD(&E->Writer, FileId.Name, (int)Size(Cm->Sizes));
     /* compress and write chunk addresses */
     CompressBufZstd(ToBuffer(Cm->Addrs), &E->CpresChunkAddrs);
-    WriteBuffer(Fp, ToBuffer(E->CpresChunkAddrs));
-    WritePOD(Fp, (int)Size(E->CpresChunkAddrs));
-    WritePOD(Fp, (int)Size(Cm->Addrs)); // number of chunks
-    ChunkAddrsStat.Add((f64)Size(Cm->Addrs) * sizeof(Cm->Addrs[0]));
-    CpresChunkAddrsStat.Add((f64)Size(E->CpresChunkAddrs));
+    Ok = Ok && Append(&E->Writer, FileId.Name, E->CpresChunkAddrs.Stream.Data, Size(E->CpresChunkAddrs)) &&
+         AppendPOD(&E->Writer, FileId.Name, (int)Size(E->CpresChunkAddrs)) &&
+         AppendPOD(&E->Writer, FileId.Name, (int)Size(Cm->Addrs)); // number of chunks
+    if (!Ok)
+      return idx2_Error(idx2_file_err_code::FileWriteFailed, "%.*s", FileId.Name.Size, FileId.Name.ConstPtr);
+    E->ChunkAddrsStat.Add((f64)Size(Cm->Addrs) * sizeof(Cm->Addrs[0]));
+    E->CpresChunkAddrsStat.Add((f64)Size(E->CpresChunkAddrs));
   }
   return idx2_Error(idx2_file_err_code::NoError);
 }
 
 f64 TotalTime_ = 0;
 
-// TODO: handle types different than float64
-error<idx2_file_err_code>
-Encode(idx2_file* Idx2, const params& P, const volume& Vol) {
-  const int BrickBytes = Prod(Idx2->BrickDimsExt3) * sizeof(f64);
-  BrickAlloc_ = free_list_allocator(BrickBytes);
-  idx2_RAII(encode_data, E, Init(&E));
-  idx2_BrickTraverse(
-    timer Timer; StartTimer(&Timer);
-//    idx2_Assert(GetLinearBrick(*Idx2, 0, Top.BrickFrom3) == Top.Address);
-//    idx2_Assert(GetSpatialBrick(*Idx2, 0, Top.Address) == Top.BrickFrom3);
-    brick_volume BVol;
-    Resize(&BVol.Vol, Idx2->BrickDimsExt3, dtype::float64, E.Alloc);
+/* Call Func(ThreadId) on NThreads threads (the calling thread is thread 0) and wait for all of them */
+idx2_T(func) static void
+ParallelRun(int NThreads, const func& Func) {
+  constexpr int MaxThreads = 256;
+  NThreads = Min(Max(NThreads, 1), MaxThreads);
+  std::thread Threads[MaxThreads];
+  idx2_For(int, I, 1, NThreads) Threads[I] = std::thread(Func, I);
+  Func(0);
+  idx2_For(int, I, 1, NThreads) Threads[I].join();
+}
+
+/* Copy the samples of a level-0 brick from Vol, which holds the samples of VolExt in the field, into a
+new brick in the brick pool of E */
+static void
+AddBrick(idx2_file* Idx2, const volume& Vol, const extent& VolExt, const v3i& Brick3, allocator* Alloc, encode_data* E) {
+  dtype BrickType = E->BrickType;
+  idx2_Assert(BrickType == dtype::float64 || Vol.Type == dtype::float32);
+  brick_volume BVol;
+  Resize(&BVol.Vol, Idx2->BrickDimsExt3, BrickType, Alloc);
+  extent BrickExtent(Brick3 * Idx2->BrickDims3, Idx2->BrickDims3);
+  extent BrickExtentCrop = Crop(BrickExtent, extent(Idx2->Dims3));
+  BVol.ExtentLocal = Relative(BrickExtentCrop, BrickExtent);
+  extent SrcExtent = Relative(BrickExtentCrop, VolExt);
+  v2d MinMax;
+  if (BrickType == dtype::float32) {
+    Fill(idx2_Range(f32, BVol.Vol), 0.0f);
+    MinMax = CopyExtentExtentMinMax<f32, f32>(SrcExtent, Vol, BVol.ExtentLocal, &BVol.Vol);
+  } else {
     Fill(idx2_Range(f64, BVol.Vol), 0.0);
-    extent BrickExtent(Top.BrickFrom3 * Idx2->BrickDims3, Idx2->BrickDims3);
-    extent BrickExtentCrop = Crop(BrickExtent, extent(Idx2->Dims3));
-    BVol.ExtentLocal = Relative(BrickExtentCrop, BrickExtent);
-    v2d MinMax;
     if (Vol.Type == dtype::float32)
-      MinMax = (CopyExtentExtentMinMax<f32, f64>(BrickExtentCrop, Vol, BVol.ExtentLocal, &BVol.Vol));
+      MinMax = CopyExtentExtentMinMax<f32, f64>(SrcExtent, Vol, BVol.ExtentLocal, &BVol.Vol);
     else if (Vol.Type == dtype::float64)
-      MinMax = (CopyExtentExtentMinMax<f64, f64>(BrickExtentCrop, Vol, BVol.ExtentLocal, &BVol.Vol));
-    Idx2->ValueRange.Min = Min(Idx2->ValueRange.Min, MinMax.Min);
-    Idx2->ValueRange.Max = Max(Idx2->ValueRange.Max, MinMax.Max);
-//    Copy(BrickExtentCrop, Vol, BVol.ExtentLocal, &BVol.Vol);
-    E.Iter = 0;
-    E.Bricks3[E.Iter] = Top.BrickFrom3;
-    E.Brick[E.Iter] = GetLinearBrick(*Idx2, E.Iter, E.Bricks3[E.Iter]);
-    idx2_Assert(E.Brick[E.Iter] == Top.Address);
-    u64 BrickKey = GetBrickKey(E.Iter, E.Brick[E.Iter]);
-    Insert(&E.BrickPool, BrickKey, BVol);
-    EncodeBrick(Idx2, P, &E);
-    TotalTime_ += Seconds(ElapsedTime(&Timer));
+      MinMax = CopyExtentExtentMinMax<f64, f64>(SrcExtent, Vol, BVol.ExtentLocal, &BVol.Vol);
+  }
+  E->ValueRange.Min = Min(E->ValueRange.Min, MinMax.Min);
+  E->ValueRange.Max = Max(E->ValueRange.Max, MinMax.Max);
+  Insert(&E->BrickPool, GetBrickKey(0, GetLinearBrick(*Idx2, 0, Brick3)), BVol);
+}
+
+/* Encode the bricks of level Iter that intersect ExtentInBricks (the parent bricks on the coarser
+levels are encoded as soon as all of their children are, unless E->OneLevel). The level-0 bricks are
+copied from Vol, or, if Vol is null, they must already be in the brick pool (see EncodeStream); the
+bricks of the other levels must be in the brick pool (see EncodeLevels). */
+static error<idx2_file_err_code>
+EncodeBricks(idx2_file* Idx2, const params& P, const volume* Vol, const extent& ExtentInBricks, encode_data* E, i8 Iter = 0) {
+  idx2_Assert(Iter == 0 || !Vol);
+  dtype BrickType = E->BrickType;
+  idx2_BrickTraverse(
+//    idx2_Assert(GetLinearBrick(*Idx2, Iter, Top.BrickFrom3) == Top.Address);
+//    idx2_Assert(GetSpatialBrick(*Idx2, Iter, Top.Address) == Top.BrickFrom3);
+    if (Vol) AddBrick(Idx2, *Vol, extent(Idx2->Dims3), Top.BrickFrom3, E->Alloc, E);
+    E->Iter = Iter;
+    E->Bricks3[E->Iter] = Top.BrickFrom3;
+    E->Brick[E->Iter] = GetLinearBrick(*Idx2, E->Iter, E->Bricks3[E->Iter]);
+    idx2_Assert(E->Brick[E->Iter] == Top.Address);
+    if (BrickType == dtype::float32) {
+      idx2_PropagateIfError(EncodeBrick<f32>(Idx2, P, E));
+    } else {
+      idx2_PropagateIfError(EncodeBrick<f64>(Idx2, P, E));
+    }
     , 128
-    , Idx2->BrickOrders[E.Iter]
+    , Idx2->BrickOrders[Iter]
     , v3i(0)
-    , Idx2->NBricks3s[E.Iter]
-    , extent(Idx2->NBricks3s[E.Iter])
-    , extent(Idx2->NBricks3s[E.Iter])
+    , Idx2->NBricks3s[Iter]
+    , ExtentInBricks
+    , extent(Idx2->NBricks3s[Iter])
   );
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
+/* Fold the encode_data of a unit (see EncodeLevels and EncodeStream) into E, which holds the state of all the units
+before it. The chunks that the previous units left open on the channels this unit uses are written
+first, in the order the serial encoder would write them, then E takes over the channels of this unit */
+static error<idx2_file_err_code>
+MergeUnit(const idx2_file& Idx2, encode_data* E, encode_data* Eu) {
+  idx2_ForEach(KeyIt, Eu->ChannelOrder) {
+    auto UIt = Lookup(&Eu->Channels, *KeyIt);
+    idx2_Assert(UIt);
+    auto ChannelIt = Lookup(&E->Channels, *KeyIt);
+    if (ChannelIt) {
+      if (Size(ChannelIt.Val->BrickStream) > 0) {
+        i8 Iter = IterationFromChannelKey(*KeyIt);
+        i8 Level = LevelFromChannelKey(*KeyIt);
+        i16 BitPlane = BitPlaneFromChannelKey(*KeyIt);
+        idx2_PropagateIfError(WriteChunk(Idx2, E, ChannelIt.Val, Iter, Level, BitPlane));
+      }
+      Swap(ChannelIt.Val, UIt.Val); // the old channel is freed together with Eu
+    } else {
+      Insert(&ChannelIt, *KeyIt, *UIt.Val);
+      *UIt.Val = channel{};
+    }
+  }
+  /* the files a unit writes are not written by any other unit */
+  idx2_ForEach(CmIt, Eu->ChunkMeta) {
+    Insert(&E->ChunkMeta, *CmIt.Key, *CmIt.Val);
+    *CmIt.Val = chunk_meta_info{};
+  }
+  /* the parent bricks left by a unit of one level (see EncodeLevels) can have children in the
+  next units too; the parts of a parent brick are zero outside of the children that filled them */
+  idx2_ForEach(BIt, Eu->BrickPool) {
+    auto It = Lookup(&E->BrickPool, *BIt.Key);
+    if (It) {
+      Add(extent(Dims(BIt.Val->Vol)), BIt.Val->Vol, extent(Dims(It.Val->Vol)), &It.Val->Vol);
+      It.Val->NChildren += BIt.Val->NChildren;
+      Dealloc(&BIt.Val->Vol);
+    } else {
+      Insert(&It, *BIt.Key, *BIt.Val);
+    }
+    *BIt.Val = brick_volume{};
+  }
+  /* the sub channels are already flushed, we only keep them so they can be counted */
+  idx2_ForEach(ScIt, Eu->SubChannels) {
+    auto It = Lookup(&E->SubChannels, *ScIt.Key);
+    if (!It) {
+      Insert(&It, *ScIt.Key, *ScIt.Val);
+      *ScIt.Val = sub_channel{};
+    }
+  }
+  idx2_ForEach(RIt, Eu->ChunkRDOs) PushBack(&E->ChunkRDOs, *RIt);
+  idx2_ForEach(LIt, Eu->ChunkRDOLengths) Insert(&E->ChunkRDOLengths, *LIt.Key, *LIt.Val);
+  E->ValueRange.Min = Min(E->ValueRange.Min, Eu->ValueRange.Min);
+  E->ValueRange.Max = Max(E->ValueRange.Max, Eu->ValueRange.Max);
+  E->BrickDeltasStat.Add(Eu->BrickDeltasStat);
+  E->BrickSzsStat.Add(Eu->BrickSzsStat);
+  E->BrickStreamStat.Add(Eu->BrickStreamStat);
+  E->ChunkStreamStat.Add(Eu->ChunkStreamStat);
+  E->BrickEMaxesStat.Add(Eu->BrickEMaxesStat);
+  E->ChunkEMaxesStat.Add(Eu->ChunkEMaxesStat);
+  E->ChunkEMaxSzsStat.Add(Eu->ChunkEMaxSzsStat);
+  E->BlockStat.Add(Eu->BlockStat);
+  E->BlockEMaxStat.Add(Eu->BlockEMaxStat);
+  E->Writer.NWrites += Eu->Writer.NWrites;
+  E->Writer.NOpens += Eu->Writer.NOpens;
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
+/* The log2 of the number of bricks of level Iter in a unit of that level (see EncodeLevels), which
+covers whole files of the level */
+static int
+GetLog2LevelUnit(const idx2_file& Idx2, i8 Iter) {
+  return Min(int(Log2Ceil(Idx2.BricksPerFiles[Iter])), int(Idx2.BrickOrderStrs[Iter].Len));
+}
+
+/* With grouped levels, the files are shared by bricks on different levels; v0.x keeps the chunks
+of a channel in a single stream. In both cases the bricks cannot be split into units. */
+static bool
+CanSplitIntoUnits(const idx2_file& Idx2) {
+  return Idx2.Version == v2i(1, 0) && !Idx2.GroupLevels;
+}
+
+/* The bricks of level Iter in unit U (a unit is an aligned box of bricks since each character of the
+brick order is one bit of one axis) */
+static extent
+GetUnitExtent(const idx2_file& Idx2, i8 Iter, int Log2Unit, u64 U) {
+  v3i From3 = GetSpatialBrick(Idx2, Iter, U << Log2Unit);
+  v3i Last3 = GetSpatialBrick(Idx2, Iter, ((U + 1) << Log2Unit) - 1);
+  return Crop(extent(From3, Last3 - From3 + 1), extent(Idx2.NBricks3s[Iter]));
+}
+
+/* The units of level Iter that intersect the field, in order */
+static void
+GetUnits(const idx2_file& Idx2, i8 Iter, int Log2Unit, array<u64>* Units) {
+  u64 NUnits = u64(1) << (Idx2.BrickOrderStrs[Iter].Len - Log2Unit);
+  idx2_For(u64, U, 0, NUnits) {
+    v3i From3 = GetSpatialBrick(Idx2, Iter, U << Log2Unit);
+    if (From3 < Idx2.NBricks3s[Iter]) PushBack(Units, U);
+  }
+}
+
+/* Move the bricks of level Iter in unit U from the brick pool of E to the one of Eu */
+static void
+MoveUnitBricks(i8 Iter, int Log2Unit, u64 U, encode_data* E, encode_data* Eu) {
+  idx2_For(u64, Brick, U << Log2Unit, (U + 1) << Log2Unit) {
+    u64 Key = GetBrickKey(Iter, Brick);
+    auto BIt = Lookup(&E->BrickPool, Key);
+    if (!BIt)
+      continue;
+    idx2_Assert(BIt.Val->NChildren == BIt.Val->NChildrenMax);
+    Insert(&Eu->BrickPool, Key, *BIt.Val);
+    Delete(&E->BrickPool, Key);
+  }
+}
+
+/* Keep Err in Eu if it is the first error of the unit (called by the thread that encodes the unit) */
+static void
+SetUnitError(encode_data* Eu, const error<idx2_file_err_code>& Err) {
+  if (Err || Eu->Error.Code != idx2_file_err_code::NoError)
+    return;
+  Eu->Error.Code = Err.Code;
+  snprintf(Eu->Error.Msg, sizeof(Eu->Error.Msg), "%.255s", ToString(Err)); // the message can be truncated
+}
+
+/* The first error of unit U, made again on the calling thread */
+static error<idx2_file_err_code>
+GetUnitError(const encode_data& Eu, u64 U) {
+  if (Eu.Error.Code == idx2_file_err_code::NoError)
+    return idx2_Error(idx2_file_err_code::NoError);
+  return idx2_Error(Eu.Error.Code, "unit %" PRIu64 ": %s", U, Eu.Error.Msg);
+}
+
+/* Write the chunk exponents and the buffered files of a unit, on the thread that encoded it */
+static error<idx2_file_err_code>
+FlushUnit(const idx2_file& Idx2, encode_data* Eu) {
+  /* the exponent files belong to a single (iteration, level) so the unit can finish them */
+  idx2_PropagateIfError(FlushChunkExponents(Idx2, Eu));
+  /* the files of the unit are written by this thread */
+  if (!Flush(&Eu->Writer))
+    return idx2_Error(idx2_file_err_code::FileWriteFailed, "cannot write the files of the unit");
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
+/* Free what an encoded unit does not need until it is merged, which can take a while when its bricks
+are read before those of the units that come before it (see EncodeStream): the last chunk of each
+channel is only written once the next unit with that channel is merged (see MergeUnit) */
+static void
+TrimUnit(encode_data* Eu) {
+  idx2_ForEach(ChannelIt, Eu->Channels) Trim(&ChannelIt.Val->BrickStream);
+}
+
+using unit_task = t2<u64, encode_data*>; // a unit and the encode_data it is encoded with
+
+/* Encode each unit Units[I].First of level Iter with its encode_data Units[I].Second, on up to
+NThreads threads (each allocates from its own cache in Allocs). The bricks are copied from Vol, or
+they are already in the brick pools of the units if Vol is null. A unit of one level also writes its
+files, which no other unit shares. The first error of a unit is kept in it (see SetUnitError). */
+static void
+EncodeUnits(idx2_file* Idx2, const params& P, const volume* Vol, i8 Iter, int Log2Unit,
+            const array<unit_task>& Units, int NThreads, pool_allocator* Allocs) {
+  std::atomic<i64> NextUnit(0);
+  ParallelRun(Min(NThreads, (int)Size(Units)), [&](int ThreadId) {
+    for (i64 I = NextUnit++; I < Size(Units); I = NextUnit++) {
+      encode_data* Eu = Units[I].Second;
+      Eu->Alloc = &Allocs[ThreadId];
+      SetUnitError(Eu, EncodeBricks(Idx2, P, Vol, GetUnitExtent(*Idx2, Iter, Log2Unit, Units[I].First), Eu, Iter));
+      if (Eu->OneLevel && Eu->Error.Code == idx2_file_err_code::NoError)
+        SetUnitError(Eu, FlushUnit(*Idx2, Eu));
+      TrimUnit(Eu);
+    }
+  });
+}
+
+/* Encode the units Units[0, NUnits) of level Iter, then merge them into E in order, together with
+the parent bricks they filled. The bricks are copied from Vol, or taken from the brick pool of E if
+Vol is null. The units that come after a failed unit are not merged, and the error of the failed
+unit is returned. */
+static error<idx2_file_err_code>
+EncodeLevelUnits(idx2_file* Idx2, const params& P, const volume* Vol, i8 Iter, int Log2Unit,
+                 const u64* Units, i64 NUnits, int NThreads, pool_allocator* Allocs, encode_data* E) {
+  /* encode a limited number of units at a time to bound the memory used by the pending units */
+  const int MaxUnits = NThreads * 4;
+  idx2_RAII(array<encode_data>, Us, Reserve(&Us, MaxUnits));
+  idx2_RAII(array<unit_task>, Tasks, Reserve(&Tasks, MaxUnits));
+  for (i64 First = 0; First < NUnits; First += MaxUnits) {
+    i64 Last = Min(First + MaxUnits, NUnits);
+    Clear(&Us); Resize(&Us, Last - First);
+    Clear(&Tasks);
+    idx2_For(i64, I, First, Last) {
+      encode_data* Eu = &Us[I - First];
+      Init(Eu, nullptr); // the allocator is the cache of the thread that encodes the unit
+      Eu->BrickType = E->BrickType;
+      Eu->OneLevel = true;
+      if (!Vol)
+        MoveUnitBricks(Iter, Log2Unit, Units[I], E, Eu);
+      PushBack(&Tasks, unit_task{Units[I], Eu});
+    }
+    EncodeUnits(Idx2, P, Vol, Iter, Log2Unit, Tasks, NThreads, Allocs);
+    error<idx2_file_err_code> Result = idx2_Error(idx2_file_err_code::NoError);
+    idx2_For(i64, I, First, Last) {
+      if (Result)
+        Result = GetUnitError(Us[I - First], Units[I]);
+      if (Result)
+        Result = MergeUnit(*Idx2, E, &Us[I - First]);
+      Dealloc(&Us[I - First]);
+    }
+    if (!Result)
+      return Result;
+  }
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
+/* Encode on NThreads threads, one level at a time. The bricks of a level are split into units, which
+are aligned ranges of 2^GetLog2LevelUnit linear brick addresses; a unit covers whole files of the
+level, so each file is written by exactly one thread. Each unit is encoded with its own encode_data,
+and merged into E in order, together with the parent bricks it filled, which are encoded with the
+next level (see EncodeLevelUnits). */
+static error<idx2_file_err_code>
+EncodeLevels(idx2_file* Idx2, const params& P, const volume& Vol, int NThreads, block_pool* Pool, encode_data* E) {
+  idx2_RAII(array<u64>, Units, Reserve(&Units, 64));
+  pool_allocator* Allocs = new pool_allocator[NThreads]; // the cache of each thread
+  idx2_CleanUp(idx2_For(int, I, 0, NThreads) Allocs[I].DeallocAll(); delete[] Allocs);
+  idx2_For(int, I, 0, NThreads) Init(&Allocs[I], Pool);
+  idx2_For(i8, Iter, 0, Idx2->NLevels) {
+    int Log2Unit = GetLog2LevelUnit(*Idx2, Iter);
+    Clear(&Units);
+    GetUnits(*Idx2, Iter, Log2Unit, &Units);
+    if (Size(Units) == 1)
+      printf("level %d is stored in one file, it is encoded on one thread\n", Iter);
+    idx2_PropagateIfError(EncodeLevelUnits(Idx2, P, Iter == 0 ? &Vol : nullptr, Iter, Log2Unit, &Units[0], Size(Units), NThreads, Allocs, E));
+  }
+  idx2_Assert(Size(E->BrickPool) == 0);
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
+/* Write the chunks that are still open in E, the chunk indices, and the meta file. The chunk
+exponents are flushed too unless the units already did it (see EncodeLevels). */
+static error<idx2_file_err_code>
+FinishEncode(idx2_file* Idx2, const params& P, encode_data* E, bool ExpsFlushed) {
+  timer Timer;
+  Idx2->ValueRange.Min = Min(Idx2->ValueRange.Min, E->ValueRange.Min);
+  Idx2->ValueRange.Max = Max(Idx2->ValueRange.Max, E->ValueRange.Max);
 
   /* dump the bit streams to files */
-  timer Timer; StartTimer(&Timer);
-  idx2_PropagateIfError(FlushChunks(*Idx2, &E));
-  idx2_PropagateIfError(FlushChunkExponents(*Idx2, &E));
+  StartTimer(&Timer);
+  idx2_PropagateIfError(FlushChunks(*Idx2, E));
+  if (!ExpsFlushed)
+    idx2_PropagateIfError(FlushChunkExponents(*Idx2, E));
   timer RdoTimer; StartTimer(&RdoTimer);
-  RateDistortionOpt(*Idx2, &E);
+  idx2_PropagateIfError(RateDistortionOpt(*Idx2, E));
   TotalTime_ += Seconds(ElapsedTime(&Timer));
   printf("rdo time                = %f\n", Seconds(ElapsedTime(&RdoTimer)));
+  if (!Flush(&E->Writer))
+    return idx2_Error(idx2_file_err_code::FileWriteFailed, "cannot write the files in %s/%s", P.OutDir, P.Meta.Name);
+  printf("file writes             = %" PRIi64 " opens = %" PRIi64 "\n", E->Writer.NWrites, E->Writer.NOpens);
 
   WriteMetaFile(*Idx2, P, idx2_PrintScratch("%s/%s/%s.idx", P.OutDir, P.Meta.Name, P.Meta.Field));
-  printf("num channels            = %" PRIi64 "\n", Size(E.Channels));
-  printf("num sub channels        = %" PRIi64 "\n", Size(E.SubChannels));
-  printf("num chunks              = %" PRIi64 "\n", ChunkStreamStat.Count());
-  printf("brick deltas      total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", BrickDeltasStat.Sum(), BrickDeltasStat.Avg(), BrickDeltasStat.StdDev());
-  printf("brick sizes       total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", BrickSzsStat.Sum(), BrickSzsStat.Avg(), BrickSzsStat.StdDev());
-  printf("brick stream      total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", BrickStreamStat.Sum(), BrickStreamStat.Avg(), BrickStreamStat.StdDev());
-  printf("block stream      total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", BlockStat.Sum(), BlockStat.Avg(), BlockStat.StdDev());
-  printf("chunk sizes       total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", ChunkSzsStat.Sum(), ChunkSzsStat.Avg(), ChunkSzsStat.StdDev());
-  printf("chunk addrs       total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", ChunkAddrsStat.Sum(), ChunkAddrsStat.Avg(), ChunkAddrsStat.StdDev());
-  printf("cpres chunk addrs total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", CpresChunkAddrsStat.Sum(), CpresChunkAddrsStat.Avg(), CpresChunkAddrsStat.StdDev());
-  printf("chunk stream      total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", ChunkStreamStat.Sum(), ChunkStreamStat.Avg(), ChunkStreamStat.StdDev());
-  printf("brick exps        total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", BrickEMaxesStat.Sum(), BrickEMaxesStat.Avg(), BrickEMaxesStat.StdDev());
-  printf("block exps        total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", BlockEMaxStat.Sum(), BlockEMaxStat.Avg(), BlockEMaxStat.StdDev());
-  printf("chunk exp sizes   total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", ChunkEMaxSzsStat.Sum(), ChunkEMaxSzsStat.Avg(), ChunkEMaxSzsStat.StdDev());
-  printf("chunk exps stream total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", ChunkEMaxesStat.Sum(), ChunkEMaxesStat.Avg(), ChunkEMaxesStat.StdDev());
+  printf("num channels            = %" PRIi64 "\n", Size(E->Channels));
+  printf("num sub channels        = %" PRIi64 "\n", Size(E->SubChannels));
+  printf("num chunks              = %" PRIi64 "\n", E->ChunkStreamStat.Count());
+  printf("brick deltas      total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", E->BrickDeltasStat.Sum(), E->BrickDeltasStat.Avg(), E->BrickDeltasStat.StdDev());
+  printf("brick sizes       total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", E->BrickSzsStat.Sum(), E->BrickSzsStat.Avg(), E->BrickSzsStat.StdDev());
+  printf("brick stream      total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", E->BrickStreamStat.Sum(), E->BrickStreamStat.Avg(), E->BrickStreamStat.StdDev());
+  printf("block stream      total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", E->BlockStat.Sum(), E->BlockStat.Avg(), E->BlockStat.StdDev());
+  printf("chunk sizes       total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", E->ChunkSzsStat.Sum(), E->ChunkSzsStat.Avg(), E->ChunkSzsStat.StdDev());
+  printf("chunk addrs       total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", E->ChunkAddrsStat.Sum(), E->ChunkAddrsStat.Avg(), E->ChunkAddrsStat.StdDev());
+  printf("cpres chunk addrs total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", E->CpresChunkAddrsStat.Sum(), E->CpresChunkAddrsStat.Avg(), E->CpresChunkAddrsStat.StdDev());
+  printf("chunk stream      total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", E->ChunkStreamStat.Sum(), E->ChunkStreamStat.Avg(), E->ChunkStreamStat.StdDev());
+  printf("brick exps        total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", E->BrickEMaxesStat.Sum(), E->BrickEMaxesStat.Avg(), E->BrickEMaxesStat.StdDev());
+  printf("block exps        total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", E->BlockEMaxStat.Sum(), E->BlockEMaxStat.Avg(), E->BlockEMaxStat.StdDev());
+  printf("chunk exp sizes   total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", E->ChunkEMaxSzsStat.Sum(), E->ChunkEMaxSzsStat.Avg(), E->ChunkEMaxSzsStat.StdDev());
+  printf("chunk exps stream total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", E->ChunkEMaxesStat.Sum(), E->ChunkEMaxesStat.Avg(), E->ChunkEMaxesStat.StdDev());
   printf("total time              = %f seconds\n", TotalTime_);
 //  _ASSERTE( _CrtCheckMemory( ) );
   return idx2_Error(idx2_file_err_code::NoError);
 }
 
+/* The largest absolute value of a float32 or float64 volume */
+static f64
+MaxAbsValue(const volume& Vol) {
+  i64 N = Prod<i64>(Dims(Vol));
+  f64 MaxAbs = 0;
+  if (Vol.Type == dtype::float32) {
+    const f32* Vals = (const f32*)Vol.Buffer.Data;
+    f32 M = 0;
+    idx2_For(i64, I, 0, N) M = Max(M, (f32)fabs(Vals[I]));
+    MaxAbs = M;
+  } else if (Vol.Type == dtype::float64) {
+    const f64* Vals = (const f64*)Vol.Buffer.Data;
+    idx2_For(i64, I, 0, N) MaxAbs = Max(MaxAbs, fabs(Vals[I]));
+  }
+  return MaxAbs;
+}
+
+error<idx2_file_err_code>
+Encode(idx2_file* Idx2, const params& P, const volume& Vol) {
+  /* the largest value is only needed to decide if the bricks of a float32 field can be float32 */
+  f64 MaxAbs = GetEncodeBrickType(*Idx2, 0) == dtype::float32 ? MaxAbsValue(Vol) : -1;
+  dtype BrickType = GetEncodeBrickType(*Idx2, MaxAbs);
+  const int BrickBytes = Prod(Idx2->BrickDimsExt3) * SizeOf(BrickType);
+  idx2_RAII(block_pool, Pool, Init(&Pool, BrickBytes));
+  pool_allocator Alloc; Init(&Alloc, &Pool);
+  idx2_RAII(encode_data, E, Init(&E, &Alloc));
+  E.BrickType = BrickType;
+  bool Parallel = P.NThreads > 1 && CanSplitIntoUnits(*Idx2);
+  if (P.NThreads > 1 && !Parallel)
+    printf("the files are shared by the levels (or the version is 0.x), encoding on one thread\n");
+  timer Timer; StartTimer(&Timer);
+  if (Parallel) {
+    idx2_PropagateIfError(EncodeLevels(Idx2, P, Vol, P.NThreads, &Pool, &E));
+  } else {
+    idx2_PropagateIfError(EncodeBricks(Idx2, P, &Vol, extent(Idx2->NBricks3s[0]), &E));
+  }
+  TotalTime_ += Seconds(ElapsedTime(&Timer));
+  /* each unit flushes its own chunk exponents */
+  return FinishEncode(Idx2, P, &E, Parallel);
+}
+
+/* A level-0 unit of bricks (see GetLog2LevelUnit) whose bricks are being read by EncodeStream */
+struct stream_unit {
+  encode_data E;
+  i64 NBricksLeft = 0; // the number of bricks of the unit that are not read yet
+};
+
+error<idx2_file_err_code>
+EncodeStream(idx2_file* Idx2, const params& P, FILE* Fp) {
+  /* the largest value of the field is not known before the end, so the bricks are float64 */
+  const int BrickBytes = Prod(Idx2->BrickDimsExt3) * SizeOf(GetEncodeBrickType(*Idx2, -1));
+  idx2_RAII(block_pool, Pool, Init(&Pool, BrickBytes));
+  pool_allocator Alloc; Init(&Alloc, &Pool);
+  idx2_RAII(encode_data, E, Init(&E, &Alloc));
+  /* if the files are shared by the levels, the whole field is one unit (of all the levels) */
+  bool Split = CanSplitIntoUnits(*Idx2);
+  if (!Split)
+    printf("the files are shared by the levels (or the version is 0.x), the whole field is kept in memory and encoded on one thread\n");
+  /* the level-0 bricks are allocated from the cache of this thread and freed (back into it) by the
+  thread that encodes their unit; each thread allocates the parent bricks of its units */
+  const int NThreads = Split ? Max(P.NThreads, 1) : 1;
+  pool_allocator* Allocs = new pool_allocator[NThreads];
+  idx2_CleanUp(idx2_For(int, I, 0, NThreads) Allocs[I].DeallocAll(); delete[] Allocs);
+  idx2_For(int, I, 0, NThreads) Init(&Allocs[I], &Pool);
+  /* the units of each level, in order, and the next one to merge into E */
+  const i8 NLevels = Split ? Idx2->NLevels : 1;
+  array<u64> Units[idx2_file::MaxLevels];
+  idx2_CleanUp(idx2_For(i8, Iter, 0, NLevels) Dealloc(&Units[Iter]));
+  int Log2Units[idx2_file::MaxLevels];
+  i64 NextMerges[idx2_file::MaxLevels] = {};
+  idx2_For(i8, Iter, 0, NLevels) {
+    Log2Units[Iter] = Split ? GetLog2LevelUnit(*Idx2, Iter) : Idx2->BrickOrderStrs[0].Len;
+    GetUnits(*Idx2, Iter, Log2Units[Iter], &Units[Iter]);
+    if (Split && Size(Units[Iter]) == 1)
+      printf("level %d is stored in one file, all of its bricks are kept in memory\n", Iter);
+  }
+  /* a unit of level Iter > 0 is ready once all the units of level Iter - 1 that hold its children
+  are merged (the parent of a brick is Brick >> TformOrderFull.Len) */
+  auto ChildrenMerged = [&](i8 Iter, u64 U) {
+    if (NextMerges[Iter - 1] == Size(Units[Iter - 1]))
+      return true;
+    u64 NextChild = Units[Iter - 1][NextMerges[Iter - 1]] << Log2Units[Iter - 1]; // the first one not merged
+    return NextChild >= (U + 1) << (Log2Units[Iter] + Idx2->TformOrderFull.Len);
+  };
+  hash_table<u64, stream_unit> Pending; // the level-0 units that are not merged yet
+  Init(&Pending, 8);
+  idx2_CleanUp(idx2_ForEach(It, Pending) Dealloc(&It.Val->E); Dealloc(&Pending));
+  idx2_RAII(array<u64>, Ready, Reserve(&Ready, 64));
+  idx2_RAII(array<unit_task>, Tasks, Reserve(&Tasks, 64));
+  /* the slab buffer (the last slab can be thinner) */
+  v3i SlabDims3(Idx2->Dims3.X, Idx2->Dims3.Y, Idx2->BrickDims3.Z);
+  volume Slab(SlabDims3, Idx2->DType);
+  idx2_CleanUp(Dealloc(&Slab));
+
+  timer Timer; StartTimer(&Timer);
+  const v3i& NBricks3 = Idx2->NBricks3s[0];
+  idx2_For(int, Bz, 0, NBricks3.Z) { // slab loop
+    /* read the slab */
+    extent SlabExt(v3i(0, 0, Bz * SlabDims3.Z), v3i(SlabDims3.X, SlabDims3.Y, Min(SlabDims3.Z, Idx2->Dims3.Z - Bz * SlabDims3.Z)));
+    size_t SlabBytes = size_t(Prod<i64>(Dims(SlabExt)) * SizeOf(Idx2->DType));
+    if (fread(Slab.Buffer.Data, 1, SlabBytes, Fp) != SlabBytes)
+      return idx2_Error(idx2_file_err_code::FileReadFailed, "slab %d", Bz);
+    /* copy the bricks of the slab into the brick pools of their units */
+    idx2_For(int, By, 0, NBricks3.Y) {
+      idx2_For(int, Bx, 0, NBricks3.X) {
+        v3i Brick3(Bx, By, Bz);
+        u64 U = GetLinearBrick(*Idx2, 0, Brick3) >> Log2Units[0];
+        auto UIt = Lookup(&Pending, U);
+        if (!UIt) {
+          stream_unit Su;
+          Init(&Su.E, &Alloc);
+          Su.E.BrickType = E.BrickType;
+          Su.E.OneLevel = Split;
+          Su.NBricksLeft = Prod<i64>(Dims(GetUnitExtent(*Idx2, 0, Log2Units[0], U)));
+          Insert(&UIt, U, Su);
+        }
+        AddBrick(Idx2, Slab, SlabExt, Brick3, &Alloc, &UIt.Val->E);
+        if (--UIt.Val->NBricksLeft == 0)
+          PushBack(&Ready, U);
+      }
+    }
+    /* encode the level-0 units whose bricks are all read */
+    Clear(&Tasks);
+    idx2_ForEach(UIt, Ready)
+      PushBack(&Tasks, unit_task{*UIt, &Lookup(&Pending, *UIt).Val->E});
+    EncodeUnits(Idx2, P, nullptr, 0, Log2Units[0], Tasks, NThreads, Allocs);
+    idx2_ForEach(TIt, Tasks)
+      idx2_PropagateIfError(GetUnitError(*TIt->Second, TIt->First));
+    Clear(&Ready);
+    /* merge the encoded units in order */
+    i64& NextMerge = NextMerges[0];
+    for (; NextMerge < Size(Units[0]); ++NextMerge) {
+      auto UIt = Lookup(&Pending, Units[0][NextMerge]);
+      if (!UIt || UIt.Val->NBricksLeft > 0)
+        break;
+      error<idx2_file_err_code> Result = idx2_Error(idx2_file_err_code::NoError);
+      if (Split) {
+        Result = MergeUnit(*Idx2, &E, &UIt.Val->E);
+        Dealloc(&UIt.Val->E);
+      } else { // the only unit takes the place of E
+        Dealloc(&E);
+        E = UIt.Val->E;
+        E.Alloc = &Alloc;
+      }
+      Delete(&Pending, Units[0][NextMerge]);
+      if (!Result)
+        return Result;
+    }
+    /* encode the units of the coarser levels whose bricks are all filled, so their files are written
+    and their bricks freed before the end of the field */
+    idx2_For(i8, Iter, 1, NLevels) {
+      i64 First = NextMerges[Iter], Last = First;
+      while (Last < Size(Units[Iter]) && ChildrenMerged(Iter, Units[Iter][Last]))
+        ++Last;
+      if (Last > First) {
+        idx2_PropagateIfError(EncodeLevelUnits(Idx2, P, nullptr, Iter, Log2Units[Iter], &Units[Iter][First], Last - First, NThreads, Allocs, &E));
+      }
+      NextMerges[Iter] = Last;
+    }
+  } // end slab loop
+  idx2_For(i8, Iter, 0, NLevels) idx2_Assert(NextMerges[Iter] == Size(Units[Iter]));
+  idx2_Assert(Size(E.BrickPool) == 0);
+  TotalTime_ += Seconds(ElapsedTime(&Timer));
+  /* each unit flushes its own chunk exponents */
+  return FinishEncode(Idx2, P, &E, Split);
+}
+
 /* ---------------------------------------------------------------------------------------------- */
 /*                                     DECODER                                                    */
 /* ---------------------------------------------------------------------------------------------- */
@@ -42432,7 +44647,8 @@ static void
 Dealloc(chunk_cache* ChunkCache) {
   Dealloc(&ChunkCache->Bricks);
   Dealloc(&ChunkCache->BrickSzs);
-  Dealloc(&ChunkCache->ChunkStream);
+  if (ChunkCache->ChunkStream.Stream.Alloc) // otherwise the stream points into a mapped file
+    Dealloc(&ChunkCache->ChunkStream);
 }
 
 static void
@@ -42454,91 +44670,306 @@ Dealloc(file_cache* FileCache) {
 }
 
 static void
-Init(file_cache_table* FileCacheTable) {
-  Init(&FileCacheTable->FileCaches, 8);
-  Init(&FileCacheTable->FileExpCaches, 5);
-  Init(&FileCacheTable->FileRdoCaches, 5);
+Init(file_cache_table* FileCacheTable, allocator* Alloc) {
+  Init(&FileCacheTable->FileCaches, 8, Alloc);
+  Init(&FileCacheTable->FileExpCaches, 5, Alloc);
+  Init(&FileCacheTable->FileRdoCaches, 5, Alloc);
 }
 static void
 Dealloc(file_cache_table* FileCacheTable) {
   idx2_ForEach(FileCacheIt, FileCacheTable->FileCaches) Dealloc(FileCacheIt.Val);
   Dealloc(&FileCacheTable->FileCaches);
   idx2_ForEach(FileExpCacheIt, FileCacheTable->FileExpCaches) Dealloc(FileExpCacheIt.Val);
+  Dealloc(&FileCacheTable->FileExpCaches);
   idx2_ForEach(FileRdoCacheIt, FileCacheTable->FileRdoCaches) Dealloc(FileRdoCacheIt.Val);
+  Dealloc(&FileCacheTable->FileRdoCaches);
 }
 
-static void
-Init(decode_data* D, allocator* Alloc = nullptr) {
+void
+Init(decode_data* D, int MaxOpenFiles, i64 ArenaBytes) {
   Init(&D->BrickPool, 5);
-  D->Alloc = Alloc ? Alloc : &BrickAlloc_;
-  Init(&D->FcTable);
-  Init(&D->Streams, 7);
-//  Reserve(&D->RequestedChunks, 64);
+  Init(&D->BrickCache, &D->BrickBlocks); // BrickBlocks is initialized by the first Decode
+  D->Alloc = &D->BrickCache;
+  D->Main = D;
+  if (ArenaBytes > 0) {
+    D->Arena = arena_allocator(ArenaBytes);
+    D->CacheAlloc = &D->Arena;
+  }
+  Init(&D->FcTable, D->CacheAlloc);
+  Init(&D->FdCache, MaxOpenFiles);
+  Init(&D->MappedFiles, 8);
+  Init(&D->BlockStates, 8);
 }
 
+/* Init the per-thread decode_data of a thread that decodes bricks on behalf of Main */
 static void
+InitWorker(decode_data* W, decode_data* Main) {
+  Init(&W->BrickCache, &Main->BrickBlocks);
+  W->Alloc = &W->BrickCache;
+  W->Main = Main;
+  W->QualityLevel = Main->QualityLevel;
+  W->EffIter = Main->EffIter;
+}
+
+void
 Dealloc(decode_data* D) {
-  D->Alloc->DeallocAll();
-  idx2_ForEach(BrickVolIt, D->BrickPool) Dealloc(&BrickVolIt.Val->Vol);
-  Dealloc(&D->BrickPool);
-  Dealloc(&D->FcTable);
+  if (D->Main == D) { // only the main decode_data owns the brick pool and the caches
+    idx2_ForEach(BrickVolIt, D->BrickPool) Dealloc(&BrickVolIt.Val->Vol);
+    Dealloc(&D->BrickPool);
+    D->BrickCache.DeallocAll();
+    Dealloc(&D->BrickBlocks);
+    if (D->CacheAlloc == &D->Arena) // everything in FcTable is in the arena
+      D->Arena.DeallocAll();
+    else
+      Dealloc(&D->FcTable);
+    Dealloc(&D->ResidentChunks);
+    Dealloc(&D->FdCache);
+    idx2_ForEach(MappedIt, D->MappedFiles) UnmapFile(MappedIt.Val);
+    Dealloc(&D->MappedFiles);
+    idx2_ForEach(StateIt, D->BlockStates) Dealloc(&StateIt.Val->Blocks);
+    Dealloc(&D->BlockStates);
+  } else { // the blocks in the cache of a worker go back to the pool of Main
+    D->BrickCache.DeallocAll();
+  }
   Dealloc(&D->BlockStream);
   Dealloc(&D->Streams);
+  Dealloc(&D->StreamSlots);
   DeallocBuf(&D->CompressedChunkExps);
+  Dealloc(&D->ChunkExpStream);
+  Dealloc(&D->ChunkBricks);
+  Dealloc(&D->ChunkBrickSzs);
   Dealloc(&D->ChunkEMaxSzsStream);
   Dealloc(&D->ChunkAddrsStream);
   Dealloc(&D->ChunkSzsStream);
-//  Dealloc(&D->RequestedChunks);
+  Dealloc(&D->PinnedChunks);
+}
+
+std::atomic<u64> DecodeIOTime_ = 0;
+std::atomic<u64> PrefetchIOTime_ = 0; // io time on the prefetch thread, hidden behind decoding
+std::atomic<u64> DataMovementTime_ = 0;
+std::atomic<u64> BytesRdos_ = 0;
+std::atomic<u64> BytesExps_ = 0;
+std::atomic<u64> BytesData_ = 0;
+
+static idx2_Inline void
+AddIOTime(decode_data* D, u64 T) {
+  if (D->IsPrefetcher)
+    PrefetchIOTime_ += T;
+  else
+    DecodeIOTime_ += T;
+}
+
+/*
+A file open for reading. If Map is not empty, the file is mapped in memory (and stays mapped until
+the decoder is deallocated), otherwise it is read with pread through the descriptor cache. Where is
+the position (initially the end of the file) of the backward reads. */
+struct read_file {
+  file_handle File;
+  u64 Key = 0;
+  buffer Map;
+  i64 Where = 0;
+};
+
+/* Map a file the first time it is read (D->Main->Mutex must be held) */
+static error<idx2_file_err_code>
+MapFileForRead(decode_data* D, u64 Key, const file_id& FileId, buffer* Map) {
+  auto MappedIt = Lookup(&D->Main->MappedFiles, Key);
+  if (!MappedIt) {
+    mmap_file MFile;
+    if (!OpenFile(&MFile, FileId.Name.ConstPtr, map_mode::Read))
+      return idx2_Error(idx2_file_err_code::FileNotFound, "%s", FileId.Name.ConstPtr);
+    if (!MapFile(&MFile)) {
+      CloseFile(&MFile);
+      return idx2_Error(idx2_file_err_code::FileReadFailed, "%s", FileId.Name.ConstPtr);
+    }
+    /* the mapping stays valid after the file is closed */
+    buffer Buf = MFile.Buf;
+    CloseFile(&MFile);
+    MFile.Buf = Buf;
+    Insert(&MappedIt, Key, MFile);
+  }
+  *Map = MappedIt.Val->Buf;
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
+/* Open a file for reading (D->Main->Mutex must not be held) */
+static error<idx2_file_err_code>
+Open(decode_data* D, const file_id& FileId, read_file* F) {
+  F->Key = FdKey(FileId.Name.ConstPtr);
+  if (D->Main->MapFiles) {
+    lock MapLock(&D->Main->Mutex);
+    auto MapOk = MapFileForRead(D, F->Key, FileId, &F->Map);
+    F->Where = F->Map.Bytes;
+    return MapOk;
+  }
+  if (!Acquire(&D->Main->FdCache, F->Key, FileId.Name.ConstPtr, &F->File, &F->Where))
+    return idx2_Error(idx2_file_err_code::FileNotFound, "%s", FileId.Name.ConstPtr);
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
+static void
+Close(decode_data* D, read_file* F) {
+  if (!F->Map.Data)
+    Release(&D->Main->FdCache, F->Key);
+}
+
+/* Open a file for reading and close it when going out of scope */
+#define idx2_OpenForRead(F, D, FileId)\
+  read_file F;\
+  { auto OpenOk = Open(D, FileId, &F); if (!OpenOk) return OpenOk; }\
+  idx2_CleanUp(Close(D, &F));
+
+/* Read the Bytes bytes right before F->Where into Dst, then move F->Where back */
+static void
+ReadBackward(read_file* F, void* Dst, i64 Bytes) {
+  F->Where -= Bytes;
+  if (F->Map.Data)
+    memcpy(Dst, F->Map.Data + F->Where, size_t(Bytes));
+  else
+    ReadAt(F->File, F->Where, Dst, Bytes);
+}
+
+idx2_T(t) static void
+ReadBackwardPOD(read_file* F, t* Val) { ReadBackward(F, Val, sizeof(t)); }
+
+/*
+Return the bytes [Offset, Offset + Bytes) of a file. If the file is mapped, the result points into
+the mapping, otherwise the bytes are read into Scratch (which must be large enough). */
+static buffer
+View(read_file* F, i64 Offset, i64 Bytes, const buffer& Scratch) {
+  if (F->Map.Data)
+    return buffer(F->Map.Data + Offset, Bytes);
+  idx2_Assert(Size(Scratch) >= Bytes);
+  ReadAt(F->File, Offset, Scratch.Data, Bytes);
+  return buffer(Scratch.Data, Bytes);
+}
+
+/* Same as View but for the Bytes bytes right before F->Where, then move F->Where back */
+static buffer
+ViewBackward(read_file* F, i64 Bytes, const buffer& Scratch) {
+  F->Where -= Bytes;
+  return View(F, F->Where, Bytes, Scratch);
+}
+
+/*
+Find the cache of a file in Table, waiting while another thread reads the file. If no thread has read
+the file, an empty placeholder (Loading) is inserted for other threads to wait on and true is
+returned: the caller then reads the file without the lock and calls PublishFile. D->Main->Mutex must
+be held. */
+idx2_T(t) static bool
+ClaimFile(decode_data* D, hash_table<u64, t>* Table, u64 Key, typename hash_table<u64, t>::iterator* It) {
+  for (;;) {
+    *It = Lookup(Table, Key);
+    if (!*It) {
+      t Placeholder; Placeholder.Loading = true;
+      Insert(It, Key, Placeholder);
+      return true;
+    }
+    if (!It->Val->Loading)
+      return false;
+    Wait(&D->Main->Loaded, &D->Main->Mutex);
+  }
 }
 
-u64 DecodeIOTime_ = 0;
-u64 DataMovementTime_ = 0;
-u64 BytesRdos_ = 0;
-u64 BytesExps_ = 0;
-u64 BytesData_ = 0;
+/*
+Replace the placeholder of a file claimed with ClaimFile (or delete it if File is null, i.e., the file
+could not be read), then wake up the threads that wait for the file. D->Main->Mutex must be held. */
+idx2_T(t) static void
+PublishFile(decode_data* D, hash_table<u64, t>* Table, u64 Key, const t* File, typename hash_table<u64, t>::iterator* It) {
+  *It = Lookup(Table, Key); // the table may have grown while the lock was released
+  idx2_Assert(*It && It->Val->Loading);
+  if (File) {
+    *It->Val = *File;
+  } else {
+    Delete(Table, Key);
+    *It = Lookup(Table, Key);
+  }
+  NotifyAll(&D->Main->Loaded);
+}
 
+/* Read and decompress the truncation points of all the chunks in a file (without the cache lock) */
 static error<idx2_file_err_code>
-ReadFileRdos(const idx2_file& Idx2, hash_table<u64, file_rdo_cache>::iterator* FileRdoCacheIt, const file_id& FileId) {
+LoadFileRdos(decode_data* D, const file_id& FileId, int* NumChunks, bitstream* Bs) {
   timer IOTimer;
   StartTimer(&IOTimer);
-  idx2_RAII(FILE*, Fp = fopen(FileId.Name.ConstPtr, "rb"),, if (Fp) fclose(Fp));
-  idx2_FSeek(Fp, 0, SEEK_END);
+  idx2_OpenForRead(F, D, FileId);
+  ReadBackwardPOD(&F, NumChunks);
+  i64 Sz = F.Where;
+  BytesRdos_ += sizeof(*NumChunks);
+  idx2_RAII(buffer, CompresBuf, if (!F.Map.Data) AllocBuf(&CompresBuf, Sz), if (CompresBuf.Data) DeallocBuf(&CompresBuf));
+  buffer CompresView = ViewBackward(&F, Sz, CompresBuf);
+  AddIOTime(D, ElapsedTime(&IOTimer));
+  BytesRdos_ += Size(CompresView);
+  DecompressBufZstd(CompresView, Bs);
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
+/* Find the rdo cache of a file, reading the file if no thread has (D->Main->Mutex must be held, it is
+released while the file is read) */
+static error<idx2_file_err_code>
+ReadFileRdos(const idx2_file& Idx2, decode_data* D, hash_table<u64, file_rdo_cache>::iterator* FileRdoCacheIt, const file_id& FileId) {
+  decode_data* M = D->Main;
+  if (!ClaimFile(D, &M->FcTable.FileRdoCaches, FileId.Id, FileRdoCacheIt))
+    return idx2_Error(idx2_file_err_code::NoError);
   int NumChunks = 0;
-  i64 Sz = idx2_FTell(Fp) - sizeof(NumChunks);
-  ReadBackwardPOD(Fp, &NumChunks);
-  BytesRdos_ += sizeof(NumChunks);
+  idx2_RAII(bitstream, Bs,);
+  Unlock(&M->Mutex);
+  auto ReadOk = LoadFileRdos(D, FileId, &NumChunks, &Bs);
+  Lock(&M->Mutex);
+  if (!ReadOk) {
+    PublishFile(D, &M->FcTable.FileRdoCaches, FileId.Id, (const file_rdo_cache*)nullptr, FileRdoCacheIt);
+    return ReadOk;
+  }
+  allocator* Alloc = M->CacheAlloc;
   file_rdo_cache FileRdoCache;
+  FileRdoCache.TileRdoCaches = array<chunk_rdo_cache>(Alloc);
   Resize(&FileRdoCache.TileRdoCaches, NumChunks);
-  idx2_RAII(buffer, CompresBuf, AllocBuf(&CompresBuf, Sz), DeallocBuf(&CompresBuf));
-  ReadBackwardBuffer(Fp, &CompresBuf);
-  DecodeIOTime_ += ElapsedTime(&IOTimer);
-  BytesRdos_ += Size(CompresBuf);
-  idx2_RAII(bitstream, Bs,);
-  DecompressBufZstd(CompresBuf, &Bs);
   int Pos = 0;
   idx2_For(int, I, 0, Size(FileRdoCache.TileRdoCaches)) {
     chunk_rdo_cache& TileRdoCache = FileRdoCache.TileRdoCaches[I];
+    TileRdoCache.TruncationPoints = array<i16>(Alloc);
     Resize(&TileRdoCache.TruncationPoints, Size(Idx2.RdoLevels) * Size(Idx2.Subbands));
     idx2_ForEach(It, TileRdoCache.TruncationPoints) *It = ((const i16*)Bs.Stream.Data)[Pos++];
   }
-  Insert(FileRdoCacheIt, FileId.Id, FileRdoCache);
+  PublishFile(D, &M->FcTable.FileRdoCaches, FileId.Id, &FileRdoCache, FileRdoCacheIt);
   return idx2_Error(idx2_file_err_code::NoError);
 }
 
+/* Read the sizes of the exponent chunks of a file into D->ChunkEMaxSzsStream (without the cache lock) */
 static error<idx2_file_err_code>
-ReadFileExponents(decode_data* D, hash_table<u64, file_exp_cache>::iterator* FileExpCacheIt, const file_id& FileId) {
+LoadFileExponents(decode_data* D, const file_id& FileId, int* ChunkEMaxSzsSz) {
   timer IOTimer;
   StartTimer(&IOTimer);
-  idx2_RAII(FILE*, Fp = fopen(FileId.Name.ConstPtr, "rb"),, if (Fp) fclose(Fp));
-  idx2_FSeek(Fp, 0, SEEK_END);
-  int ChunkEMaxSzsSz = 0; ReadBackwardPOD(Fp, &ChunkEMaxSzsSz);
+  idx2_OpenForRead(F, D, FileId);
+  ReadBackwardPOD(&F, ChunkEMaxSzsSz);
   Rewind(&D->ChunkEMaxSzsStream);
-  GrowToAccomodate(&D->ChunkEMaxSzsStream, ChunkEMaxSzsSz - Size(D->ChunkEMaxSzsStream));
-  ReadBackwardBuffer(Fp, &D->ChunkEMaxSzsStream.Stream, ChunkEMaxSzsSz);
-  BytesExps_ += sizeof(int) + ChunkEMaxSzsSz;
-  DecodeIOTime_ += ElapsedTime(&IOTimer);
+  GrowToAccomodate(&D->ChunkEMaxSzsStream, *ChunkEMaxSzsSz - Size(D->ChunkEMaxSzsStream));
+  /* always copied (it is small) since the stream is read in 8-byte words and ends near the end of the file */
+  ReadBackward(&F, D->ChunkEMaxSzsStream.Stream.Data, *ChunkEMaxSzsSz);
+  BytesExps_ += sizeof(int) + *ChunkEMaxSzsSz;
+  AddIOTime(D, ElapsedTime(&IOTimer));
   InitRead(&D->ChunkEMaxSzsStream, D->ChunkEMaxSzsStream.Stream);
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
+/* Find the exponent cache of a file, reading the file if no thread has (D->Main->Mutex must be held,
+it is released while the file is read) */
+static error<idx2_file_err_code>
+ReadFileExponents(decode_data* D, hash_table<u64, file_exp_cache>::iterator* FileExpCacheIt, const file_id& FileId) {
+  decode_data* M = D->Main;
+  if (!ClaimFile(D, &M->FcTable.FileExpCaches, FileId.Id, FileExpCacheIt))
+    return idx2_Error(idx2_file_err_code::NoError);
+  int ChunkEMaxSzsSz = 0;
+  Unlock(&M->Mutex);
+  auto ReadOk = LoadFileExponents(D, FileId, &ChunkEMaxSzsSz);
+  Lock(&M->Mutex);
+  if (!ReadOk) {
+    PublishFile(D, &M->FcTable.FileExpCaches, FileId.Id, (const file_exp_cache*)nullptr, FileExpCacheIt);
+    return ReadOk;
+  }
   file_exp_cache FileExpCache;
+  FileExpCache.ChunkExpSzs = array<i32>(M->CacheAlloc);
+  FileExpCache.ChunkExpCaches = array<chunk_exp_cache>(M->CacheAlloc);
   Reserve(&FileExpCache.ChunkExpSzs, ChunkEMaxSzsSz);
   i32 ChunkEMaxSz = 0;
   while (Size(D->ChunkEMaxSzsStream) < ChunkEMaxSzsSz) {
@@ -42546,174 +44977,357 @@ ReadFileExponents(decode_data* D, hash_table<u64, file_exp_cache>::iterator* Fil
   }
   Resize(&FileExpCache.ChunkExpCaches, Size(FileExpCache.ChunkExpSzs));
   idx2_Assert(Size(D->ChunkEMaxSzsStream) == ChunkEMaxSzsSz);
-  Insert(FileExpCacheIt, FileId.Id, FileExpCache);
+  PublishFile(D, &M->FcTable.FileExpCaches, FileId.Id, &FileExpCache, FileExpCacheIt);
   return idx2_Error(idx2_file_err_code::NoError);
 }
 
-/* Given a brick address, open the file associated with the brick and cache its chunk information */
+/*
+Read the chunk addresses of a file into D->ChunkAddrsStream and point ChunkSzsStream to its chunk sizes
+(without the cache lock) */
 static error<idx2_file_err_code>
-ReadFile(decode_data* D, hash_table<u64, file_cache>::iterator* FileCacheIt, const file_id& FileId) {
+LoadFile(decode_data* D, const file_id& FileId, int* NChunks, bitstream* ChunkSzsStream) {
   timer IOTimer;
   StartTimer(&IOTimer);
-  idx2_RAII(FILE*, Fp = fopen(FileId.Name.ConstPtr, "rb"),, if (Fp) fclose(Fp));
-  idx2_FSeek(Fp, 0, SEEK_END);
-  int NChunks = 0; ReadBackwardPOD(Fp, &NChunks);
+  idx2_OpenForRead(F, D, FileId);
+  ReadBackwardPOD(&F, NChunks);
   // TODO: check if there are too many NChunks
 
   /* read and decompress chunk addresses */
-  int IniChunkAddrsSz = NChunks * (int)sizeof(u64);
-  int ChunkAddrsSz; ReadBackwardPOD(Fp, &ChunkAddrsSz);
-  idx2_RAII(buffer, CpresChunkAddrs, AllocBuf(&CpresChunkAddrs, ChunkAddrsSz), DeallocBuf(&CpresChunkAddrs)); // TODO: move to decode_data
-  ReadBackwardBuffer(Fp, &CpresChunkAddrs, ChunkAddrsSz);
+  int IniChunkAddrsSz = *NChunks * (int)sizeof(u64);
+  int ChunkAddrsSz; ReadBackwardPOD(&F, &ChunkAddrsSz);
+  idx2_RAII(buffer, CpresChunkAddrs, if (!F.Map.Data) AllocBuf(&CpresChunkAddrs, ChunkAddrsSz), if (CpresChunkAddrs.Data) DeallocBuf(&CpresChunkAddrs)); // TODO: move to decode_data
+  buffer CpresChunkAddrsView = ViewBackward(&F, ChunkAddrsSz, CpresChunkAddrs);
   BytesData_ += ChunkAddrsSz;
-  DecodeIOTime_ += ElapsedTime(&IOTimer);
+  AddIOTime(D, ElapsedTime(&IOTimer));
   Rewind(&D->ChunkAddrsStream);
   GrowToAccomodate(&D->ChunkAddrsStream, IniChunkAddrsSz - Size(D->ChunkAddrsStream));
-  DecompressBufZstd(CpresChunkAddrs, &D->ChunkAddrsStream);
+  DecompressBufZstd(CpresChunkAddrsView, &D->ChunkAddrsStream);
 
-  /* read chunk sizes */
+  /* read chunk sizes (the chunk addresses follow them so 8-byte reads stay inside the file) */
   ResetTimer(&IOTimer);
   int ChunkSizesSz = 0;
-  ReadBackwardPOD(Fp, &ChunkSizesSz);
+  ReadBackwardPOD(&F, &ChunkSizesSz);
   Rewind(&D->ChunkSzsStream);
-  GrowToAccomodate(&D->ChunkSzsStream, ChunkSizesSz - Size(D->ChunkSzsStream));
-  ReadBackwardBuffer(Fp, &D->ChunkSzsStream.Stream, ChunkSizesSz);
+  if (!F.Map.Data)
+    GrowToAccomodate(&D->ChunkSzsStream, ChunkSizesSz - Size(D->ChunkSzsStream));
+  InitRead(ChunkSzsStream, ViewBackward(&F, ChunkSizesSz, D->ChunkSzsStream.Stream));
   BytesData_ += ChunkSizesSz;
-  DecodeIOTime_ += ElapsedTime(&IOTimer);
-  InitRead(&D->ChunkSzsStream, D->ChunkSzsStream.Stream);
+  AddIOTime(D, ElapsedTime(&IOTimer));
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
+/*
+Given a brick address, find the file associated with the brick and cache its chunk information, reading
+the file if no thread has (D->Main->Mutex must be held, it is released while the file is read) */
+static error<idx2_file_err_code>
+ReadFile(decode_data* D, hash_table<u64, file_cache>::iterator* FileCacheIt, const file_id& FileId) {
+  decode_data* M = D->Main;
+  if (!ClaimFile(D, &M->FcTable.FileCaches, FileId.Id, FileCacheIt))
+    return idx2_Error(idx2_file_err_code::NoError);
+  int NChunks = 0;
+  bitstream ChunkSzsStream; // in D->ChunkSzsStream or in the mapping of the file
+  Unlock(&M->Mutex);
+  auto ReadOk = LoadFile(D, FileId, &NChunks, &ChunkSzsStream);
+  Lock(&M->Mutex);
+  if (!ReadOk) {
+    PublishFile(D, &M->FcTable.FileCaches, FileId.Id, (const file_cache*)nullptr, FileCacheIt);
+    return ReadOk;
+  }
 
   /* parse the chunk addresses and cache in memory */
+  allocator* Alloc = M->CacheAlloc;
   file_cache FileCache;
+  FileCache.ChunkSizes = array<i64>(Alloc);
+  Reserve(&FileCache.ChunkSizes, NChunks);
   i64 AccumSize = 0;
-  Init(&FileCache.ChunkCaches, 10);
+  Init(&FileCache.ChunkCaches, 10, Alloc);
   idx2_For(int, I, 0, NChunks) {
-    i64 ChunkSize = ReadVarByte(&D->ChunkSzsStream);
+    i64 ChunkSize = ReadVarByte(&ChunkSzsStream);
     u64 ChunkAddr = *((u64*)D->ChunkAddrsStream.Stream.Data + I);
     chunk_cache ChunkCache; ChunkCache.ChunkPos = I;
+    ChunkCache.Bricks = array<u64>(Alloc);
+    ChunkCache.BrickSzs = array<i32>(Alloc);
     Insert(&FileCache.ChunkCaches, ChunkAddr, ChunkCache);
     PushBack(&FileCache.ChunkSizes, AccumSize += ChunkSize);
   }
-  idx2_Assert(Size(D->ChunkSzsStream) == ChunkSizesSz);
-  Insert(FileCacheIt, FileId.Id, FileCache);
+  idx2_Assert(Size(ChunkSzsStream) == Size(ChunkSzsStream.Stream));
+  PublishFile(D, &M->FcTable.FileCaches, FileId.Id, &FileCache, FileCacheIt);
   return idx2_Error(idx2_file_err_code::NoError);
 }
 
+/* Parse the header of a chunk (its bricks and their sizes) into Bricks and BrickSzs */
 static void
-DecompressChunk(bitstream* ChunkStream, chunk_cache* ChunkCache, u64 ChunkAddress, int L) {
+DecompressChunk(bitstream* ChunkStream, array<u64>* Bricks, array<i32>* BrickSzs, u64 ChunkAddress, int L) {
   (void)L; u64 Brk = ((ChunkAddress >> 18) & 0x3FFFFFFFFFFull); (void)Brk;
   InitRead(ChunkStream, ChunkStream->Stream);
   int NBricks = (int)ReadVarByte(ChunkStream); idx2_Assert(NBricks > 0);
 
   /* decompress and store the brick ids */
   u64 Brick = ReadVarByte(ChunkStream);
-  Resize(&ChunkCache->Bricks, NBricks);
-  ChunkCache->Bricks[0] = Brick;
+  Resize(Bricks, NBricks);
+  (*Bricks)[0] = Brick;
   idx2_For(int, I, 1, NBricks) {
     Brick += ReadUnary(ChunkStream) + 1;
-    ChunkCache->Bricks[I] = Brick;
+    (*Bricks)[I] = Brick;
     idx2_Assert(Brk == (Brick >> L));
   }
-  Resize(&ChunkCache->BrickSzs, NBricks);
+  Resize(BrickSzs, NBricks);
 
   /* decompress and store the brick sizes */
   i32 BrickSize = 0;
   SeekToNextByte(ChunkStream);
-  idx2_ForEach(BrickSzIt, ChunkCache->BrickSzs) *BrickSzIt = BrickSize += (i32)ReadVarByte(ChunkStream);
-  ChunkCache->ChunkStream = *ChunkStream;
+  idx2_ForEach(BrickSzIt, *BrickSzs) *BrickSzIt = BrickSize += (i32)ReadVarByte(ChunkStream);
+}
+
+/* Pin a chunk in memory until D is done with the current subband (D->Main->Mutex must be held) */
+static void
+Pin(decode_data* D, const cached_chunk& C) {
+  if (C.Chunk) {
+    ++C.Chunk->NUsers;
+    C.Chunk->LastUse = ++D->Main->CacheClock;
+  } else {
+    ++C.ChunkExp->NUsers;
+    C.ChunkExp->LastUse = ++D->Main->CacheClock;
+  }
+  PushBack(&D->PinnedChunks, C);
+}
+
+static void
+UnpinAll(decode_data* D) {
+  if (Size(D->PinnedChunks) == 0)
+    return;
+  lock CacheLock(&D->Main->Mutex);
+  idx2_ForEach(It, D->PinnedChunks) {
+    if (It->Chunk) --It->Chunk->NUsers; else --It->ChunkExp->NUsers;
+  }
+  Clear(&D->PinnedChunks);
+}
+
+/*
+Evict the least recently used chunks that are not pinned, until at most Target bytes are cached.
+An evicted chunk stays in its file cache, empty, and is read again the next time it is needed. */
+static void
+EvictChunks(decode_data* M, i64 Target) {
+  std::sort(Begin(M->ResidentChunks), End(M->ResidentChunks), [](const cached_chunk& A, const cached_chunk& B) {
+    return (A.Chunk ? A.Chunk->LastUse : A.ChunkExp->LastUse) < (B.Chunk ? B.Chunk->LastUse : B.ChunkExp->LastUse);
+  });
+  i64 NKept = 0;
+  idx2_ForEach(It, M->ResidentChunks) {
+    bool Pinned = It->Chunk ? It->Chunk->NUsers > 0 : It->ChunkExp->NUsers > 0;
+    if (M->CacheBytes <= Target || Pinned) {
+      M->ResidentChunks[NKept++] = *It;
+      continue;
+    }
+    M->CacheBytes -= Size(*It);
+    ++M->NEvictions;
+    if (It->Chunk) {
+      Dealloc(It->Chunk);
+      It->Chunk->ChunkStream = bitstream();
+    } else {
+      Dealloc(It->ChunkExp);
+      *It->ChunkExp = chunk_exp_cache();
+    }
+  }
+  Resize(&M->ResidentChunks, NKept);
+}
+
+/* Count a chunk that has just been read towards the cache budget (D->Main->Mutex must be held) */
+static void
+AddToCache(decode_data* D, const cached_chunk& C) {
+  decode_data* M = D->Main;
+  PushBack(&M->ResidentChunks, C);
+  M->CacheBytes += Size(C);
+  M->PeakCacheBytes = Max(M->PeakCacheBytes, M->CacheBytes);
+  if (M->MaxCacheBytes > 0 && M->CacheBytes > M->MaxCacheBytes) // evict more than needed so that the resident chunks are not sorted on every read
+    EvictChunks(M, M->MaxCacheBytes / 4 * 3);
+}
+
+/* Read and decompress an exponent chunk into D->ChunkExpStream (without the cache lock) */
+static error<idx2_file_err_code>
+LoadChunkExponents(decode_data* D, const file_id& FileId, i32 ChunkExpOffset, i32 ChunkExpSize, i64* Bytes) {
+  timer IOTimer;
+  StartTimer(&IOTimer);
+  idx2_OpenForRead(F, D, FileId);
+  // TODO: calculate the number of bricks in this chunk in a different way to verify correctness
+  if (!F.Map.Data)
+    Resize(&D->CompressedChunkExps, ChunkExpSize);
+  buffer CompressedView = View(&F, ChunkExpOffset, ChunkExpSize, D->CompressedChunkExps);
+  BytesExps_ += ChunkExpSize;
+  AddIOTime(D, ElapsedTime(&IOTimer));
+  *Bytes = ZSTD_getFrameContentSize(CompressedView.Data, Size(CompressedView));
+  Rewind(&D->ChunkExpStream);
+  DecompressBufZstd(CompressedView, &D->ChunkExpStream);
+  return idx2_Error(idx2_file_err_code::NoError);
 }
 
-/* Given a brick address, read the exponent chunk associated with the brick and cache it */
+/*
+Given a brick address, read the exponent chunk associated with the brick and cache it. The chunk is
+claimed (Loading) under the cache lock, read and decompressed without it, then copied to the cache
+(whose allocator is only accessed under the lock). */
 // TODO: remove the last two params (already stored in D)
 static expected<const chunk_exp_cache*, idx2_file_err_code>
 ReadChunkExponents(const idx2_file& Idx2, decode_data* D, u64 Brick, i8 Iter, i8 Level) {
+  decode_data* M = D->Main;
   file_id FileId = ConstructFilePathExponents(Idx2, Brick, Iter, Level);
-  auto FileExpCacheIt = Lookup(&D->FcTable.FileExpCaches, FileId.Id);
-  if (!FileExpCacheIt) {
-    auto ReadFileOk = ReadFileExponents(D, &FileExpCacheIt, FileId);
-    if (!ReadFileOk) idx2_PropagateError(ReadFileOk);
-  }
+  lock CacheLock(&M->Mutex);
+  hash_table<u64, file_exp_cache>::iterator FileExpCacheIt;
+  auto ReadFileOk = ReadFileExponents(D, &FileExpCacheIt, FileId);
+  if (!ReadFileOk) idx2_PropagateError(ReadFileOk);
   if (!FileExpCacheIt) return idx2_Error(idx2_file_err_code::FileNotFound);
   file_exp_cache* FileExpCache = FileExpCacheIt.Val;
   idx2_Assert(D->ChunkInFile < Size(FileExpCache->ChunkExpSzs));
 
-  /* find the appropriate chunk */
-  if (IsEmpty(FileExpCache->ChunkExpCaches[D->ChunkInFile])) {
-    timer IOTimer;
-    StartTimer(&IOTimer);
-    idx2_RAII(FILE*, Fp = fopen(FileId.Name.ConstPtr, "rb"), , if (Fp) fclose(Fp));
-    idx2_Assert(Fp); // TODO: return an error
-    i32 ChunkExpOffset = D->ChunkInFile == 0 ? 0 : FileExpCache->ChunkExpSzs[D->ChunkInFile - 1];
-    i32 ChunkExpSize = FileExpCache->ChunkExpSzs[D->ChunkInFile] - ChunkExpOffset;
-    idx2_FSeek(Fp, ChunkExpOffset, SEEK_SET);
-    chunk_exp_cache ChunkExpCache;
-    bitstream& ChunkExpStream = ChunkExpCache.BrickExpsStream;
-    // TODO: calculate the number of bricks in this chunk in a different way to verify correctness
-    Resize(&D->CompressedChunkExps, ChunkExpSize);
-    ReadBuffer(Fp, &D->CompressedChunkExps, ChunkExpSize);
-    DecompressBufZstd(buffer{D->CompressedChunkExps.Data, ChunkExpSize}, &ChunkExpStream);
-    BytesExps_ += ChunkExpSize;
-    DecodeIOTime_ += ElapsedTime(&IOTimer);
+  /* find the appropriate chunk (which stays in place even if FileExpCaches grows, unlike FileExpCache) */
+  chunk_exp_cache* ChunkExpCache = &FileExpCache->ChunkExpCaches[D->ChunkInFile];
+  i32 ChunkExpOffset = D->ChunkInFile == 0 ? 0 : FileExpCache->ChunkExpSzs[D->ChunkInFile - 1];
+  i32 ChunkExpSize = FileExpCache->ChunkExpSzs[D->ChunkInFile] - ChunkExpOffset;
+  while (ChunkExpCache->Loading)
+    Wait(&M->Loaded, &M->Mutex);
+  if (IsEmpty(*ChunkExpCache)) {
+    i64 Bytes = 0;
+    ChunkExpCache->Loading = true;
+    Unlock(&M->Mutex);
+    auto ReadOk = LoadChunkExponents(D, FileId, ChunkExpOffset, ChunkExpSize, &Bytes);
+    Lock(&M->Mutex);
+    ChunkExpCache->Loading = false;
+    NotifyAll(&M->Loaded);
+    if (!ReadOk) return ReadOk;
+    bitstream& ChunkExpStream = ChunkExpCache->BrickExpsStream;
+    InitWrite(&ChunkExpStream, Bytes, M->CacheAlloc);
+    memcpy(ChunkExpStream.Stream.Data, D->ChunkExpStream.Stream.Data, Bytes);
+    memset(ChunkExpStream.Stream.Data + Bytes, 0, Size(ChunkExpStream.Stream) - Bytes);
     InitRead(&ChunkExpStream, ChunkExpStream.Stream);
-    FileExpCache->ChunkExpCaches[D->ChunkInFile] = ChunkExpCache;
+    Pin(D, cached_chunk{nullptr, ChunkExpCache});
+    AddToCache(D, cached_chunk{nullptr, ChunkExpCache});
+  } else {
+    Pin(D, cached_chunk{nullptr, ChunkExpCache});
   }
-  return &FileExpCache->ChunkExpCaches[D->ChunkInFile];
+  return ChunkExpCache;
 }
 
 static expected<const chunk_rdo_cache*, idx2_file_err_code>
 ReadChunkRdos(const idx2_file& Idx2, decode_data* D, u64 Brick, i8 Iter) {
   file_id FileId = ConstructFilePathRdos(Idx2, Brick, Iter);
-  auto FileRdoCacheIt = Lookup(&D->FcTable.FileRdoCaches, FileId.Id);
-  if (!FileRdoCacheIt) {
-    auto ReadFileOk = ReadFileRdos(Idx2, &FileRdoCacheIt, FileId);
-    if (!ReadFileOk) idx2_PropagateError(ReadFileOk);
-  }
+  lock CacheLock(&D->Main->Mutex);
+  hash_table<u64, file_rdo_cache>::iterator FileRdoCacheIt;
+  auto ReadFileOk = ReadFileRdos(Idx2, D, &FileRdoCacheIt, FileId);
+  if (!ReadFileOk) idx2_PropagateError(ReadFileOk);
   if (!FileRdoCacheIt) return idx2_Error(idx2_file_err_code::FileNotFound);
   file_rdo_cache* FileRdoCache = FileRdoCacheIt.Val;
   return &FileRdoCache->TileRdoCaches[D->ChunkInFile];
 }
 
-/* Given a brick address, read the chunk associated with the brick and cache the chunk */
+/*
+Read a chunk into ChunkStream (which points into the mapping of the file, or has been allocated with
+the cache allocator, under the lock) and parse its header into D->ChunkBricks and D->ChunkBrickSzs
+(without the cache lock) */
+static error<idx2_file_err_code>
+LoadChunk(const idx2_file& Idx2, decode_data* D, const file_id& FileId, i64 ChunkOffset, i64 ChunkSize, u64 ChunkAddress, i8 Iter, bitstream* ChunkStream) {
+  timer IOTimer;
+  StartTimer(&IOTimer);
+  idx2_OpenForRead(F, D, FileId);
+  if (F.Map.Data) { // point into the mapping (the file metadata follows the chunks so 8-byte reads stay inside the file)
+    ChunkStream->Stream = View(&F, ChunkOffset, ChunkSize, buffer());
+  } else {
+    ReadAt(F.File, ChunkOffset, ChunkStream->Stream.Data, ChunkSize);
+    memset(ChunkStream->Stream.Data + ChunkSize, 0, Size(ChunkStream->Stream) - ChunkSize);
+  }
+  BytesData_ += ChunkSize;
+  AddIOTime(D, ElapsedTime(&IOTimer));
+  DecompressChunk(ChunkStream, &D->ChunkBricks, &D->ChunkBrickSzs, ChunkAddress, Log2Ceil(Idx2.BricksPerChunks[Iter])); // TODO: check for error
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
+/*
+Given a brick address, read the chunk associated with the brick and cache the chunk. The chunk is
+claimed (Loading) under the cache lock, read and parsed without it, then published under the lock
+(as in ReadChunksAhead). */
 static expected<const chunk_cache*, idx2_file_err_code>
 ReadChunk(const idx2_file& Idx2, decode_data* D, u64 Brick, i8 Iter, i8 Level, i16 BitPlane) {
+  decode_data* M = D->Main;
   file_id FileId = ConstructFilePath(Idx2, Brick, Iter, Level, BitPlane);
-  auto FileCacheIt = Lookup(&D->FcTable.FileCaches, FileId.Id);
-  if (!FileCacheIt) {
-    auto ReadFileOk = ReadFile(D, &FileCacheIt, FileId);
-    if (!ReadFileOk) idx2_PropagateError(ReadFileOk);
-  }
+  lock CacheLock(&M->Mutex);
+  hash_table<u64, file_cache>::iterator FileCacheIt;
+  auto ReadFileOk = ReadFile(D, &FileCacheIt, FileId);
+  if (!ReadFileOk) idx2_PropagateError(ReadFileOk);
   if (!FileCacheIt) return idx2_Error(idx2_file_err_code::FileNotFound);
 
-  /* find the appropriate chunk */
+  /* find the appropriate chunk (which stays in place even if FileCaches grows, unlike FileCache) */
   u64 ChunkAddress = GetChunkAddress(Idx2, Brick, Iter, Level, BitPlane);
   file_cache* FileCache = FileCacheIt.Val;
-  decltype(FileCache->ChunkCaches)::iterator ChunkCacheIt;
-  ChunkCacheIt = Lookup(&FileCache->ChunkCaches, ChunkAddress);
+  auto ChunkCacheIt = Lookup(&FileCache->ChunkCaches, ChunkAddress);
   if (!ChunkCacheIt) return idx2_Error(idx2_file_err_code::ChunkNotFound);
   chunk_cache* ChunkCache = ChunkCacheIt.Val;
+  i32 ChunkPos = ChunkCache->ChunkPos;
+  i64 ChunkOffset = ChunkPos > 0 ? FileCache->ChunkSizes[ChunkPos - 1] : 0;
+  i64 ChunkSize = FileCache->ChunkSizes[ChunkPos] - ChunkOffset;
+  while (ChunkCache->Loading)
+    Wait(&M->Loaded, &M->Mutex);
   if (Size(ChunkCache->ChunkStream.Stream) == 0) {
-    timer IOTimer;
-    StartTimer(&IOTimer);
-    idx2_RAII(FILE*, Fp = fopen(FileId.Name.ConstPtr, "rb"), , if (Fp) fclose(Fp));
-    i32 ChunkPos = ChunkCache->ChunkPos;
-    i64 ChunkOffset = ChunkPos > 0 ? FileCache->ChunkSizes[ChunkPos - 1] : 0;
-    i64 ChunkSize = FileCache->ChunkSizes[ChunkPos] - ChunkOffset;
-    idx2_FSeek(Fp, ChunkOffset, SEEK_SET);
-    bitstream ChunkStream; InitWrite(&ChunkStream, ChunkSize); // NOTE: not a memory leak since we will keep track of this in ChunkCache
-    ReadBuffer(Fp, &ChunkStream.Stream);
-    BytesData_ += Size(ChunkStream.Stream);
-    DecodeIOTime_ += ElapsedTime(&IOTimer);
-    DecompressChunk(&ChunkStream, ChunkCache, ChunkAddress, Log2Ceil(Idx2.BricksPerChunks[Iter])); // TODO: check for error
-//    PushBack(&D->RequestedChunks, t2<u64, u64>{ChunkAddress, FileId.Id});
-  }
-  return ChunkCacheIt.Val;
-}
-
-/* decode the subband of a brick */
-// TODO: we can detect the precision and switch to the avx2 version that uses float for better
-// performance
+    bitstream ChunkStream;
+    if (!M->MapFiles)
+      InitWrite(&ChunkStream, ChunkSize, M->CacheAlloc); // NOTE: not a memory leak since we will keep track of this in ChunkCache
+    ChunkCache->Loading = true;
+    Unlock(&M->Mutex);
+    auto ReadOk = LoadChunk(Idx2, D, FileId, ChunkOffset, ChunkSize, ChunkAddress, Iter, &ChunkStream);
+    Lock(&M->Mutex);
+    ChunkCache->Loading = false;
+    NotifyAll(&M->Loaded);
+    if (!ReadOk) {
+      if (!M->MapFiles)
+        M->CacheAlloc->Dealloc(&ChunkStream.Stream);
+      return ReadOk;
+    }
+    Clone(D->ChunkBricks, &ChunkCache->Bricks);
+    Clone(D->ChunkBrickSzs, &ChunkCache->BrickSzs);
+    ChunkCache->ChunkStream = ChunkStream;
+    Pin(D, cached_chunk{ChunkCache, nullptr});
+    AddToCache(D, cached_chunk{ChunkCache, nullptr});
+  } else {
+    Pin(D, cached_chunk{ChunkCache, nullptr});
+  }
+  return ChunkCache;
+}
+
+static idx2_Inline u64
+GetSubbandKey(i8 Iter, u64 Brick, i8 Level) { return (GetBrickKey(Iter, Brick) << 3) + Level; }
+
+/* Return the block states of a subband (created if they do not exist) */
+static subband_state
+GetSubbandState(decode_data* D, u64 Brick, i8 Iter, i8 Level, int NBlocks) {
+  lock StateLock(&D->Main->Mutex);
+  u64 Key = GetSubbandKey(Iter, Brick, Level);
+  auto StateIt = Lookup(&D->Main->BlockStates, Key);
+  if (!StateIt) {
+    subband_state State;
+    Resize(&State.Blocks, NBlocks);
+    Fill(idx2_Range(State.Blocks), block_state());
+    Insert(&StateIt, Key, State);
+  }
+  return *StateIt.Val; // a copy of the same blocks, which stay in place even if BlockStates grows
+}
+
+/* Return the lowest bit plane in the block states of a subband (or the max i16 if there is no state) */
+static i16
+GetLowestBitPlane(decode_data* D, u64 Brick, i8 Iter, i8 Level) {
+  lock StateLock(&D->Main->Mutex);
+  auto StateIt = Lookup(&D->Main->BlockStates, GetSubbandKey(Iter, Brick, Level));
+  return StateIt ? StateIt.Val->LowestBp : traits<i16>::Max;
+}
+
+static void
+SetLowestBitPlane(decode_data* D, u64 Brick, i8 Iter, i8 Level, i16 LowestBp) {
+  lock StateLock(&D->Main->Mutex);
+  auto StateIt = Lookup(&D->Main->BlockStates, GetSubbandKey(Iter, Brick, Level));
+  idx2_Assert(StateIt);
+  StateIt.Val->LowestBp = Min(StateIt.Val->LowestBp, LowestBp);
+}
+
+/* decode the subband of a brick (whose samples are of type t) */
 // TODO: if a block does not decode any bit plane, no need to copy data afterwards
-static error<idx2_file_err_code>
+idx2_T(t) static error<idx2_file_err_code>
 DecodeSubband(const idx2_file& Idx2, decode_data* D, f64 Accuracy, const grid& SbGrid, volume* BVol) {
+  idx2_CleanUp(UnpinAll(D)); // the chunks read for this subband can be evicted once it is decoded
   u64 Brick = D->Brick[D->Iter];
   v3i SbDims3 = Dims(SbGrid);
   v3i NBlocks3 = (SbDims3 + Idx2.BlockDims3 - 1) / Idx2.BlockDims3;
@@ -42741,36 +45355,80 @@ DecodeSubband(const idx2_file& Idx2, decode_data* D, f64 Accuracy, const grid& S
   SeekToByte(&BrickExpsStream, BrickExpOffset);
   u32 LastBlock = EncodeMorton3(v3<u32>(NBlocks3 - 1));
   const i8 NBitPlanes = idx2_BitSizeOf(u64);
+  /* continue from the bit planes decoded by earlier decodes, if their states are kept */
+  block_state* States = nullptr;
+  if (D->Main->KeepBlockStates)
+    States = Begin(GetSubbandState(D, Brick, D->Iter, D->Level, Prod(NBlocks3)).Blocks);
+  int BlockIdx = 0;
   /* gather the streams (for the different bit planes) */
+  const i16 BpBase = i16(Exponent(Accuracy) + NBitPlanes - 7); // the lowest bit plane decoded (see the bit plane loop)
+  /* the distances between neighboring samples of the subband in the brick */
+  v3i BrickDims3 = Dims(*BVol), SbFrom3 = From(SbGrid), SbStrd3 = Strd(SbGrid);
+  v3<i64> SampleStrd3(SbStrd3.X, i64(SbStrd3.Y) * BrickDims3.X, i64(SbStrd3.Z) * BrickDims3.X * BrickDims3.Y);
+  i64 DataMovementTime = 0; // added to DataMovementTime_ once per subband
+  /* the full blocks with bit planes are inverse transformed Zfp.BatchSize at a time */
+  u64 BatchUInts[ZfpMaxBatchSize * 64] = {};
+  i64 BatchInts[ZfpMaxBatchSize * 64];
+  i16 BatchEMaxes[ZfpMaxBatchSize];
+  v3i BatchD3s[ZfpMaxBatchSize];
+  int NBatch = 0;
+  auto DecodeBatch = [&]() {
+    if (NBatch == 0) return;
+    Zfp.InverseZfpBatch(BatchUInts, BatchInts);
+    const int Prec = NBitPlanes - 1 - 3;
+    idx2_For(int, I, 0, NBatch) {
+      f64 BlockFloats[4 * 4 * 4]; // dequantized in f64 whatever the type of the brick
+      buffer_t BufFloats(BlockFloats, 64);
+      buffer_t BufInts(&BatchInts[I * 64], 64);
+      Dequantize(BatchEMaxes[I], Prec, BufInts, &BufFloats);
+      timer DataTimer;
+      StartTimer(&DataTimer);
+      ScatterBlock(BlockFloats, SampleStrd3, &BVol->At<t>(SbFrom3, SbStrd3, BatchD3s[I]));
+      DataMovementTime += ElapsedTime(&DataTimer);
+    }
+    NBatch = 0;
+  };
   auto& Streams = D->Streams;
-  Clear(&Streams);
+  idx2_ForEach(SlotIt, D->StreamSlots) Streams[*SlotIt] = bitstream();
+  Clear(&D->StreamSlots);
   idx2_InclusiveFor(u32, Block, 0, LastBlock) { // zfp block loop
     v3i Z3(DecodeMorton3(Block));
     idx2_NextMorton(Block, Z3, NBlocks3);
+    block_state* State = States ? &States[BlockIdx++] : nullptr;
     v3i D3 = Z3 * Idx2.BlockDims3;
     v3i BlockDims3 = Min(Idx2.BlockDims3, SbDims3 - D3);
     const int NDims = NumDims(BlockDims3);
     const int NVals = 1 << (2 * NDims);
     const int Prec = NBitPlanes - 1 - NDims;
-    f64 BlockFloats[4 * 4 * 4];
-    buffer_t BufFloats(BlockFloats, NVals);
-    buffer_t BufInts((i64*)BlockFloats, NVals);
-    u64 BlockUInts [4 * 4 * 4] = {}; buffer_t BufUInts (BlockUInts , Prod(BlockDims3));
     bool CodedInNextIter = D->Level == 0 && D->Iter + 1 < Idx2.NLevels && BlockDims3 == Idx2.BlockDims3;
     if (CodedInNextIter) continue;
+    bool FullBlock = BlockDims3 == v3i(4);
+    u64 PartialUInts[4 * 4 * 4];
+    u64* BlockUInts = FullBlock ? &BatchUInts[NBatch * 64] : PartialUInts; // decoded into the batch directly
+    memset(BlockUInts, 0, sizeof(PartialUInts));
     i16 EMax = SizeOf(Idx2.DType) > 4 ? (i16)Read(&BrickExpsStream, 16) - traits<f64>::ExpBias
                                     : (i16)Read(&BrickExpsStream, traits<f32>::ExpBits) - traits<f32>::ExpBias;
     i8 N = 0;
     i8 EndBitPlane = Min(i8(BitSizeOf(Idx2.DType) + (24 + NDims)), NBitPlanes);
     int NBitPlanesDecoded = Exponent(Accuracy) - 6 - EMax + 1;
     i8 NBps = 0;
-    idx2_InclusiveForBackward(i8, Bp, NBitPlanes - 1, NBitPlanes - EndBitPlane) { // bit plane loop
+    i8 NBpsBefore = State ? State->NBps : 0; // the bit planes decoded by earlier decodes
+    if (NBpsBefore > 0) {
+      memcpy(BlockUInts, State->UInts, sizeof(PartialUInts));
+      N = State->N;
+    }
+    /* decoding bit plane by bit plane and then transposing is faster when there are many bit planes,
+    but the new bit planes of a block that has a state are added to the coefficients directly */
+    bool Transpose = NBitPlanesDecoded > 8 && NBpsBefore == 0;
+    idx2_InclusiveForBackward(i8, Bp, NBitPlanes - 1 - NBpsBefore, NBitPlanes - EndBitPlane) { // bit plane loop
       i16 RealBp = Bp + EMax;
       if (NBitPlanes - 6 > RealBp - Exponent(Accuracy) + 1) break;
       if (RealBp < MinBitPlane) break;
-      auto StreamIt = Lookup(&Streams, RealBp);
-      bitstream* Stream = nullptr;
-      if (!StreamIt) { // first block in the brick
+      i32 Slot = RealBp - BpBase;
+      if (Slot >= Size(Streams))
+        Resize(&Streams, Slot + 1);
+      bitstream* Stream = &Streams[Slot];
+      if (!Stream->Stream.Data) { // first block in the brick
         auto ReadChunkResult = ReadChunk(Idx2, D, Brick, D->Iter, D->Level, RealBp);
         if (!ReadChunkResult) { idx2_Assert(false); return Error(ReadChunkResult); }
         const chunk_cache* ChunkCache = Value(ReadChunkResult);
@@ -42781,72 +45439,119 @@ DecodeSubband(const idx2_file& Idx2, decode_data* D, f64 Accuracy, const grid& S
         idx2_Assert(BrickInChunk < Size(ChunkCache->BrickSzs));
         i64 BrickOffset = BrickInChunk == 0 ? 0 : ChunkCache->BrickSzs[BrickInChunk - 1];
         BrickOffset += Size(ChunkCache->ChunkStream);
-        Insert(&StreamIt, RealBp, ChunkCache->ChunkStream);
-        Stream = StreamIt.Val;
+        *Stream = ChunkCache->ChunkStream;
+        PushBack(&D->StreamSlots, Slot);
         SeekToByte(Stream, BrickOffset);
-      } else {
-        Stream = StreamIt.Val;
       }
       /* zfp decode */
       ++NBps;
 //      timer Timer; StartTimer(&Timer);
-      if (NBitPlanesDecoded <= 8)
-        Decode(BlockUInts, NVals, Bp, N, Stream);
+      if (!Transpose)
+        Zfp.Decode(BlockUInts, NVals, Bp, N, Stream);
       else
-        DecodeTest(&BlockUInts[NBitPlanes - 1 - Bp], NVals, N, Stream);
+        Zfp.DecodeTest(&BlockUInts[NBitPlanes - 1 - Bp], NVals, N, Stream);
 //      DecodeTime_ += Seconds(ElapsedTime(&Timer));
     } // end bit plane loop
-    if (NBitPlanesDecoded > 8) {
+    if (Transpose) {
 //      timer Timer; StartTimer(&Timer);
-      TransposeRecursive(BlockUInts, NBps);
+      Zfp.TransposeRecursive(BlockUInts, NBps);
 //      DecodeTime_ += Seconds(ElapsedTime(&Timer));
     }
-    if (NBps > 0) {
-      InverseShuffle(BlockUInts, (i64*)BlockFloats, NDims);
-      InverseZfp((i64*)BlockFloats, NDims);
+    if (State) {
+      memcpy(State->UInts, BlockUInts, sizeof(PartialUInts));
+      State->N = N;
+      State->NBps = NBpsBefore + NBps;
+    }
+    if (NBpsBefore + NBps == 0) continue;
+    if (FullBlock) {
+      BatchEMaxes[NBatch] = EMax;
+      BatchD3s[NBatch] = D3;
+      if (++NBatch == Zfp.BatchSize) DecodeBatch();
+    } else { // partial block
+      f64 BlockFloats[4 * 4 * 4];
+      i64 BlockInts[4 * 4 * 4];
+      buffer_t BufFloats(BlockFloats, NVals);
+      buffer_t BufInts(BlockInts, NVals);
+      Zfp.InverseShuffle(BlockUInts, BlockInts, NDims);
+      Zfp.InverseZfp(BlockInts, NDims);
       Dequantize(EMax, Prec, BufInts, &BufFloats);
-      v3i S3;
-      int J = 0;
-      v3i From3 = From(SbGrid), Strd3 = Strd(SbGrid);
       timer DataTimer;
       StartTimer(&DataTimer);
+      v3i S3;
+      int J = 0;
       idx2_BeginFor3(S3, v3i(0), BlockDims3, v3i(1)) { // sample loop
         idx2_Assert(D3 + S3 < SbDims3);
-        BVol->At<f64>(From3, Strd3, D3 + S3) = BlockFloats[J++];
+        BVol->At<t>(SbFrom3, SbStrd3, D3 + S3) = t(BlockFloats[J++]);
       } idx2_EndFor3 // end sample loop
-      DataMovementTime_ += ElapsedTime(&DataTimer);
+      DataMovementTime += ElapsedTime(&DataTimer);
     }
   }
+  DecodeBatch();
+  DataMovementTime_ += DataMovementTime;
+  if (States) // the bit planes that the blocks stop at (independent of the block exponents)
+    SetLowestBitPlane(D, Brick, D->Iter, D->Level, (i16)Max(NBitPlanes - 7 + Exponent(Accuracy), MinBitPlane));
   return idx2_Error(idx2_file_err_code::NoError);
 }
 
+/* Return the mask of the subbands to decode given the mask of the requested subbands */
+static u8
+GetDecodeSubbandMask(u8 Mask) {
+  // TODO: test this logic
+  u8 DecodeSbMask = Mask; // TODO: need change if we support more than one transform pass per brick
+  idx2_For(u8, Sb, 0, 8) {
+    if (!BitSet(Mask, Sb)) continue;
+    idx2_For(u8, S, 0, 8) if ((Sb | S) <= Sb) DecodeSbMask = SetBit(DecodeSbMask, S);
+  } // end subband loop
+  return DecodeSbMask;
+}
+
+/* Where DecodeBrick puts a brick of the output level: the samples in SGrid of the brick go to DGrid of
+Vol, after the inverse lifting passes in Passes (see GetOutputLiftPasses) */
+struct brick_output {
+  const array<lift_pass>* Passes = nullptr;
+  grid SGrid;
+  grid DGrid;
+  volume* Vol = nullptr;
+};
+
+/* The inverse lifting passes of a brick of the output level, whose samples are output on the grid of
+OutMask (see GetGrid). Along an axis where no subband of OutMask is high, the output skips the odd
+samples, and the coefficients there are all zeros, so the inverse lifting along that axis leaves the
+even samples as they are: the passes along that axis are dropped, and the other passes are only done
+on the even samples of that axis. */
 static void
-DecodeBrick(const idx2_file& Idx2, const params& P, decode_data* D, u8 Mask, f64 Accuracy) {
+GetOutputLiftPasses(const idx2_file& Idx2, u8 OutMask, array<lift_pass>* Passes) {
+  const transform_details& Td = Idx2.Td;
+  v3i M3 = Idx2.BrickDimsExt3;
+  PushInversePasses(Td, M3, Passes);
+  if (Td.NPasses != 1) // GetGrid assumes one transform pass per level
+    return;
+  v3i Div = GetHighAxes(OutMask, Idx2.Subbands);
+  i64 N = 0;
+  idx2_ForEach(PassIt, *Passes) {
+    if (Div[PassIt->Axis] == 0) continue;
+    lift_pass L = *PassIt;
+    v3i D3 = Dims(L.Grid), S3 = Strd(L.Grid);
+    idx2_For(int, D, 0, 3) if (Div[D] == 0) { D3[D] = (D3[D] + 1) >> 1; S3[D] <<= 1; }
+    SetDims(&L.Grid, D3);
+    SetStrd(&L.Grid, S3);
+    (*Passes)[N++] = L;
+  }
+  Resize(Passes, N);
+}
+
+idx2_T(t) static error<idx2_file_err_code>
+DecodeBrick(const idx2_file& Idx2, const params& P, decode_data* D, u8 Mask, f64 Accuracy, volume* BrickVol, const brick_output* Out = nullptr) {
+  error<idx2_file_err_code> Result = idx2_Error(idx2_file_err_code::NoError);
   i8 Iter = D->Iter;
   u64 Brick = D->Brick[Iter];
-//  if ((Brick >> Idx2.BricksPerChunks[Iter]) != D->LastTile) {
-//    idx2_ForEach(It, D->RequestedChunks) {
-//      auto& FileCache = D->FcTable.FileCaches[It->Second];
-//      auto ChunkCacheIt = Lookup(&FileCache.ChunkCaches, It->First);
-//      Dealloc(ChunkCacheIt.Val);
-//      Delete(&FileCache.ChunkCaches, It->First); // TODO: write a delete that works on iterator
-//    }
-//    Clear(&D->RequestedChunks);
-//    D->LastTile = Brick >> Idx2.BricksPerChunks[Iter];
-//  }
 //  printf("level %d brick " idx2_PrStrV3i " %llu\n", Iter, idx2_PrV3i(D->Bricks3[Iter]), Brick);
-  auto BrickIt = Lookup(&D->BrickPool, GetBrickKey(Iter, Brick));
-  idx2_Assert(BrickIt);
-  volume& BVol = BrickIt.Val->Vol;
+  (void)Brick;
+  volume& BVol = *BrickVol;
 
   /* construct a list of subbands to decode */
-  // TODO: test this logic
   idx2_Assert(Size(Idx2.Subbands) <= 8);
-  u8 DecodeSbMask = Mask; // TODO: need change if we support more than one transform pass per brick
-  idx2_For(u8, Sb, 0, 8) {
-    if (!BitSet(Mask, Sb)) continue;
-    idx2_For(u8, S, 0, 8) if ((Sb | S) <= Sb) DecodeSbMask = SetBit(DecodeSbMask, S);
-  } // end subband loop
+  u8 DecodeSbMask = GetDecodeSubbandMask(Mask);
 
   /* recursively decode the brick, one subband at a time */
   idx2_Assert(Size(Idx2.Subbands) == 8);
@@ -42861,47 +45566,308 @@ DecodeBrick(const idx2_file& Idx2, const params& P, decode_data* D, u8 Mask, f64
       v3i PBrick3 = (D->Bricks3[NextIter] = Brick3 / Idx2.GroupBrick3);
       u64 PBrick = (D->Brick[NextIter] = GetLinearBrick(Idx2, NextIter, PBrick3));
       u64 PKey = GetBrickKey(NextIter, PBrick);
-      auto PbIt = Lookup(&D->BrickPool, PKey);
-      idx2_Assert(PbIt);
       // TODO: problem: here we will need access to D->LinearChunkInFile/D->LinearBrickInChunk for
       // the parent, which won't be computed correctly by the outside code, so for now we have to
       // stick to decoding from higher level down
-      /* copy data from the parent's to my buffer */
-      if (PbIt.Val->NChildren == 0) {
-        v3i From3 = (Brick3 / Idx2.GroupBrick3) * Idx2.GroupBrick3;
-        v3i NChildren3 = Dims(Crop(extent(From3, Idx2.GroupBrick3), extent(Idx2.NBricks3s[Iter])));
-        PbIt.Val->NChildrenMax = (i8)Prod(NChildren3);
+      /* the parent is complete since a level is only decoded after the coarser level is done */
+      brick_volume* PBVol = nullptr;
+      {
+        lock PoolLock(&D->Main->Mutex);
+        auto PbIt = Lookup(&D->Main->BrickPool, PKey);
+        idx2_Assert(PbIt);
+        PBVol = PbIt.Val;
+        if (PBVol->NChildrenMax == 0) {
+          v3i From3 = (Brick3 / Idx2.GroupBrick3) * Idx2.GroupBrick3;
+          v3i NChildren3 = Dims(Crop(extent(From3, Idx2.GroupBrick3), extent(Idx2.NBricks3s[Iter])));
+          PBVol->NChildrenMax = (i8)Prod(NChildren3);
+        }
       }
-      ++PbIt.Val->NChildren;
+      /* copy data from the parent's to my buffer */
       v3i LocalBrickPos3 = Brick3 % Idx2.GroupBrick3;
       grid SbGridNonExt = S.Grid; SetDims(&SbGridNonExt, SbDimsNonExt3);
       extent ToGrid(LocalBrickPos3 * SbDimsNonExt3, SbDimsNonExt3);
-      CopyExtentGrid<f64, f64>(ToGrid, PbIt.Val->Vol, SbGridNonExt, &BVol);
-      if (PbIt.Val->NChildren == PbIt.Val->NChildrenMax) { // last child
-        Dealloc(&PbIt.Val->Vol);
-        Delete(&D->BrickPool, PKey);
+      CopyExtentGrid<t, t>(ToGrid, PBVol->Vol, SbGridNonExt, &BVol);
+      /* count the child only after the copy, so that the parent outlives concurrent siblings */
+      lock PoolLock(&D->Main->Mutex);
+      if (++PBVol->NChildren == PBVol->NChildrenMax) { // last child
+        Dealloc(&PBVol->Vol);
+        Delete(&D->Main->BrickPool, PKey);
       }
     }
     D->Level = Sb;
     if (Sb == 0 || Iter >= D->EffIter) { // NOTE: the check for Sb == 0 prevents the output volume from having blocking artifacts
-      if      (Idx2.Version == v2i(0, 0)) DecodeSubbandV0_0(Idx2, D, S.Grid, &BVol);
-      else if (Idx2.Version == v2i(0, 1)) DecodeSubbandV0_1(Idx2, D, S.Grid, &BVol);
-      else if (Idx2.Version == v2i(1, 0)) DecodeSubband(Idx2, D, Accuracy, S.Grid, &BVol);
+      error<idx2_file_err_code> SbResult = idx2_Error(idx2_file_err_code::NoError);
+      if      (Idx2.Version == v2i(0, 0)) SbResult = DecodeSubbandV0_0(Idx2, D, S.Grid, &BVol);
+      else if (Idx2.Version == v2i(0, 1)) SbResult = DecodeSubbandV0_1(Idx2, D, S.Grid, &BVol);
+      else if (Idx2.Version == v2i(1, 0)) SbResult = DecodeSubband<t>(Idx2, D, Accuracy, S.Grid, &BVol);
+      if (!SbResult && Result) // keep the first error, the other subbands (and the parent bookkeeping) still go on
+        Result = SbResult;
     }
   } // end subband loop
-  // TODO: inverse transform only to the necessary level
-  if (!P.WaveletOnly) {
-//    printf("inverting\n");
-    if (Iter + 1 < Idx2.NLevels)
-      InverseCdf53(Idx2.BrickDimsExt3, D->Iter, Idx2.Subbands, Idx2.Td, &BVol, false);
-    else
-      InverseCdf53(Idx2.BrickDimsExt3, D->Iter, Idx2.Subbands, Idx2.Td, &BVol, true);
+  if (P.WaveletOnly) {
+    if (Out)
+      CopyGridGrid(Out->SGrid, BVol, Out->DGrid, Out->Vol);
+    return Result;
   }
+  bool LastIter = Iter + 1 >= Idx2.NLevels;
+  if (Out) { // the last pass writes to the output
+    DenormalizeCdf53(Idx2.BrickDimsExt3, D->Iter, Idx2.Subbands, Idx2.Td, &BVol, LastIter, DecodeSbMask);
+    LiftCdf53(*Out->Passes, &BVol, Out->SGrid, Out->DGrid, Out->Vol);
+  } else {
+    InverseCdf53(Idx2.BrickDimsExt3, D->Iter, Idx2.Subbands, Idx2.Td, &BVol, LastIter);
+  }
+  return Result;
 }
 
-/* TODO: dealloc chunks after we are done with them */
-void
-Decode(const idx2_file& Idx2, const params& P, buffer* OutBuf) {
+/* A brick recorded by the traversal of a level, to be decoded later (possibly on another thread) */
+struct brick_task {
+  v3i Brick3;
+  u64 Brick = 0;
+  i32 ChunkInFile = 0;
+  i32 BrickInChunk = 0;
+};
+
+/* Call Visit on each brick of level Iter that intersects the extent Ext (in samples), in the order
+the bricks are stored (file by file, chunk by chunk) */
+idx2_T(visitor) static void
+TraverseBricks(const idx2_file& Idx2, const extent& Ext, i8 Iter, const visitor& Visit) {
+  v3i BrickDims3 = Idx2.BrickDims3 * Pow(Idx2.GroupBrick3, Iter);
+  v3i BrickFirst3 = From(Ext) / BrickDims3;
+  v3i BrickLast3 = Last(Ext) / BrickDims3;
+  extent ExtentInBricks(BrickFirst3, BrickLast3 - BrickFirst3 + 1);
+  v3i ChunkDims3 = Idx2.BricksPerChunk3s[Iter] * BrickDims3;
+  v3i ChunkFirst3 = From(Ext) / ChunkDims3;
+  v3i ChunkLast3 = Last(Ext) /  ChunkDims3;
+  extent ExtentInChunks(ChunkFirst3, ChunkLast3 - ChunkFirst3 + 1);
+  v3i FileDims3 = ChunkDims3 * Idx2.ChunksPerFile3s[Iter];
+  v3i FileFirst3 = From(Ext) / FileDims3;
+  v3i FileLast3 = Last(Ext) / FileDims3;
+  extent ExtentInFiles(FileFirst3, FileLast3 - FileFirst3 + 1);
+  extent VolExt(Idx2.Dims3);
+  v3i VolBrickFirst3 = From(VolExt) / BrickDims3;
+  v3i VolBrickLast3 = Last(VolExt)  / BrickDims3;
+  extent VolExtentInBricks(VolBrickFirst3, VolBrickLast3 - VolBrickFirst3 + 1);
+  v3i VolChunkFirst3 = From(VolExt) / ChunkDims3;
+  v3i VolChunkLast3 = Last(VolExt) / ChunkDims3;
+  extent VolExtentInChunks(VolChunkFirst3, VolChunkLast3 - VolChunkFirst3 + 1);
+  v3i VolFileFirst3 = From(VolExt) / FileDims3;
+  v3i VolFileLast3 = Last(VolExt) / FileDims3;
+  extent VolExtentInFiles(VolFileFirst3, VolFileLast3 - VolFileFirst3 + 1);
+  idx2_FileTraverse(
+//      u64 FileAddr = FileTop.Address;
+//      idx2_Assert(FileAddr == GetLinearFile(Idx2, Iter, FileTop.FileFrom3));
+    idx2_ChunkTraverse(
+//        u64 ChunkAddr = (FileAddr * Idx2.ChunksPerFiles[Iter]) + ChunkTop.Address;
+//        idx2_Assert(ChunkAddr == GetLinearChunk(Idx2, Iter, ChunkTop.ChunkFrom3));
+      idx2_BrickTraverse(
+//          u64 BrickAddr = (ChunkAddr * Idx2.BricksPerChunks[Iter]) + Top.Address;
+//          idx2_Assert(BrickAddr == GetLinearBrick(Idx2, Iter, Top.BrickFrom3));
+        brick_task Task;
+        Task.Brick3 = Top.BrickFrom3;
+        Task.Brick = GetLinearBrick(Idx2, Iter, Top.BrickFrom3);
+        Task.ChunkInFile = ChunkTop.ChunkInFile;
+        Task.BrickInChunk = Top.BrickInChunk;
+        Visit(Task);
+        , 64
+        , Idx2.BrickOrderChunks[Iter]
+        , ChunkTop.ChunkFrom3 * Idx2.BricksPerChunk3s[Iter]
+        , Idx2.BricksPerChunk3s[Iter]
+        , ExtentInBricks
+        , VolExtentInBricks
+      );
+      , 64
+      , Idx2.ChunkOrderFiles[Iter]
+      , FileTop.FileFrom3 * Idx2.ChunksPerFile3s[Iter]
+      , Idx2.ChunksPerFile3s[Iter]
+      , ExtentInChunks
+      , VolExtentInChunks
+    );
+    , 64
+    , Idx2.FileOrders[Iter]
+    , v3i(0)
+    , Idx2.NFiles3s[Iter]
+    , ExtentInFiles
+    , VolExtentInFiles
+  );
+}
+
+/* A (file, chunk) pair needed by a brick, the chunk address is without the bit plane */
+struct planned_file_chunk {
+  u64 FileAddr = 0;
+  u64 ChunkAddr = 0;
+  u64 Brick = 0;
+  i8 Level = 0;
+  i16 LowestBp = traits<i16>::Max; // the bit planes >= LowestBp are in the block states of the brick
+  bool operator<(const planned_file_chunk& Other) const {
+    return FileAddr < Other.FileAddr || (FileAddr == Other.FileAddr && ChunkAddr < Other.ChunkAddr);
+  }
+};
+
+/* A chunk to read from a file */
+struct planned_read {
+  i64 Offset = 0;
+  i64 Bytes = 0;
+  u64 ChunkAddr = 0;
+  chunk_cache* ChunkCache = nullptr;
+};
+
+/*
+Read, before the bricks Tasks[First, Last) of level Iter are decoded, the exponent chunks and the
+chunks they will need. The chunks of each file are sorted by offset and chunks at most MaxGap bytes
+apart are read with one read, instead of one small read per chunk the first time a bit plane is
+decoded. Only files that group bit planes are planned (otherwise which bit plane files exist is not
+known beforehand). The rdo truncation points are not applied, so a few chunks may be read that are
+not decoded. The chunks are claimed (Loading) and the cache lock is not held while reading, so this
+can run on a prefetch thread while other threads decode (and wait for the chunks they need).
+With MaxBytes > 0, the chunks that would take the bytes read past MaxBytes are left out (and false
+is returned); NBytes is set to the bytes of the chunks read. */
+static bool
+ReadChunksAhead(const idx2_file& Idx2, const params& P, decode_data* D, i8 Iter, f64 Accuracy, const array<brick_task>& Tasks, i64 First, i64 Last, i64 MaxBytes = 0, i64* NBytes = nullptr) {
+  i64 PlannedBytes = 0;
+  bool Fits = true;
+  idx2_CleanUp(if (NBytes) *NBytes = PlannedBytes);
+  if (Idx2.Version != v2i(1, 0))
+    return Fits;
+  const i64 MaxGap = 64 * 1024;
+  const i64 MaxReadBytes = 16 * 1024 * 1024;
+  const i8 NBitPlanes = idx2_BitSizeOf(u64);
+  decode_data* M = D->Main;
+  u8 Mask = Iter == P.DecodeLevel ? P.DecodeMask : (Iter < P.DecodeLevel ? 0x1 : 0xFF);
+  u8 DecodeSbMask = GetDecodeSubbandMask(Mask);
+
+  /* read the exponent chunks, and collect the chunks (without their bit planes) needed by the bricks */
+  idx2_RAII(array<planned_file_chunk>, FileChunks, Reserve(&FileChunks, (Last - First) * 8));
+  idx2_For(i64, T, First, Last) {
+    const brick_task& Task = Tasks[T];
+    D->ChunkInFile = Task.ChunkInFile;
+    idx2_For(i8, Sb, 0, (i8)Size(Idx2.Subbands)) {
+      if (!BitSet(DecodeSbMask, Sb) || !(Sb == 0 || Iter >= M->EffIter)) continue;
+      ReadChunkExponents(Idx2, D, Task.Brick, Iter, Sb); // an error is reported when the brick is decoded
+      planned_file_chunk Fc;
+      Fc.FileAddr = GetFileAddress(Idx2, Task.Brick, Iter, Sb, 0);
+      Fc.ChunkAddr = GetChunkAddress(Idx2, Task.Brick, Iter, Sb, 0);
+      Fc.Brick = Task.Brick;
+      Fc.Level = Sb;
+      if (M->KeepBlockStates)
+        Fc.LowestBp = GetLowestBitPlane(D, Task.Brick, Iter, Sb);
+      PushBack(&FileChunks, Fc);
+    }
+  }
+  UnpinAll(D);
+  if (!Idx2.GroupBitPlanes || M->MapFiles)
+    return Fits;
+  std::sort(Begin(FileChunks), End(FileChunks));
+
+  idx2_RAII(array<u64>, ChunkAddrs, Reserve(&ChunkAddrs, 64));
+  idx2_RAII(array<i16>, ChunkLowestBps, Reserve(&ChunkLowestBps, 64));
+  idx2_RAII(array<planned_read>, Reads, Reserve(&Reads, 64));
+  idx2_RAII(buffer, ReadBuf, , if (ReadBuf.Data) DeallocBuf(&ReadBuf));
+  for (i64 I = 0; I < Size(FileChunks);) {
+    /* the chunks needed from this file */
+    i64 J = I;
+    Clear(&ChunkAddrs);
+    Clear(&ChunkLowestBps);
+    for (; J < Size(FileChunks) && FileChunks[J].FileAddr == FileChunks[I].FileAddr; ++J) {
+      if (Size(ChunkAddrs) == 0 || Back(ChunkAddrs) != FileChunks[J].ChunkAddr) {
+        PushBack(&ChunkAddrs, FileChunks[J].ChunkAddr);
+        PushBack(&ChunkLowestBps, FileChunks[J].LowestBp);
+      } else { // a bit plane is needed if a brick of the chunk does not have it in its state
+        Back(ChunkLowestBps) = Max(Back(ChunkLowestBps), FileChunks[J].LowestBp);
+      }
+    }
+    file_id FileId = ConstructFilePath(Idx2, FileChunks[I].Brick, Iter, FileChunks[I].Level, 0);
+    I = J;
+
+    /* find the chunks of the file that are needed and not in memory */
+    Clear(&Reads);
+    {
+      lock CacheLock(&M->Mutex);
+      hash_table<u64, file_cache>::iterator FileCacheIt;
+      if (!ReadFile(D, &FileCacheIt, FileId))
+        continue; // the error is reported when the brick is decoded
+      if (!FileCacheIt)
+        continue;
+      file_cache* FileCache = FileCacheIt.Val;
+      idx2_ForEach(ChunkCacheIt, FileCache->ChunkCaches) {
+        u64 ChunkAddr = *ChunkCacheIt.Key;
+        auto AddrIt = BinarySearch(idx2_Range(ChunkAddrs), ChunkAddr & ~u64(0xFFF));
+        if (AddrIt == End(ChunkAddrs) || *AddrIt != (ChunkAddr & ~u64(0xFFF))) continue;
+        i16 RealBp = i16(ChunkAddr & 0xFFF);
+        if (RealBp >= 0x800) RealBp -= 0x1000; // the bit plane is stored as a 12-bit signed integer
+        if (NBitPlanes - 6 > RealBp - Exponent(Accuracy) + 1) continue; // same test as in DecodeSubband
+        if (RealBp >= ChunkLowestBps[AddrIt - Begin(ChunkAddrs)]) continue; // already decoded
+        chunk_cache* ChunkCache = ChunkCacheIt.Val; // stays at the same address even if FcTable grows
+        if (ChunkCache->Loading || Size(ChunkCache->ChunkStream.Stream) > 0) continue;
+        i32 ChunkPos = ChunkCache->ChunkPos;
+        planned_read Read;
+        Read.Offset = ChunkPos > 0 ? FileCache->ChunkSizes[ChunkPos - 1] : 0;
+        Read.Bytes = FileCache->ChunkSizes[ChunkPos] - Read.Offset;
+        Read.ChunkAddr = ChunkAddr;
+        Read.ChunkCache = ChunkCache;
+        if (MaxBytes > 0 && PlannedBytes + Read.Bytes > MaxBytes) {
+          Fits = false;
+          continue;
+        }
+        PlannedBytes += Read.Bytes;
+        ChunkCache->Loading = true; // decoding threads that need the chunk wait for it
+        PushBack(&Reads, Read);
+      }
+    }
+    if (Size(Reads) == 0) continue;
+    std::sort(Begin(Reads), End(Reads), [](const planned_read& A, const planned_read& B) { return A.Offset < B.Offset; });
+
+    /* merge nearby chunks into large reads */
+    read_file F;
+    if (!Open(D, FileId, &F)) { // the chunks are read again (and the error reported) when they are decoded
+      lock CacheLock(&M->Mutex);
+      idx2_ForEach(ReadIt, Reads) ReadIt->ChunkCache->Loading = false;
+      NotifyAll(&M->Loaded);
+      continue;
+    }
+    for (i64 K = 0; K < Size(Reads);) {
+      i64 L = K + 1;
+      i64 ReadFrom = Reads[K].Offset, ReadTo = ReadFrom + Reads[K].Bytes;
+      while (L < Size(Reads) && Reads[L].Offset - ReadTo <= MaxGap && Reads[L].Offset + Reads[L].Bytes - ReadFrom <= MaxReadBytes) {
+        ReadTo = Reads[L].Offset + Reads[L].Bytes;
+        ++L;
+      }
+      timer IOTimer;
+      StartTimer(&IOTimer);
+      if (Size(ReadBuf) < ReadTo - ReadFrom) {
+        if (ReadBuf.Data) DeallocBuf(&ReadBuf);
+        AllocBuf(&ReadBuf, ReadTo - ReadFrom);
+      }
+      bool ReadOk = ReadAt(F.File, ReadFrom, ReadBuf.Data, ReadTo - ReadFrom);
+      AddIOTime(D, ElapsedTime(&IOTimer));
+      BytesData_ += ReadTo - ReadFrom;
+      /* the chunks are copied out of ReadBuf under the lock since they are allocated with M->CacheAlloc;
+      if the read failed, the chunks are read again (and the error reported) when they are decoded */
+      lock CacheLock(&M->Mutex);
+      ++M->NPlannedReads;
+      M->NPlannedReadBytes += ReadTo - ReadFrom;
+      for (; K < L; ++K) {
+        M->NPlannedBytes += Reads[K].Bytes;
+        ++M->NPlannedChunks;
+        chunk_cache* ChunkCache = Reads[K].ChunkCache;
+        ChunkCache->Loading = false;
+        if (!ReadOk) continue;
+        bitstream ChunkStream; InitWrite(&ChunkStream, Reads[K].Bytes, M->CacheAlloc);
+        memcpy(ChunkStream.Stream.Data, ReadBuf.Data + (Reads[K].Offset - ReadFrom), Reads[K].Bytes);
+        memset(ChunkStream.Stream.Data + Reads[K].Bytes, 0, Size(ChunkStream.Stream) - Reads[K].Bytes);
+        DecompressChunk(&ChunkStream, &ChunkCache->Bricks, &ChunkCache->BrickSzs, Reads[K].ChunkAddr, Log2Ceil(Idx2.BricksPerChunks[Iter]));
+        ChunkCache->ChunkStream = ChunkStream; // kept in the chunk cache
+        ChunkCache->LastUse = ++M->CacheClock; // about to be used, so not the first to be evicted
+        AddToCache(D, cached_chunk{ChunkCache, nullptr});
+      }
+      NotifyAll(&M->Loaded);
+    }
+    Close(D, &F);
+  }
+  return Fits;
+}
+
+error<idx2_file_err_code>
+Decode(const idx2_file& Idx2, const params& P, decode_data* D, buffer* OutBuf) {
   timer DecodeTimer; StartTimer(&DecodeTimer);
   // TODO: we should add a --effective-mask
   u8 OutMask = P.DecodeLevel == P.OutputLevel ? P.DecodeMask : 128;
@@ -42927,110 +45893,380 @@ Decode(const idx2_file& Idx2, const params& P, buffer* OutBuf) {
     SetDims(&OutVolMem, Dims(OutGrid));
     OutVolMem.Type = Idx2.DType;
   }
-  const int BrickBytes = Prod(Idx2.BrickDimsExt3) * sizeof(f64);
-  BrickAlloc_ = free_list_allocator(BrickBytes);
-  // TODO: move the decode_data into idx2_file itself
-  idx2_RAII(decode_data, D, Init(&D, &BrickAlloc_));
-//  D.QualityLevel = Dw->GetQuality();
-  D.EffIter = P.DecodeLevel; // effective level (levels smaller than this won't be decoded)
+  /* the caches in D may be warm from previous calls, the rest of the state is per call */
+  D->MapFiles = P.MapFiles;
+  D->MaxCacheBytes = P.CacheBytes;
+  D->FdCache.MaxOpenFiles = Max(P.MaxOpenFiles, 1);
+  D->KeepBlockStates = P.KeepBlockStates;
+//  D->QualityLevel = Dw->GetQuality();
+  D->EffIter = P.DecodeLevel; // effective level (levels smaller than this won't be decoded)
   f64 Accuracy = Max(Idx2.Accuracy, P.DecodeAccuracy);
+  dtype BrickType = GetDecodeBrickType(Idx2, P);
+  const i64 BrickBytes = Prod<i64>(Idx2.BrickDimsExt3) * SizeOf(BrickType);
+  if (D->BrickBlocks.BlockBytes == 0)
+    Init(&D->BrickBlocks, BrickBytes);
+  /* if D first decoded with float32 bricks, the float64 bricks do not fit in the blocks of the pool
+  and are allocated outside of it (see pool_allocator) */
+  idx2_Assert(2 * D->BrickBlocks.BlockBytes >= BrickBytes, "D is used with another field");
+  /* the bricks of a level are independent of one another, so they can be decoded in parallel, as
+  long as their parents (in the coarser level) are all decoded first */
+  int NThreads = Idx2.Version == v2i(1, 0) ? P.NThreads : 1; // v0.x decoders keep file offsets in D
+  const i64 MaxTasks = 4096; // the maximum number of bricks to record before decoding them
+  idx2_RAII(array<brick_task>, Tasks, Reserve(&Tasks, MaxTasks));
+  idx2_RAII(array<lift_pass>, OutPasses, GetOutputLiftPasses(Idx2, OutMask, &OutPasses));
+  volume* Out = P.OutMode == params::out_mode::WriteToFile ? &OutVol.Vol
+              : P.OutMode == params::out_mode::KeepInMemory ? &OutVolMem : nullptr;
+  error<idx2_file_err_code> Result = idx2_Error(idx2_file_err_code::NoError); // the first error of any brick
 //  i64 CountZeroes = 0;
   idx2_InclusiveForBackward(i8, Iter, Idx2.NLevels - 1, 0) {
     if (Iter < P.OutputLevel) break;
-    extent Ext = P.DecodeExtent; // this is in unit of samples
     v3i BrickDims3 = Idx2.BrickDims3 * Pow(Idx2.GroupBrick3, Iter);
-    v3i BrickFirst3 = From(Ext) / BrickDims3;
-    v3i BrickLast3 = Last(Ext) / BrickDims3;
-    extent ExtentInBricks(BrickFirst3, BrickLast3 - BrickFirst3 + 1);
-    v3i ChunkDims3 = Idx2.BricksPerChunk3s[Iter] * BrickDims3;
-    v3i ChunkFirst3 = From(Ext) / ChunkDims3;
-    v3i ChunkLast3 = Last(Ext) /  ChunkDims3;
-    extent ExtentInChunks(ChunkFirst3, ChunkLast3 - ChunkFirst3 + 1);
-    v3i FileDims3 = ChunkDims3 * Idx2.ChunksPerFile3s[Iter];
-    v3i FileFirst3 = From(Ext) / FileDims3;
-    v3i FileLast3 = Last(Ext) / FileDims3;
-    extent ExtentInFiles(FileFirst3, FileLast3 - FileFirst3 + 1);
-    extent VolExt(Idx2.Dims3);
-    v3i VolBrickFirst3 = From(VolExt) / BrickDims3;
-    v3i VolBrickLast3 = Last(VolExt)  / BrickDims3;
-    extent VolExtentInBricks(VolBrickFirst3, VolBrickLast3 - VolBrickFirst3 + 1);
-    v3i VolChunkFirst3 = From(VolExt) / ChunkDims3;
-    v3i VolChunkLast3 = Last(VolExt) / ChunkDims3;
-    extent VolExtentInChunks(VolChunkFirst3, VolChunkLast3 - VolChunkFirst3 + 1);
-    v3i VolFileFirst3 = From(VolExt) / FileDims3;
-    v3i VolFileLast3 = Last(VolExt) / FileDims3;
-    extent VolExtentInFiles(VolFileFirst3, VolFileLast3 - VolFileFirst3 + 1);
-    idx2_FileTraverse(
-//      u64 FileAddr = FileTop.Address;
-//      idx2_Assert(FileAddr == GetLinearFile(Idx2, Iter, FileTop.FileFrom3));
-      idx2_ChunkTraverse(
-//        u64 ChunkAddr = (FileAddr * Idx2.ChunksPerFiles[Iter]) + ChunkTop.Address;
-//        idx2_Assert(ChunkAddr == GetLinearChunk(Idx2, Iter, ChunkTop.ChunkFrom3));
-        D.ChunkInFile = ChunkTop.ChunkInFile;
-        idx2_BrickTraverse(
-          D.BrickInChunk = Top.BrickInChunk;
-//          u64 BrickAddr = (ChunkAddr * Idx2.BricksPerChunks[Iter]) + Top.Address;
-//          idx2_Assert(BrickAddr == GetLinearBrick(Idx2, Iter, Top.BrickFrom3));
-          brick_volume BVol;
-          Resize(&BVol.Vol, Idx2.BrickDimsExt3, dtype::float64, D.Alloc);
-          // TODO: for progressive decompression, copy the data from BrickTable to BrickVol
-          Fill(idx2_Range(f64, BVol.Vol), 0.0);
-          D.Iter = Iter;
-          D.Bricks3[Iter] = Top.BrickFrom3;
-          D.Brick[Iter] = GetLinearBrick(Idx2, Iter, Top.BrickFrom3);
-          u64 BrickKey = GetBrickKey(Iter, D.Brick[Iter]);
-          Insert(&D.BrickPool, BrickKey, BVol);
-          u8 Mask = Iter == P.DecodeLevel ? P.DecodeMask : (Iter < P.DecodeLevel ? 0x1 : 0xFF);
-          DecodeBrick(Idx2, P, &D, Mask, Accuracy);
-          if (Iter == P.OutputLevel) {
-            grid BrickGrid(Top.BrickFrom3 * BrickDims3, Idx2.BrickDims3, v3i(1 << Iter)); // TODO: the 1 << Iter is only true for 1 transform pass per level
-            grid OutBrickGrid = Crop(OutGrid, BrickGrid);
-            grid BrickGridLocal = Relative(OutBrickGrid, BrickGrid);
-            if (P.OutMode == params::out_mode::WriteToFile) {
-              if (OutVol.Vol.Type == dtype::float32)
-                (CopyGridGrid<f64, f32>(BrickGridLocal, BVol.Vol, Relative(OutBrickGrid, OutGrid), &OutVol.Vol));
-              else if (OutVol.Vol.Type == dtype::float64)
-                (CopyGridGrid<f64, f64>(BrickGridLocal, BVol.Vol, Relative(OutBrickGrid, OutGrid), &OutVol.Vol));
-//              CountZeroes += CopyGridGridCountZeroes(BrickGridLocal, BVol.Vol, Relative(OutBrickGrid, OutGrid), &OutVol.Vol);
-            } else if (P.OutMode == params::out_mode::KeepInMemory) {
-              if (OutVolMem.Type == dtype::float32)
-                (CopyGridGrid<f64, f32>(BrickGridLocal, BVol.Vol, Relative(OutBrickGrid, OutGrid), &OutVolMem));
-              else if (OutVolMem.Type == dtype::float64)
-                (CopyGridGrid<f64, f64>(BrickGridLocal, BVol.Vol, Relative(OutBrickGrid, OutGrid), &OutVolMem));
+    auto DecodeTask = [&](decode_data* W, const brick_task& Task) {
+      W->Iter = Iter;
+      W->Bricks3[Iter] = Task.Brick3;
+      W->Brick[Iter] = Task.Brick;
+      W->ChunkInFile = Task.ChunkInFile;
+      W->BrickInChunk = Task.BrickInChunk;
+      volume OutBVol; // bricks at the output level are not parents of any brick, so they are not pooled
+      volume* BVol = &OutBVol;
+      if (Iter == P.OutputLevel) { // from the cache of this thread, so no locking is needed
+        Resize(BVol, Idx2.BrickDimsExt3, BrickType, W->Alloc);
+      } else {
+        lock PoolLock(&D->Mutex);
+        auto BrickIt = Lookup(&D->BrickPool, GetBrickKey(Iter, Task.Brick));
+        idx2_Assert(BrickIt);
+        BVol = &BrickIt.Val->Vol;
+      }
+      /* a brick of the output level is written to the output by DecodeBrick, with its last inverse
+      lifting pass; the output grids of different bricks do not overlap so no locking is needed */
+      brick_output BOut;
+      if (Iter == P.OutputLevel && Out) {
+        grid BrickGrid(Task.Brick3 * BrickDims3, Idx2.BrickDims3, v3i(1 << Iter)); // TODO: the 1 << Iter is only true for 1 transform pass per level
+        grid OutBrickGrid = Crop(OutGrid, BrickGrid);
+        BOut = brick_output{ &OutPasses, Relative(OutBrickGrid, BrickGrid), Relative(OutBrickGrid, OutGrid), Out };
+      }
+      /* with P.KeepBlockStates, DecodeSubband rebuilds the coefficients from the kept block states */
+      u8 Mask = Iter == P.DecodeLevel ? P.DecodeMask : (Iter < P.DecodeLevel ? 0x1 : 0xFF);
+      error<idx2_file_err_code> BrickResult;
+      if (BrickType == dtype::float32) {
+        Fill(idx2_Range(f32, *BVol), 0.0f);
+        BrickResult = DecodeBrick<f32>(Idx2, P, W, Mask, Accuracy, BVol, BOut.Vol ? &BOut : nullptr);
+      } else {
+        Fill(idx2_Range(f64, *BVol), 0.0);
+        BrickResult = DecodeBrick<f64>(Idx2, P, W, Mask, Accuracy, BVol, BOut.Vol ? &BOut : nullptr);
+      }
+      if (Iter == P.OutputLevel)
+        Dealloc(BVol);
+      if (!BrickResult) {
+        lock ResultLock(&D->Mutex);
+        if (Result) Result = BrickResult;
+      }
+    };
+    /* decode the recorded bricks, the first thread uses D itself, the others use their own decode_data */
+    std::atomic<i64> NextTask = 0;
+    auto DecodeTasks = [&]() {
+      NextTask = 0;
+      /* with a prefetch depth, a separate thread reads the chunks of the next PrefetchDepth bricks
+      while the bricks before them are decoded; otherwise the chunks of all the bricks are read first.
+      With a cache limit, the chunks read ahead must fit in half of the cache (the other half holds the
+      chunks of the bricks being decoded), or they would be evicted before they are decoded and read
+      again: the depth is halved whenever the chunks of a window do not fit in their share of the
+      budget, and prefetching stops when those of a single brick do not */
+      const i64 MaxAheadBytes = D->MaxCacheBytes / 2;
+      std::thread Prefetcher;
+      mutex PrefetchMutex;
+      condition_variable TaskTaken; // signalled when NextTask advances (or when the prefetcher must stop)
+      bool StopPrefetch = false; // under PrefetchMutex
+      if (P.PrefetchDepth > 0) {
+        Prefetcher = std::thread([&]() {
+          decode_data W;
+          InitWorker(&W, D);
+          W.IsPrefetcher = true;
+          i64 Depth = P.PrefetchDepth;
+          i64 Window = Max(Depth / 4, i64(1));
+          for (i64 First = 0; First < Size(Tasks);) {
+            {
+              lock PrefetchLock(&PrefetchMutex);
+              while (!StopPrefetch && First >= NextTask + Depth)
+                Wait(&TaskTaken, &PrefetchMutex);
+              if (StopPrefetch) break;
+            }
+            First = Max(First, i64(NextTask)); // bricks already being decoded are not prefetched
+            i64 Last = Min(First + Window, Size(Tasks));
+            if (First >= Last) break;
+            if (!ReadChunksAhead(Idx2, P, &W, Iter, Accuracy, Tasks, First, Last, MaxAheadBytes * Window / Depth)) {
+              if (Window == 1) break;
+              Depth = Max(Depth / 2, i64(1));
+              Window = Max(Depth / 4, i64(1));
             }
-            Dealloc(&BVol.Vol);
-            Delete(&D.BrickPool, BrickKey); // TODO: also delete the parent bricks once we are done
+            First = Last;
           }
-          , 64
-          , Idx2.BrickOrderChunks[Iter]
-          , ChunkTop.ChunkFrom3 * Idx2.BricksPerChunk3s[Iter]
-          , Idx2.BricksPerChunk3s[Iter]
-          , ExtentInBricks
-          , VolExtentInBricks
-        );
-        , 64
-        , Idx2.ChunkOrderFiles[Iter]
-        , FileTop.FileFrom3 * Idx2.ChunksPerFile3s[Iter]
-        , Idx2.ChunksPerFile3s[Iter]
-        , ExtentInChunks
-        , VolExtentInChunks
-      );
-      , 64
-      , Idx2.FileOrders[Iter]
-      , v3i(0)
-      , Idx2.NFiles3s[Iter]
-      , ExtentInFiles
-      , VolExtentInFiles
-    );
+          Dealloc(&W);
+        });
+      } else if (P.CoalesceReads) {
+        ReadChunksAhead(Idx2, P, D, Iter, Accuracy, Tasks, 0, Size(Tasks), MaxAheadBytes);
+      }
+      ParallelRun(NThreads, [&](int ThreadId) {
+        decode_data W;
+        decode_data* WPtr = D;
+        if (ThreadId > 0) {
+          InitWorker(&W, D);
+          WPtr = &W;
+        }
+        for (i64 I = NextTask++; I < Size(Tasks); I = NextTask++) {
+          if (P.PrefetchDepth > 0) {
+            lock PrefetchLock(&PrefetchMutex);
+            NotifyAll(&TaskTaken);
+          }
+          DecodeTask(WPtr, Tasks[I]);
+        }
+        if (ThreadId > 0)
+          Dealloc(&W);
+      });
+      if (Prefetcher.joinable()) {
+        {
+          lock PrefetchLock(&PrefetchMutex);
+          StopPrefetch = true;
+          NotifyAll(&TaskTaken);
+        }
+        Prefetcher.join();
+      }
+      Clear(&Tasks);
+    };
+    TraverseBricks(Idx2, P.DecodeExtent, Iter, [&](const brick_task& Task) {
+      if (Iter != P.OutputLevel) { // the brick will be a parent when decoding the next level
+        brick_volume BVol;
+        Resize(&BVol.Vol, Idx2.BrickDimsExt3, BrickType, D->Alloc);
+        Insert(&D->BrickPool, GetBrickKey(Iter, Task.Brick), BVol);
+      }
+      PushBack(&Tasks, Task);
+      if (Size(Tasks) == MaxTasks)
+        DecodeTasks();
+    });
+    if (Size(Tasks) > 0)
+      DecodeTasks();
+    if (!Result) break; // the finer levels would be decoded from incomplete bricks
   } // end level loop
 //  printf("count zeroes        = %lld\n", CountZeroes);
   printf("total decode time   = %f\n", Seconds(ElapsedTime(&DecodeTimer)));
   printf("io time             = %f\n", Seconds(DecodeIOTime_));
+  printf("prefetch io time    = %f (hidden)\n", Seconds(PrefetchIOTime_));
+  printf("open file hits      = %" PRIi64 " misses = %" PRIi64 "\n", D->FdCache.NHits, D->FdCache.NMisses);
+  printf("peak cache size     = %" PRIi64 " bytes (%" PRIi64 " evictions)\n", D->PeakCacheBytes, D->NEvictions);
+  printf("read-ahead chunks   = %" PRIi64 " (%" PRIi64 " bytes) in %" PRIi64 " reads (%" PRIi64 " bytes), %" PRIi64 " reads saved\n",
+         D->NPlannedChunks, D->NPlannedBytes, D->NPlannedReads, D->NPlannedReadBytes, D->NPlannedChunks - D->NPlannedReads);
   printf("data movement time  = %f\n", Seconds(DataMovementTime_));
-  printf("rdo   bytes read    = %" PRIi64 "\n", BytesRdos_);
-  printf("exp   bytes read    = %" PRIi64 "\n", BytesExps_);
-  printf("data  bytes read    = %" PRIi64 "\n", BytesData_);
+  printf("rdo   bytes read    = %" PRIi64 "\n", BytesRdos_.load());
+  printf("exp   bytes read    = %" PRIi64 "\n", BytesExps_.load());
+  printf("data  bytes read    = %" PRIi64 "\n", BytesData_.load());
   printf("total bytes read    = %" PRIi64 "\n", BytesRdos_ + BytesExps_ + BytesData_);
+  if (D->CacheAlloc == &D->Arena)
+    printf("arena allocations   = %" PRIi64 " in %" PRIi64 " blocks\n", D->Arena.NAllocs, D->Arena.NBlocks);
+  /* parents whose children are outside of the decode extent are still in the pool */
+  idx2_ForEach(BrickVolIt, D->BrickPool) Dealloc(&BrickVolIt.Val->Vol);
+  Clear(&D->BrickPool);
+  return Result;
+}
+
+/* The files and chunks already counted by EstimateDecodeCost, keyed by file id and chunk address */
+struct cost_tables {
+  hash_table<u64, i64> Files, ExpFiles;
+  hash_table<u64, i64> Chunks, ExpChunks;
+  hash_table<i16, i64> BitPlanes; // the bit planes of the current subband that are counted
+};
+
+/* Count the index of the data file FileId (reading it if needed) and the chunk ChunkAddr in it */
+static error<idx2_file_err_code>
+CountChunk(decode_data* D, const file_id& FileId, u64 ChunkAddr, cost_tables* Tables, decode_cost* Cost) {
+  lock CacheLock(&D->Main->Mutex);
+  hash_table<u64, file_cache>::iterator FileCacheIt;
+  u64 BytesBefore = BytesData_;
+  idx2_PropagateIfError(ReadFile(D, &FileCacheIt, FileId)); // nothing is read if the file is in the cache
+  Cost->IndexBytes += BytesData_ - BytesBefore;
+  if (!FileCacheIt) return idx2_Error(idx2_file_err_code::FileNotFound);
+  if (!Lookup(&Tables->Files, FileId.Id)) {
+    Insert(&Tables->Files, FileId.Id, i64(0));
+    ++Cost->NFiles;
+  }
+  file_cache* FileCache = FileCacheIt.Val;
+  auto ChunkCacheIt = Lookup(&FileCache->ChunkCaches, ChunkAddr);
+  if (!ChunkCacheIt) return idx2_Error(idx2_file_err_code::ChunkNotFound);
+  i32 ChunkPos = ChunkCacheIt.Val->ChunkPos;
+  i64 ChunkSize = FileCache->ChunkSizes[ChunkPos] - (ChunkPos > 0 ? FileCache->ChunkSizes[ChunkPos - 1] : 0);
+  Insert(&Tables->Chunks, ChunkAddr, ChunkSize);
+  ++Cost->NChunks;
+  Cost->ChunkBytes += ChunkSize;
+  if (Size(ChunkCacheIt.Val->ChunkStream.Stream) > 0)
+    Cost->ResidentChunkBytes += ChunkSize;
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
+/* Same as DecodeSubband, except that the bit plane chunks are counted instead of decoded */
+static error<idx2_file_err_code>
+EstimateSubbandCost(const idx2_file& Idx2, decode_data* D, f64 Accuracy, const grid& SbGrid, cost_tables* Tables, decode_cost* Cost) {
+  idx2_CleanUp(UnpinAll(D));
+  u64 Brick = D->Brick[D->Iter];
+  v3i SbDims3 = Dims(SbGrid);
+  v3i NBlocks3 = (SbDims3 + Idx2.BlockDims3 - 1) / Idx2.BlockDims3;
+  int MinBitPlane = traits<i16>::Min;
+  if (Size(Idx2.RdoLevels) > 0 && D->QualityLevel >= 0) {
+    auto ReadChunkRdoResult = ReadChunkRdos(Idx2, D, Brick, D->Iter);
+    if (!ReadChunkRdoResult) return Error(ReadChunkRdoResult);
+    const chunk_rdo_cache* ChunkRdoCache = Value(ReadChunkRdoResult);
+    int Ql = Min(D->QualityLevel, (int)Size(Idx2.RdoLevels) - 1);
+    MinBitPlane = ChunkRdoCache->TruncationPoints[D->Level * Size(Idx2.RdoLevels) + Ql];
+  }
+  if (MinBitPlane == traits<i16>::Max) return idx2_Error(idx2_file_err_code::NoError);
+  int BlockCount = Prod(NBlocks3);
+  if (D->Level == 0 && D->Iter + 1 < Idx2.NLevels)
+    BlockCount -= Prod(SbDims3 / Idx2.BlockDims3);
+
+  /* count (and read) the exponent chunk */
+  file_id ExpFileId = ConstructFilePathExponents(Idx2, Brick, D->Iter, D->Level);
+  {
+    lock CacheLock(&D->Main->Mutex);
+    hash_table<u64, file_exp_cache>::iterator FileExpCacheIt;
+    u64 BytesBefore = BytesExps_;
+    idx2_PropagateIfError(ReadFileExponents(D, &FileExpCacheIt, ExpFileId)); // nothing is read if the file is in the cache
+    Cost->IndexBytes += BytesExps_ - BytesBefore;
+    if (!FileExpCacheIt) return idx2_Error(idx2_file_err_code::FileNotFound);
+    if (!Lookup(&Tables->ExpFiles, ExpFileId.Id)) {
+      Insert(&Tables->ExpFiles, ExpFileId.Id, i64(0));
+      ++Cost->NExpFiles;
+    }
+    u64 ExpChunkAddr = GetChunkAddress(Idx2, Brick, D->Iter, D->Level, 0);
+    if (!Lookup(&Tables->ExpChunks, ExpChunkAddr)) {
+      const array<i32>& ChunkExpSzs = FileExpCacheIt.Val->ChunkExpSzs;
+      idx2_Assert(D->ChunkInFile < Size(ChunkExpSzs));
+      i64 ChunkExpSize = ChunkExpSzs[D->ChunkInFile] - (D->ChunkInFile > 0 ? ChunkExpSzs[D->ChunkInFile - 1] : 0);
+      Insert(&Tables->ExpChunks, ExpChunkAddr, ChunkExpSize);
+      ++Cost->NExpChunks;
+      Cost->ExpBytes += ChunkExpSize;
+    }
+  }
+  auto ReadChunkExpResult = ReadChunkExponents(Idx2, D, Brick, D->Iter, D->Level);
+  if (!ReadChunkExpResult) return Error(ReadChunkExpResult);
+  const chunk_exp_cache* ChunkExpCache = Value(ReadChunkExpResult);
+  i32 BrickExpOffset = (D->BrickInChunk * BlockCount) * (SizeOf(Idx2.DType) > 4 ? 2 : 1);
+  bitstream BrickExpsStream = ChunkExpCache->BrickExpsStream;
+  SeekToByte(&BrickExpsStream, BrickExpOffset);
+
+  /* count the chunks of the bit planes that the blocks decode */
+  u32 LastBlock = EncodeMorton3(v3<u32>(NBlocks3 - 1));
+  const i8 NBitPlanes = idx2_BitSizeOf(u64);
+  i16 LowestBp = D->Main->KeepBlockStates ? GetLowestBitPlane(D, Brick, D->Iter, D->Level) : traits<i16>::Max;
+  Clear(&Tables->BitPlanes);
+  idx2_InclusiveFor(u32, Block, 0, LastBlock) { // zfp block loop
+    v3i Z3(DecodeMorton3(Block));
+    idx2_NextMorton(Block, Z3, NBlocks3);
+    v3i D3 = Z3 * Idx2.BlockDims3;
+    v3i BlockDims3 = Min(Idx2.BlockDims3, SbDims3 - D3);
+    const int NDims = NumDims(BlockDims3);
+    bool CodedInNextIter = D->Level == 0 && D->Iter + 1 < Idx2.NLevels && BlockDims3 == Idx2.BlockDims3;
+    if (CodedInNextIter) continue;
+    i16 EMax = SizeOf(Idx2.DType) > 4 ? (i16)Read(&BrickExpsStream, 16) - traits<f64>::ExpBias
+                                    : (i16)Read(&BrickExpsStream, traits<f32>::ExpBits) - traits<f32>::ExpBias;
+    i8 EndBitPlane = Min(i8(BitSizeOf(Idx2.DType) + (24 + NDims)), NBitPlanes);
+    idx2_InclusiveForBackward(i8, Bp, NBitPlanes - 1, NBitPlanes - EndBitPlane) { // bit plane loop
+      i16 RealBp = Bp + EMax;
+      if (NBitPlanes - 6 > RealBp - Exponent(Accuracy) + 1) break;
+      if (RealBp < MinBitPlane) break;
+      if (RealBp >= LowestBp) continue; // decoded before, the block state has it
+      if (Lookup(&Tables->BitPlanes, RealBp)) continue;
+      Insert(&Tables->BitPlanes, RealBp, i64(0));
+      u64 ChunkAddr = GetChunkAddress(Idx2, Brick, D->Iter, D->Level, RealBp);
+      if (Lookup(&Tables->Chunks, ChunkAddr)) continue; // counted for another brick
+      file_id FileId = ConstructFilePath(Idx2, Brick, D->Iter, D->Level, RealBp);
+      idx2_PropagateIfError(CountChunk(D, FileId, ChunkAddr, Tables, Cost));
+    } // end bit plane loop
+  }
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
+error<idx2_file_err_code>
+EstimateDecodeCost(const idx2_file& Idx2, const params& P, decode_data* D, decode_cost* Cost) {
+  if (Idx2.Version != v2i(1, 0))
+    return idx2_Error(idx2_file_err_code::NotSupportedInVersion);
+  *Cost = decode_cost();
+  u8 OutMask = P.DecodeLevel == P.OutputLevel ? P.DecodeMask : 128;
+  Cost->OutGrid = GetGrid(P.DecodeExtent, P.OutputLevel, OutMask, Idx2.Subbands);
+  Cost->OutputBytes = Prod<i64>(Dims(Cost->OutGrid)) * SizeOf(Idx2.DType);
+  D->MapFiles = P.MapFiles;
+  D->MaxCacheBytes = P.CacheBytes;
+  D->FdCache.MaxOpenFiles = Max(P.MaxOpenFiles, 1);
+  D->KeepBlockStates = P.KeepBlockStates;
+  D->EffIter = P.DecodeLevel;
+  f64 Accuracy = Max(Idx2.Accuracy, P.DecodeAccuracy);
+  cost_tables Tables;
+  Init(&Tables.Files, 8); Init(&Tables.ExpFiles, 8);
+  Init(&Tables.Chunks, 10); Init(&Tables.ExpChunks, 10);
+  Init(&Tables.BitPlanes, 7);
+  idx2_CleanUp(
+    Dealloc(&Tables.Files); Dealloc(&Tables.ExpFiles);
+    Dealloc(&Tables.Chunks); Dealloc(&Tables.ExpChunks);
+    Dealloc(&Tables.BitPlanes);
+  );
+  error<idx2_file_err_code> Result = idx2_Error(idx2_file_err_code::NoError);
+  idx2_InclusiveForBackward(i8, Iter, Idx2.NLevels - 1, 0) {
+    if (Iter < P.OutputLevel) break;
+    u8 Mask = Iter == P.DecodeLevel ? P.DecodeMask : (Iter < P.DecodeLevel ? 0x1 : 0xFF);
+    u8 DecodeSbMask = GetDecodeSubbandMask(Mask);
+    TraverseBricks(Idx2, P.DecodeExtent, Iter, [&](const brick_task& Task) {
+      if (!Result) return;
+      ++Cost->NBricks;
+      D->Iter = Iter;
+      D->Bricks3[Iter] = Task.Brick3;
+      D->Brick[Iter] = Task.Brick;
+      D->ChunkInFile = Task.ChunkInFile;
+      D->BrickInChunk = Task.BrickInChunk;
+      idx2_For(i8, Sb, 0, (i8)Size(Idx2.Subbands)) {
+        if (!BitSet(DecodeSbMask, Sb) || !(Sb == 0 || Iter >= D->EffIter)) continue;
+        D->Level = Sb;
+        Result = EstimateSubbandCost(Idx2, D, Accuracy, Idx2.Subbands[Sb].Grid, &Tables, Cost);
+        if (!Result) return;
+      }
+    });
+    if (!Result) return Result;
+  }
+  return Result;
+}
+
+error<idx2_file_err_code>
+Decode(const idx2_file& Idx2, const params& P, buffer* OutBuf) {
+  /* evicted chunks would stay in the arena, so a cache limit turns the arena off */
+  idx2_RAII(decode_data, D, Init(&D, P.MaxOpenFiles, P.CacheBytes > 0 ? 0 : P.ArenaBytes));
+  return Decode(Idx2, P, &D, OutBuf);
+}
+
+void
+ClearBlockStates(decode_data* D) {
+  idx2_Assert(D->Main == D);
+  idx2_ForEach(StateIt, D->BlockStates) Dealloc(&StateIt.Val->Blocks);
+  Clear(&D->BlockStates);
+}
+
+void
+ClearCaches(decode_data* D) {
+  idx2_Assert(D->Main == D);
+  Dealloc(&D->FcTable);
+  Init(&D->FcTable, D->CacheAlloc);
+  Clear(&D->ResidentChunks);
+  D->CacheBytes = 0;
+  int MaxOpenFiles = D->FdCache.MaxOpenFiles;
+  Dealloc(&D->FdCache);
+  Init(&D->FdCache, MaxOpenFiles);
+  idx2_ForEach(MappedIt, D->MappedFiles) UnmapFile(MappedIt.Val);
+  Clear(&D->MappedFiles);
+  ClearBlockStates(D);
+}
+
+void
+TrimCaches(decode_data* D, i64 MaxBytes) {
+  idx2_Assert(D->Main == D);
+  EvictChunks(D, MaxBytes);
+  /* the memory of the bricks of previous calls */
+  D->BrickCache.DeallocAll();
+  Trim(&D->BrickBlocks);
 }
 
 } // namespace idx2
@@ -43469,6 +46705,22 @@ Dealloc(volume* Vol) {
   DeallocBuf(&Vol->Buffer);
 }
 
+void
+CopyGridGrid(const grid& SGrid, const volume& SVol, const grid& DGrid, volume* DVol) {
+  idx2_Assert(IsFloatingPoint(SVol.Type) && IsFloatingPoint(DVol->Type), "type not supported");
+  if (SVol.Type == dtype::float32) {
+    if (DVol->Type == dtype::float32)
+      CopyGridGrid<f32, f32>(SGrid, SVol, DGrid, DVol);
+    else
+      CopyGridGrid<f32, f64>(SGrid, SVol, DGrid, DVol);
+  } else {
+    if (DVol->Type == dtype::float32)
+      CopyGridGrid<f64, f32>(SGrid, SVol, DGrid, DVol);
+    else
+      CopyGridGrid<f64, f64>(SGrid, SVol, DGrid, DVol);
+  }
+}
+
 void
 Clone(const volume& Src, volume* Dst, allocator* Alloc) {
   Clone(Src.Buffer, &Dst->Buffer, Alloc);
@@ -43674,6 +46926,229 @@ Decode(u64* Block, int B, i64 S, i8& N, i8& M, bitstream* Bs) {
   return ((N == 64 && M == N)|| Lb == 0);
 }
 
+/* Gather bit plane B of a block of NVals coefficients (bit I of the result is the bit of coefficient I) */
+idx2_TargetScalar static u64
+GatherBitPlaneScalar(const u64* idx2_Restrict Block, int NVals, int B) {
+  u64 X = 0;
+  for (int I = 0; I < NVals; ++I)
+    X += ((Block[I] >> B) & 1u) << I;
+  return X;
+}
+
+#if defined(idx2_X86)
+/* 4 coefficients at a time: their bit B is shifted into the sign bit, which movemask collects */
+idx2_TargetAvx2 static u64
+GatherBitPlaneAvx2(const u64* idx2_Restrict Block, int NVals, int B) {
+  u64 X = 0;
+  __m128i Shift = _mm_cvtsi32_si128(63 - B);
+  int I = 0;
+  for (; I + 4 <= NVals; I += 4) {
+    __m256i Val = _mm256_sll_epi64(_mm256_loadu_si256((const __m256i*)(Block + I)), Shift);
+    X |= u64(_mm256_movemask_pd(_mm256_castsi256_pd(Val))) << I;
+  }
+  for (; I < NVals; ++I)
+    X += ((Block[I] >> B) & 1u) << I;
+  return X;
+}
+
+/* 8 coefficients at a time, with one test into a mask register */
+idx2_TargetAvx512 static u64
+GatherBitPlaneAvx512(const u64* idx2_Restrict Block, int NVals, int B) {
+  u64 X = 0;
+  __m512i Bit = _mm512_set1_epi64(i64(u64(1) << B));
+  int I = 0;
+  for (; I + 8 <= NVals; I += 8)
+    X |= u64(_mm512_test_epi64_mask(_mm512_loadu_si512(Block + I), Bit)) << I;
+  for (; I < NVals; ++I)
+    X += ((Block[I] >> B) & 1u) << I;
+  return X;
+}
+
+/* Transpose the 4x4 64-bit values in R0, R1, R2, R3 (one row in each) */
+idx2_TargetAvx2 static idx2_Inline void
+Transpose4x4(__m256i& R0, __m256i& R1, __m256i& R2, __m256i& R3) {
+  __m256i T0 = _mm256_unpacklo_epi64(R0, R1), T1 = _mm256_unpackhi_epi64(R0, R1);
+  __m256i T2 = _mm256_unpacklo_epi64(R2, R3), T3 = _mm256_unpackhi_epi64(R2, R3);
+  R0 = _mm256_permute2x128_si256(T0, T2, 0x20);
+  R1 = _mm256_permute2x128_si256(T1, T3, 0x20);
+  R2 = _mm256_permute2x128_si256(T0, T2, 0x31);
+  R3 = _mm256_permute2x128_si256(T1, T3, 0x31);
+}
+
+/* Transpose the 8x8 64-bit values in R0, ..., R7 (one row in each): pairs of values, then 128-bit
+lanes, then pairs of 128-bit lanes. The unmasked intrinsics pass an undefined source to the masked
+builtins in g++, which then warns (-Wuninitialized); the zero-masking forms with a full mask compile
+to the same instructions */
+idx2_TargetAvx512 static idx2_Inline void
+Transpose8x8(__m512i& R0, __m512i& R1, __m512i& R2, __m512i& R3, __m512i& R4, __m512i& R5, __m512i& R6, __m512i& R7) {
+  __m512i T0 = _mm512_maskz_unpacklo_epi64(0xFF, R0, R1), T1 = _mm512_maskz_unpackhi_epi64(0xFF, R0, R1);
+  __m512i T2 = _mm512_maskz_unpacklo_epi64(0xFF, R2, R3), T3 = _mm512_maskz_unpackhi_epi64(0xFF, R2, R3);
+  __m512i T4 = _mm512_maskz_unpacklo_epi64(0xFF, R4, R5), T5 = _mm512_maskz_unpackhi_epi64(0xFF, R4, R5);
+  __m512i T6 = _mm512_maskz_unpacklo_epi64(0xFF, R6, R7), T7 = _mm512_maskz_unpackhi_epi64(0xFF, R6, R7);
+  __m512i U0 = _mm512_maskz_shuffle_i64x2(0xFF, T0, T2, 0x88), U1 = _mm512_maskz_shuffle_i64x2(0xFF, T1, T3, 0x88);
+  __m512i U2 = _mm512_maskz_shuffle_i64x2(0xFF, T0, T2, 0xdd), U3 = _mm512_maskz_shuffle_i64x2(0xFF, T1, T3, 0xdd);
+  __m512i U4 = _mm512_maskz_shuffle_i64x2(0xFF, T4, T6, 0x88), U5 = _mm512_maskz_shuffle_i64x2(0xFF, T5, T7, 0x88);
+  __m512i U6 = _mm512_maskz_shuffle_i64x2(0xFF, T4, T6, 0xdd), U7 = _mm512_maskz_shuffle_i64x2(0xFF, T5, T7, 0xdd);
+  R0 = _mm512_maskz_shuffle_i64x2(0xFF, U0, U4, 0x88); R4 = _mm512_maskz_shuffle_i64x2(0xFF, U0, U4, 0xdd);
+  R1 = _mm512_maskz_shuffle_i64x2(0xFF, U1, U5, 0x88); R5 = _mm512_maskz_shuffle_i64x2(0xFF, U1, U5, 0xdd);
+  R2 = _mm512_maskz_shuffle_i64x2(0xFF, U2, U6, 0x88); R6 = _mm512_maskz_shuffle_i64x2(0xFF, U2, U6, 0xdd);
+  R3 = _mm512_maskz_shuffle_i64x2(0xFF, U3, U7, 0x88); R7 = _mm512_maskz_shuffle_i64x2(0xFF, U3, U7, 0xdd);
+}
+
+/* Row I of the 4x4 (8x8) values to transpose is made of coefficients I, ..., I + 3 (I + 7) of block L */
+idx2_TargetAvx2 static idx2_Inline __m256i
+LoadRow4(const void* Blocks, int L, int I) { return _mm256_loadu_si256((const __m256i*)((const u64*)Blocks + L * 64 + I)); }
+idx2_TargetAvx2 static idx2_Inline void
+StoreRow4(void* Blocks, int L, int I, __m256i R) { _mm256_storeu_si256((__m256i*)((u64*)Blocks + L * 64 + I), R); }
+idx2_TargetAvx512 static idx2_Inline __m512i
+LoadRow8(const void* Blocks, int L, int I) { return _mm512_loadu_si512((const u64*)Blocks + L * 64 + I); }
+idx2_TargetAvx512 static idx2_Inline void
+StoreRow8(void* Blocks, int L, int I, __m512i R) { _mm512_storeu_si512((u64*)Blocks + L * 64 + I, R); }
+
+/* The batched transforms of idx2_zfp.h, with the transposes between one block after another and
+the structure of arrays done 4x4 (8x8) values at a time in registers. V[I] holds coefficient I of
+all the blocks. */
+idx2_TargetAvx2 static void
+ForwardZfp4Blocks(const i64* idx2_Restrict IBlocks, u64* idx2_Restrict UBlocks) {
+  __m256i V[64];
+  for (int I = 0; I < 64; I += 4) {
+    __m256i R0 = LoadRow4(IBlocks, 0, I), R1 = LoadRow4(IBlocks, 1, I), R2 = LoadRow4(IBlocks, 2, I), R3 = LoadRow4(IBlocks, 3, I);
+    Transpose4x4(R0, R1, R2, R3);
+    V[I + 0] = R0; V[I + 1] = R1; V[I + 2] = R2; V[I + 3] = R3;
+  }
+  ForwardZfpSoA<4>((i64*)V);
+  const __m256i Mask = _mm256_set1_epi64x(i64(traits<u64>::NBinaryMask));
+  for (int I = 0; I < 64; I += 4) {
+    __m256i R[4];
+    for (int K = 0; K < 4; ++K) R[K] = _mm256_xor_si256(_mm256_add_epi64(V[Perm3[I + K]], Mask), Mask);
+    Transpose4x4(R[0], R[1], R[2], R[3]);
+    for (int L = 0; L < 4; ++L) StoreRow4(UBlocks, L, I, R[L]);
+  }
+}
+
+idx2_TargetAvx2 static void
+InverseZfp4Blocks(const u64* idx2_Restrict UBlocks, i64* idx2_Restrict IBlocks) {
+  __m256i V[64];
+  const __m256i Mask = _mm256_set1_epi64x(i64(traits<u64>::NBinaryMask));
+  for (int I = 0; I < 64; I += 4) {
+    __m256i R[4];
+    for (int L = 0; L < 4; ++L) R[L] = LoadRow4(UBlocks, L, I);
+    Transpose4x4(R[0], R[1], R[2], R[3]);
+    for (int K = 0; K < 4; ++K) V[Perm3[I + K]] = _mm256_sub_epi64(_mm256_xor_si256(R[K], Mask), Mask);
+  }
+  InverseZfpSoA<4>((i64*)V);
+  for (int I = 0; I < 64; I += 4) {
+    __m256i R0 = V[I + 0], R1 = V[I + 1], R2 = V[I + 2], R3 = V[I + 3];
+    Transpose4x4(R0, R1, R2, R3);
+    StoreRow4(IBlocks, 0, I, R0); StoreRow4(IBlocks, 1, I, R1); StoreRow4(IBlocks, 2, I, R2); StoreRow4(IBlocks, 3, I, R3);
+  }
+}
+
+idx2_TargetAvx512 static void
+ForwardZfp8Blocks(const i64* idx2_Restrict IBlocks, u64* idx2_Restrict UBlocks) {
+  __m512i V[64];
+  for (int I = 0; I < 64; I += 8) {
+    __m512i R[8];
+    for (int L = 0; L < 8; ++L) R[L] = LoadRow8(IBlocks, L, I);
+    Transpose8x8(R[0], R[1], R[2], R[3], R[4], R[5], R[6], R[7]);
+    for (int K = 0; K < 8; ++K) V[I + K] = R[K];
+  }
+  ForwardZfpSoA<8>((i64*)V);
+  const __m512i Mask = _mm512_set1_epi64(i64(traits<u64>::NBinaryMask));
+  for (int I = 0; I < 64; I += 8) {
+    __m512i R[8];
+    for (int K = 0; K < 8; ++K) R[K] = _mm512_xor_si512(_mm512_add_epi64(V[Perm3[I + K]], Mask), Mask);
+    Transpose8x8(R[0], R[1], R[2], R[3], R[4], R[5], R[6], R[7]);
+    for (int L = 0; L < 8; ++L) StoreRow8(UBlocks, L, I, R[L]);
+  }
+}
+
+idx2_TargetAvx512 static void
+InverseZfp8Blocks(const u64* idx2_Restrict UBlocks, i64* idx2_Restrict IBlocks) {
+  __m512i V[64];
+  const __m512i Mask = _mm512_set1_epi64(i64(traits<u64>::NBinaryMask));
+  for (int I = 0; I < 64; I += 8) {
+    __m512i R[8];
+    for (int L = 0; L < 8; ++L) R[L] = LoadRow8(UBlocks, L, I);
+    Transpose8x8(R[0], R[1], R[2], R[3], R[4], R[5], R[6], R[7]);
+    for (int K = 0; K < 8; ++K) V[Perm3[I + K]] = _mm512_sub_epi64(_mm512_xor_si512(R[K], Mask), Mask);
+  }
+  InverseZfpSoA<8>((i64*)V);
+  for (int I = 0; I < 64; I += 8) {
+    __m512i R[8];
+    for (int K = 0; K < 8; ++K) R[K] = V[I + K];
+    Transpose8x8(R[0], R[1], R[2], R[3], R[4], R[5], R[6], R[7]);
+    for (int L = 0; L < 8; ++L) StoreRow8(IBlocks, L, I, R[L]);
+  }
+}
+#endif
+
+/*
+Define the kernels of an isa: the templates of idx2_zfp.h instantiated for 64-bit integers and
+compiled for the isa (Target), except that the bit plane gather of Encode, the bit plane deposit
+of Decode and the transpose of the bit planes decoded by DecodeTest have versions with intrinsics.
+The batched transforms work on BatchSize blocks, as many as the 64-bit lanes of a vector register. */
+#define idx2_ZfpKernels(Suffix, Isa, Target, GatherBitPlane, DepositBitPlane, TransposeBitPlanes, BatchSize, ForwardBatch, InverseBatch)\
+Target static void ForwardZfp##Suffix(i64* P, int D) { ForwardZfp(P, D); }\
+Target static void InverseZfp##Suffix(i64* P, int D) { InverseZfp(P, D); }\
+Target static void ForwardShuffle##Suffix(i64* IBlock, u64* UBlock, int D) { ForwardShuffle(IBlock, UBlock, D); }\
+Target static void InverseShuffle##Suffix(u64* UBlock, i64* IBlock, int D) { InverseShuffle(UBlock, IBlock, D); }\
+Target static void \
+Encode##Suffix(u64* Block, int NVals, int B, i8& N, bitstream* Bs) {\
+  EncodeBitPlane(GatherBitPlane(Block, NVals, B), NVals, N, Bs);\
+}\
+Target static void \
+Decode##Suffix(u64* Block, int NVals, int B, i8& N, bitstream* Bs) {\
+  u64 X = 0;\
+  DecodeTest(&X, NVals, N, Bs);\
+  DepositBitPlane(X, B, Block);\
+}\
+Target static void DecodeTest##Suffix(u64* Block, int NVals, i8& N, bitstream* Bs) { DecodeTest(Block, NVals, N, Bs); }\
+Target static void TransposeRecursive##Suffix(u64* Block, int NBps) { TransposeBitPlanes(Block, NBps); }\
+Target static void \
+ForwardZfpBatch##Suffix(const i64* IBlocks, u64* UBlocks) { ForwardBatch(IBlocks, UBlocks); }\
+Target static void \
+InverseZfpBatch##Suffix(const u64* UBlocks, i64* IBlocks) { InverseBatch(UBlocks, IBlocks); }\
+static_assert(BatchSize <= ZfpMaxBatchSize);\
+static const zfp_kernels ZfpKernels##Suffix = {\
+  Isa, ForwardZfp##Suffix, InverseZfp##Suffix, ForwardShuffle##Suffix, InverseShuffle##Suffix,\
+  Encode##Suffix, Decode##Suffix, DecodeTest##Suffix, TransposeRecursive##Suffix,\
+  BatchSize, ForwardZfpBatch##Suffix, InverseZfpBatch##Suffix\
+};
+
+idx2_ZfpKernels(Scalar, isa::scalar, idx2_TargetScalar, GatherBitPlaneScalar, TransposeNormal, TransposeRecursive, 1,
+                ForwardZfpBatch<1>, InverseZfpBatch<1>)
+#if defined(idx2_X86)
+idx2_ZfpKernels(Avx2, isa::avx2, idx2_TargetAvx2, GatherBitPlaneAvx2, TransposeAvx2, TransposeRecursive, 4,
+                ForwardZfp4Blocks, InverseZfp4Blocks)
+idx2_ZfpKernels(Avx512, isa::avx512, idx2_TargetAvx512, GatherBitPlaneAvx512, TransposeAvx512, TransposeBitPlanesAvx512, 8,
+                ForwardZfp8Blocks, InverseZfp8Blocks)
+#endif
+
+static const zfp_kernels&
+GetZfpKernels(isa Isa) {
+#if defined(idx2_X86)
+  if (Isa == isa::avx512)
+    return ZfpKernelsAvx512;
+  if (Isa == isa::avx2)
+    return ZfpKernelsAvx2;
+#endif
+  (void)Isa;
+  return ZfpKernelsScalar;
+}
+
+zfp_kernels Zfp = GetZfpKernels(DetectIsa());
+
+isa
+SetIsa(isa Isa) {
+  isa Best = DetectIsa();
+  if (Isa == isa::__Invalid__ || u8(Isa) > u8(Best))
+    Isa = Best;
+  Zfp = GetZfpKernels(Isa);
+  Cdf53 = GetCdf53Kernels(Isa);
+  return Isa;
+}
+
 } // namespace idx2
 
 namespace idx2 {
@@ -43694,8 +47169,7 @@ GetOutputGrid(const idx2_file& Idx2, const params& P) {
 
 error<idx2_file_err_code>
 Decode(idx2_file* Idx2, const params& P, buffer* OutBuf) {
-  Decode(*Idx2, P, OutBuf);
-  return idx2_Error(idx2_file_err_code::NoError);
+  return Decode(*Idx2, P, OutBuf);
 }
 
 error<idx2_file_err_code>
@@ -43704,6 +47178,53 @@ Destroy(idx2_file* Idx2) {
   return idx2_Error(idx2_file_err_code::NoError);
 }
 
+error<idx2_file_err_code>
+Init(decoder* Dec, const idx2_file& Idx2, const params& P) {
+  Dec->Idx2 = &Idx2;
+  Init(&Dec->D, P.MaxOpenFiles);
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
+error<idx2_file_err_code>
+Decode(decoder* Dec, const params& P, buffer* OutBuf) {
+  return Decode(*Dec->Idx2, P, &Dec->D, OutBuf);
+}
+
+error<idx2_file_err_code>
+Refine(decoder* Dec, const params& P, buffer* OutBuf) {
+  params Q = P;
+  Q.KeepBlockStates = true;
+  return Decode(*Dec->Idx2, Q, &Dec->D, OutBuf);
+}
+
+error<idx2_file_err_code>
+EstimateDecodeCost(const idx2_file& Idx2, const params& P, decode_cost* Cost) {
+  idx2_RAII(decode_data, D, Init(&D, P.MaxOpenFiles));
+  return EstimateDecodeCost(Idx2, P, &D, Cost);
+}
+
+error<idx2_file_err_code>
+EstimateDecodeCost(decoder* Dec, const params& P, decode_cost* Cost) {
+  return EstimateDecodeCost(*Dec->Idx2, P, &Dec->D, Cost);
+}
+
+void
+Clear(decoder* Dec) {
+  ClearCaches(&Dec->D);
+}
+
+void
+Trim(decoder* Dec, i64 MaxBytes) {
+  TrimCaches(&Dec->D, MaxBytes);
+}
+
+error<idx2_file_err_code>
+Destroy(decoder* Dec) {
+  Dealloc(&Dec->D);
+  Dec->Idx2 = nullptr;
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
 } // end namespace idx2
 
 #endif // idx2_Implementation
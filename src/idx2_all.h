@@ -4,6 +4,7 @@
 #include "idx2_bitops.h"
 #include "idx2_circular_queue.h"
 #include "idx2_common.h"
+#include "idx2_cpu.h"
 #include "idx2_dataset.h"
 #include "idx2_data_types.h"
 #include "idx2_debugbreak.h"
@@ -11,6 +12,7 @@
 #include "idx2_error.h"
 #include "idx2_error_codes.h"
 #include "idx2_expected.h"
+#include "idx2_fd_cache.h"
 #include "idx2_filesystem.h"
 #include "idx2_file_utils.h"
 #include "idx2_hashtable.h"
@@ -22,6 +24,7 @@
 #include "idx2_memory.h"
 #include "idx2_memory_map.h"
 #include "idx2_mutex.h"
+#include "idx2_pool_allocator.h"
 #include "idx2_random.h"
 #include "idx2_scopeguard.h"
 #include "idx2_function.h"
@@ -31,6 +34,7 @@
 #include "idx2_timer.h"
 #include "idx2_utils.h"
 #include "idx2_wavelet.h"
+#include "idx2_write_cache.h"
 #include "idx2_v1.h"
 #include "idx2_varint.h"
 #include "idx2_volume.h"
@@ -0,0 +1,417 @@
+/*
+Micro-benchmarks of the codec. Build with
+  sh ./build-gcc.sh Release idx2_bench
+and run
+  ./bin/idx2_bench [benchmark name] [--isa scalar|avx2|avx512]
+(all benchmarks run if no name is given). Each benchmark reports its best time over a few runs.
+*/
+
+#define idx2_Implementation
+#include "idx2_lib.hpp"
+
+using namespace idx2;
+
+static constexpr int NRuns = 3;
+
+static void
+RemoveDirIfExists(cstr Dir) {
+  if (DirExists(Dir))
+    RemoveDir(Dir);
+}
+
+/* A smooth field with some noise, so that the blocks have many significant bit planes */
+static void
+FillField(volume* Vol) {
+  v3i Dims3 = Dims(*Vol);
+  u64 Seed = 1;
+  v3i P3;
+  idx2_BeginFor3(P3, v3i(0), Dims3, v3i(1)) {
+    Seed = Seed * 6364136223846793005ull + 1442695040888963407ull;
+    f64 Noise = f64(Seed >> 11) / f64(u64(1) << 53) - 0.5;
+    f64 Val = sin(P3.X * 0.05) * cos(P3.Y * 0.07) + 0.5 * sin(P3.Z * 0.03 + P3.X * 0.01) + 1e-3 * Noise;
+    i64 I = Row(Dims3, P3);
+    if (Vol->Type == dtype::float64)
+      ((f64*)Vol->Buffer.Data)[I] = Val;
+    else
+      ((f32*)Vol->Buffer.Data)[I] = (f32)Val;
+  } idx2_EndFor3
+}
+
+/*
+Encode a 128^3 field, then decode it in full with a decoder that keeps the chunks it reads (so
+that the decode runs after the first one read no files). The rate is in zfp blocks (of 4^3
+samples) per second. Most of the time is spent in the bit plane loops of EncodeSubband and
+DecodeSubband at this accuracy. */
+static void
+BenchZfpBlocks(dtype DType) {
+  params P;
+  snprintf(P.Meta.Name, sizeof(P.Meta.Name), "bench");
+  stref TypeStr = ToString(DType);
+  snprintf(P.Meta.Field, sizeof(P.Meta.Field), "%.*s", TypeStr.Size, TypeStr.ConstPtr);
+  P.Meta.Dims3 = v3i(128);
+  P.Meta.DType = DType;
+  P.BrickDims3 = v3i(32);
+  P.NLevels = 2;
+  P.Accuracy = DType == dtype::float64 ? 1e-12 : 1e-6;
+  P.OutDir = "idx2_bench_out";
+  volume Vol(P.Meta.Dims3, DType);
+  idx2_CleanUp(Dealloc(&Vol));
+  FillField(&Vol);
+  const f64 NBlocks = f64(Prod<i64>(P.Meta.Dims3)) / 64;
+
+  /* encode */
+  f64 EncodeTime = traits<f64>::Max;
+  idx2_For(int, Run, 0, NRuns) {
+    RemoveDirIfExists(idx2_PrintScratch("%s/%s", P.OutDir, P.Meta.Name));
+    idx2_file Idx2;
+    SetName(&Idx2, P.Meta.Name);
+    SetField(&Idx2, P.Meta.Field);
+    SetVersion(&Idx2, P.Version);
+    SetDimensions(&Idx2, P.Meta.Dims3);
+    SetDataType(&Idx2, P.Meta.DType);
+    SetBrickSize(&Idx2, P.BrickDims3);
+    SetBricksPerChunk(&Idx2, P.BricksPerChunk);
+    SetChunksPerFile(&Idx2, P.ChunksPerFile);
+    SetNumIterations(&Idx2, (i8)P.NLevels);
+    SetAccuracy(&Idx2, P.Accuracy);
+    SetFilesPerDirectory(&Idx2, P.FilesPerDir);
+    SetDir(&Idx2, P.OutDir);
+    idx2_ExitIfError(Finalize(&Idx2));
+    timer Timer; StartTimer(&Timer);
+    idx2_ExitIfError(Encode(&Idx2, P, Vol));
+    EncodeTime = Min(EncodeTime, Seconds(ElapsedTime(&Timer)));
+    Dealloc(&Idx2);
+  }
+
+  /* decode */
+  params Q;
+  Q.Action = action::Decode;
+  char InputFile[256];
+  snprintf(InputFile, sizeof(InputFile), "%s/%s/%s.idx", P.OutDir, P.Meta.Name, P.Meta.Field);
+  Q.InputFile = InputFile;
+  Q.InDir = P.OutDir;
+  Q.DecodeExtent = extent(P.Meta.Dims3);
+  Q.DecodeAccuracy = P.Accuracy;
+  idx2_file Idx2;
+  idx2_CleanUp(Dealloc(&Idx2));
+  idx2_ExitIfError(Init(&Idx2, Q));
+  decoder Dec;
+  idx2_ExitIfError(Init(&Dec, Idx2, Q));
+  idx2_CleanUp(Destroy(&Dec));
+  buffer OutBuf;
+  AllocBuf(&OutBuf, Prod<i64>(Dims(GetOutputGrid(Idx2, Q))) * SizeOf(DType));
+  idx2_CleanUp(DeallocBuf(&OutBuf));
+  f64 DecodeTime = traits<f64>::Max;
+  idx2_For(int, Run, 0, NRuns + 1) {
+    timer Timer; StartTimer(&Timer);
+    idx2_ExitIfError(Decode(&Dec, Q, &OutBuf));
+    if (Run > 0) // the first decode reads the files
+      DecodeTime = Min(DecodeTime, Seconds(ElapsedTime(&Timer)));
+  }
+  RemoveDirIfExists(idx2_PrintScratch("%s/%s", P.OutDir, P.Meta.Name));
+
+  printf("zfp blocks %-7s: encode %8.3f Mblocks/s (%.3f s), decode %8.3f Mblocks/s (%.3f s)\n",
+         P.Meta.Field, NBlocks / EncodeTime * 1e-6, EncodeTime, NBlocks / DecodeTime * 1e-6, DecodeTime);
+}
+
+static void
+BenchZfpBlocks() {
+  BenchZfpBlocks(dtype::float64);
+  BenchZfpBlocks(dtype::float32);
+}
+
+/*
+Copy all the 4^3 blocks of the finest subband (stride 2) of a 64^3 brick to a local block and back,
+sample by sample with volume::At (as the codec did before) and with GatherBlock and ScatterBlock.
+The rate is in blocks per second for a round trip. */
+idx2_T(t) static void
+BenchBlockCopy(dtype DType) {
+  const v3i BrickDims3(64);
+  volume Vol(BrickDims3, DType);
+  idx2_CleanUp(Dealloc(&Vol));
+  FillField(&Vol);
+  const v3i From3(1), Strd3(2), SbDims3 = BrickDims3 / Strd3;
+  const v3i NBlocks3 = SbDims3 / 4;
+  const v3<i64> SampleStrd3(Strd3.X, i64(Strd3.Y) * BrickDims3.X, i64(Strd3.Z) * BrickDims3.X * BrickDims3.Y);
+  const int NReps = 50;
+  const f64 NBlocks = f64(Prod<i64>(NBlocks3)) * NReps;
+  t Block[64];
+  f64 Sum = 0; // keeps the copies from being optimized away
+
+  f64 AtTime = traits<f64>::Max;
+  idx2_For(int, Run, 0, NRuns) {
+    timer Timer; StartTimer(&Timer);
+    idx2_For(int, Rep, 0, NReps) {
+      v3i B3;
+      idx2_BeginFor3(B3, v3i(0), NBlocks3, v3i(1)) {
+        v3i S3;
+        int J = 0;
+        idx2_BeginFor3(S3, v3i(0), v3i(4), v3i(1)) {
+          Block[J++] = Vol.At<t>(From3, Strd3, B3 * 4 + S3);
+        } idx2_EndFor3
+        Block[Rep & 63] += 1;
+        J = 0;
+        idx2_BeginFor3(S3, v3i(0), v3i(4), v3i(1)) {
+          Vol.At<t>(From3, Strd3, B3 * 4 + S3) = Block[J++];
+        } idx2_EndFor3
+      } idx2_EndFor3
+    }
+    AtTime = Min(AtTime, Seconds(ElapsedTime(&Timer)));
+    Sum += Block[0];
+  }
+
+  f64 BlockTime = traits<f64>::Max;
+  idx2_For(int, Run, 0, NRuns) {
+    timer Timer; StartTimer(&Timer);
+    idx2_For(int, Rep, 0, NReps) {
+      v3i B3;
+      idx2_BeginFor3(B3, v3i(0), NBlocks3, v3i(1)) {
+        t* Base = &Vol.At<t>(From3, Strd3, B3 * 4);
+        GatherBlock(Base, SampleStrd3, Block);
+        Block[Rep & 63] += 1;
+        ScatterBlock(Block, SampleStrd3, Base);
+      } idx2_EndFor3
+    }
+    BlockTime = Min(BlockTime, Seconds(ElapsedTime(&Timer)));
+    Sum += Block[0];
+  }
+
+  stref TypeStr = ToString(DType);
+  printf("block copy %-7.*s: At %8.3f Mblocks/s, GatherBlock/ScatterBlock %8.3f Mblocks/s (checksum %g)\n",
+         TypeStr.Size, TypeStr.ConstPtr, NBlocks / AtTime * 1e-6, NBlocks / BlockTime * 1e-6, Sum);
+}
+
+static void
+BenchBlockCopy() {
+  BenchBlockCopy<f64>(dtype::float64);
+  BenchBlockCopy<f32>(dtype::float32);
+}
+
+/*
+Decode the 40 highest bit planes of many zfp blocks with Zfp.DecodeTest, then transpose them with
+Zfp.TransposeRecursive (as DecodeSubband does for high-precision decodes), for every isa the cpu
+supports. The coefficients decay along the block like those of smooth fields. */
+static void
+BenchBitPlanes() {
+  const int NBlocks = 1 << 14, NBps = 40, NVals = 64;
+  u64 Seed = 1;
+  auto Next = [&Seed]() { Seed = Seed * 6364136223846793005ull + 1442695040888963407ull; return Seed; };
+  bitstream Bs;
+  InitWrite(&Bs, i64(NBlocks) * NBps * (NVals + 8) / 8 + 64);
+  idx2_CleanUp(Dealloc(&Bs));
+  idx2_For(int, B, 0, NBlocks) {
+    u64 Block[64];
+    idx2_For(int, I, 0, 64) Block[I] = Next() >> (I / 2 + (Next() >> 61));
+    i8 N = 0;
+    idx2_InclusiveForBackward(int, Bp, 63, 64 - NBps) Zfp.Encode(Block, NVals, Bp, N, &Bs);
+  }
+  Flush(&Bs);
+  isa Best = Zfp.Isa;
+  idx2_InclusiveFor(u8, I, u8(isa::scalar), u8(Best)) {
+    SetIsa(isa(I));
+    f64 Time = traits<f64>::Max;
+    u64 Sum = 0; // keeps the decode from being optimized away
+    idx2_For(int, Run, 0, NRuns) {
+      timer Timer; StartTimer(&Timer);
+      bitstream In;
+      InitRead(&In, Bs.Stream);
+      idx2_For(int, B, 0, NBlocks) {
+        u64 Block[64] = {};
+        i8 N = 0;
+        idx2_For(int, K, 0, NBps) Zfp.DecodeTest(&Block[K], NVals, N, &In);
+        Zfp.TransposeRecursive(Block, NBps);
+        Sum += Block[B & 63];
+      }
+      Time = Min(Time, Seconds(ElapsedTime(&Timer)));
+    }
+    stref IsaStr = ToString(Zfp.Isa);
+    printf("bit planes %-7.*s: %8.3f Mblocks/s (checksum %llu)\n", IsaStr.Size, IsaStr.ConstPtr,
+           NBlocks / Time * 1e-6, (unsigned long long)Sum);
+  }
+  SetIsa(Best);
+}
+
+/*
+Forward and inverse zfp transforms (with the shuffle) of many blocks, one block at a time and
+Zfp.BatchSize blocks at a time, for every isa the cpu supports. */
+static void
+BenchZfpTransform() {
+  const int NBlocks = 1 << 8, NReps = 1 << 7; // the blocks stay in the cache
+  u64 Seed = 1;
+  array<i64> Ints; Resize(&Ints, i64(NBlocks) * 64);
+  idx2_CleanUp(Dealloc(&Ints));
+  array<u64> UInts; Resize(&UInts, i64(NBlocks) * 64);
+  idx2_CleanUp(Dealloc(&UInts));
+  array<i64> Out; Resize(&Out, i64(NBlocks) * 64);
+  idx2_CleanUp(Dealloc(&Out));
+  idx2_For(i64, I, 0, Size(Ints)) {
+    Seed = Seed * 6364136223846793005ull + 1442695040888963407ull;
+    Ints[I] = i64(Seed >> 4) - (i64(1) << 59);
+  }
+  isa Best = Zfp.Isa;
+  idx2_InclusiveFor(u8, I, u8(isa::scalar), u8(Best)) {
+    SetIsa(isa(I));
+    f64 Times[4]; // forward, inverse, forward batched, inverse batched
+    idx2_For(int, K, 0, 4) Times[K] = traits<f64>::Max;
+    idx2_For(int, Run, 0, NRuns) {
+      timer Timer; StartTimer(&Timer);
+      idx2_For(int, R, 0, NReps) idx2_For(int, B, 0, NBlocks) {
+        i64 Block[64];
+        memcpy(Block, &Ints[B * 64], sizeof(Block));
+        Zfp.ForwardZfp(Block, 3);
+        Zfp.ForwardShuffle(Block, &UInts[B * 64], 3);
+      }
+      Times[0] = Min(Times[0], Seconds(ElapsedTime(&Timer)));
+      StartTimer(&Timer);
+      idx2_For(int, R, 0, NReps) idx2_For(int, B, 0, NBlocks) {
+        Zfp.InverseShuffle(&UInts[B * 64], &Out[B * 64], 3);
+        Zfp.InverseZfp(&Out[B * 64], 3);
+      }
+      Times[1] = Min(Times[1], Seconds(ElapsedTime(&Timer)));
+      StartTimer(&Timer);
+      idx2_For(int, R, 0, NReps) for (int B = 0; B < NBlocks; B += Zfp.BatchSize)
+        Zfp.ForwardZfpBatch(&Ints[B * 64], &UInts[B * 64]);
+      Times[2] = Min(Times[2], Seconds(ElapsedTime(&Timer)));
+      StartTimer(&Timer);
+      idx2_For(int, R, 0, NReps) for (int B = 0; B < NBlocks; B += Zfp.BatchSize)
+        Zfp.InverseZfpBatch(&UInts[B * 64], &Out[B * 64]);
+      Times[3] = Min(Times[3], Seconds(ElapsedTime(&Timer)));
+    }
+    stref IsaStr = ToString(Zfp.Isa);
+    printf("zfp transform %-7.*s: forward %8.3f inverse %8.3f, batched (%d) forward %8.3f inverse %8.3f Mblocks/s (checksum %lld)\n",
+           IsaStr.Size, IsaStr.ConstPtr, NBlocks * NReps / Times[0] * 1e-6, NBlocks * NReps / Times[1] * 1e-6, Zfp.BatchSize,
+           NBlocks * NReps / Times[2] * 1e-6, NBlocks * NReps / Times[3] * 1e-6, (long long)Out[NBlocks * 32]);
+  }
+  SetIsa(Best);
+}
+
+/*
+Forward and inverse CDF 5/3 lifting of a f64 volume along each axis (one pass on the whole volume),
+with FLiftCdf53X/Y/Z and ILiftCdf53X/Y/Z and with the Cdf53 kernels of every isa the cpu supports.
+The volume is either a brick (which stays in the cache) or a larger volume. */
+static void
+BenchCdf53(int N, int NReps) {
+  v3i N3(N), M3(N - 1);
+  volume Vol(N3, dtype::float64);
+  idx2_CleanUp(Dealloc(&Vol));
+  FillField(&Vol);
+  grid G(N3);
+  f64 NSamples = f64(Prod<i64>(N3)) * NReps;
+  auto Time = [&](auto&& Func) {
+    f64 Best = traits<f64>::Max;
+    idx2_For(int, Run, 0, NRuns) {
+      timer Timer; StartTimer(&Timer);
+      idx2_For(int, R, 0, NReps) Func();
+      Best = Min(Best, Seconds(ElapsedTime(&Timer)));
+    }
+    return NSamples / Best * 1e-6;
+  };
+  /* a forward pass followed by an inverse pass leaves the volume (almost) as it was */
+  f64 Old[3][2];
+  Old[0][0] = Time([&]() { FLiftCdf53X<f64>(G, M3, lift_option::Normal, &Vol); ILiftCdf53X<f64>(G, M3, lift_option::Normal, &Vol); });
+  Old[1][0] = Time([&]() { FLiftCdf53Y<f64>(G, M3, lift_option::Normal, &Vol); ILiftCdf53Y<f64>(G, M3, lift_option::Normal, &Vol); });
+  Old[2][0] = Time([&]() { FLiftCdf53Z<f64>(G, M3, lift_option::Normal, &Vol); ILiftCdf53Z<f64>(G, M3, lift_option::Normal, &Vol); });
+  printf("cdf53 %3d^3 lines  : forward+inverse X %8.2f Y %8.2f Z %8.2f MSamples/s\n", N, Old[0][0], Old[1][0], Old[2][0]);
+  isa Best = Zfp.Isa;
+  idx2_InclusiveFor(u8, I, u8(isa::scalar), u8(Best)) {
+    SetIsa(isa(I));
+    f64 New[3];
+    idx2_For(int, D, 0, 3) {
+      New[D] = Time([&]() { Cdf53.FLift[D][1](G, M3, lift_option::Normal, &Vol); Cdf53.ILift[D][1](G, M3, lift_option::Normal, &Vol); });
+    }
+    stref IsaStr = ToString(Cdf53.Isa);
+    printf("cdf53 %3d^3 %-7.*s: forward+inverse X %8.2f Y %8.2f Z %8.2f MSamples/s (checksum %g)\n", N, IsaStr.Size,
+           IsaStr.ConstPtr, New[0], New[1], New[2], ((f64*)Vol.Buffer.Data)[Prod<i64>(N3) / 2]);
+  }
+  SetIsa(Best);
+}
+
+static void
+BenchCdf53() {
+  BenchCdf53(33, 256);
+  BenchCdf53(257, 2);
+}
+
+/*
+Extrapolate and transform 32^3 f64 bricks (full ones and ones at the boundary of a volume) as the
+encoder does, with ExtrapolateCdf53 twice then ForwardCdf53, and with the fused lifting passes
+(LiftCdf53) then NormalizeCdf53. */
+static void
+BenchBrickTransform() {
+  const int NReps = 64;
+  v3i B3(33), M3(32);
+  u64 Order = EncodeTransformOrder("XYZ++");
+  transform_details Td;
+  ComputeTransformDetails(&Td, B3, 2, Order);
+  array<subband> Subbands;
+  BuildSubbands(B3, 2, Order, &Subbands);
+  idx2_CleanUp(Dealloc(&Subbands));
+  volume Vol(B3, dtype::float64);
+  idx2_CleanUp(Dealloc(&Vol));
+  const v3i DimsList[] = { v3i(32), v3i(20, 32, 7) };
+  for (const v3i& N3 : DimsList) {
+    array<lift_pass> Passes;
+    idx2_CleanUp(Dealloc(&Passes));
+    transform_details TdExt;
+    ComputeTransformDetails(&TdExt, N3, Log2Floor(Max(Max(N3.X, N3.Y), N3.Z)), Order);
+    PushForwardPasses(TdExt, M3, &Passes);
+    PushInversePasses(TdExt, M3, &Passes);
+    ComputeTransformDetails(&TdExt, N3, 5, Order);
+    PushForwardPasses(TdExt, M3, &Passes);
+    ComputeTransformDetails(&TdExt, B3, 5, Order);
+    PushInversePasses(TdExt, M3, &Passes);
+    PushForwardPasses(Td, B3, &Passes);
+    f64 Times[2] = { traits<f64>::Max, traits<f64>::Max }; // separate, fused
+    idx2_For(int, Run, 0, NRuns) {
+      FillField(&Vol);
+      timer Timer; StartTimer(&Timer);
+      idx2_For(int, R, 0, NReps) {
+        transform_details TdBrick;
+        ComputeTransformDetails(&TdBrick, N3, Log2Floor(Max(Max(N3.X, N3.Y), N3.Z)), Order);
+        ExtrapolateCdf53(TdBrick, &Vol);
+        ExtrapolateCdf53(N3, Order, &Vol);
+        ForwardCdf53(B3, 0, Subbands, Td, &Vol, false);
+      }
+      Times[0] = Min(Times[0], Seconds(ElapsedTime(&Timer)));
+      FillField(&Vol);
+      StartTimer(&Timer);
+      idx2_For(int, R, 0, NReps) {
+        LiftCdf53(Passes, &Vol);
+        NormalizeCdf53(B3, 0, Subbands, Td, &Vol, false);
+      }
+      Times[1] = Min(Times[1], Seconds(ElapsedTime(&Timer)));
+    }
+    printf("brick transform " idx2_PrStrV3i ": separate %8.3f fused %8.3f Kbricks/s\n", idx2_PrV3i(N3),
+           NReps / Times[0] * 1e-3, NReps / Times[1] * 1e-3);
+  }
+}
+
+struct benchmark {
+  cstr Name;
+  void (*Func)();
+};
+
+static const benchmark Benchmarks[] = {
+  { "zfp_blocks", BenchZfpBlocks },
+  { "block_copy", BenchBlockCopy },
+  { "bit_planes", BenchBitPlanes },
+  { "zfp_transform", BenchZfpTransform },
+  { "cdf53", BenchCdf53 },
+  { "brick_transform", BenchBrickTransform },
+};
+
+int
+main(int Argc, cstr* Argv) {
+  cstr Name = Argc > 1 && Argv[1][0] != '-' ? Argv[1] : nullptr;
+  /* --isa runs the zfp and cdf53 kernels of the given isa (if the cpu supports it) */
+  cstr IsaStr = nullptr;
+  if (OptVal(Argc, Argv, "--isa", &IsaStr))
+    SetIsa(StringTo<isa>()(stref(IsaStr)));
+  stref UsedStr = ToString(Zfp.Isa);
+  printf("isa = %.*s\n", UsedStr.Size, UsedStr.ConstPtr);
+  for (const benchmark& B : Benchmarks) {
+    if (!Name || strcmp(Name, B.Name) == 0)
+      B.Func();
+  }
+  return 0;
+}
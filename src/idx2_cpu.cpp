@@ -0,0 +1,69 @@
+#include "idx2_cpu.h"
+#if defined(idx2_X86)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+namespace idx2 {
+
+#if defined(idx2_X86)
+/* Regs = (EAX, EBX, ECX, EDX) */
+static void
+CpuId(u32 Leaf, u32 SubLeaf, u32 Regs[4]) {
+#if defined(_MSC_VER)
+  int R[4];
+  __cpuidex(R, int(Leaf), int(SubLeaf));
+  idx2_For(int, I, 0, 4) Regs[I] = u32(R[I]);
+#else
+  __cpuid_count(Leaf, SubLeaf, Regs[0], Regs[1], Regs[2], Regs[3]);
+#endif
+}
+
+/* The register state components that the operating system saves on context switches */
+static u64
+XGetBv() {
+#if defined(_MSC_VER)
+  return _xgetbv(0);
+#else
+  u32 Lo, Hi;
+  __asm__ volatile("xgetbv" : "=a"(Lo), "=d"(Hi) : "c"(0));
+  return (u64(Hi) << 32) | Lo;
+#endif
+}
+#endif
+
+isa
+DetectIsa() {
+#if defined(idx2_X86)
+  u32 Regs[4];
+  CpuId(0, 0, Regs);
+  u32 MaxLeaf = Regs[0];
+  if (MaxLeaf < 7)
+    return isa::scalar;
+  CpuId(1, 0, Regs);
+  bool OsXSave = (Regs[2] >> 27) & 1, Avx = (Regs[2] >> 28) & 1, Popcnt = (Regs[2] >> 23) & 1;
+  if (!OsXSave || !Avx || !Popcnt)
+    return isa::scalar;
+  u64 Xcr0 = XGetBv();
+  if ((Xcr0 & 0x6) != 0x6) // the os does not save the xmm and ymm registers
+    return isa::scalar;
+  CpuId(0x80000001, 0, Regs);
+  bool Lzcnt = (Regs[2] >> 5) & 1;
+  CpuId(7, 0, Regs);
+  u32 Ebx = Regs[1];
+  bool Avx2 = (Ebx >> 5) & 1, Bmi1 = (Ebx >> 3) & 1, Bmi2 = (Ebx >> 8) & 1;
+  if (!Avx2 || !Bmi1 || !Bmi2 || !Lzcnt)
+    return isa::scalar;
+  bool Avx512 = ((Ebx >> 16) & 1) && ((Ebx >> 17) & 1) && ((Ebx >> 30) & 1) && ((Ebx >> 31) & 1); // F, DQ, BW, VL
+  if (Avx512 && (Xcr0 & 0xe6) == 0xe6) // the os also saves the opmask and zmm registers
+    return isa::avx512;
+  return isa::avx2;
+#else
+  return isa::scalar;
+#endif
+}
+
+} // namespace idx2
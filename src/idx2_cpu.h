@@ -0,0 +1,41 @@
+/* Detection of the instruction set extensions of the cpu (see zfp_kernels for their use) */
+
+#pragma once
+
+#include "idx2_common.h"
+#include "idx2_enum.h"
+#include "idx2_macros.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define idx2_X86 1
+#endif
+
+/*
+The kernels that have a version for each isa are compiled for that isa with idx2_TargetAvx2 or
+idx2_TargetAvx512 (and with idx2_TargetScalar for the scalar version), independently of the flags
+of the build. Everything they call is inlined into them (so it is also compiled for their isa). The
+scalar kernels are compiled for the architecture the build targets. MSVC needs no flags to compile
+intrinsics, so the attributes only force the inlining there. */
+#if defined(idx2_X86) && (defined(__GNUC__) || defined(__clang__))
+#define idx2_TargetScalar __attribute__((flatten))
+#define idx2_TargetAvx2 __attribute__((target("avx2,bmi,bmi2,lzcnt,popcnt"), flatten))
+#define idx2_TargetAvx512 __attribute__((target("avx512f,avx512bw,avx512dq,avx512vl,avx2,bmi,bmi2,lzcnt,popcnt"), flatten))
+#elif defined(__GNUC__) || defined(__clang__)
+#define idx2_TargetScalar __attribute__((flatten))
+#define idx2_TargetAvx2 __attribute__((flatten))
+#define idx2_TargetAvx512 __attribute__((flatten))
+#else
+#define idx2_TargetScalar
+#define idx2_TargetAvx2
+#define idx2_TargetAvx512
+#endif
+
+idx2_Enum(isa, u8, scalar, avx2, avx512)
+
+namespace idx2 {
+
+/* Return the best isa that both the cpu and the operating system support (avx512 means AVX-512 F,
+BW, DQ and VL; the avx2 and avx512 kernels also use BMI1, BMI2 and LZCNT) */
+isa DetectIsa();
+
+} // namespace idx2
@@ -0,0 +1,132 @@
+#include "idx2_fd_cache.h"
+#include "idx2_algorithm.h"
+#include "idx2_math.h"
+
+namespace idx2 {
+
+static bool
+OpenFd(cstr FileName, file_handle* File, i64* Bytes) {
+#if defined(_WIN32)
+  *File = CreateFileA(FileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (*File == INVALID_HANDLE_VALUE)
+    return false;
+  LARGE_INTEGER FileSize{{0, 0}};
+  if (!GetFileSizeEx(*File, &FileSize)) {
+    CloseHandle(*File);
+    return false;
+  }
+  *Bytes = FileSize.QuadPart;
+#elif defined(__CYGWIN__) || defined(__linux__) || defined(__APPLE__)
+  *File = open(FileName, O_RDONLY);
+  if (*File == -1)
+    return false;
+  struct ::stat Stat;
+  if (fstat(*File, &Stat) == -1) {
+    close(*File);
+    return false;
+  }
+  *Bytes = Stat.st_size;
+#endif
+  return true;
+}
+
+static void
+CloseFd(file_handle File) {
+#if defined(_WIN32)
+  CloseHandle(File);
+#elif defined(__CYGWIN__) || defined(__linux__) || defined(__APPLE__)
+  close(File);
+#endif
+}
+
+/* Hash(cstr) in idx2_hashtable.h is only 32-bit */
+u64
+FdKey(cstr FileName) {
+  u64 H = 0xcbf29ce484222325ull;
+  while (*FileName)
+    H = (u64(u8(*FileName++)) ^ H) * 0x100000001b3ull;
+  return H;
+}
+
+void
+Init(fd_cache* Fc, int MaxOpenFiles) {
+  Fc->MaxOpenFiles = Max(MaxOpenFiles, 1);
+  Init(&Fc->Files, Log2Ceil(Fc->MaxOpenFiles) + 2);
+  Fc->Clock = 0;
+  Fc->NHits = Fc->NMisses = 0;
+}
+
+void
+Dealloc(fd_cache* Fc) {
+  idx2_ForEach(It, Fc->Files) CloseFd(It.Val->File);
+  Dealloc(&Fc->Files);
+}
+
+bool
+Acquire(fd_cache* Fc, u64 Key, cstr FileName, file_handle* File, i64* Bytes) {
+  lock Lock(&Fc->Mutex);
+  auto It = Lookup(&Fc->Files, Key);
+  if (It) {
+    ++Fc->NHits;
+  } else {
+    ++Fc->NMisses;
+    /* close the least recently used file that is not in use */
+    if (Size(Fc->Files) >= Fc->MaxOpenFiles) {
+      u64 LruKey = 0, LruUse = traits<u64>::Max;
+      idx2_ForEach(FIt, Fc->Files) {
+        if (FIt.Val->NUsers == 0 && FIt.Val->LastUse < LruUse) {
+          LruKey = *FIt.Key;
+          LruUse = FIt.Val->LastUse;
+        }
+      }
+      if (LruUse != traits<u64>::Max) {
+        CloseFd(Lookup(&Fc->Files, LruKey).Val->File);
+        Delete(&Fc->Files, LruKey);
+      }
+    }
+    fd_entry Entry;
+    if (!OpenFd(FileName, &Entry.File, &Entry.Bytes))
+      return false;
+    It = Insert(&Fc->Files, Key, Entry);
+  }
+  It.Val->LastUse = ++Fc->Clock;
+  ++It.Val->NUsers;
+  *File = It.Val->File;
+  *Bytes = It.Val->Bytes;
+  return true;
+}
+
+void
+Release(fd_cache* Fc, u64 Key) {
+  lock Lock(&Fc->Mutex);
+  auto It = Lookup(&Fc->Files, Key);
+  idx2_Assert(It && It.Val->NUsers > 0);
+  --It.Val->NUsers;
+}
+
+bool
+ReadAt(file_handle File, i64 Offset, void* Dst, i64 Bytes) {
+#if defined(_WIN32)
+  byte* Ptr = (byte*)Dst;
+  while (Bytes > 0) {
+    OVERLAPPED Ov = {};
+    Ov.Offset = DWORD(Offset & 0xFFFFFFFF);
+    Ov.OffsetHigh = DWORD(Offset >> 32);
+    DWORD Read = 0;
+    if (!::ReadFile(File, Ptr, DWORD(Min(Bytes, i64(1) << 30)), &Read, &Ov) || Read == 0)
+      return false;
+    Ptr += Read; Offset += Read; Bytes -= Read;
+  }
+#elif defined(__CYGWIN__) || defined(__linux__) || defined(__APPLE__)
+  byte* Ptr = (byte*)Dst;
+  while (Bytes > 0) {
+    ssize_t Read = pread(File, Ptr, size_t(Bytes), off_t(Offset));
+    if (Read <= 0)
+      return false;
+    Ptr += Read; Offset += Read; Bytes -= Read;
+  }
+#endif
+  return true;
+}
+
+} // namespace idx2
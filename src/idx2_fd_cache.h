@@ -0,0 +1,59 @@
+/* An LRU cache of files that are open for reading, keyed by a hash of the file path */
+
+#pragma once
+
+#include "idx2_common.h"
+#include "idx2_hashtable.h"
+#include "idx2_memory.h"
+#include "idx2_memory_map.h"
+#include "idx2_mutex.h"
+
+namespace idx2 {
+
+struct fd_entry {
+  file_handle File;
+  i64 Bytes = 0; // size of the file
+  u64 LastUse = 0;
+  int NUsers = 0; // an entry in use is never closed
+};
+
+/*
+The key is a hash of the path since the ids of data, exponent, and rdo files can coincide.
+The files are read with positional reads (pread), so several threads can read from the same file
+at the same time. When there are MaxOpenFiles open files, opening one more file closes the least
+recently used file that is not in use. */
+struct fd_cache {
+  hash_table<u64, fd_entry> Files;
+  int MaxOpenFiles = 256;
+  u64 Clock = 0;
+  i64 NHits = 0;
+  i64 NMisses = 0;
+  mutex Mutex;
+};
+
+void Init(fd_cache* Fc, int MaxOpenFiles);
+/* Close all the files */
+void Dealloc(fd_cache* Fc);
+
+/* The key of a file in the cache (a 64-bit FNV-1a hash of the path) */
+u64 FdKey(cstr FileName);
+/*
+Return the handle of a file (opening it if it is not in the cache) and its size. The file is not
+closed until Release is called. Return false if the file cannot be opened. */
+bool Acquire(fd_cache* Fc, u64 Key, cstr FileName, file_handle* File, i64* Bytes);
+void Release(fd_cache* Fc, u64 Key);
+
+/* Read Bytes bytes starting at Offset. Return false if fewer bytes are read. */
+bool ReadAt(file_handle File, i64 Offset, void* Dst, i64 Bytes);
+
+/* Read the Bytes bytes right before *Where, then move *Where to the start of those bytes */
+idx2_Inline bool
+ReadBackwardAt(file_handle File, i64* Where, void* Dst, i64 Bytes) {
+  *Where -= Bytes;
+  return ReadAt(File, *Where, Dst, Bytes);
+}
+
+idx2_T(t) idx2_Inline bool
+ReadBackwardPOD(file_handle File, i64* Where, t* Val) { return ReadBackwardAt(File, Where, Val, sizeof(t)); }
+
+} // namespace idx2
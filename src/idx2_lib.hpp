@@ -21,12 +21,59 @@ Init(idx2_file* Idx2, const params& P);
 idx2::grid
 GetOutputGrid(const idx2_file& Idx2, const params& P);
 
+/* Set P.NThreads > 1 to decode the bricks of each level on multiple threads */
 error<idx2_file_err_code>
 Decode(idx2_file* Idx2, const params& P, buffer* OutBuf);
 
 error<idx2_file_err_code>
 Destroy(idx2_file* Idx2);
 
+/*
+A decoder keeps the file indices, exponents, rdo information, and chunks it reads across Decode
+calls, so repeated queries against the same field do not read and parse the same files again.
+Idx2 must outlive the decoder, and the decoder must not be copied or moved after Init. */
+struct decoder {
+  const idx2_file* Idx2 = nullptr;
+  decode_data D;
+};
+
+error<idx2_file_err_code>
+Init(decoder* Dec, const idx2_file& Idx2, const params& P);
+
+/* Same as Decode(idx2_file*, ...) but reuses (and keeps) the caches of Dec */
+error<idx2_file_err_code>
+Decode(decoder* Dec, const params& P, buffer* OutBuf);
+
+/*
+Report how many files, chunks, and compressed bytes decoding with P would read, and the size of the
+output, without decoding (only the chunk indices and the exponents are read) */
+error<idx2_file_err_code>
+EstimateDecodeCost(const idx2_file& Idx2, const params& P, decode_cost* Cost);
+
+/* Same as above, but the indices and exponents that are read stay in the caches of Dec (and
+Cost->ResidentChunkBytes tells how much of the data Dec already has) */
+error<idx2_file_err_code>
+EstimateDecodeCost(decoder* Dec, const params& P, decode_cost* Cost);
+
+/*
+Same as Decode(Dec, P, OutBuf), but the zfp state of every decoded block is kept in Dec, so that a
+later Refine of the same region with a smaller P.DecodeAccuracy reads and decodes only the bit planes
+that are missing (a larger P.DecodeAccuracy returns the more accurate result that Dec already has).
+The states take about as much memory as the decoded bricks; Clear drops them. */
+error<idx2_file_err_code>
+Refine(decoder* Dec, const params& P, buffer* OutBuf);
+
+/* Drop everything Dec has cached (e.g. if the files have changed) and close its files */
+void
+Clear(decoder* Dec);
+
+/* Evict cached chunks, least recently used first, until at most MaxBytes remain */
+void
+Trim(decoder* Dec, i64 MaxBytes = 0);
+
+error<idx2_file_err_code>
+Destroy(decoder* Dec);
+
 }
 
 #ifdef idx2_Implementation
@@ -51,8 +98,7 @@ GetOutputGrid(const idx2_file& Idx2, const params& P) {
 
 error<idx2_file_err_code>
 Decode(idx2_file* Idx2, const params& P, buffer* OutBuf) {
-  Decode(*Idx2, P, OutBuf);
-  return idx2_Error(idx2_file_err_code::NoError);
+  return Decode(*Idx2, P, OutBuf);
 }
 
 error<idx2_file_err_code>
@@ -61,6 +107,53 @@ Destroy(idx2_file* Idx2) {
   return idx2_Error(idx2_file_err_code::NoError);
 }
 
+error<idx2_file_err_code>
+Init(decoder* Dec, const idx2_file& Idx2, const params& P) {
+  Dec->Idx2 = &Idx2;
+  Init(&Dec->D, P.MaxOpenFiles);
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
+error<idx2_file_err_code>
+Decode(decoder* Dec, const params& P, buffer* OutBuf) {
+  return Decode(*Dec->Idx2, P, &Dec->D, OutBuf);
+}
+
+error<idx2_file_err_code>
+Refine(decoder* Dec, const params& P, buffer* OutBuf) {
+  params Q = P;
+  Q.KeepBlockStates = true;
+  return Decode(*Dec->Idx2, Q, &Dec->D, OutBuf);
+}
+
+error<idx2_file_err_code>
+EstimateDecodeCost(const idx2_file& Idx2, const params& P, decode_cost* Cost) {
+  idx2_RAII(decode_data, D, Init(&D, P.MaxOpenFiles));
+  return EstimateDecodeCost(Idx2, P, &D, Cost);
+}
+
+error<idx2_file_err_code>
+EstimateDecodeCost(decoder* Dec, const params& P, decode_cost* Cost) {
+  return EstimateDecodeCost(*Dec->Idx2, P, &Dec->D, Cost);
+}
+
+void
+Clear(decoder* Dec) {
+  ClearCaches(&Dec->D);
+}
+
+void
+Trim(decoder* Dec, i64 MaxBytes) {
+  TrimCaches(&Dec->D, MaxBytes);
+}
+
+error<idx2_file_err_code>
+Destroy(decoder* Dec) {
+  Dealloc(&Dec->D);
+  Dec->Idx2 = nullptr;
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
 } // end namespace idx2
 
 #endif // idx2_Implementation
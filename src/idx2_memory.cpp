@@ -108,10 +108,10 @@ Alloc(buffer* Buf, i64 Bytes) {
 void linear_allocator::
 Dealloc(buffer* Buf) {
   if (Buf->Data + Buf->Bytes == Block.Data + CurrentBytes) {
+    CurrentBytes -= Buf->Bytes;
     Buf->Data = nullptr;
     Buf->Bytes = 0;
     Buf->Alloc = nullptr;
-    CurrentBytes -= Buf->Bytes;
   }
 }
 
@@ -207,6 +207,66 @@ DeallocAll() {
   Secondary->DeallocAll();
 }
 
+arena_allocator::
+arena_allocator() = default;
+
+arena_allocator::
+arena_allocator(i64 BlockBytesIn, allocator* ParentIn)
+  : BlockBytes(BlockBytesIn)
+  , Parent(ParentIn) {}
+
+bool arena_allocator::
+Alloc(buffer* Buf, i64 Bytes) {
+  idx2_Assert(Parent && BlockBytes > 0);
+  idx2_Assert(!Buf->Data || Buf->Bytes == 0, "Buffer not freed before allocating new memory");
+  const i64 HeaderBytes = ((i64)sizeof(block) + Align - 1) / Align * Align;
+  i64 PaddedBytes = (Bytes + Align - 1) / Align * Align;
+  if (!Current.Alloc(Buf, PaddedBytes)) {
+    /* an allocation that does not fit in a block gets a block of its own, and the current block
+    (which may still have room for smaller allocations) stays current */
+    bool OwnBlock = HeaderBytes + PaddedBytes > BlockBytes;
+    buffer BlockBuf;
+    Parent->Alloc(&BlockBuf, OwnBlock ? HeaderBytes + PaddedBytes : BlockBytes);
+    block* B = (block*)BlockBuf.Data;
+    B->Next = Blocks;
+    B->Bytes = BlockBuf.Bytes;
+    Blocks = B;
+    ++NBlocks;
+    buffer Rest = BlockBuf + HeaderBytes;
+    if (OwnBlock) {
+      Buf->Data = Rest.Data;
+    } else {
+      Current = linear_allocator(Rest);
+      Current.Alloc(Buf, PaddedBytes);
+    }
+  }
+  ++NAllocs;
+  Buf->Bytes = Bytes;
+  Buf->Alloc = this;
+  return true;
+}
+
+void arena_allocator::
+Dealloc(buffer* Buf) {
+  buffer PaddedBuf(Buf->Data, (Buf->Bytes + Align - 1) / Align * Align, &Current);
+  Current.Dealloc(&PaddedBuf);
+  Buf->Data = nullptr;
+  Buf->Bytes = 0;
+  Buf->Alloc = nullptr;
+}
+
+void arena_allocator::
+DeallocAll() {
+  while (Blocks) {
+    block* Next = Blocks->Next;
+    buffer BlockBuf((byte*)Blocks, Blocks->Bytes, Parent);
+    Parent->Dealloc(&BlockBuf);
+    Blocks = Next;
+  }
+  Current = linear_allocator();
+  NAllocs = NBlocks = 0;
+}
+
 void
 Clone(const buffer& Src, buffer* Dst, allocator* Alloc) {
   if (Dst->Data && Dst->Bytes != Src.Bytes)
@@ -2,8 +2,7 @@
 
 // TODO: think about thread safety
 // TODO: (double-ended) StackAllocator
-// TODO: aligned allocation
-// TODO: pool allocator
+// NOTE: see idx2_pool_allocator.h for a thread-safe pool of aligned blocks
 // TODO: add asserts
 
 #include <stdlib.h>
@@ -55,6 +54,10 @@ struct free_list_allocator;
 /* Try to allocate using one allocator first (the Primary), then if that fails,
  * use another allocator (the Secondary). */
 struct fallback_allocator;
+/*
+A linear allocator over a chain of large blocks (taken from some Parent allocator), all of which
+are freed at once by DeallocAll. Dealloc only reclaims the most recent allocation. Not thread-safe. */
+struct arena_allocator;
 
 struct mallocator : public allocator {
   bool Alloc(buffer* Buf, i64 Bytes) override;
@@ -123,6 +126,22 @@ struct fallback_allocator : public allocator {
   void DeallocAll() override;
 };
 
+struct arena_allocator : public allocator {
+  struct block { block* Next = nullptr; i64 Bytes = 0; }; // the header of a block
+  static constexpr i64 Align = 16; // the alignment of the allocations
+  linear_allocator Current; // the part of the current block after its header
+  block* Blocks = nullptr; // all the blocks, the most recent first
+  i64 BlockBytes = 0;
+  allocator* Parent = nullptr;
+  i64 NAllocs = 0; // the number of allocations since the last DeallocAll
+  i64 NBlocks = 0; // the number of allocations from Parent since the last DeallocAll
+  arena_allocator();
+  arena_allocator(i64 BlockBytesIn, allocator* ParentIn = &Mallocator());
+  bool Alloc(buffer* Buf, i64 Bytes) override;
+  void Dealloc(buffer* Buf) override;
+  void DeallocAll() override;
+};
+
 void Clone(const buffer& Src, buffer* Dst, allocator* Alloc = &Mallocator());
 
 /* Abstract away memory allocations/deallocations */
@@ -59,7 +59,7 @@ MapFile(mmap_file* MMap, i64 Bytes) {
   MMap->Buf.Bytes = FileSize.QuadPart;
 #elif defined(__CYGWIN__) || defined(__linux__) || defined(__APPLE__)
   size_t FileSize;
-  struct stat Stat;
+  struct ::stat Stat;
   if (Bytes != 0)
     FileSize = Bytes;
   else if (fstat(MMap->File, &Stat) == 0)
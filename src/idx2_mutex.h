@@ -16,6 +16,14 @@ bool TryLock(mutex* Mutex);
 /* Return true if the lock can be released. Return false if something goes wrong. */
 bool Unlock(mutex* Mutex);
 
+struct condition_variable;
+/*
+Release the mutex (which must be held), block until the condition variable is signalled, then
+acquire the mutex again. The wait can end without a signal, so the condition must be checked again. */
+bool Wait(condition_variable* Cond, mutex* Mutex);
+/* Wake up all the threads waiting on the condition variable */
+bool NotifyAll(condition_variable* Cond);
+
 }
 
 #include "idx2_macros.h"
@@ -63,12 +71,29 @@ Unlock(mutex* Mutex) {
   return true;
 }
 
+struct condition_variable {
+  CONDITION_VARIABLE Cv;
+  condition_variable();
+};
+
+idx2_Inline condition_variable::
+condition_variable() { InitializeConditionVariable(&Cv); }
+
+idx2_Inline bool
+Wait(condition_variable* Cond, mutex* Mutex) { return SleepConditionVariableCS(&Cond->Cv, &Mutex->Crit, INFINITE) != 0; }
+
+idx2_Inline bool
+NotifyAll(condition_variable* Cond) {
+  WakeAllConditionVariable(&Cond->Cv);
+  return true;
+}
+
 } // namespace idx2
 #elif defined(__CYGWIN__) || defined(__linux__) || defined(__APPLE__)
 #include <pthread.h>
 namespace idx2 {
 struct mutex {
-  pthread_mutex_t Mx;
+  pthread_mutex_t Mx = PTHREAD_MUTEX_INITIALIZER;
 };
 
 struct lock {
@@ -92,6 +117,16 @@ TryLock(mutex* Mutex) { return pthread_mutex_trylock(&Mutex->Mx) == 0; }
 idx2_Inline bool
 Unlock(mutex* Mutex) { return pthread_mutex_unlock(&Mutex->Mx) == 0; }
 
+struct condition_variable {
+  pthread_cond_t Cv = PTHREAD_COND_INITIALIZER;
+};
+
+idx2_Inline bool
+Wait(condition_variable* Cond, mutex* Mutex) { return pthread_cond_wait(&Cond->Cv, &Mutex->Mx) == 0; }
+
+idx2_Inline bool
+NotifyAll(condition_variable* Cond) { return pthread_cond_broadcast(&Cond->Cv) == 0; }
+
 } // namespace idx2
 #endif
 
@@ -0,0 +1,163 @@
+#include "idx2_pool_allocator.h"
+#include "idx2_assert.h"
+#include "idx2_math.h"
+#include <stdlib.h>
+
+namespace idx2 {
+
+using block = block_pool::block;
+
+static byte*
+AlignedAlloc(i64 Bytes, int Align) {
+#if defined(_WIN32)
+  return (byte*)_aligned_malloc(size_t(Bytes), size_t(Align));
+#elif defined(__CYGWIN__) || defined(__linux__) || defined(__APPLE__)
+  void* Ptr = nullptr;
+  return posix_memalign(&Ptr, size_t(Align), size_t(Bytes)) == 0 ? (byte*)Ptr : nullptr;
+#endif
+}
+
+static void
+AlignedFree(void* Ptr) {
+#if defined(_WIN32)
+  _aligned_free(Ptr);
+#elif defined(__CYGWIN__) || defined(__linux__) || defined(__APPLE__)
+  free(Ptr);
+#endif
+}
+
+/* Push a list of batches (linked by NextBatch, from First to Last) onto the stack of the pool */
+static void
+PushBatches(block_pool* Pool, block* First, block* Last) {
+  Last->NextBatch = Pool->Batches.load(std::memory_order_relaxed);
+  while (!Pool->Batches.compare_exchange_weak(Last->NextBatch, First, std::memory_order_release, std::memory_order_relaxed)) {}
+}
+
+/* Take a batch from the stack of the pool (or return null if it is empty) */
+static block*
+PopBatch(block_pool* Pool) {
+  block* First = Pool->Batches.exchange(nullptr, std::memory_order_acquire);
+  if (!First)
+    return nullptr;
+  block* Rest = First->NextBatch;
+  if (Rest) {
+    block* Last = Rest;
+    while (Last->NextBatch) Last = Last->NextBatch;
+    PushBatches(Pool, Rest, Last);
+  }
+  First->NextBatch = nullptr;
+  return First;
+}
+
+void
+Init(block_pool* Pool, i64 Bytes) {
+  idx2_Assert(Pool->NBlocks == 0);
+  i64 MinBytes = sizeof(block);
+  Pool->BlockBytes = ((Max(Bytes, MinBytes) + PoolBlockAlign - 1) / PoolBlockAlign) * PoolBlockAlign;
+  Pool->Batches = nullptr;
+}
+
+void
+Trim(block_pool* Pool) {
+  block* Batch = Pool->Batches.exchange(nullptr, std::memory_order_acquire);
+  while (Batch) {
+    block* NextBatch = Batch->NextBatch;
+    for (block* B = Batch; B;) {
+      block* Next = B->Next;
+      AlignedFree(B);
+      --Pool->NBlocks;
+      B = Next;
+    }
+    Batch = NextBatch;
+  }
+}
+
+void
+Dealloc(block_pool* Pool) {
+  Trim(Pool);
+  idx2_Assert(Pool->NBlocks == 0, "%" PRIi64 " blocks are not given back", i64(Pool->NBlocks));
+  Pool->BlockBytes = 0;
+}
+
+void
+Init(pool_allocator* Cache, block_pool* Pool) {
+  idx2_Assert(!Cache->Head && !Cache->Freed.load());
+  Cache->Pool = Pool;
+  Cache->NBlocks = 0;
+}
+
+/* Move the blocks deallocated by any thread into the cache */
+static void
+TakeFreed(pool_allocator* Cache) {
+  block* B = Cache->Freed.exchange(nullptr, std::memory_order_acquire);
+  while (B) {
+    block* Next = B->Next;
+    B->Next = Cache->Head;
+    Cache->Head = B;
+    ++Cache->NBlocks;
+    B = Next;
+  }
+}
+
+/* Give N blocks of the cache back to the pool, as one batch */
+static void
+GiveBatch(pool_allocator* Cache, int N) {
+  idx2_Assert(0 < N && N <= Cache->NBlocks);
+  block* First = Cache->Head;
+  block* Last = First;
+  idx2_For(int, I, 1, N) Last = Last->Next;
+  Cache->Head = Last->Next;
+  Cache->NBlocks -= N;
+  Last->Next = nullptr;
+  PushBatches(Cache->Pool, First, First);
+}
+
+bool pool_allocator::
+Alloc(buffer* Buf, i64 Bytes) {
+  idx2_Assert(Pool && Pool->BlockBytes > 0);
+  if (Bytes > Pool->BlockBytes)
+    return Mallocator().Alloc(Buf, Bytes);
+  if (!Head) {
+    TakeFreed(this);
+    while (NBlocks > 2 * PoolBatchSize) GiveBatch(this, PoolBatchSize);
+  }
+  if (!Head) {
+    Head = PopBatch(Pool);
+    for (block* B = Head; B; B = B->Next) ++NBlocks;
+  }
+  byte* Data = nullptr;
+  if (Head) {
+    Data = (byte*)Head;
+    Head = Head->Next;
+    --NBlocks;
+  } else {
+    Data = AlignedAlloc(Pool->BlockBytes, PoolBlockAlign);
+    idx2_AbortIf(!Data, "Out of memory");
+    ++Pool->NBlocks;
+  }
+  Buf->Data = Data;
+  Buf->Bytes = Bytes;
+  Buf->Alloc = this;
+  return true;
+}
+
+void pool_allocator::
+Dealloc(buffer* Buf) {
+  idx2_Assert(Pool && Buf->Bytes <= Pool->BlockBytes);
+  block* B = (block*)Buf->Data;
+  B->Next = Freed.load(std::memory_order_relaxed);
+  while (!Freed.compare_exchange_weak(B->Next, B, std::memory_order_release, std::memory_order_relaxed)) {}
+  Buf->Data = nullptr;
+  Buf->Bytes = 0;
+  Buf->Alloc = nullptr;
+}
+
+void pool_allocator::
+DeallocAll() {
+  if (!Pool)
+    return;
+  TakeFreed(this);
+  while (NBlocks > 0) GiveBatch(this, Min(NBlocks, PoolBatchSize));
+}
+
+} // namespace idx2
@@ -0,0 +1,57 @@
+/* A thread-safe allocator of equally sized blocks (e.g. bricks), with a cache of blocks per thread */
+
+#pragma once
+
+#include "idx2_common.h"
+#include "idx2_memory.h"
+#include <atomic>
+
+namespace idx2 {
+
+constexpr int PoolBlockAlign = 64; // the alignment of the blocks (a cache line, or an avx-512 vector)
+constexpr int PoolBatchSize = 8; // the number of blocks moved at once between a cache and its pool
+
+/*
+The free blocks of a session (an encode, or a decode_data) that are not in the cache of any thread.
+They are kept in batches of up to PoolBatchSize blocks, which form a lock-free stack: a batch is
+pushed with a compare-and-swap, and a batch is taken by taking the whole stack with an exchange and
+pushing the other batches back, so that no thread ever reads a batch that another thread has taken
+(which makes the stack immune to the ABA problem). A thread that finds the stack empty (possibly
+because another thread holds all the batches for a moment) allocates a new block instead. */
+struct block_pool {
+  struct block {
+    block* Next = nullptr; // the next block in the same list (or batch)
+    block* NextBatch = nullptr; // only used by the first block of a batch in the stack
+  };
+  i64 BlockBytes = 0; // rounded up to a multiple of PoolBlockAlign
+  std::atomic<block*> Batches{nullptr};
+  std::atomic<i64> NBlocks{0}; // the number of blocks allocated from the system
+};
+
+/* Blocks can hold up to Bytes bytes */
+void Init(block_pool* Pool, i64 Bytes);
+/* Free the blocks in the pool. Blocks that are in use or in a cache are not freed. */
+void Trim(block_pool* Pool);
+/* Free the blocks, all of which must have been given back (see DeallocAll(pool_allocator*)) */
+void Dealloc(block_pool* Pool);
+
+/*
+The cache of blocks of one thread. Only that thread allocates from it (without synchronization), but
+a block can be deallocated by any thread: the block goes back to the cache it came from, through a
+lock-free list that the cache takes over when it runs out of blocks. A cache holds at most
+2 * PoolBatchSize blocks and gives the rest back to its pool; an empty cache takes a batch from the
+pool. Allocations larger than the blocks of the pool are done with Mallocator(). */
+struct pool_allocator : public allocator {
+  block_pool* Pool = nullptr;
+  block_pool::block* Head = nullptr; // the blocks in the cache
+  int NBlocks = 0; // the number of blocks in Head
+  std::atomic<block_pool::block*> Freed{nullptr}; // the blocks deallocated since the last Alloc
+  bool Alloc(buffer* Buf, i64 Bytes) override;
+  void Dealloc(buffer* Buf) override;
+  /* Give all the blocks in the cache back to the pool. No other thread may use the cache meanwhile. */
+  void DeallocAll() override;
+};
+
+void Init(pool_allocator* Cache, block_pool* Pool);
+
+} // namespace idx2
@@ -0,0 +1,69 @@
+#include "idx2_test.h"
+#include "idx2_common.h"
+#include "idx2_pool_allocator.h"
+#include "idx2_random.h"
+#include <thread>
+
+using namespace idx2;
+
+/* Threads allocate blocks from their own caches, and free them or hand them over to other threads
+through shared slots, so that many blocks are freed by a thread other than the one that allocated
+them; all the blocks must be given back to the pool in the end */
+void
+TestPoolAllocator() {
+  const int NThreads = 4;
+  const int NSlots = 64;
+  block_pool Pool;
+  Init(&Pool, 1000);
+  idx2_Assert(Pool.BlockBytes % PoolBlockAlign == 0 && Pool.BlockBytes >= 1000);
+  pool_allocator Caches[NThreads];
+  idx2_For(int, I, 0, NThreads) Init(&Caches[I], &Pool);
+  std::atomic<byte*> Slots[NSlots];
+  idx2_For(int, I, 0, NSlots) Slots[I] = nullptr;
+  auto Check = [&](byte* Data) {
+    idx2_Assert((uintptr_t)Data % PoolBlockAlign == 0);
+    idx2_For(int, J, 1, 1000) idx2_Assert(Data[J] == Data[0]);
+  };
+  auto Free = [&](byte* Data) {
+    Check(Data);
+    buffer Buf(Data, 1000, &Caches[Data[0] % NThreads]);
+    Buf.Alloc->Dealloc(&Buf);
+  };
+  std::thread Threads[NThreads];
+  idx2_For(int, T, 0, NThreads) {
+    Threads[T] = std::thread([&, T]() {
+      pcg32 Pcg;
+      Seed(&Pcg, 1234 + T);
+      byte* Own[32] = {};
+      idx2_For(int, Round, 0, 20000) {
+        int I = NextUInt(&Pcg, 32);
+        if (Own[I]) {
+          byte* Data = Own[I]; Own[I] = nullptr;
+          if (NextUInt(&Pcg, 2)) // hand the block over to whichever thread takes it from the slot
+            Data = Slots[NextUInt(&Pcg, NSlots)].exchange(Data);
+          if (Data)
+            Free(Data);
+        } else {
+          buffer Buf;
+          Caches[T].Alloc(&Buf, 1 + NextUInt(&Pcg, 1000));
+          memset(Buf.Data, T + NThreads * NextUInt(&Pcg, 60), 1000); // the value says which cache
+          Own[I] = Buf.Data;
+        }
+      }
+      idx2_For(int, I, 0, 32) if (Own[I]) Free(Own[I]);
+    });
+  }
+  idx2_For(int, T, 0, NThreads) Threads[T].join();
+  idx2_For(int, I, 0, NSlots) if (Slots[I]) Free(Slots[I]);
+  /* allocations larger than the blocks do not come from the pool */
+  buffer Big;
+  Caches[0].Alloc(&Big, 2000);
+  idx2_Assert(Big.Alloc != &Caches[0]);
+  DeallocBuf(&Big);
+  idx2_For(int, I, 0, NThreads) Caches[I].DeallocAll();
+  idx2_Assert(Pool.NBlocks > 0);
+  Dealloc(&Pool);
+  idx2_Assert(Pool.NBlocks == 0);
+}
+
+idx2_RegisterTest(TestPoolAllocator)
@@ -21,6 +21,15 @@ struct stat {
     SSq += Val * Val;
   }
 
+  /* combine with the statistics of another (disjoint) set of values */
+  idx2_Inline void Add(const stat& Other) {
+    MinV = Min(MinV, Other.MinV);
+    MaxV = Max(MaxV, Other.MaxV);
+    S += Other.S;
+    N += Other.N;
+    SSq += Other.SSq;
+  }
+
   idx2_Inline f64 GetMin() const { return MinV; }
   idx2_Inline f64 GetMax() const { return MaxV; }
   idx2_Inline f64 Sum() const { return S; }
@@ -10,6 +10,9 @@
 //#include "idx2_signal_processing_test.cpp"
 //#include "idx2_volume_test.cpp"
 #include "idx2_wavelet_test.cpp"
+#include "idx2_zfp_test.cpp"
+#include "idx2_pool_allocator_test.cpp"
+#include "idx2_v1_test.cpp"
 //#include "idx2_wz_test.cpp"
 //#include "idx2_varint_test.cpp"
 //#include "idx2_test.h"
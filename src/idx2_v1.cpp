@@ -29,6 +29,8 @@
 #endif
 
 #include <algorithm> // TODO: write my own quicksort
+#include <atomic>
+#include <thread>
 
 #if defined(__clang__) || defined(__GNUC__)
 #pragma GCC diagnostic push
@@ -68,16 +70,23 @@ GetPartialResolution(const v3i& Dims3, u8 Mask, const array<subband>& Subbands)
   return OutDims3;
 }*/
 
-static grid
-GetGrid(const extent& Ext, int Iter, u8 Mask, const array<subband>& Subbands) {
-  v3i Strd3(1); // start with stride (1, 1, 1)
-  idx2_For(int, D, 0, 3) Strd3[D] <<= Iter; // TODO: only work with 1 transform pass per level
+/* Whether (1) or not (0) some subband in Mask is high along each axis */
+static v3i
+GetHighAxes(u8 Mask, const array<subband>& Subbands) {
   v3i Div(0);
   idx2_For(u8, Sb, 0, 8) {
     if (!BitSet(Mask, Sb)) continue;
     v3i Lh3 = Subbands[Sb].LowHigh3;
     idx2_For(int, D, 0, 3) Div[D] = Max(Div[D], Lh3[D]);
   }
+  return Div;
+}
+
+static grid
+GetGrid(const extent& Ext, int Iter, u8 Mask, const array<subband>& Subbands) {
+  v3i Strd3(1); // start with stride (1, 1, 1)
+  idx2_For(int, D, 0, 3) Strd3[D] <<= Iter; // TODO: only work with 1 transform pass per level
+  v3i Div = GetHighAxes(Mask, Subbands);
   idx2_For(int, D, 0, 3) if (Div[D] == 0) Strd3[D] <<= 1;
   v3i First3 = From(Ext), Last3 = Last(Ext);
   First3 = ((First3 + Strd3 - 1) / Strd3) * Strd3;
@@ -143,7 +152,6 @@ BitPlaneFromChannelKey(u64 ChannelKey) { return i16(ChannelKey >> 16); }
 idx2_Inline u16
 GetSubChannelKey(i8 Iter, i8 Level) { return (u16(Level) << 4) + Iter; }
 
-static free_list_allocator BrickAlloc_;
 
 void Dealloc(params* P) { Dealloc(&P->RdoLevels); }
 void SetName(idx2_file* Idx2, cstr Name) { snprintf(Idx2->Name, sizeof(Idx2->Name), "%s", Name); }
@@ -570,9 +578,67 @@ ReadMetaFile(idx2_file* Idx2, cstr FileName) {
   return idx2_Error(idx2_file_err_code::NoError);
 }
 
+static void
+Append(segmented_stream* Ss, const byte* Data, i64 Bytes) {
+  while (Bytes > 0) {
+    i64 Seg = Ss->Bytes / segmented_stream::SegBytes;
+    i64 Offset = Ss->Bytes % segmented_stream::SegBytes;
+    if (Seg == Size(Ss->Segs)) {
+      buffer Buf;
+      AllocBuf(&Buf, segmented_stream::SegBytes);
+      PushBack(&Ss->Segs, Buf);
+    } else if (Ss->Segs[Seg].Bytes < segmented_stream::SegBytes) { // the segment was trimmed
+      buffer Buf;
+      AllocBuf(&Buf, segmented_stream::SegBytes);
+      memcpy(Buf.Data, Ss->Segs[Seg].Data, size_t(Offset));
+      DeallocBuf(&Ss->Segs[Seg]);
+      Ss->Segs[Seg] = Buf;
+    }
+    i64 N = Min(Bytes, segmented_stream::SegBytes - Offset);
+    memcpy(Ss->Segs[Seg].Data + Offset, Data, size_t(N));
+    Ss->Bytes += N;
+    Data += N;
+    Bytes -= N;
+  }
+}
+
+/* The segments are kept for reuse */
+idx2_Inline static void
+Rewind(segmented_stream* Ss) { Ss->Bytes = 0; }
+
+/* Free the segments past the bytes written and shrink the last one to them, for a stream that is
+kept a while before it is written (see TrimUnit); Append grows the last segment back */
+static void
+Trim(segmented_stream* Ss) {
+  i64 NSegs = (Ss->Bytes + segmented_stream::SegBytes - 1) / segmented_stream::SegBytes;
+  idx2_For(i64, Seg, NSegs, Size(Ss->Segs)) DeallocBuf(&Ss->Segs[Seg]);
+  Resize(&Ss->Segs, NSegs);
+  i64 LastBytes = Ss->Bytes - (NSegs - 1) * segmented_stream::SegBytes;
+  if (NSegs > 0 && LastBytes < Ss->Segs[NSegs - 1].Bytes) {
+    buffer Buf;
+    AllocBuf(&Buf, LastBytes);
+    memcpy(Buf.Data, Ss->Segs[NSegs - 1].Data, size_t(LastBytes));
+    DeallocBuf(&Ss->Segs[NSegs - 1]);
+    Ss->Segs[NSegs - 1] = Buf;
+  }
+}
+
+/* Add the written bytes of each segment to Parts */
+static void
+GetParts(const segmented_stream& Ss, array<buffer>* Parts) {
+  for (i64 Begin = 0, Seg = 0; Begin < Ss.Bytes; Begin += segmented_stream::SegBytes, ++Seg)
+    PushBack(Parts, buffer(Ss.Segs[Seg].Data, Min(segmented_stream::SegBytes, Ss.Bytes - Begin)));
+}
+
+static void
+Dealloc(segmented_stream* Ss) {
+  idx2_ForEach(SegIt, Ss->Segs) DeallocBuf(SegIt);
+  Dealloc(&Ss->Segs);
+  Ss->Bytes = 0;
+}
+
 static void
 Init(channel* C) {
-  InitWrite(&C->BrickStream, 16384);
   InitWrite(&C->BrickDeltasStream, 32);
   InitWrite(&C->BrickSzsStream, 256);
   InitWrite(&C->BlockStream, 256);
@@ -628,7 +694,6 @@ GetLinearBrick(const idx2_file& Idx2, int Iter, v3i Brick3) {
   return LinearBrick;
 }
 
-/* only used for debugging
 static v3i
 GetSpatialBrick(const idx2_file& Idx2, int Iter, u64 LinearBrick) {
   int Size = Idx2.BrickOrderStrs[Iter].Len;
@@ -640,7 +705,7 @@ GetSpatialBrick(const idx2_file& Idx2, int Iter, u64 LinearBrick) {
     Brick3[D] <<= 1;
   }
   return Brick3 >> 1;
-}*/
+}
 
 /* only used for debugging
 static u64
@@ -813,22 +878,28 @@ void Dealloc(chunk_meta_info* Cm) {
 }
 
 static void
-Init(encode_data* E, allocator* Alloc = nullptr) {
+Init(encode_data* E, allocator* Alloc) {
   Init(&E->BrickPool, 9);
   Init(&E->Channels, 10);
   Init(&E->SubChannels, 5);
-  E->Alloc = Alloc ? Alloc : &BrickAlloc_;
+  E->Alloc = Alloc;
   Init(&E->ChunkMeta, 8);
   Init(&E->ChunkEMaxesMeta, 5);
   InitWrite(&E->CpresEMaxes, 32768);
   InitWrite(&E->CpresChunkAddrs, 16384);
-  InitWrite(&E->ChunkStream, 16384);
+  InitWrite(&E->ChunkStream, 64);
+  Reserve(&E->ChunkParts, 64);
   InitWrite(&E->ChunkEMaxesStream, 32768);
   Init(&E->ChunkRDOLengths, 10);
+  Init(&E->Writer);
+  Init(&E->BrickLiftPasses, 3);
 }
 
 static void
 Dealloc(encode_data* E) {
+  idx2_ForEach(BrickIt, E->BrickPool) { // the bricks are only left if the encode failed
+    if (BrickIt.Val->Vol.Buffer) Dealloc(&BrickIt.Val->Vol);
+  }
   E->Alloc->DeallocAll();
   Dealloc(&E->BrickPool);
   idx2_ForEach(ChannelIt, E->Channels) Dealloc(ChannelIt.Val);
@@ -841,12 +912,22 @@ Dealloc(encode_data* E) {
   Dealloc(&E->CpresEMaxes);
   Dealloc(&E->CpresChunkAddrs);
   Dealloc(&E->ChunkStream);
+  Dealloc(&E->ChunkParts);
   Dealloc(&E->ChunkEMaxesStream);
   Dealloc(&E->BlockSigs);
+  Dealloc(&E->ChannelSlots);
   Dealloc(&E->EMaxes);
   Dealloc(&E->BlockStream);
   Dealloc(&E->ChunkRDOs);
   Dealloc(&E->ChunkRDOLengths);
+  Dealloc(&E->ChannelOrder);
+  Dealloc(&E->ChunkEMaxesMeta);
+  /* the files are all flushed unless the encode failed, in which case nothing more is written (and
+  the message of the error, see idx2_Error, is kept) */
+  Discard(&E->Writer);
+  Dealloc(&E->Writer);
+  idx2_ForEach(PassesIt, E->BrickLiftPasses) Dealloc(PassesIt.Val);
+  Dealloc(&E->BrickLiftPasses);
 }
 
 #define idx2_NextMorton(Morton, Row3, Dims3)\
@@ -911,37 +992,36 @@ FlattenBrickTable(
   }
 }
 
-/* book-keeping stuffs */
-static stat BrickDeltasStat;
-static stat BrickSzsStat;
-static stat BrickStreamStat;
-static stat ChunkStreamStat;
-
-// TODO: return error
-static void
+/* A chunk is the number of bricks followed by the brick deltas, the brick sizes, and the brick data.
+The parts are appended to the file as they are, without first being copied into one stream. */
+static error<idx2_file_err_code>
 WriteChunk(const idx2_file& Idx2, encode_data* E, channel* C, i8 Iter, i8 Level, i16 BitPlane) {
-  BrickDeltasStat.Add((f64)Size(C->BrickDeltasStream)); // brick deltas
-  BrickSzsStat.Add((f64)Size(C->BrickSzsStream)); // brick sizes
-  BrickStreamStat.Add((f64)Size(C->BrickStream)); // brick data
-  i64 ChunkSize = Size(C->BrickDeltasStream) + Size(C->BrickSzsStream) + Size(C->BrickStream) + 64;
+  E->BrickDeltasStat.Add((f64)Size(C->BrickDeltasStream)); // brick deltas
+  E->BrickSzsStat.Add((f64)Size(C->BrickSzsStream)); // brick sizes
+  E->BrickStreamStat.Add((f64)Size(C->BrickStream)); // brick data
   Rewind(&E->ChunkStream);
-  GrowToAccomodate(&E->ChunkStream, ChunkSize);
+  GrowToAccomodate(&E->ChunkStream, 16);
   WriteVarByte(&E->ChunkStream, C->NBricks);
-  WriteStream(&E->ChunkStream, &C->BrickDeltasStream);
-  WriteStream(&E->ChunkStream, &C->BrickSzsStream);
-  WriteStream(&E->ChunkStream, &C->BrickStream);
   Flush(&E->ChunkStream);
-  ChunkStreamStat.Add((f64)Size(E->ChunkStream));
+  Flush(&C->BrickDeltasStream);
+  Flush(&C->BrickSzsStream);
+  Clear(&E->ChunkParts);
+  PushBack(&E->ChunkParts, ToBuffer(E->ChunkStream));
+  PushBack(&E->ChunkParts, ToBuffer(C->BrickDeltasStream));
+  PushBack(&E->ChunkParts, ToBuffer(C->BrickSzsStream));
+  GetParts(C->BrickStream, &E->ChunkParts);
+  i64 ChunkSize = Size(E->ChunkStream) + Size(C->BrickDeltasStream) + Size(C->BrickSzsStream) + Size(C->BrickStream);
+  E->ChunkStreamStat.Add((f64)ChunkSize);
+
+  /* write to file */
+  file_id FileId = ConstructFilePath(Idx2, C->LastBrick, Iter, Level, BitPlane);
+  if (!Append(&E->Writer, FileId.Name, Begin(E->ChunkParts), (int)Size(E->ChunkParts)))
+    return idx2_Error(idx2_file_err_code::FileWriteFailed, "%.*s", FileId.Name.Size, FileId.Name.ConstPtr);
 
   /* we are done with these, rewind */
   Rewind(&C->BrickDeltasStream);
   Rewind(&C->BrickSzsStream);
   Rewind(&C->BrickStream);
-
-  /* write to file */
-  file_id FileId = ConstructFilePath(Idx2, C->LastBrick, Iter, Level, BitPlane);
-  idx2_OpenMaybeExistingFile(Fp, FileId.Name.ConstPtr, "ab");
-  WriteBuffer(Fp, ToBuffer(E->ChunkStream));
   /* keep track of the chunk addresses and sizes */
   auto ChunkMetaIt = Lookup(&E->ChunkMeta, FileId.Id);
   if (!ChunkMetaIt) {
@@ -952,34 +1032,32 @@ WriteChunk(const idx2_file& Idx2, encode_data* E, channel* C, i8 Iter, i8 Level,
   idx2_Assert(ChunkMetaIt);
   chunk_meta_info* ChunkMeta = ChunkMetaIt.Val;
   GrowToAccomodate(&ChunkMeta->Sizes, 4);
-  WriteVarByte(&ChunkMeta->Sizes, Size(E->ChunkStream));
+  WriteVarByte(&ChunkMeta->Sizes, ChunkSize);
   u64 ChunkAddress = GetChunkAddress(Idx2, C->LastBrick, Iter, Level, BitPlane);
   PushBack(&ChunkMeta->Addrs, ChunkAddress);
 //  printf("chunk %x level %d bit plane %d offset %llu size %d\n", ChunkAddress, Level, BitPlane, Where, (i64)Size(Channel->ChunkStream));
-  PushBack(&E->ChunkRDOs, rdo_chunk{ChunkAddress, Size(E->ChunkStream), 0.0});
+  PushBack(&E->ChunkRDOs, rdo_chunk{ChunkAddress, ChunkSize, 0.0});
   Rewind(&E->ChunkStream);
+  return idx2_Error(idx2_file_err_code::NoError);
 }
 
-stat BrickEMaxesStat;
-stat ChunkEMaxesStat;
-
 // Write once per chunk
-static void
+static error<idx2_file_err_code>
 WriteChunkExponents(const idx2_file& Idx2, encode_data* E, sub_channel* Sc, i8 Iter, i8 Level) {
   /* brick exponents */
   Flush(&Sc->BrickEMaxesStream);
-  BrickEMaxesStat.Add((f64)Size(Sc->BrickEMaxesStream));
+  E->BrickEMaxesStat.Add((f64)Size(Sc->BrickEMaxesStream));
   Rewind(&E->ChunkEMaxesStream);
   CompressBufZstd(ToBuffer(Sc->BrickEMaxesStream), &E->ChunkEMaxesStream);
-  ChunkEMaxesStat.Add((f64)Size(E->ChunkEMaxesStream));
+  E->ChunkEMaxesStat.Add((f64)Size(E->ChunkEMaxesStream));
 
   /* rewind */
   Rewind(&Sc->BrickEMaxesStream);
 
   /* write to file */
   file_id FileId = ConstructFilePathExponents(Idx2, Sc->LastBrick, Iter, Level);
-  idx2_OpenMaybeExistingFile(Fp, FileId.Name.ConstPtr, "ab");
-  WriteBuffer(Fp, ToBuffer(E->ChunkEMaxesStream));
+  if (!Append(&E->Writer, FileId.Name, E->ChunkEMaxesStream.Stream.Data, Size(E->ChunkEMaxesStream)))
+    return idx2_Error(idx2_file_err_code::FileWriteFailed, "%.*s", FileId.Name.Size, FileId.Name.ConstPtr);
   /* keep track of the chunk sizes */
   auto ChunkEMaxesMetaIt = Lookup(&E->ChunkEMaxesMeta, FileId.Id);
   if (!ChunkEMaxesMetaIt) {
@@ -995,6 +1073,7 @@ WriteChunkExponents(const idx2_file& Idx2, encode_data* E, sub_channel* Sc, i8 I
   Insert(&E->ChunkRDOLengths, ChunkAddress, (u32)Size(E->ChunkEMaxesStream));
 
   Rewind(&E->ChunkEMaxesStream);
+  return idx2_Error(idx2_file_err_code::NoError);
 }
 
 struct sub_channel_ptr {
@@ -1007,26 +1086,24 @@ struct sub_channel_ptr {
   }
 };
 
-stat ChunkEMaxSzsStat;
-
 // TODO: check the error path
 error<idx2_file_err_code>
 FlushChunkExponents(const idx2_file& Idx2, encode_data* E) {
   idx2_ForEach(ScIt, E->SubChannels) {
     i8 Iteration = IterationFromChannelKey(*ScIt.Key);
     i8 Level = LevelFromChannelKey(*ScIt.Key);
-    WriteChunkExponents(Idx2, E, ScIt.Val, Iteration, Level);
+    idx2_PropagateIfError(WriteChunkExponents(Idx2, E, ScIt.Val, Iteration, Level));
   }
   idx2_ForEach(CemIt, E->ChunkEMaxesMeta) {
     bitstream* ChunkEMaxSzs = CemIt.Val;
     file_id FileId = ConstructFilePathExponents(Idx2, *CemIt.Key);
     idx2_Assert(FileId.Id == *CemIt.Key);
     /* write chunk emax sizes */
-    idx2_OpenMaybeExistingFile(Fp, FileId.Name.ConstPtr, "ab");
     Flush(ChunkEMaxSzs);
-    ChunkEMaxSzsStat.Add((f64)Size(*ChunkEMaxSzs));
-    WriteBuffer(Fp, ToBuffer(*ChunkEMaxSzs));
-    WritePOD(Fp, (int)Size(*ChunkEMaxSzs));
+    E->ChunkEMaxSzsStat.Add((f64)Size(*ChunkEMaxSzs));
+    if (!Append(&E->Writer, FileId.Name, ChunkEMaxSzs->Stream.Data, Size(*ChunkEMaxSzs)) ||
+        !AppendPOD(&E->Writer, FileId.Name, (int)Size(*ChunkEMaxSzs)))
+      return idx2_Error(idx2_file_err_code::FileWriteFailed, "%.*s", FileId.Name.Size, FileId.Name.ConstPtr);
   }
   return idx2_Error(idx2_file_err_code::NoError);
 }
@@ -1145,9 +1222,10 @@ struct rdo_mini {
 /* Rate distortion optimization is done once per tile and iter/level */
 // TODO: change the word "Chunk" to "Tile" elsewhere where it makes sense
 // TODO: normalize the distortion by the number of samples a chunk has
-static void
+static error<idx2_file_err_code>
 RateDistortionOpt(const idx2_file& Idx2, encode_data* E) {
-  if (Size(Idx2.RdoLevels) == 0) return;
+  if (Size(Idx2.RdoLevels) == 0)
+    return idx2_Error(idx2_file_err_code::NoError);
   constexpr u64 InfInt = 0x7FF0000000000000ull;
   const f64 Inf = *(f64*)(&InfInt);
 
@@ -1292,7 +1370,6 @@ RateDistortionOpt(const idx2_file& Idx2, encode_data* E) {
       u64 FirstBrickAddr = ((FileAddr * Idx2.ChunksPerFiles[Iter]) + 0) * Idx2.BricksPerChunks[Iter] + 0;
       file_id FileId = ConstructFilePathRdos(Idx2, FirstBrickAddr, Iter);
       int NumChunks = 0;
-      idx2_OpenMaybeExistingFile(Fp, FileId.Name.ConstPtr, "ab");
       idx2_ChunkTraverse(
         ++NumChunks;
         u64 ChunkAddr = (FileAddr * Idx2.ChunksPerFiles[Iter]) + ChunkTop.Address;
@@ -1328,9 +1405,10 @@ RateDistortionOpt(const idx2_file& Idx2, encode_data* E) {
       ); // end chunk (tile) traverse
       buffer Buf(Buffer.Buffer.Data, Size(Buffer) * sizeof(i16));
       CompressBufZstd(Buf, &BitStream);
-      WriteBuffer(Fp, buffer{BitStream.Stream.Data, Size(BitStream)});
-      WritePOD(Fp, NumChunks);
-      fclose(Fp);
+      bool Ok = Append(&E->Writer, FileId.Name, BitStream.Stream.Data, Size(BitStream)) &&
+                AppendPOD(&E->Writer, FileId.Name, NumChunks);
+      if (!Ok)
+        return idx2_Error(idx2_file_err_code::FileWriteFailed, "%.*s", FileId.Name.Size, FileId.Name.ConstPtr);
       Clear(&Buffer);
       Rewind(&BitStream);
       , 64
@@ -1342,109 +1420,163 @@ RateDistortionOpt(const idx2_file& Idx2, encode_data* E) {
     );
   } // end level loop
   idx2_Assert(Pos == Size(RdoPrecomputes));
+  return idx2_Error(idx2_file_err_code::NoError);
 }
 
-static stat BlockStat;
-static stat BlockEMaxStat;
+/* The slot of a bit plane of the subband being encoded, whose channel is looked up (or created) only
+if the channels may have moved since the slot was last used */
+static channel_slot*
+GetChannelSlot(encode_data* E, i64 SlotIdx, i16 RealBp) {
+  idx2_Assert(SlotIdx >= 0);
+  if (SlotIdx >= Size(E->ChannelSlots))
+    Resize(&E->ChannelSlots, SlotIdx + 1);
+  channel_slot* Slot = &E->ChannelSlots[SlotIdx];
+  if (Slot->Gen != E->ChannelGen) {
+    u32 ChannelKey = GetChannelKey(RealBp, E->Iter, E->Level);
+    auto ChannelIt = Lookup(&E->Channels, ChannelKey);
+    if (!ChannelIt) {
+      channel Channel; Init(&Channel);
+      Insert(&ChannelIt, ChannelKey, Channel);
+      PushBack(&E->ChannelOrder, ChannelKey);
+      ++E->ChannelGen;
+    }
+    Slot->Channel = ChannelIt.Val;
+    Slot->Gen = E->ChannelGen;
+  }
+  return Slot;
+}
 
-// TODO: return an error code
-static void
+idx2_T(t) static error<idx2_file_err_code>
 EncodeSubband(idx2_file* Idx2, encode_data* E, const grid& SbGrid, volume* BrickVol) {
   u64 Brick = E->Brick[E->Iter];
   v3i SbDims3 = Dims(SbGrid);
   v3i NBlocks3 = (SbDims3 + Idx2->BlockDims3 - 1) / Idx2->BlockDims3;
   u32 LastBlock = EncodeMorton3(v3<u32>(NBlocks3 - 1));
   const i8 NBitPlanes = idx2_BitSizeOf(u64);
+  const i16 BpBase = i16(Exponent(Idx2->Accuracy) + NBitPlanes - 7); // the lowest bit plane encoded (see TooHighPrecision)
+  idx2_ForEach(SigIt, E->BlockSigs) E->ChannelSlots[SigIt->BitPlane - BpBase] = channel_slot{};
   Clear(&E->BlockSigs); Reserve(&E->BlockSigs, NBitPlanes);
   Clear(&E->EMaxes); Reserve(&E->EMaxes, Prod(NBlocks3));
+  /* the distances between neighboring samples of the subband in the brick */
+  v3i BrickDims3 = Dims(*BrickVol), SbFrom3 = From(SbGrid), SbStrd3 = Strd(SbGrid);
+  v3<i64> SampleStrd3(SbStrd3.X, i64(SbStrd3.Y) * BrickDims3.X, i64(SbStrd3.Z) * BrickDims3.X * BrickDims3.Y);
 
   /* query the right sub channel for the block exponents */
   u16 SubChanKey = GetSubChannelKey(E->Iter, E->Level);
   auto ScIt = Lookup(&E->SubChannels, SubChanKey);
   if (!ScIt) {
     sub_channel SubChan; Init(&SubChan);
+    SubChan.LastChunk = Brick >> Log2Ceil(Idx2->BricksPerChunks[E->Iter]);
     Insert(&ScIt, SubChanKey, SubChan);
   }
   idx2_Assert(ScIt);
   sub_channel* Sc = ScIt.Val;
 
-  /* pass 1: compress the blocks */
-  idx2_InclusiveFor(u32, Block, 0, LastBlock) { // zfp block loop
-    v3i Z3(DecodeMorton3(Block));
-    idx2_NextMorton(Block, Z3, NBlocks3);
-    v3i D3 = Z3 * Idx2->BlockDims3;
-    v3i BlockDims3 = Min(Idx2->BlockDims3, SbDims3 - D3);
-    const i8 NDims = (i8)NumDims(BlockDims3);
+  /* encode the bit planes of a transformed block (once a chunk fails to be written, Err holds the error
+  and the other blocks are skipped) */
+  error<idx2_file_err_code> Err = idx2_Error(idx2_file_err_code::NoError);
+  auto EncodeBlock = [&](u32 Block, i16 EMax, i8 NDims, u64* BlockUInts) {
+    if (!Err) return;
     const int NVals = 1 << (2 * NDims);
-    const i8 Prec = NBitPlanes - 1 - NDims;
-    f64 BlockFloats[4 * 4 * 4];
-    buffer_t BufFloats(BlockFloats, NVals);
-    buffer_t BufInts((i64*)BlockFloats, NVals);
-    u64 BlockUInts [4 * 4 * 4];
-    buffer_t BufUInts (BlockUInts , NVals);
-    bool CodedInNextIter = E->Level == 0 && E->Iter + 1 < Idx2->NLevels && BlockDims3 == Idx2->BlockDims3;
-    if (CodedInNextIter) continue;
-    /* copy the samples to the local buffer */
-    v3i S3;
-    int J = 0;
-    v3i From3 = From(SbGrid), Strd3 = Strd(SbGrid);
-    idx2_BeginFor3(S3, v3i(0), BlockDims3, v3i(1)) { // sample loop
-      idx2_Assert(D3 + S3 < SbDims3);
-      BlockFloats[J++] = BrickVol->At<f64>(From3, Strd3, D3 + S3);
-    } idx2_EndFor3 // end sample loop
-    /* zfp transform and shuffle */
-    const i16 EMax = SizeOf(Idx2->DType) > 4 ? (i16)QuantizeF64(Prec, BufFloats, &BufInts) : (i16)QuantizeF32(Prec, BufFloats, &BufInts);
-    PushBack(&E->EMaxes, EMax);
-    ForwardZfp((i64*)BlockFloats, NDims);
-    ForwardShuffle((i64*)BlockFloats, BlockUInts, NDims);
-    /* zfp encode */
     i8 N = 0; // number of significant coefficients in the block so far
     i8 EndBitPlane = Min(i8(BitSizeOf(Idx2->DType) + (24 + NDims)), NBitPlanes); // TODO: why 24 (this is only based on empirical experiments with float32, for other types it might be different)?
     idx2_InclusiveForBackward(i8, Bp, NBitPlanes - 1, NBitPlanes - EndBitPlane) { // bit plane loop
       i16 RealBp = Bp + EMax;
       bool TooHighPrecision = NBitPlanes  - 6 > RealBp - Exponent(Idx2->Accuracy) + 1;
       if (TooHighPrecision) break;
-      u32 ChannelKey = GetChannelKey(RealBp, E->Iter, E->Level);
-      auto ChannelIt = Lookup(&E->Channels, ChannelKey);
-      if (!ChannelIt) {
-        channel Channel; Init(&Channel);
-        Insert(&ChannelIt, ChannelKey, Channel);
-      }
-      idx2_Assert(ChannelIt);
-      channel* C = ChannelIt.Val;
+      channel_slot* Slot = GetChannelSlot(E, RealBp - BpBase, RealBp);
+      channel* C = Slot->Channel;
       /* write block id */
-      // u32 BlockDelta = Block;
-      int I = 0;
-      for (; I < Size(E->BlockSigs); ++I) {
-        if (E->BlockSigs[I].BitPlane == RealBp) {
-          idx2_Assert(Block > E->BlockSigs[I].Block);
-          // BlockDelta = Block - E->BlockSigs[I].Block - 1;
-          E->BlockSigs[I].Block = Block;
-          break;
-        }
+      if (Slot->Sig >= 0) {
+        idx2_Assert(Block > E->BlockSigs[Slot->Sig].Block);
+        E->BlockSigs[Slot->Sig].Block = Block;
       }
       /* write chunk if this brick is after the last chunk */
-      bool FirstSigBlock = I == Size(E->BlockSigs); // first block that becomes significant on this bit plane
+      bool FirstSigBlock = Slot->Sig < 0; // first block that becomes significant on this bit plane
       bool BrickNotEmpty = Size(C->BrickStream) > 0;
       bool NewChunk = Brick >= (C->LastChunk + 1) * Idx2->BricksPerChunks[E->Iter]; // TODO: multiplier?
       if (FirstSigBlock) {
         if (NewChunk) {
-          if (BrickNotEmpty) WriteChunk(*Idx2, E, C, E->Iter, E->Level, RealBp);
+          if (BrickNotEmpty) {
+            Err = WriteChunk(*Idx2, E, C, E->Iter, E->Level, RealBp);
+            if (!Err) return;
+          }
           C->NBricks = 0;
           C->LastChunk = Brick >> Log2Ceil(Idx2->BricksPerChunks[E->Iter]);
         }
+        Slot->Sig = (i32)Size(E->BlockSigs);
         PushBack(&E->BlockSigs, block_sig{Block, RealBp});
       }
       /* encode the block */
       GrowIfTooFull(&C->BlockStream);
-      Encode(BlockUInts, NVals, Bp, N, &C->BlockStream);
+      Zfp.Encode(BlockUInts, NVals, Bp, N, &C->BlockStream);
     } // end bit plane loop
+  };
+
+  /* the full blocks are quantized one by one but transformed Zfp.BatchSize at a time, then coded in
+  the same order as the partial blocks (a partial block first codes the full blocks before it) */
+  i64 BatchInts[ZfpMaxBatchSize * 64] = {};
+  u64 BatchUInts[ZfpMaxBatchSize * 64];
+  u32 BatchBlocks[ZfpMaxBatchSize];
+  i16 BatchEMaxes[ZfpMaxBatchSize];
+  int NBatch = 0;
+  auto EncodeBatch = [&]() {
+    if (NBatch == 0) return;
+    Zfp.ForwardZfpBatch(BatchInts, BatchUInts);
+    idx2_For(int, I, 0, NBatch) EncodeBlock(BatchBlocks[I], BatchEMaxes[I], 3, &BatchUInts[I * 64]);
+    NBatch = 0;
+  };
+
+  /* pass 1: compress the blocks */
+  idx2_InclusiveFor(u32, Block, 0, LastBlock) { // zfp block loop
+    v3i Z3(DecodeMorton3(Block));
+    idx2_NextMorton(Block, Z3, NBlocks3);
+    v3i D3 = Z3 * Idx2->BlockDims3;
+    v3i BlockDims3 = Min(Idx2->BlockDims3, SbDims3 - D3);
+    const i8 NDims = (i8)NumDims(BlockDims3);
+    const int NVals = 1 << (2 * NDims);
+    const i8 Prec = NBitPlanes - 1 - NDims;
+    bool CodedInNextIter = E->Level == 0 && E->Iter + 1 < Idx2->NLevels && BlockDims3 == Idx2->BlockDims3;
+    if (CodedInNextIter) continue;
+    f64 BlockFloats[4 * 4 * 4]; // the samples are quantized in f64 whatever the type of the brick
+    buffer_t BufFloats(BlockFloats, NVals);
+    bool FullBlock = BlockDims3 == v3i(4);
+    i64 BlockInts[4 * 4 * 4];
+    buffer_t BufInts(FullBlock ? &BatchInts[NBatch * 64] : BlockInts, NVals);
+    /* copy the samples to the local buffer */
+    if (FullBlock) {
+      GatherBlock(&BrickVol->At<t>(SbFrom3, SbStrd3, D3), SampleStrd3, BlockFloats);
+    } else { // partial block
+      v3i S3;
+      int J = 0;
+      idx2_BeginFor3(S3, v3i(0), BlockDims3, v3i(1)) { // sample loop
+        idx2_Assert(D3 + S3 < SbDims3);
+        BlockFloats[J++] = BrickVol->At<t>(SbFrom3, SbStrd3, D3 + S3);
+      } idx2_EndFor3 // end sample loop
+    }
+    const i16 EMax = SizeOf(Idx2->DType) > 4 ? (i16)QuantizeF64(Prec, BufFloats, &BufInts) : (i16)QuantizeF32(Prec, BufFloats, &BufInts);
+    PushBack(&E->EMaxes, EMax);
+    if (FullBlock) {
+      BatchBlocks[NBatch] = Block;
+      BatchEMaxes[NBatch] = EMax;
+      if (++NBatch == Zfp.BatchSize) EncodeBatch();
+    } else {
+      EncodeBatch();
+      /* zfp transform and shuffle */
+      u64 BlockUInts[4 * 4 * 4];
+      Zfp.ForwardZfp(BlockInts, NDims);
+      Zfp.ForwardShuffle(BlockInts, BlockUInts, NDims);
+      EncodeBlock(Block, EMax, NDims, BlockUInts);
+    }
   } // end zfp block loop
+  EncodeBatch();
+  if (!Err)
+    return Err;
 
   /* write the last chunk exponents if this is the first brick of the new chunk */
   bool NewChunk = Brick >= (Sc->LastChunk + 1) * Idx2->BricksPerChunks[E->Iter];
   if (NewChunk) {
-    WriteChunkExponents(*Idx2, E, Sc, E->Iter, E->Level);
+    idx2_PropagateIfError(WriteChunkExponents(*Idx2, E, Sc, E->Iter, E->Level));
     Sc->LastChunk = Brick >> Log2Ceil(Idx2->BricksPerChunks[E->Iter]);
   }
   /* write the min emax */
@@ -1457,7 +1589,7 @@ EncodeSubband(idx2_file* Idx2, encode_data* E, const grid& SbGrid, volume* Brick
   i64 BrickEMaxesSz = Size(Sc->BlockEMaxesStream);
   GrowToAccomodate(&Sc->BrickEMaxesStream, BrickEMaxesSz);
   WriteStream(&Sc->BrickEMaxesStream, &Sc->BlockEMaxesStream);
-  BlockEMaxStat.Add((f64)Size(Sc->BlockEMaxesStream));
+  E->BlockEMaxStat.Add((f64)Size(Sc->BlockEMaxesStream));
   Rewind(&Sc->BlockEMaxesStream);
   Sc->LastBrick = Brick;
 
@@ -1473,10 +1605,7 @@ EncodeSubband(idx2_file* Idx2, encode_data* E, const grid& SbGrid, volume* Brick
     idx2_For(int, I, 0, Size(E->BlockSigs)) { // bit plane loop
       i16 RealBp = E->BlockSigs[I].BitPlane;
       if (Block != E->BlockSigs[I].Block) continue;
-      u32 ChannelKey = GetChannelKey(RealBp, E->Iter, E->Level);
-      auto ChannelIt = Lookup(&E->Channels, ChannelKey);
-      idx2_Assert(ChannelIt);
-      channel* C = ChannelIt.Val;
+      channel* C = GetChannelSlot(E, RealBp - BpBase, RealBp)->Channel;
       /* write brick delta */
       if (C->NBricks == 0) {// start of a chunk
         GrowToAccomodate(&C->BrickDeltasStream, 8);
@@ -1490,17 +1619,51 @@ EncodeSubband(idx2_file* Idx2, encode_data* E, const grid& SbGrid, volume* Brick
       GrowToAccomodate(&C->BrickSzsStream, 4);
       WriteVarByte(&C->BrickSzsStream, BrickSize);
       /* write brick data */
-      GrowToAccomodate(&C->BrickStream, BrickSize);
-      WriteStream(&C->BrickStream, &C->BlockStream);
-      BlockStat.Add((f64)Size(C->BlockStream));
+      Flush(&C->BlockStream);
+      Append(&C->BrickStream, C->BlockStream.Stream.Data, BrickSize);
+      E->BlockStat.Add((f64)Size(C->BlockStream));
       Rewind(&C->BlockStream);
       ++C->NBricks;
       C->LastBrick = Brick;
     } // end bit plane loop
   } // end zfp block loop
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
+/*
+The lifting passes that EncodeBrick does on a brick whose ExtentLocal has dims N3: the
+extrapolation with the transform details of N3 (ExtrapolateCdf53(Td, Vol)), a second extrapolation
+(ExtrapolateCdf53(N3, TformOrder, Vol)), then the forward transform of the brick. They only depend
+on N3, so they are computed once per N3 (all bricks but the ones at the boundary have the same N3),
+and LiftCdf53 fuses the passes where one transform ends and the next starts. */
+static const array<lift_pass>&
+GetBrickLiftPasses(const idx2_file& Idx2, encode_data* E, const v3i& N3) {
+  auto It = Lookup(&E->BrickLiftPasses, Pack3i64(N3));
+  if (It)
+    return *It.Val;
+  v3i B3 = Idx2.BrickDimsExt3;
+  v3i M3(B3.X == 1 ? 1 : B3.X - 1, B3.Y == 1 ? 1 : B3.Y - 1, B3.Z == 1 ? 1 : B3.Z - 1);
+  array<lift_pass> Passes;
+  transform_details Td;
+  if (N3 == Idx2.BrickDims3) {
+    Td = Idx2.TdExtrpolate;
+  } else { // brick at the boundary
+    int NLevels = Log2Floor(Max(Max(N3.X, N3.Y), N3.Z));
+    ComputeTransformDetails(&Td, N3, NLevels, Idx2.TformOrder);
+  }
+  PushForwardPasses(Td, M3, &Passes);
+  PushInversePasses(Td, M3, &Passes);
+  int NLevels = Log2Floor(Max(Max(B3.X, B3.Y), B3.Z));
+  ComputeTransformDetails(&Td, N3, NLevels, Idx2.TformOrder);
+  PushForwardPasses(Td, M3, &Passes);
+  ComputeTransformDetails(&Td, B3, NLevels, Idx2.TformOrder);
+  PushInversePasses(Td, M3, &Passes);
+  PushForwardPasses(Idx2.Td, Idx2.BrickDimsExt3, &Passes);
+  Insert(&It, Pack3i64(N3), Passes);
+  return *It.Val;
 }
 
-static inline void
+idx2_T(t) static inline error<idx2_file_err_code>
 EncodeBrick(idx2_file* Idx2, const params& P, encode_data* E, bool IncIter = false) {
   idx2_Assert(Idx2->NLevels <= idx2_file::MaxLevels);
   i8 Iter = E->Iter += IncIter;
@@ -1510,24 +1673,11 @@ EncodeBrick(idx2_file* Idx2, const params& P, encode_data* E, bool IncIter = fal
   idx2_Assert(BIt);
   volume& BVol = BIt.Val->Vol;
   idx2_Assert(BVol.Buffer);
-  if (Dims(BIt.Val->ExtentLocal) == Idx2->BrickDims3) {
-    ExtrapolateCdf53(Idx2->TdExtrpolate, &BVol);
-  } else { // brick at the boundary
-    v3i N3 = Dims(BIt.Val->ExtentLocal);
-    transform_details Td;
-    int NLevels = Log2Floor(Max(Max(N3.X, N3.Y), N3.Z));
-    ComputeTransformDetails(&Td, N3, NLevels, Idx2->TformOrder);
-    ExtrapolateCdf53(Td, &BVol);
-  }
-  ExtrapolateCdf53(Dims(BIt.Val->ExtentLocal), Idx2->TformOrder, &BVol);
-  if (!P.WaveletOnly) {
-    if (Iter + 1 < Idx2->NLevels)
-      ForwardCdf53(Idx2->BrickDimsExt3, E->Iter, Idx2->Subbands, Idx2->Td, &BVol, false);
-    else
-      ForwardCdf53(Idx2->BrickDimsExt3, E->Iter, Idx2->Subbands, Idx2->Td, &BVol, true);
-  } else {
-    ForwardCdf53(Idx2->BrickDimsExt3, E->Iter, Idx2->Subbands, Idx2->Td, &BVol, false);
-  }
+  idx2_Assert(Dims(BVol) == Idx2->BrickDimsExt3);
+  /* extrapolate the brick, then transform it */
+  LiftCdf53(GetBrickLiftPasses(*Idx2, E, Dims(BIt.Val->ExtentLocal)), &BVol);
+  bool LastIter = !P.WaveletOnly && Iter + 1 >= Idx2->NLevels;
+  NormalizeCdf53(Idx2->BrickDimsExt3, E->Iter, Idx2->Subbands, Idx2->Td, &BVol, LastIter);
   /* recursively encode the brick, one subband at a time */
   idx2_For(i8, Sb, 0, Size(Idx2->Subbands)) { // subband loop
     const subband& S = Idx2->Subbands[Sb];
@@ -1542,8 +1692,8 @@ EncodeBrick(idx2_file* Idx2, const params& P, encode_data* E, bool IncIter = fal
       auto PbIt = Lookup(&E->BrickPool, PKey);
       if (!PbIt) { // instantiate the parent brick in the hash table
         brick_volume PBrickVol;
-        Resize(&PBrickVol.Vol, Idx2->BrickDimsExt3, dtype::float64, E->Alloc);
-        Fill(idx2_Range(f64, PBrickVol.Vol), 0.0);
+        Resize(&PBrickVol.Vol, Idx2->BrickDimsExt3, BVol.Type, E->Alloc);
+        Fill(idx2_Range(t, PBrickVol.Vol), t(0));
         v3i From3 = (Brick3 / Idx2->GroupBrick3) * Idx2->GroupBrick3;
         v3i NChildren3 = Dims(Crop(extent(From3, Idx2->GroupBrick3), extent(Idx2->NBricks3s[Iter])));
         PBrickVol.NChildrenMax = (i8)Prod(NChildren3);
@@ -1554,19 +1704,21 @@ EncodeBrick(idx2_file* Idx2, const params& P, encode_data* E, bool IncIter = fal
       v3i LocalBrickPos3 = Brick3 % Idx2->GroupBrick3;
       grid SbGridNonExt = S.Grid; SetDims(&SbGridNonExt, SbDimsNonExt3);
       extent ToGrid(LocalBrickPos3 * SbDimsNonExt3, SbDimsNonExt3);
-      CopyGridExtent<f64, f64>(SbGridNonExt, BVol, ToGrid, &PbIt.Val->Vol);
+      CopyGridExtent<t, t>(SbGridNonExt, BVol, ToGrid, &PbIt.Val->Vol);
 //      Copy(SbGridNonExt, BVol, ToGrid, &PbIt.Val->Vol);
       bool LastChild = ++PbIt.Val->NChildren == PbIt.Val->NChildrenMax;
-      if (LastChild) EncodeBrick(Idx2, P, E, true);
+      if (LastChild && !E->OneLevel)
+        idx2_PropagateIfError(EncodeBrick<t>(Idx2, P, E, true));
     } // end Sb == 0 && NextIteration < Idx2->NLevels
     E->Level = Sb;
     if      (Idx2->Version == v2i(0, 0)) EncodeSubbandV0_0(Idx2, E, S.Grid, &BVol);
     else if (Idx2->Version == v2i(0, 1)) EncodeSubbandV0_1(Idx2, E, S.Grid, &BVol);
-    else if (Idx2->Version == v2i(1, 0)) EncodeSubband(Idx2, E, S.Grid, &BVol);
+    else if (Idx2->Version == v2i(1, 0)) idx2_PropagateIfError(EncodeSubband<t>(Idx2, E, S.Grid, &BVol));
   } // end subband loop
   Dealloc(&BVol);
   Delete(&E->BrickPool, GetBrickKey(Iter, Brick));
   E->Iter -= IncIter;
+  return idx2_Error(idx2_file_err_code::NoError);
 }
 
 // TODO: return true error code
@@ -1584,9 +1736,6 @@ struct channel_ptr {
   }
 };
 
-static stat CpresChunkAddrsStat;
-static stat ChunkAddrsStat;
-static stat ChunkSzsStat;
 // TODO: check the error path
 error<idx2_file_err_code>
 FlushChunks(const idx2_file& Idx2, encode_data* E) {
@@ -1600,7 +1749,7 @@ FlushChunks(const idx2_file& Idx2, encode_data* E) {
     i8 Iter = IterationFromChannelKey(Ch->First);
     i8 Level = LevelFromChannelKey(Ch->First);
     i16 BitPlane = BitPlaneFromChannelKey(Ch->First);
-    WriteChunk(Idx2, E, Ch->Second, Iter, Level, BitPlane);
+    idx2_PropagateIfError(WriteChunk(Idx2, E, Ch->Second, Iter, Level, BitPlane));
   }
 
   /* write the chunk meta */
@@ -1612,94 +1761,537 @@ FlushChunks(const idx2_file& Idx2, encode_data* E) {
     }
     idx2_Assert(FileId.Id == *CmIt.Key);
     /* compress and write chunk sizes */
-    idx2_OpenMaybeExistingFile(Fp, FileId.Name.ConstPtr, "ab");
     Flush(&Cm->Sizes);
-    WriteBuffer(Fp, ToBuffer(Cm->Sizes));
-    ChunkSzsStat.Add((f64)Size(Cm->Sizes));
-    WritePOD(Fp, (int)Size(Cm->Sizes));
+    E->ChunkSzsStat.Add((f64)Size(Cm->Sizes));
+    bool Ok = Append(&E->Writer, FileId.Name, Cm->Sizes.Stream.Data, Size(Cm->Sizes)) &&
+              AppendPOD(&E->Writer, FileId.Name, (int)Size(Cm->Sizes));
     /* compress and write chunk addresses */
     CompressBufZstd(ToBuffer(Cm->Addrs), &E->CpresChunkAddrs);
-    WriteBuffer(Fp, ToBuffer(E->CpresChunkAddrs));
-    WritePOD(Fp, (int)Size(E->CpresChunkAddrs));
-    WritePOD(Fp, (int)Size(Cm->Addrs)); // number of chunks
-    ChunkAddrsStat.Add((f64)Size(Cm->Addrs) * sizeof(Cm->Addrs[0]));
-    CpresChunkAddrsStat.Add((f64)Size(E->CpresChunkAddrs));
+    Ok = Ok && Append(&E->Writer, FileId.Name, E->CpresChunkAddrs.Stream.Data, Size(E->CpresChunkAddrs)) &&
+         AppendPOD(&E->Writer, FileId.Name, (int)Size(E->CpresChunkAddrs)) &&
+         AppendPOD(&E->Writer, FileId.Name, (int)Size(Cm->Addrs)); // number of chunks
+    if (!Ok)
+      return idx2_Error(idx2_file_err_code::FileWriteFailed, "%.*s", FileId.Name.Size, FileId.Name.ConstPtr);
+    E->ChunkAddrsStat.Add((f64)Size(Cm->Addrs) * sizeof(Cm->Addrs[0]));
+    E->CpresChunkAddrsStat.Add((f64)Size(E->CpresChunkAddrs));
   }
   return idx2_Error(idx2_file_err_code::NoError);
 }
 
 f64 TotalTime_ = 0;
 
-// TODO: handle types different than float64
-error<idx2_file_err_code>
-Encode(idx2_file* Idx2, const params& P, const volume& Vol) {
-  const int BrickBytes = Prod(Idx2->BrickDimsExt3) * sizeof(f64);
-  BrickAlloc_ = free_list_allocator(BrickBytes);
-  idx2_RAII(encode_data, E, Init(&E));
-  idx2_BrickTraverse(
-    timer Timer; StartTimer(&Timer);
-//    idx2_Assert(GetLinearBrick(*Idx2, 0, Top.BrickFrom3) == Top.Address);
-//    idx2_Assert(GetSpatialBrick(*Idx2, 0, Top.Address) == Top.BrickFrom3);
-    brick_volume BVol;
-    Resize(&BVol.Vol, Idx2->BrickDimsExt3, dtype::float64, E.Alloc);
+/* Call Func(ThreadId) on NThreads threads (the calling thread is thread 0) and wait for all of them */
+idx2_T(func) static void
+ParallelRun(int NThreads, const func& Func) {
+  constexpr int MaxThreads = 256;
+  NThreads = Min(Max(NThreads, 1), MaxThreads);
+  std::thread Threads[MaxThreads];
+  idx2_For(int, I, 1, NThreads) Threads[I] = std::thread(Func, I);
+  Func(0);
+  idx2_For(int, I, 1, NThreads) Threads[I].join();
+}
+
+/* Copy the samples of a level-0 brick from Vol, which holds the samples of VolExt in the field, into a
+new brick in the brick pool of E */
+static void
+AddBrick(idx2_file* Idx2, const volume& Vol, const extent& VolExt, const v3i& Brick3, allocator* Alloc, encode_data* E) {
+  dtype BrickType = E->BrickType;
+  idx2_Assert(BrickType == dtype::float64 || Vol.Type == dtype::float32);
+  brick_volume BVol;
+  Resize(&BVol.Vol, Idx2->BrickDimsExt3, BrickType, Alloc);
+  extent BrickExtent(Brick3 * Idx2->BrickDims3, Idx2->BrickDims3);
+  extent BrickExtentCrop = Crop(BrickExtent, extent(Idx2->Dims3));
+  BVol.ExtentLocal = Relative(BrickExtentCrop, BrickExtent);
+  extent SrcExtent = Relative(BrickExtentCrop, VolExt);
+  v2d MinMax;
+  if (BrickType == dtype::float32) {
+    Fill(idx2_Range(f32, BVol.Vol), 0.0f);
+    MinMax = CopyExtentExtentMinMax<f32, f32>(SrcExtent, Vol, BVol.ExtentLocal, &BVol.Vol);
+  } else {
     Fill(idx2_Range(f64, BVol.Vol), 0.0);
-    extent BrickExtent(Top.BrickFrom3 * Idx2->BrickDims3, Idx2->BrickDims3);
-    extent BrickExtentCrop = Crop(BrickExtent, extent(Idx2->Dims3));
-    BVol.ExtentLocal = Relative(BrickExtentCrop, BrickExtent);
-    v2d MinMax;
     if (Vol.Type == dtype::float32)
-      MinMax = (CopyExtentExtentMinMax<f32, f64>(BrickExtentCrop, Vol, BVol.ExtentLocal, &BVol.Vol));
+      MinMax = CopyExtentExtentMinMax<f32, f64>(SrcExtent, Vol, BVol.ExtentLocal, &BVol.Vol);
     else if (Vol.Type == dtype::float64)
-      MinMax = (CopyExtentExtentMinMax<f64, f64>(BrickExtentCrop, Vol, BVol.ExtentLocal, &BVol.Vol));
-    Idx2->ValueRange.Min = Min(Idx2->ValueRange.Min, MinMax.Min);
-    Idx2->ValueRange.Max = Max(Idx2->ValueRange.Max, MinMax.Max);
-//    Copy(BrickExtentCrop, Vol, BVol.ExtentLocal, &BVol.Vol);
-    E.Iter = 0;
-    E.Bricks3[E.Iter] = Top.BrickFrom3;
-    E.Brick[E.Iter] = GetLinearBrick(*Idx2, E.Iter, E.Bricks3[E.Iter]);
-    idx2_Assert(E.Brick[E.Iter] == Top.Address);
-    u64 BrickKey = GetBrickKey(E.Iter, E.Brick[E.Iter]);
-    Insert(&E.BrickPool, BrickKey, BVol);
-    EncodeBrick(Idx2, P, &E);
-    TotalTime_ += Seconds(ElapsedTime(&Timer));
+      MinMax = CopyExtentExtentMinMax<f64, f64>(SrcExtent, Vol, BVol.ExtentLocal, &BVol.Vol);
+  }
+  E->ValueRange.Min = Min(E->ValueRange.Min, MinMax.Min);
+  E->ValueRange.Max = Max(E->ValueRange.Max, MinMax.Max);
+  Insert(&E->BrickPool, GetBrickKey(0, GetLinearBrick(*Idx2, 0, Brick3)), BVol);
+}
+
+/* Encode the bricks of level Iter that intersect ExtentInBricks (the parent bricks on the coarser
+levels are encoded as soon as all of their children are, unless E->OneLevel). The level-0 bricks are
+copied from Vol, or, if Vol is null, they must already be in the brick pool (see EncodeStream); the
+bricks of the other levels must be in the brick pool (see EncodeLevels). */
+static error<idx2_file_err_code>
+EncodeBricks(idx2_file* Idx2, const params& P, const volume* Vol, const extent& ExtentInBricks, encode_data* E, i8 Iter = 0) {
+  idx2_Assert(Iter == 0 || !Vol);
+  dtype BrickType = E->BrickType;
+  idx2_BrickTraverse(
+//    idx2_Assert(GetLinearBrick(*Idx2, Iter, Top.BrickFrom3) == Top.Address);
+//    idx2_Assert(GetSpatialBrick(*Idx2, Iter, Top.Address) == Top.BrickFrom3);
+    if (Vol) AddBrick(Idx2, *Vol, extent(Idx2->Dims3), Top.BrickFrom3, E->Alloc, E);
+    E->Iter = Iter;
+    E->Bricks3[E->Iter] = Top.BrickFrom3;
+    E->Brick[E->Iter] = GetLinearBrick(*Idx2, E->Iter, E->Bricks3[E->Iter]);
+    idx2_Assert(E->Brick[E->Iter] == Top.Address);
+    if (BrickType == dtype::float32) {
+      idx2_PropagateIfError(EncodeBrick<f32>(Idx2, P, E));
+    } else {
+      idx2_PropagateIfError(EncodeBrick<f64>(Idx2, P, E));
+    }
     , 128
-    , Idx2->BrickOrders[E.Iter]
+    , Idx2->BrickOrders[Iter]
     , v3i(0)
-    , Idx2->NBricks3s[E.Iter]
-    , extent(Idx2->NBricks3s[E.Iter])
-    , extent(Idx2->NBricks3s[E.Iter])
+    , Idx2->NBricks3s[Iter]
+    , ExtentInBricks
+    , extent(Idx2->NBricks3s[Iter])
   );
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
+/* Fold the encode_data of a unit (see EncodeLevels and EncodeStream) into E, which holds the state of all the units
+before it. The chunks that the previous units left open on the channels this unit uses are written
+first, in the order the serial encoder would write them, then E takes over the channels of this unit */
+static error<idx2_file_err_code>
+MergeUnit(const idx2_file& Idx2, encode_data* E, encode_data* Eu) {
+  idx2_ForEach(KeyIt, Eu->ChannelOrder) {
+    auto UIt = Lookup(&Eu->Channels, *KeyIt);
+    idx2_Assert(UIt);
+    auto ChannelIt = Lookup(&E->Channels, *KeyIt);
+    if (ChannelIt) {
+      if (Size(ChannelIt.Val->BrickStream) > 0) {
+        i8 Iter = IterationFromChannelKey(*KeyIt);
+        i8 Level = LevelFromChannelKey(*KeyIt);
+        i16 BitPlane = BitPlaneFromChannelKey(*KeyIt);
+        idx2_PropagateIfError(WriteChunk(Idx2, E, ChannelIt.Val, Iter, Level, BitPlane));
+      }
+      Swap(ChannelIt.Val, UIt.Val); // the old channel is freed together with Eu
+    } else {
+      Insert(&ChannelIt, *KeyIt, *UIt.Val);
+      *UIt.Val = channel{};
+    }
+  }
+  /* the files a unit writes are not written by any other unit */
+  idx2_ForEach(CmIt, Eu->ChunkMeta) {
+    Insert(&E->ChunkMeta, *CmIt.Key, *CmIt.Val);
+    *CmIt.Val = chunk_meta_info{};
+  }
+  /* the parent bricks left by a unit of one level (see EncodeLevels) can have children in the
+  next units too; the parts of a parent brick are zero outside of the children that filled them */
+  idx2_ForEach(BIt, Eu->BrickPool) {
+    auto It = Lookup(&E->BrickPool, *BIt.Key);
+    if (It) {
+      Add(extent(Dims(BIt.Val->Vol)), BIt.Val->Vol, extent(Dims(It.Val->Vol)), &It.Val->Vol);
+      It.Val->NChildren += BIt.Val->NChildren;
+      Dealloc(&BIt.Val->Vol);
+    } else {
+      Insert(&It, *BIt.Key, *BIt.Val);
+    }
+    *BIt.Val = brick_volume{};
+  }
+  /* the sub channels are already flushed, we only keep them so they can be counted */
+  idx2_ForEach(ScIt, Eu->SubChannels) {
+    auto It = Lookup(&E->SubChannels, *ScIt.Key);
+    if (!It) {
+      Insert(&It, *ScIt.Key, *ScIt.Val);
+      *ScIt.Val = sub_channel{};
+    }
+  }
+  idx2_ForEach(RIt, Eu->ChunkRDOs) PushBack(&E->ChunkRDOs, *RIt);
+  idx2_ForEach(LIt, Eu->ChunkRDOLengths) Insert(&E->ChunkRDOLengths, *LIt.Key, *LIt.Val);
+  E->ValueRange.Min = Min(E->ValueRange.Min, Eu->ValueRange.Min);
+  E->ValueRange.Max = Max(E->ValueRange.Max, Eu->ValueRange.Max);
+  E->BrickDeltasStat.Add(Eu->BrickDeltasStat);
+  E->BrickSzsStat.Add(Eu->BrickSzsStat);
+  E->BrickStreamStat.Add(Eu->BrickStreamStat);
+  E->ChunkStreamStat.Add(Eu->ChunkStreamStat);
+  E->BrickEMaxesStat.Add(Eu->BrickEMaxesStat);
+  E->ChunkEMaxesStat.Add(Eu->ChunkEMaxesStat);
+  E->ChunkEMaxSzsStat.Add(Eu->ChunkEMaxSzsStat);
+  E->BlockStat.Add(Eu->BlockStat);
+  E->BlockEMaxStat.Add(Eu->BlockEMaxStat);
+  E->Writer.NWrites += Eu->Writer.NWrites;
+  E->Writer.NOpens += Eu->Writer.NOpens;
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
+/* The log2 of the number of bricks of level Iter in a unit of that level (see EncodeLevels), which
+covers whole files of the level */
+static int
+GetLog2LevelUnit(const idx2_file& Idx2, i8 Iter) {
+  return Min(int(Log2Ceil(Idx2.BricksPerFiles[Iter])), int(Idx2.BrickOrderStrs[Iter].Len));
+}
+
+/* With grouped levels, the files are shared by bricks on different levels; v0.x keeps the chunks
+of a channel in a single stream. In both cases the bricks cannot be split into units. */
+static bool
+CanSplitIntoUnits(const idx2_file& Idx2) {
+  return Idx2.Version == v2i(1, 0) && !Idx2.GroupLevels;
+}
+
+/* The bricks of level Iter in unit U (a unit is an aligned box of bricks since each character of the
+brick order is one bit of one axis) */
+static extent
+GetUnitExtent(const idx2_file& Idx2, i8 Iter, int Log2Unit, u64 U) {
+  v3i From3 = GetSpatialBrick(Idx2, Iter, U << Log2Unit);
+  v3i Last3 = GetSpatialBrick(Idx2, Iter, ((U + 1) << Log2Unit) - 1);
+  return Crop(extent(From3, Last3 - From3 + 1), extent(Idx2.NBricks3s[Iter]));
+}
+
+/* The units of level Iter that intersect the field, in order */
+static void
+GetUnits(const idx2_file& Idx2, i8 Iter, int Log2Unit, array<u64>* Units) {
+  u64 NUnits = u64(1) << (Idx2.BrickOrderStrs[Iter].Len - Log2Unit);
+  idx2_For(u64, U, 0, NUnits) {
+    v3i From3 = GetSpatialBrick(Idx2, Iter, U << Log2Unit);
+    if (From3 < Idx2.NBricks3s[Iter]) PushBack(Units, U);
+  }
+}
+
+/* Move the bricks of level Iter in unit U from the brick pool of E to the one of Eu */
+static void
+MoveUnitBricks(i8 Iter, int Log2Unit, u64 U, encode_data* E, encode_data* Eu) {
+  idx2_For(u64, Brick, U << Log2Unit, (U + 1) << Log2Unit) {
+    u64 Key = GetBrickKey(Iter, Brick);
+    auto BIt = Lookup(&E->BrickPool, Key);
+    if (!BIt)
+      continue;
+    idx2_Assert(BIt.Val->NChildren == BIt.Val->NChildrenMax);
+    Insert(&Eu->BrickPool, Key, *BIt.Val);
+    Delete(&E->BrickPool, Key);
+  }
+}
+
+/* Keep Err in Eu if it is the first error of the unit (called by the thread that encodes the unit) */
+static void
+SetUnitError(encode_data* Eu, const error<idx2_file_err_code>& Err) {
+  if (Err || Eu->Error.Code != idx2_file_err_code::NoError)
+    return;
+  Eu->Error.Code = Err.Code;
+  snprintf(Eu->Error.Msg, sizeof(Eu->Error.Msg), "%.255s", ToString(Err)); // the message can be truncated
+}
+
+/* The first error of unit U, made again on the calling thread */
+static error<idx2_file_err_code>
+GetUnitError(const encode_data& Eu, u64 U) {
+  if (Eu.Error.Code == idx2_file_err_code::NoError)
+    return idx2_Error(idx2_file_err_code::NoError);
+  return idx2_Error(Eu.Error.Code, "unit %" PRIu64 ": %s", U, Eu.Error.Msg);
+}
+
+/* Write the chunk exponents and the buffered files of a unit, on the thread that encoded it */
+static error<idx2_file_err_code>
+FlushUnit(const idx2_file& Idx2, encode_data* Eu) {
+  /* the exponent files belong to a single (iteration, level) so the unit can finish them */
+  idx2_PropagateIfError(FlushChunkExponents(Idx2, Eu));
+  /* the files of the unit are written by this thread */
+  if (!Flush(&Eu->Writer))
+    return idx2_Error(idx2_file_err_code::FileWriteFailed, "cannot write the files of the unit");
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
+/* Free what an encoded unit does not need until it is merged, which can take a while when its bricks
+are read before those of the units that come before it (see EncodeStream): the last chunk of each
+channel is only written once the next unit with that channel is merged (see MergeUnit) */
+static void
+TrimUnit(encode_data* Eu) {
+  idx2_ForEach(ChannelIt, Eu->Channels) Trim(&ChannelIt.Val->BrickStream);
+}
+
+using unit_task = t2<u64, encode_data*>; // a unit and the encode_data it is encoded with
+
+/* Encode each unit Units[I].First of level Iter with its encode_data Units[I].Second, on up to
+NThreads threads (each allocates from its own cache in Allocs). The bricks are copied from Vol, or
+they are already in the brick pools of the units if Vol is null. A unit of one level also writes its
+files, which no other unit shares. The first error of a unit is kept in it (see SetUnitError). */
+static void
+EncodeUnits(idx2_file* Idx2, const params& P, const volume* Vol, i8 Iter, int Log2Unit,
+            const array<unit_task>& Units, int NThreads, pool_allocator* Allocs) {
+  std::atomic<i64> NextUnit(0);
+  ParallelRun(Min(NThreads, (int)Size(Units)), [&](int ThreadId) {
+    for (i64 I = NextUnit++; I < Size(Units); I = NextUnit++) {
+      encode_data* Eu = Units[I].Second;
+      Eu->Alloc = &Allocs[ThreadId];
+      SetUnitError(Eu, EncodeBricks(Idx2, P, Vol, GetUnitExtent(*Idx2, Iter, Log2Unit, Units[I].First), Eu, Iter));
+      if (Eu->OneLevel && Eu->Error.Code == idx2_file_err_code::NoError)
+        SetUnitError(Eu, FlushUnit(*Idx2, Eu));
+      TrimUnit(Eu);
+    }
+  });
+}
+
+/* Encode the units Units[0, NUnits) of level Iter, then merge them into E in order, together with
+the parent bricks they filled. The bricks are copied from Vol, or taken from the brick pool of E if
+Vol is null. The units that come after a failed unit are not merged, and the error of the failed
+unit is returned. */
+static error<idx2_file_err_code>
+EncodeLevelUnits(idx2_file* Idx2, const params& P, const volume* Vol, i8 Iter, int Log2Unit,
+                 const u64* Units, i64 NUnits, int NThreads, pool_allocator* Allocs, encode_data* E) {
+  /* encode a limited number of units at a time to bound the memory used by the pending units */
+  const int MaxUnits = NThreads * 4;
+  idx2_RAII(array<encode_data>, Us, Reserve(&Us, MaxUnits));
+  idx2_RAII(array<unit_task>, Tasks, Reserve(&Tasks, MaxUnits));
+  for (i64 First = 0; First < NUnits; First += MaxUnits) {
+    i64 Last = Min(First + MaxUnits, NUnits);
+    Clear(&Us); Resize(&Us, Last - First);
+    Clear(&Tasks);
+    idx2_For(i64, I, First, Last) {
+      encode_data* Eu = &Us[I - First];
+      Init(Eu, nullptr); // the allocator is the cache of the thread that encodes the unit
+      Eu->BrickType = E->BrickType;
+      Eu->OneLevel = true;
+      if (!Vol)
+        MoveUnitBricks(Iter, Log2Unit, Units[I], E, Eu);
+      PushBack(&Tasks, unit_task{Units[I], Eu});
+    }
+    EncodeUnits(Idx2, P, Vol, Iter, Log2Unit, Tasks, NThreads, Allocs);
+    error<idx2_file_err_code> Result = idx2_Error(idx2_file_err_code::NoError);
+    idx2_For(i64, I, First, Last) {
+      if (Result)
+        Result = GetUnitError(Us[I - First], Units[I]);
+      if (Result)
+        Result = MergeUnit(*Idx2, E, &Us[I - First]);
+      Dealloc(&Us[I - First]);
+    }
+    if (!Result)
+      return Result;
+  }
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
+/* Encode on NThreads threads, one level at a time. The bricks of a level are split into units, which
+are aligned ranges of 2^GetLog2LevelUnit linear brick addresses; a unit covers whole files of the
+level, so each file is written by exactly one thread. Each unit is encoded with its own encode_data,
+and merged into E in order, together with the parent bricks it filled, which are encoded with the
+next level (see EncodeLevelUnits). */
+static error<idx2_file_err_code>
+EncodeLevels(idx2_file* Idx2, const params& P, const volume& Vol, int NThreads, block_pool* Pool, encode_data* E) {
+  idx2_RAII(array<u64>, Units, Reserve(&Units, 64));
+  pool_allocator* Allocs = new pool_allocator[NThreads]; // the cache of each thread
+  idx2_CleanUp(idx2_For(int, I, 0, NThreads) Allocs[I].DeallocAll(); delete[] Allocs);
+  idx2_For(int, I, 0, NThreads) Init(&Allocs[I], Pool);
+  idx2_For(i8, Iter, 0, Idx2->NLevels) {
+    int Log2Unit = GetLog2LevelUnit(*Idx2, Iter);
+    Clear(&Units);
+    GetUnits(*Idx2, Iter, Log2Unit, &Units);
+    if (Size(Units) == 1)
+      printf("level %d is stored in one file, it is encoded on one thread\n", Iter);
+    idx2_PropagateIfError(EncodeLevelUnits(Idx2, P, Iter == 0 ? &Vol : nullptr, Iter, Log2Unit, &Units[0], Size(Units), NThreads, Allocs, E));
+  }
+  idx2_Assert(Size(E->BrickPool) == 0);
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
+/* Write the chunks that are still open in E, the chunk indices, and the meta file. The chunk
+exponents are flushed too unless the units already did it (see EncodeLevels). */
+static error<idx2_file_err_code>
+FinishEncode(idx2_file* Idx2, const params& P, encode_data* E, bool ExpsFlushed) {
+  timer Timer;
+  Idx2->ValueRange.Min = Min(Idx2->ValueRange.Min, E->ValueRange.Min);
+  Idx2->ValueRange.Max = Max(Idx2->ValueRange.Max, E->ValueRange.Max);
 
   /* dump the bit streams to files */
-  timer Timer; StartTimer(&Timer);
-  idx2_PropagateIfError(FlushChunks(*Idx2, &E));
-  idx2_PropagateIfError(FlushChunkExponents(*Idx2, &E));
+  StartTimer(&Timer);
+  idx2_PropagateIfError(FlushChunks(*Idx2, E));
+  if (!ExpsFlushed)
+    idx2_PropagateIfError(FlushChunkExponents(*Idx2, E));
   timer RdoTimer; StartTimer(&RdoTimer);
-  RateDistortionOpt(*Idx2, &E);
+  idx2_PropagateIfError(RateDistortionOpt(*Idx2, E));
   TotalTime_ += Seconds(ElapsedTime(&Timer));
   printf("rdo time                = %f\n", Seconds(ElapsedTime(&RdoTimer)));
+  if (!Flush(&E->Writer))
+    return idx2_Error(idx2_file_err_code::FileWriteFailed, "cannot write the files in %s/%s", P.OutDir, P.Meta.Name);
+  printf("file writes             = %" PRIi64 " opens = %" PRIi64 "\n", E->Writer.NWrites, E->Writer.NOpens);
 
   WriteMetaFile(*Idx2, P, idx2_PrintScratch("%s/%s/%s.idx", P.OutDir, P.Meta.Name, P.Meta.Field));
-  printf("num channels            = %" PRIi64 "\n", Size(E.Channels));
-  printf("num sub channels        = %" PRIi64 "\n", Size(E.SubChannels));
-  printf("num chunks              = %" PRIi64 "\n", ChunkStreamStat.Count());
-  printf("brick deltas      total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", BrickDeltasStat.Sum(), BrickDeltasStat.Avg(), BrickDeltasStat.StdDev());
-  printf("brick sizes       total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", BrickSzsStat.Sum(), BrickSzsStat.Avg(), BrickSzsStat.StdDev());
-  printf("brick stream      total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", BrickStreamStat.Sum(), BrickStreamStat.Avg(), BrickStreamStat.StdDev());
-  printf("block stream      total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", BlockStat.Sum(), BlockStat.Avg(), BlockStat.StdDev());
-  printf("chunk sizes       total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", ChunkSzsStat.Sum(), ChunkSzsStat.Avg(), ChunkSzsStat.StdDev());
-  printf("chunk addrs       total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", ChunkAddrsStat.Sum(), ChunkAddrsStat.Avg(), ChunkAddrsStat.StdDev());
-  printf("cpres chunk addrs total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", CpresChunkAddrsStat.Sum(), CpresChunkAddrsStat.Avg(), CpresChunkAddrsStat.StdDev());
-  printf("chunk stream      total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", ChunkStreamStat.Sum(), ChunkStreamStat.Avg(), ChunkStreamStat.StdDev());
-  printf("brick exps        total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", BrickEMaxesStat.Sum(), BrickEMaxesStat.Avg(), BrickEMaxesStat.StdDev());
-  printf("block exps        total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", BlockEMaxStat.Sum(), BlockEMaxStat.Avg(), BlockEMaxStat.StdDev());
-  printf("chunk exp sizes   total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", ChunkEMaxSzsStat.Sum(), ChunkEMaxSzsStat.Avg(), ChunkEMaxSzsStat.StdDev());
-  printf("chunk exps stream total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", ChunkEMaxesStat.Sum(), ChunkEMaxesStat.Avg(), ChunkEMaxesStat.StdDev());
+  printf("num channels            = %" PRIi64 "\n", Size(E->Channels));
+  printf("num sub channels        = %" PRIi64 "\n", Size(E->SubChannels));
+  printf("num chunks              = %" PRIi64 "\n", E->ChunkStreamStat.Count());
+  printf("brick deltas      total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", E->BrickDeltasStat.Sum(), E->BrickDeltasStat.Avg(), E->BrickDeltasStat.StdDev());
+  printf("brick sizes       total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", E->BrickSzsStat.Sum(), E->BrickSzsStat.Avg(), E->BrickSzsStat.StdDev());
+  printf("brick stream      total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", E->BrickStreamStat.Sum(), E->BrickStreamStat.Avg(), E->BrickStreamStat.StdDev());
+  printf("block stream      total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", E->BlockStat.Sum(), E->BlockStat.Avg(), E->BlockStat.StdDev());
+  printf("chunk sizes       total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", E->ChunkSzsStat.Sum(), E->ChunkSzsStat.Avg(), E->ChunkSzsStat.StdDev());
+  printf("chunk addrs       total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", E->ChunkAddrsStat.Sum(), E->ChunkAddrsStat.Avg(), E->ChunkAddrsStat.StdDev());
+  printf("cpres chunk addrs total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", E->CpresChunkAddrsStat.Sum(), E->CpresChunkAddrsStat.Avg(), E->CpresChunkAddrsStat.StdDev());
+  printf("chunk stream      total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", E->ChunkStreamStat.Sum(), E->ChunkStreamStat.Avg(), E->ChunkStreamStat.StdDev());
+  printf("brick exps        total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", E->BrickEMaxesStat.Sum(), E->BrickEMaxesStat.Avg(), E->BrickEMaxesStat.StdDev());
+  printf("block exps        total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", E->BlockEMaxStat.Sum(), E->BlockEMaxStat.Avg(), E->BlockEMaxStat.StdDev());
+  printf("chunk exp sizes   total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", E->ChunkEMaxSzsStat.Sum(), E->ChunkEMaxSzsStat.Avg(), E->ChunkEMaxSzsStat.StdDev());
+  printf("chunk exps stream total = %12.0f avg = %12.1f stddev = %12.1f bytes\n", E->ChunkEMaxesStat.Sum(), E->ChunkEMaxesStat.Avg(), E->ChunkEMaxesStat.StdDev());
   printf("total time              = %f seconds\n", TotalTime_);
 //  _ASSERTE( _CrtCheckMemory( ) );
   return idx2_Error(idx2_file_err_code::NoError);
 }
 
+/* The largest absolute value of a float32 or float64 volume */
+static f64
+MaxAbsValue(const volume& Vol) {
+  i64 N = Prod<i64>(Dims(Vol));
+  f64 MaxAbs = 0;
+  if (Vol.Type == dtype::float32) {
+    const f32* Vals = (const f32*)Vol.Buffer.Data;
+    f32 M = 0;
+    idx2_For(i64, I, 0, N) M = Max(M, (f32)fabs(Vals[I]));
+    MaxAbs = M;
+  } else if (Vol.Type == dtype::float64) {
+    const f64* Vals = (const f64*)Vol.Buffer.Data;
+    idx2_For(i64, I, 0, N) MaxAbs = Max(MaxAbs, fabs(Vals[I]));
+  }
+  return MaxAbs;
+}
+
+error<idx2_file_err_code>
+Encode(idx2_file* Idx2, const params& P, const volume& Vol) {
+  /* the largest value is only needed to decide if the bricks of a float32 field can be float32 */
+  f64 MaxAbs = GetEncodeBrickType(*Idx2, 0) == dtype::float32 ? MaxAbsValue(Vol) : -1;
+  dtype BrickType = GetEncodeBrickType(*Idx2, MaxAbs);
+  const int BrickBytes = Prod(Idx2->BrickDimsExt3) * SizeOf(BrickType);
+  idx2_RAII(block_pool, Pool, Init(&Pool, BrickBytes));
+  pool_allocator Alloc; Init(&Alloc, &Pool);
+  idx2_RAII(encode_data, E, Init(&E, &Alloc));
+  E.BrickType = BrickType;
+  bool Parallel = P.NThreads > 1 && CanSplitIntoUnits(*Idx2);
+  if (P.NThreads > 1 && !Parallel)
+    printf("the files are shared by the levels (or the version is 0.x), encoding on one thread\n");
+  timer Timer; StartTimer(&Timer);
+  if (Parallel) {
+    idx2_PropagateIfError(EncodeLevels(Idx2, P, Vol, P.NThreads, &Pool, &E));
+  } else {
+    idx2_PropagateIfError(EncodeBricks(Idx2, P, &Vol, extent(Idx2->NBricks3s[0]), &E));
+  }
+  TotalTime_ += Seconds(ElapsedTime(&Timer));
+  /* each unit flushes its own chunk exponents */
+  return FinishEncode(Idx2, P, &E, Parallel);
+}
+
+/* A level-0 unit of bricks (see GetLog2LevelUnit) whose bricks are being read by EncodeStream */
+struct stream_unit {
+  encode_data E;
+  i64 NBricksLeft = 0; // the number of bricks of the unit that are not read yet
+};
+
+error<idx2_file_err_code>
+EncodeStream(idx2_file* Idx2, const params& P, FILE* Fp) {
+  /* the largest value of the field is not known before the end, so the bricks are float64 */
+  const int BrickBytes = Prod(Idx2->BrickDimsExt3) * SizeOf(GetEncodeBrickType(*Idx2, -1));
+  idx2_RAII(block_pool, Pool, Init(&Pool, BrickBytes));
+  pool_allocator Alloc; Init(&Alloc, &Pool);
+  idx2_RAII(encode_data, E, Init(&E, &Alloc));
+  /* if the files are shared by the levels, the whole field is one unit (of all the levels) */
+  bool Split = CanSplitIntoUnits(*Idx2);
+  if (!Split)
+    printf("the files are shared by the levels (or the version is 0.x), the whole field is kept in memory and encoded on one thread\n");
+  /* the level-0 bricks are allocated from the cache of this thread and freed (back into it) by the
+  thread that encodes their unit; each thread allocates the parent bricks of its units */
+  const int NThreads = Split ? Max(P.NThreads, 1) : 1;
+  pool_allocator* Allocs = new pool_allocator[NThreads];
+  idx2_CleanUp(idx2_For(int, I, 0, NThreads) Allocs[I].DeallocAll(); delete[] Allocs);
+  idx2_For(int, I, 0, NThreads) Init(&Allocs[I], &Pool);
+  /* the units of each level, in order, and the next one to merge into E */
+  const i8 NLevels = Split ? Idx2->NLevels : 1;
+  array<u64> Units[idx2_file::MaxLevels];
+  idx2_CleanUp(idx2_For(i8, Iter, 0, NLevels) Dealloc(&Units[Iter]));
+  int Log2Units[idx2_file::MaxLevels];
+  i64 NextMerges[idx2_file::MaxLevels] = {};
+  idx2_For(i8, Iter, 0, NLevels) {
+    Log2Units[Iter] = Split ? GetLog2LevelUnit(*Idx2, Iter) : Idx2->BrickOrderStrs[0].Len;
+    GetUnits(*Idx2, Iter, Log2Units[Iter], &Units[Iter]);
+    if (Split && Size(Units[Iter]) == 1)
+      printf("level %d is stored in one file, all of its bricks are kept in memory\n", Iter);
+  }
+  /* a unit of level Iter > 0 is ready once all the units of level Iter - 1 that hold its children
+  are merged (the parent of a brick is Brick >> TformOrderFull.Len) */
+  auto ChildrenMerged = [&](i8 Iter, u64 U) {
+    if (NextMerges[Iter - 1] == Size(Units[Iter - 1]))
+      return true;
+    u64 NextChild = Units[Iter - 1][NextMerges[Iter - 1]] << Log2Units[Iter - 1]; // the first one not merged
+    return NextChild >= (U + 1) << (Log2Units[Iter] + Idx2->TformOrderFull.Len);
+  };
+  hash_table<u64, stream_unit> Pending; // the level-0 units that are not merged yet
+  Init(&Pending, 8);
+  idx2_CleanUp(idx2_ForEach(It, Pending) Dealloc(&It.Val->E); Dealloc(&Pending));
+  idx2_RAII(array<u64>, Ready, Reserve(&Ready, 64));
+  idx2_RAII(array<unit_task>, Tasks, Reserve(&Tasks, 64));
+  /* the slab buffer (the last slab can be thinner) */
+  v3i SlabDims3(Idx2->Dims3.X, Idx2->Dims3.Y, Idx2->BrickDims3.Z);
+  volume Slab(SlabDims3, Idx2->DType);
+  idx2_CleanUp(Dealloc(&Slab));
+
+  timer Timer; StartTimer(&Timer);
+  const v3i& NBricks3 = Idx2->NBricks3s[0];
+  idx2_For(int, Bz, 0, NBricks3.Z) { // slab loop
+    /* read the slab */
+    extent SlabExt(v3i(0, 0, Bz * SlabDims3.Z), v3i(SlabDims3.X, SlabDims3.Y, Min(SlabDims3.Z, Idx2->Dims3.Z - Bz * SlabDims3.Z)));
+    size_t SlabBytes = size_t(Prod<i64>(Dims(SlabExt)) * SizeOf(Idx2->DType));
+    if (fread(Slab.Buffer.Data, 1, SlabBytes, Fp) != SlabBytes)
+      return idx2_Error(idx2_file_err_code::FileReadFailed, "slab %d", Bz);
+    /* copy the bricks of the slab into the brick pools of their units */
+    idx2_For(int, By, 0, NBricks3.Y) {
+      idx2_For(int, Bx, 0, NBricks3.X) {
+        v3i Brick3(Bx, By, Bz);
+        u64 U = GetLinearBrick(*Idx2, 0, Brick3) >> Log2Units[0];
+        auto UIt = Lookup(&Pending, U);
+        if (!UIt) {
+          stream_unit Su;
+          Init(&Su.E, &Alloc);
+          Su.E.BrickType = E.BrickType;
+          Su.E.OneLevel = Split;
+          Su.NBricksLeft = Prod<i64>(Dims(GetUnitExtent(*Idx2, 0, Log2Units[0], U)));
+          Insert(&UIt, U, Su);
+        }
+        AddBrick(Idx2, Slab, SlabExt, Brick3, &Alloc, &UIt.Val->E);
+        if (--UIt.Val->NBricksLeft == 0)
+          PushBack(&Ready, U);
+      }
+    }
+    /* encode the level-0 units whose bricks are all read */
+    Clear(&Tasks);
+    idx2_ForEach(UIt, Ready)
+      PushBack(&Tasks, unit_task{*UIt, &Lookup(&Pending, *UIt).Val->E});
+    EncodeUnits(Idx2, P, nullptr, 0, Log2Units[0], Tasks, NThreads, Allocs);
+    idx2_ForEach(TIt, Tasks)
+      idx2_PropagateIfError(GetUnitError(*TIt->Second, TIt->First));
+    Clear(&Ready);
+    /* merge the encoded units in order */
+    i64& NextMerge = NextMerges[0];
+    for (; NextMerge < Size(Units[0]); ++NextMerge) {
+      auto UIt = Lookup(&Pending, Units[0][NextMerge]);
+      if (!UIt || UIt.Val->NBricksLeft > 0)
+        break;
+      error<idx2_file_err_code> Result = idx2_Error(idx2_file_err_code::NoError);
+      if (Split) {
+        Result = MergeUnit(*Idx2, &E, &UIt.Val->E);
+        Dealloc(&UIt.Val->E);
+      } else { // the only unit takes the place of E
+        Dealloc(&E);
+        E = UIt.Val->E;
+        E.Alloc = &Alloc;
+      }
+      Delete(&Pending, Units[0][NextMerge]);
+      if (!Result)
+        return Result;
+    }
+    /* encode the units of the coarser levels whose bricks are all filled, so their files are written
+    and their bricks freed before the end of the field */
+    idx2_For(i8, Iter, 1, NLevels) {
+      i64 First = NextMerges[Iter], Last = First;
+      while (Last < Size(Units[Iter]) && ChildrenMerged(Iter, Units[Iter][Last]))
+        ++Last;
+      if (Last > First) {
+        idx2_PropagateIfError(EncodeLevelUnits(Idx2, P, nullptr, Iter, Log2Units[Iter], &Units[Iter][First], Last - First, NThreads, Allocs, &E));
+      }
+      NextMerges[Iter] = Last;
+    }
+  } // end slab loop
+  idx2_For(i8, Iter, 0, NLevels) idx2_Assert(NextMerges[Iter] == Size(Units[Iter]));
+  idx2_Assert(Size(E.BrickPool) == 0);
+  TotalTime_ += Seconds(ElapsedTime(&Timer));
+  /* each unit flushes its own chunk exponents */
+  return FinishEncode(Idx2, P, &E, Split);
+}
+
 /* ---------------------------------------------------------------------------------------------- */
 /*                                     DECODER                                                    */
 /* ---------------------------------------------------------------------------------------------- */
@@ -1721,7 +2313,8 @@ static void
 Dealloc(chunk_cache* ChunkCache) {
   Dealloc(&ChunkCache->Bricks);
   Dealloc(&ChunkCache->BrickSzs);
-  Dealloc(&ChunkCache->ChunkStream);
+  if (ChunkCache->ChunkStream.Stream.Alloc) // otherwise the stream points into a mapped file
+    Dealloc(&ChunkCache->ChunkStream);
 }
 
 static void
@@ -1743,266 +2336,664 @@ Dealloc(file_cache* FileCache) {
 }
 
 static void
-Init(file_cache_table* FileCacheTable) {
-  Init(&FileCacheTable->FileCaches, 8);
-  Init(&FileCacheTable->FileExpCaches, 5);
-  Init(&FileCacheTable->FileRdoCaches, 5);
+Init(file_cache_table* FileCacheTable, allocator* Alloc) {
+  Init(&FileCacheTable->FileCaches, 8, Alloc);
+  Init(&FileCacheTable->FileExpCaches, 5, Alloc);
+  Init(&FileCacheTable->FileRdoCaches, 5, Alloc);
 }
 static void
 Dealloc(file_cache_table* FileCacheTable) {
   idx2_ForEach(FileCacheIt, FileCacheTable->FileCaches) Dealloc(FileCacheIt.Val);
   Dealloc(&FileCacheTable->FileCaches);
   idx2_ForEach(FileExpCacheIt, FileCacheTable->FileExpCaches) Dealloc(FileExpCacheIt.Val);
+  Dealloc(&FileCacheTable->FileExpCaches);
   idx2_ForEach(FileRdoCacheIt, FileCacheTable->FileRdoCaches) Dealloc(FileRdoCacheIt.Val);
+  Dealloc(&FileCacheTable->FileRdoCaches);
 }
 
-static void
-Init(decode_data* D, allocator* Alloc = nullptr) {
+void
+Init(decode_data* D, int MaxOpenFiles, i64 ArenaBytes) {
   Init(&D->BrickPool, 5);
-  D->Alloc = Alloc ? Alloc : &BrickAlloc_;
-  Init(&D->FcTable);
-  Init(&D->Streams, 7);
-//  Reserve(&D->RequestedChunks, 64);
+  Init(&D->BrickCache, &D->BrickBlocks); // BrickBlocks is initialized by the first Decode
+  D->Alloc = &D->BrickCache;
+  D->Main = D;
+  if (ArenaBytes > 0) {
+    D->Arena = arena_allocator(ArenaBytes);
+    D->CacheAlloc = &D->Arena;
+  }
+  Init(&D->FcTable, D->CacheAlloc);
+  Init(&D->FdCache, MaxOpenFiles);
+  Init(&D->MappedFiles, 8);
+  Init(&D->BlockStates, 8);
 }
 
+/* Init the per-thread decode_data of a thread that decodes bricks on behalf of Main */
 static void
+InitWorker(decode_data* W, decode_data* Main) {
+  Init(&W->BrickCache, &Main->BrickBlocks);
+  W->Alloc = &W->BrickCache;
+  W->Main = Main;
+  W->QualityLevel = Main->QualityLevel;
+  W->EffIter = Main->EffIter;
+}
+
+void
 Dealloc(decode_data* D) {
-  D->Alloc->DeallocAll();
-  idx2_ForEach(BrickVolIt, D->BrickPool) Dealloc(&BrickVolIt.Val->Vol);
-  Dealloc(&D->BrickPool);
-  Dealloc(&D->FcTable);
+  if (D->Main == D) { // only the main decode_data owns the brick pool and the caches
+    idx2_ForEach(BrickVolIt, D->BrickPool) Dealloc(&BrickVolIt.Val->Vol);
+    Dealloc(&D->BrickPool);
+    D->BrickCache.DeallocAll();
+    Dealloc(&D->BrickBlocks);
+    if (D->CacheAlloc == &D->Arena) // everything in FcTable is in the arena
+      D->Arena.DeallocAll();
+    else
+      Dealloc(&D->FcTable);
+    Dealloc(&D->ResidentChunks);
+    Dealloc(&D->FdCache);
+    idx2_ForEach(MappedIt, D->MappedFiles) UnmapFile(MappedIt.Val);
+    Dealloc(&D->MappedFiles);
+    idx2_ForEach(StateIt, D->BlockStates) Dealloc(&StateIt.Val->Blocks);
+    Dealloc(&D->BlockStates);
+  } else { // the blocks in the cache of a worker go back to the pool of Main
+    D->BrickCache.DeallocAll();
+  }
   Dealloc(&D->BlockStream);
   Dealloc(&D->Streams);
+  Dealloc(&D->StreamSlots);
   DeallocBuf(&D->CompressedChunkExps);
+  Dealloc(&D->ChunkExpStream);
+  Dealloc(&D->ChunkBricks);
+  Dealloc(&D->ChunkBrickSzs);
   Dealloc(&D->ChunkEMaxSzsStream);
   Dealloc(&D->ChunkAddrsStream);
   Dealloc(&D->ChunkSzsStream);
-//  Dealloc(&D->RequestedChunks);
+  Dealloc(&D->PinnedChunks);
+}
+
+std::atomic<u64> DecodeIOTime_ = 0;
+std::atomic<u64> PrefetchIOTime_ = 0; // io time on the prefetch thread, hidden behind decoding
+std::atomic<u64> DataMovementTime_ = 0;
+std::atomic<u64> BytesRdos_ = 0;
+std::atomic<u64> BytesExps_ = 0;
+std::atomic<u64> BytesData_ = 0;
+
+static idx2_Inline void
+AddIOTime(decode_data* D, u64 T) {
+  if (D->IsPrefetcher)
+    PrefetchIOTime_ += T;
+  else
+    DecodeIOTime_ += T;
 }
 
-u64 DecodeIOTime_ = 0;
-u64 DataMovementTime_ = 0;
-u64 BytesRdos_ = 0;
-u64 BytesExps_ = 0;
-u64 BytesData_ = 0;
+/*
+A file open for reading. If Map is not empty, the file is mapped in memory (and stays mapped until
+the decoder is deallocated), otherwise it is read with pread through the descriptor cache. Where is
+the position (initially the end of the file) of the backward reads. */
+struct read_file {
+  file_handle File;
+  u64 Key = 0;
+  buffer Map;
+  i64 Where = 0;
+};
 
+/* Map a file the first time it is read (D->Main->Mutex must be held) */
 static error<idx2_file_err_code>
-ReadFileRdos(const idx2_file& Idx2, hash_table<u64, file_rdo_cache>::iterator* FileRdoCacheIt, const file_id& FileId) {
-  timer IOTimer;
-  StartTimer(&IOTimer);
-  idx2_RAII(FILE*, Fp = fopen(FileId.Name.ConstPtr, "rb"),, if (Fp) fclose(Fp));
-  idx2_FSeek(Fp, 0, SEEK_END);
-  int NumChunks = 0;
-  i64 Sz = idx2_FTell(Fp) - sizeof(NumChunks);
-  ReadBackwardPOD(Fp, &NumChunks);
-  BytesRdos_ += sizeof(NumChunks);
-  file_rdo_cache FileRdoCache;
-  Resize(&FileRdoCache.TileRdoCaches, NumChunks);
-  idx2_RAII(buffer, CompresBuf, AllocBuf(&CompresBuf, Sz), DeallocBuf(&CompresBuf));
-  ReadBackwardBuffer(Fp, &CompresBuf);
-  DecodeIOTime_ += ElapsedTime(&IOTimer);
-  BytesRdos_ += Size(CompresBuf);
-  idx2_RAII(bitstream, Bs,);
-  DecompressBufZstd(CompresBuf, &Bs);
-  int Pos = 0;
-  idx2_For(int, I, 0, Size(FileRdoCache.TileRdoCaches)) {
-    chunk_rdo_cache& TileRdoCache = FileRdoCache.TileRdoCaches[I];
-    Resize(&TileRdoCache.TruncationPoints, Size(Idx2.RdoLevels) * Size(Idx2.Subbands));
-    idx2_ForEach(It, TileRdoCache.TruncationPoints) *It = ((const i16*)Bs.Stream.Data)[Pos++];
+MapFileForRead(decode_data* D, u64 Key, const file_id& FileId, buffer* Map) {
+  auto MappedIt = Lookup(&D->Main->MappedFiles, Key);
+  if (!MappedIt) {
+    mmap_file MFile;
+    if (!OpenFile(&MFile, FileId.Name.ConstPtr, map_mode::Read))
+      return idx2_Error(idx2_file_err_code::FileNotFound, "%s", FileId.Name.ConstPtr);
+    if (!MapFile(&MFile)) {
+      CloseFile(&MFile);
+      return idx2_Error(idx2_file_err_code::FileReadFailed, "%s", FileId.Name.ConstPtr);
+    }
+    /* the mapping stays valid after the file is closed */
+    buffer Buf = MFile.Buf;
+    CloseFile(&MFile);
+    MFile.Buf = Buf;
+    Insert(&MappedIt, Key, MFile);
   }
-  Insert(FileRdoCacheIt, FileId.Id, FileRdoCache);
+  *Map = MappedIt.Val->Buf;
   return idx2_Error(idx2_file_err_code::NoError);
 }
 
+/* Open a file for reading (D->Main->Mutex must not be held) */
 static error<idx2_file_err_code>
-ReadFileExponents(decode_data* D, hash_table<u64, file_exp_cache>::iterator* FileExpCacheIt, const file_id& FileId) {
-  timer IOTimer;
-  StartTimer(&IOTimer);
-  idx2_RAII(FILE*, Fp = fopen(FileId.Name.ConstPtr, "rb"),, if (Fp) fclose(Fp));
-  idx2_FSeek(Fp, 0, SEEK_END);
-  int ChunkEMaxSzsSz = 0; ReadBackwardPOD(Fp, &ChunkEMaxSzsSz);
-  Rewind(&D->ChunkEMaxSzsStream);
-  GrowToAccomodate(&D->ChunkEMaxSzsStream, ChunkEMaxSzsSz - Size(D->ChunkEMaxSzsStream));
-  ReadBackwardBuffer(Fp, &D->ChunkEMaxSzsStream.Stream, ChunkEMaxSzsSz);
-  BytesExps_ += sizeof(int) + ChunkEMaxSzsSz;
-  DecodeIOTime_ += ElapsedTime(&IOTimer);
-  InitRead(&D->ChunkEMaxSzsStream, D->ChunkEMaxSzsStream.Stream);
-  file_exp_cache FileExpCache;
-  Reserve(&FileExpCache.ChunkExpSzs, ChunkEMaxSzsSz);
-  i32 ChunkEMaxSz = 0;
-  while (Size(D->ChunkEMaxSzsStream) < ChunkEMaxSzsSz) {
-    PushBack(&FileExpCache.ChunkExpSzs, ChunkEMaxSz += (i32)ReadVarByte(&D->ChunkEMaxSzsStream));
+Open(decode_data* D, const file_id& FileId, read_file* F) {
+  F->Key = FdKey(FileId.Name.ConstPtr);
+  if (D->Main->MapFiles) {
+    lock MapLock(&D->Main->Mutex);
+    auto MapOk = MapFileForRead(D, F->Key, FileId, &F->Map);
+    F->Where = F->Map.Bytes;
+    return MapOk;
   }
-  Resize(&FileExpCache.ChunkExpCaches, Size(FileExpCache.ChunkExpSzs));
-  idx2_Assert(Size(D->ChunkEMaxSzsStream) == ChunkEMaxSzsSz);
-  Insert(FileExpCacheIt, FileId.Id, FileExpCache);
+  if (!Acquire(&D->Main->FdCache, F->Key, FileId.Name.ConstPtr, &F->File, &F->Where))
+    return idx2_Error(idx2_file_err_code::FileNotFound, "%s", FileId.Name.ConstPtr);
   return idx2_Error(idx2_file_err_code::NoError);
 }
 
-/* Given a brick address, open the file associated with the brick and cache its chunk information */
-static error<idx2_file_err_code>
-ReadFile(decode_data* D, hash_table<u64, file_cache>::iterator* FileCacheIt, const file_id& FileId) {
-  timer IOTimer;
-  StartTimer(&IOTimer);
-  idx2_RAII(FILE*, Fp = fopen(FileId.Name.ConstPtr, "rb"),, if (Fp) fclose(Fp));
-  idx2_FSeek(Fp, 0, SEEK_END);
-  int NChunks = 0; ReadBackwardPOD(Fp, &NChunks);
-  // TODO: check if there are too many NChunks
+static void
+Close(decode_data* D, read_file* F) {
+  if (!F->Map.Data)
+    Release(&D->Main->FdCache, F->Key);
+}
 
-  /* read and decompress chunk addresses */
-  int IniChunkAddrsSz = NChunks * (int)sizeof(u64);
-  int ChunkAddrsSz; ReadBackwardPOD(Fp, &ChunkAddrsSz);
-  idx2_RAII(buffer, CpresChunkAddrs, AllocBuf(&CpresChunkAddrs, ChunkAddrsSz), DeallocBuf(&CpresChunkAddrs)); // TODO: move to decode_data
-  ReadBackwardBuffer(Fp, &CpresChunkAddrs, ChunkAddrsSz);
-  BytesData_ += ChunkAddrsSz;
-  DecodeIOTime_ += ElapsedTime(&IOTimer);
-  Rewind(&D->ChunkAddrsStream);
+/* Open a file for reading and close it when going out of scope */
+#define idx2_OpenForRead(F, D, FileId)\
+  read_file F;\
+  { auto OpenOk = Open(D, FileId, &F); if (!OpenOk) return OpenOk; }\
+  idx2_CleanUp(Close(D, &F));
+
+/* Read the Bytes bytes right before F->Where into Dst, then move F->Where back */
+static void
+ReadBackward(read_file* F, void* Dst, i64 Bytes) {
+  F->Where -= Bytes;
+  if (F->Map.Data)
+    memcpy(Dst, F->Map.Data + F->Where, size_t(Bytes));
+  else
+    ReadAt(F->File, F->Where, Dst, Bytes);
+}
+
+idx2_T(t) static void
+ReadBackwardPOD(read_file* F, t* Val) { ReadBackward(F, Val, sizeof(t)); }
+
+/*
+Return the bytes [Offset, Offset + Bytes) of a file. If the file is mapped, the result points into
+the mapping, otherwise the bytes are read into Scratch (which must be large enough). */
+static buffer
+View(read_file* F, i64 Offset, i64 Bytes, const buffer& Scratch) {
+  if (F->Map.Data)
+    return buffer(F->Map.Data + Offset, Bytes);
+  idx2_Assert(Size(Scratch) >= Bytes);
+  ReadAt(F->File, Offset, Scratch.Data, Bytes);
+  return buffer(Scratch.Data, Bytes);
+}
+
+/* Same as View but for the Bytes bytes right before F->Where, then move F->Where back */
+static buffer
+ViewBackward(read_file* F, i64 Bytes, const buffer& Scratch) {
+  F->Where -= Bytes;
+  return View(F, F->Where, Bytes, Scratch);
+}
+
+/*
+Find the cache of a file in Table, waiting while another thread reads the file. If no thread has read
+the file, an empty placeholder (Loading) is inserted for other threads to wait on and true is
+returned: the caller then reads the file without the lock and calls PublishFile. D->Main->Mutex must
+be held. */
+idx2_T(t) static bool
+ClaimFile(decode_data* D, hash_table<u64, t>* Table, u64 Key, typename hash_table<u64, t>::iterator* It) {
+  for (;;) {
+    *It = Lookup(Table, Key);
+    if (!*It) {
+      t Placeholder; Placeholder.Loading = true;
+      Insert(It, Key, Placeholder);
+      return true;
+    }
+    if (!It->Val->Loading)
+      return false;
+    Wait(&D->Main->Loaded, &D->Main->Mutex);
+  }
+}
+
+/*
+Replace the placeholder of a file claimed with ClaimFile (or delete it if File is null, i.e., the file
+could not be read), then wake up the threads that wait for the file. D->Main->Mutex must be held. */
+idx2_T(t) static void
+PublishFile(decode_data* D, hash_table<u64, t>* Table, u64 Key, const t* File, typename hash_table<u64, t>::iterator* It) {
+  *It = Lookup(Table, Key); // the table may have grown while the lock was released
+  idx2_Assert(*It && It->Val->Loading);
+  if (File) {
+    *It->Val = *File;
+  } else {
+    Delete(Table, Key);
+    *It = Lookup(Table, Key);
+  }
+  NotifyAll(&D->Main->Loaded);
+}
+
+/* Read and decompress the truncation points of all the chunks in a file (without the cache lock) */
+static error<idx2_file_err_code>
+LoadFileRdos(decode_data* D, const file_id& FileId, int* NumChunks, bitstream* Bs) {
+  timer IOTimer;
+  StartTimer(&IOTimer);
+  idx2_OpenForRead(F, D, FileId);
+  ReadBackwardPOD(&F, NumChunks);
+  i64 Sz = F.Where;
+  BytesRdos_ += sizeof(*NumChunks);
+  idx2_RAII(buffer, CompresBuf, if (!F.Map.Data) AllocBuf(&CompresBuf, Sz), if (CompresBuf.Data) DeallocBuf(&CompresBuf));
+  buffer CompresView = ViewBackward(&F, Sz, CompresBuf);
+  AddIOTime(D, ElapsedTime(&IOTimer));
+  BytesRdos_ += Size(CompresView);
+  DecompressBufZstd(CompresView, Bs);
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
+/* Find the rdo cache of a file, reading the file if no thread has (D->Main->Mutex must be held, it is
+released while the file is read) */
+static error<idx2_file_err_code>
+ReadFileRdos(const idx2_file& Idx2, decode_data* D, hash_table<u64, file_rdo_cache>::iterator* FileRdoCacheIt, const file_id& FileId) {
+  decode_data* M = D->Main;
+  if (!ClaimFile(D, &M->FcTable.FileRdoCaches, FileId.Id, FileRdoCacheIt))
+    return idx2_Error(idx2_file_err_code::NoError);
+  int NumChunks = 0;
+  idx2_RAII(bitstream, Bs,);
+  Unlock(&M->Mutex);
+  auto ReadOk = LoadFileRdos(D, FileId, &NumChunks, &Bs);
+  Lock(&M->Mutex);
+  if (!ReadOk) {
+    PublishFile(D, &M->FcTable.FileRdoCaches, FileId.Id, (const file_rdo_cache*)nullptr, FileRdoCacheIt);
+    return ReadOk;
+  }
+  allocator* Alloc = M->CacheAlloc;
+  file_rdo_cache FileRdoCache;
+  FileRdoCache.TileRdoCaches = array<chunk_rdo_cache>(Alloc);
+  Resize(&FileRdoCache.TileRdoCaches, NumChunks);
+  int Pos = 0;
+  idx2_For(int, I, 0, Size(FileRdoCache.TileRdoCaches)) {
+    chunk_rdo_cache& TileRdoCache = FileRdoCache.TileRdoCaches[I];
+    TileRdoCache.TruncationPoints = array<i16>(Alloc);
+    Resize(&TileRdoCache.TruncationPoints, Size(Idx2.RdoLevels) * Size(Idx2.Subbands));
+    idx2_ForEach(It, TileRdoCache.TruncationPoints) *It = ((const i16*)Bs.Stream.Data)[Pos++];
+  }
+  PublishFile(D, &M->FcTable.FileRdoCaches, FileId.Id, &FileRdoCache, FileRdoCacheIt);
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
+/* Read the sizes of the exponent chunks of a file into D->ChunkEMaxSzsStream (without the cache lock) */
+static error<idx2_file_err_code>
+LoadFileExponents(decode_data* D, const file_id& FileId, int* ChunkEMaxSzsSz) {
+  timer IOTimer;
+  StartTimer(&IOTimer);
+  idx2_OpenForRead(F, D, FileId);
+  ReadBackwardPOD(&F, ChunkEMaxSzsSz);
+  Rewind(&D->ChunkEMaxSzsStream);
+  GrowToAccomodate(&D->ChunkEMaxSzsStream, *ChunkEMaxSzsSz - Size(D->ChunkEMaxSzsStream));
+  /* always copied (it is small) since the stream is read in 8-byte words and ends near the end of the file */
+  ReadBackward(&F, D->ChunkEMaxSzsStream.Stream.Data, *ChunkEMaxSzsSz);
+  BytesExps_ += sizeof(int) + *ChunkEMaxSzsSz;
+  AddIOTime(D, ElapsedTime(&IOTimer));
+  InitRead(&D->ChunkEMaxSzsStream, D->ChunkEMaxSzsStream.Stream);
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
+/* Find the exponent cache of a file, reading the file if no thread has (D->Main->Mutex must be held,
+it is released while the file is read) */
+static error<idx2_file_err_code>
+ReadFileExponents(decode_data* D, hash_table<u64, file_exp_cache>::iterator* FileExpCacheIt, const file_id& FileId) {
+  decode_data* M = D->Main;
+  if (!ClaimFile(D, &M->FcTable.FileExpCaches, FileId.Id, FileExpCacheIt))
+    return idx2_Error(idx2_file_err_code::NoError);
+  int ChunkEMaxSzsSz = 0;
+  Unlock(&M->Mutex);
+  auto ReadOk = LoadFileExponents(D, FileId, &ChunkEMaxSzsSz);
+  Lock(&M->Mutex);
+  if (!ReadOk) {
+    PublishFile(D, &M->FcTable.FileExpCaches, FileId.Id, (const file_exp_cache*)nullptr, FileExpCacheIt);
+    return ReadOk;
+  }
+  file_exp_cache FileExpCache;
+  FileExpCache.ChunkExpSzs = array<i32>(M->CacheAlloc);
+  FileExpCache.ChunkExpCaches = array<chunk_exp_cache>(M->CacheAlloc);
+  Reserve(&FileExpCache.ChunkExpSzs, ChunkEMaxSzsSz);
+  i32 ChunkEMaxSz = 0;
+  while (Size(D->ChunkEMaxSzsStream) < ChunkEMaxSzsSz) {
+    PushBack(&FileExpCache.ChunkExpSzs, ChunkEMaxSz += (i32)ReadVarByte(&D->ChunkEMaxSzsStream));
+  }
+  Resize(&FileExpCache.ChunkExpCaches, Size(FileExpCache.ChunkExpSzs));
+  idx2_Assert(Size(D->ChunkEMaxSzsStream) == ChunkEMaxSzsSz);
+  PublishFile(D, &M->FcTable.FileExpCaches, FileId.Id, &FileExpCache, FileExpCacheIt);
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
+/*
+Read the chunk addresses of a file into D->ChunkAddrsStream and point ChunkSzsStream to its chunk sizes
+(without the cache lock) */
+static error<idx2_file_err_code>
+LoadFile(decode_data* D, const file_id& FileId, int* NChunks, bitstream* ChunkSzsStream) {
+  timer IOTimer;
+  StartTimer(&IOTimer);
+  idx2_OpenForRead(F, D, FileId);
+  ReadBackwardPOD(&F, NChunks);
+  // TODO: check if there are too many NChunks
+
+  /* read and decompress chunk addresses */
+  int IniChunkAddrsSz = *NChunks * (int)sizeof(u64);
+  int ChunkAddrsSz; ReadBackwardPOD(&F, &ChunkAddrsSz);
+  idx2_RAII(buffer, CpresChunkAddrs, if (!F.Map.Data) AllocBuf(&CpresChunkAddrs, ChunkAddrsSz), if (CpresChunkAddrs.Data) DeallocBuf(&CpresChunkAddrs)); // TODO: move to decode_data
+  buffer CpresChunkAddrsView = ViewBackward(&F, ChunkAddrsSz, CpresChunkAddrs);
+  BytesData_ += ChunkAddrsSz;
+  AddIOTime(D, ElapsedTime(&IOTimer));
+  Rewind(&D->ChunkAddrsStream);
   GrowToAccomodate(&D->ChunkAddrsStream, IniChunkAddrsSz - Size(D->ChunkAddrsStream));
-  DecompressBufZstd(CpresChunkAddrs, &D->ChunkAddrsStream);
+  DecompressBufZstd(CpresChunkAddrsView, &D->ChunkAddrsStream);
 
-  /* read chunk sizes */
+  /* read chunk sizes (the chunk addresses follow them so 8-byte reads stay inside the file) */
   ResetTimer(&IOTimer);
   int ChunkSizesSz = 0;
-  ReadBackwardPOD(Fp, &ChunkSizesSz);
+  ReadBackwardPOD(&F, &ChunkSizesSz);
   Rewind(&D->ChunkSzsStream);
-  GrowToAccomodate(&D->ChunkSzsStream, ChunkSizesSz - Size(D->ChunkSzsStream));
-  ReadBackwardBuffer(Fp, &D->ChunkSzsStream.Stream, ChunkSizesSz);
+  if (!F.Map.Data)
+    GrowToAccomodate(&D->ChunkSzsStream, ChunkSizesSz - Size(D->ChunkSzsStream));
+  InitRead(ChunkSzsStream, ViewBackward(&F, ChunkSizesSz, D->ChunkSzsStream.Stream));
   BytesData_ += ChunkSizesSz;
-  DecodeIOTime_ += ElapsedTime(&IOTimer);
-  InitRead(&D->ChunkSzsStream, D->ChunkSzsStream.Stream);
+  AddIOTime(D, ElapsedTime(&IOTimer));
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
+/*
+Given a brick address, find the file associated with the brick and cache its chunk information, reading
+the file if no thread has (D->Main->Mutex must be held, it is released while the file is read) */
+static error<idx2_file_err_code>
+ReadFile(decode_data* D, hash_table<u64, file_cache>::iterator* FileCacheIt, const file_id& FileId) {
+  decode_data* M = D->Main;
+  if (!ClaimFile(D, &M->FcTable.FileCaches, FileId.Id, FileCacheIt))
+    return idx2_Error(idx2_file_err_code::NoError);
+  int NChunks = 0;
+  bitstream ChunkSzsStream; // in D->ChunkSzsStream or in the mapping of the file
+  Unlock(&M->Mutex);
+  auto ReadOk = LoadFile(D, FileId, &NChunks, &ChunkSzsStream);
+  Lock(&M->Mutex);
+  if (!ReadOk) {
+    PublishFile(D, &M->FcTable.FileCaches, FileId.Id, (const file_cache*)nullptr, FileCacheIt);
+    return ReadOk;
+  }
 
   /* parse the chunk addresses and cache in memory */
+  allocator* Alloc = M->CacheAlloc;
   file_cache FileCache;
+  FileCache.ChunkSizes = array<i64>(Alloc);
+  Reserve(&FileCache.ChunkSizes, NChunks);
   i64 AccumSize = 0;
-  Init(&FileCache.ChunkCaches, 10);
+  Init(&FileCache.ChunkCaches, 10, Alloc);
   idx2_For(int, I, 0, NChunks) {
-    i64 ChunkSize = ReadVarByte(&D->ChunkSzsStream);
+    i64 ChunkSize = ReadVarByte(&ChunkSzsStream);
     u64 ChunkAddr = *((u64*)D->ChunkAddrsStream.Stream.Data + I);
     chunk_cache ChunkCache; ChunkCache.ChunkPos = I;
+    ChunkCache.Bricks = array<u64>(Alloc);
+    ChunkCache.BrickSzs = array<i32>(Alloc);
     Insert(&FileCache.ChunkCaches, ChunkAddr, ChunkCache);
     PushBack(&FileCache.ChunkSizes, AccumSize += ChunkSize);
   }
-  idx2_Assert(Size(D->ChunkSzsStream) == ChunkSizesSz);
-  Insert(FileCacheIt, FileId.Id, FileCache);
+  idx2_Assert(Size(ChunkSzsStream) == Size(ChunkSzsStream.Stream));
+  PublishFile(D, &M->FcTable.FileCaches, FileId.Id, &FileCache, FileCacheIt);
   return idx2_Error(idx2_file_err_code::NoError);
 }
 
+/* Parse the header of a chunk (its bricks and their sizes) into Bricks and BrickSzs */
 static void
-DecompressChunk(bitstream* ChunkStream, chunk_cache* ChunkCache, u64 ChunkAddress, int L) {
+DecompressChunk(bitstream* ChunkStream, array<u64>* Bricks, array<i32>* BrickSzs, u64 ChunkAddress, int L) {
   (void)L; u64 Brk = ((ChunkAddress >> 18) & 0x3FFFFFFFFFFull); (void)Brk;
   InitRead(ChunkStream, ChunkStream->Stream);
   int NBricks = (int)ReadVarByte(ChunkStream); idx2_Assert(NBricks > 0);
 
   /* decompress and store the brick ids */
   u64 Brick = ReadVarByte(ChunkStream);
-  Resize(&ChunkCache->Bricks, NBricks);
-  ChunkCache->Bricks[0] = Brick;
+  Resize(Bricks, NBricks);
+  (*Bricks)[0] = Brick;
   idx2_For(int, I, 1, NBricks) {
     Brick += ReadUnary(ChunkStream) + 1;
-    ChunkCache->Bricks[I] = Brick;
+    (*Bricks)[I] = Brick;
     idx2_Assert(Brk == (Brick >> L));
   }
-  Resize(&ChunkCache->BrickSzs, NBricks);
+  Resize(BrickSzs, NBricks);
 
   /* decompress and store the brick sizes */
   i32 BrickSize = 0;
   SeekToNextByte(ChunkStream);
-  idx2_ForEach(BrickSzIt, ChunkCache->BrickSzs) *BrickSzIt = BrickSize += (i32)ReadVarByte(ChunkStream);
-  ChunkCache->ChunkStream = *ChunkStream;
+  idx2_ForEach(BrickSzIt, *BrickSzs) *BrickSzIt = BrickSize += (i32)ReadVarByte(ChunkStream);
+}
+
+/* Pin a chunk in memory until D is done with the current subband (D->Main->Mutex must be held) */
+static void
+Pin(decode_data* D, const cached_chunk& C) {
+  if (C.Chunk) {
+    ++C.Chunk->NUsers;
+    C.Chunk->LastUse = ++D->Main->CacheClock;
+  } else {
+    ++C.ChunkExp->NUsers;
+    C.ChunkExp->LastUse = ++D->Main->CacheClock;
+  }
+  PushBack(&D->PinnedChunks, C);
+}
+
+static void
+UnpinAll(decode_data* D) {
+  if (Size(D->PinnedChunks) == 0)
+    return;
+  lock CacheLock(&D->Main->Mutex);
+  idx2_ForEach(It, D->PinnedChunks) {
+    if (It->Chunk) --It->Chunk->NUsers; else --It->ChunkExp->NUsers;
+  }
+  Clear(&D->PinnedChunks);
+}
+
+/*
+Evict the least recently used chunks that are not pinned, until at most Target bytes are cached.
+An evicted chunk stays in its file cache, empty, and is read again the next time it is needed. */
+static void
+EvictChunks(decode_data* M, i64 Target) {
+  std::sort(Begin(M->ResidentChunks), End(M->ResidentChunks), [](const cached_chunk& A, const cached_chunk& B) {
+    return (A.Chunk ? A.Chunk->LastUse : A.ChunkExp->LastUse) < (B.Chunk ? B.Chunk->LastUse : B.ChunkExp->LastUse);
+  });
+  i64 NKept = 0;
+  idx2_ForEach(It, M->ResidentChunks) {
+    bool Pinned = It->Chunk ? It->Chunk->NUsers > 0 : It->ChunkExp->NUsers > 0;
+    if (M->CacheBytes <= Target || Pinned) {
+      M->ResidentChunks[NKept++] = *It;
+      continue;
+    }
+    M->CacheBytes -= Size(*It);
+    ++M->NEvictions;
+    if (It->Chunk) {
+      Dealloc(It->Chunk);
+      It->Chunk->ChunkStream = bitstream();
+    } else {
+      Dealloc(It->ChunkExp);
+      *It->ChunkExp = chunk_exp_cache();
+    }
+  }
+  Resize(&M->ResidentChunks, NKept);
+}
+
+/* Count a chunk that has just been read towards the cache budget (D->Main->Mutex must be held) */
+static void
+AddToCache(decode_data* D, const cached_chunk& C) {
+  decode_data* M = D->Main;
+  PushBack(&M->ResidentChunks, C);
+  M->CacheBytes += Size(C);
+  M->PeakCacheBytes = Max(M->PeakCacheBytes, M->CacheBytes);
+  if (M->MaxCacheBytes > 0 && M->CacheBytes > M->MaxCacheBytes) // evict more than needed so that the resident chunks are not sorted on every read
+    EvictChunks(M, M->MaxCacheBytes / 4 * 3);
+}
+
+/* Read and decompress an exponent chunk into D->ChunkExpStream (without the cache lock) */
+static error<idx2_file_err_code>
+LoadChunkExponents(decode_data* D, const file_id& FileId, i32 ChunkExpOffset, i32 ChunkExpSize, i64* Bytes) {
+  timer IOTimer;
+  StartTimer(&IOTimer);
+  idx2_OpenForRead(F, D, FileId);
+  // TODO: calculate the number of bricks in this chunk in a different way to verify correctness
+  if (!F.Map.Data)
+    Resize(&D->CompressedChunkExps, ChunkExpSize);
+  buffer CompressedView = View(&F, ChunkExpOffset, ChunkExpSize, D->CompressedChunkExps);
+  BytesExps_ += ChunkExpSize;
+  AddIOTime(D, ElapsedTime(&IOTimer));
+  *Bytes = ZSTD_getFrameContentSize(CompressedView.Data, Size(CompressedView));
+  Rewind(&D->ChunkExpStream);
+  DecompressBufZstd(CompressedView, &D->ChunkExpStream);
+  return idx2_Error(idx2_file_err_code::NoError);
 }
 
-/* Given a brick address, read the exponent chunk associated with the brick and cache it */
+/*
+Given a brick address, read the exponent chunk associated with the brick and cache it. The chunk is
+claimed (Loading) under the cache lock, read and decompressed without it, then copied to the cache
+(whose allocator is only accessed under the lock). */
 // TODO: remove the last two params (already stored in D)
 static expected<const chunk_exp_cache*, idx2_file_err_code>
 ReadChunkExponents(const idx2_file& Idx2, decode_data* D, u64 Brick, i8 Iter, i8 Level) {
+  decode_data* M = D->Main;
   file_id FileId = ConstructFilePathExponents(Idx2, Brick, Iter, Level);
-  auto FileExpCacheIt = Lookup(&D->FcTable.FileExpCaches, FileId.Id);
-  if (!FileExpCacheIt) {
-    auto ReadFileOk = ReadFileExponents(D, &FileExpCacheIt, FileId);
-    if (!ReadFileOk) idx2_PropagateError(ReadFileOk);
-  }
+  lock CacheLock(&M->Mutex);
+  hash_table<u64, file_exp_cache>::iterator FileExpCacheIt;
+  auto ReadFileOk = ReadFileExponents(D, &FileExpCacheIt, FileId);
+  if (!ReadFileOk) idx2_PropagateError(ReadFileOk);
   if (!FileExpCacheIt) return idx2_Error(idx2_file_err_code::FileNotFound);
   file_exp_cache* FileExpCache = FileExpCacheIt.Val;
   idx2_Assert(D->ChunkInFile < Size(FileExpCache->ChunkExpSzs));
 
-  /* find the appropriate chunk */
-  if (IsEmpty(FileExpCache->ChunkExpCaches[D->ChunkInFile])) {
-    timer IOTimer;
-    StartTimer(&IOTimer);
-    idx2_RAII(FILE*, Fp = fopen(FileId.Name.ConstPtr, "rb"), , if (Fp) fclose(Fp));
-    idx2_Assert(Fp); // TODO: return an error
-    i32 ChunkExpOffset = D->ChunkInFile == 0 ? 0 : FileExpCache->ChunkExpSzs[D->ChunkInFile - 1];
-    i32 ChunkExpSize = FileExpCache->ChunkExpSzs[D->ChunkInFile] - ChunkExpOffset;
-    idx2_FSeek(Fp, ChunkExpOffset, SEEK_SET);
-    chunk_exp_cache ChunkExpCache;
-    bitstream& ChunkExpStream = ChunkExpCache.BrickExpsStream;
-    // TODO: calculate the number of bricks in this chunk in a different way to verify correctness
-    Resize(&D->CompressedChunkExps, ChunkExpSize);
-    ReadBuffer(Fp, &D->CompressedChunkExps, ChunkExpSize);
-    DecompressBufZstd(buffer{D->CompressedChunkExps.Data, ChunkExpSize}, &ChunkExpStream);
-    BytesExps_ += ChunkExpSize;
-    DecodeIOTime_ += ElapsedTime(&IOTimer);
+  /* find the appropriate chunk (which stays in place even if FileExpCaches grows, unlike FileExpCache) */
+  chunk_exp_cache* ChunkExpCache = &FileExpCache->ChunkExpCaches[D->ChunkInFile];
+  i32 ChunkExpOffset = D->ChunkInFile == 0 ? 0 : FileExpCache->ChunkExpSzs[D->ChunkInFile - 1];
+  i32 ChunkExpSize = FileExpCache->ChunkExpSzs[D->ChunkInFile] - ChunkExpOffset;
+  while (ChunkExpCache->Loading)
+    Wait(&M->Loaded, &M->Mutex);
+  if (IsEmpty(*ChunkExpCache)) {
+    i64 Bytes = 0;
+    ChunkExpCache->Loading = true;
+    Unlock(&M->Mutex);
+    auto ReadOk = LoadChunkExponents(D, FileId, ChunkExpOffset, ChunkExpSize, &Bytes);
+    Lock(&M->Mutex);
+    ChunkExpCache->Loading = false;
+    NotifyAll(&M->Loaded);
+    if (!ReadOk) return ReadOk;
+    bitstream& ChunkExpStream = ChunkExpCache->BrickExpsStream;
+    InitWrite(&ChunkExpStream, Bytes, M->CacheAlloc);
+    memcpy(ChunkExpStream.Stream.Data, D->ChunkExpStream.Stream.Data, Bytes);
+    memset(ChunkExpStream.Stream.Data + Bytes, 0, Size(ChunkExpStream.Stream) - Bytes);
     InitRead(&ChunkExpStream, ChunkExpStream.Stream);
-    FileExpCache->ChunkExpCaches[D->ChunkInFile] = ChunkExpCache;
+    Pin(D, cached_chunk{nullptr, ChunkExpCache});
+    AddToCache(D, cached_chunk{nullptr, ChunkExpCache});
+  } else {
+    Pin(D, cached_chunk{nullptr, ChunkExpCache});
   }
-  return &FileExpCache->ChunkExpCaches[D->ChunkInFile];
+  return ChunkExpCache;
 }
 
 static expected<const chunk_rdo_cache*, idx2_file_err_code>
 ReadChunkRdos(const idx2_file& Idx2, decode_data* D, u64 Brick, i8 Iter) {
   file_id FileId = ConstructFilePathRdos(Idx2, Brick, Iter);
-  auto FileRdoCacheIt = Lookup(&D->FcTable.FileRdoCaches, FileId.Id);
-  if (!FileRdoCacheIt) {
-    auto ReadFileOk = ReadFileRdos(Idx2, &FileRdoCacheIt, FileId);
-    if (!ReadFileOk) idx2_PropagateError(ReadFileOk);
-  }
+  lock CacheLock(&D->Main->Mutex);
+  hash_table<u64, file_rdo_cache>::iterator FileRdoCacheIt;
+  auto ReadFileOk = ReadFileRdos(Idx2, D, &FileRdoCacheIt, FileId);
+  if (!ReadFileOk) idx2_PropagateError(ReadFileOk);
   if (!FileRdoCacheIt) return idx2_Error(idx2_file_err_code::FileNotFound);
   file_rdo_cache* FileRdoCache = FileRdoCacheIt.Val;
   return &FileRdoCache->TileRdoCaches[D->ChunkInFile];
 }
 
-/* Given a brick address, read the chunk associated with the brick and cache the chunk */
+/*
+Read a chunk into ChunkStream (which points into the mapping of the file, or has been allocated with
+the cache allocator, under the lock) and parse its header into D->ChunkBricks and D->ChunkBrickSzs
+(without the cache lock) */
+static error<idx2_file_err_code>
+LoadChunk(const idx2_file& Idx2, decode_data* D, const file_id& FileId, i64 ChunkOffset, i64 ChunkSize, u64 ChunkAddress, i8 Iter, bitstream* ChunkStream) {
+  timer IOTimer;
+  StartTimer(&IOTimer);
+  idx2_OpenForRead(F, D, FileId);
+  if (F.Map.Data) { // point into the mapping (the file metadata follows the chunks so 8-byte reads stay inside the file)
+    ChunkStream->Stream = View(&F, ChunkOffset, ChunkSize, buffer());
+  } else {
+    ReadAt(F.File, ChunkOffset, ChunkStream->Stream.Data, ChunkSize);
+    memset(ChunkStream->Stream.Data + ChunkSize, 0, Size(ChunkStream->Stream) - ChunkSize);
+  }
+  BytesData_ += ChunkSize;
+  AddIOTime(D, ElapsedTime(&IOTimer));
+  DecompressChunk(ChunkStream, &D->ChunkBricks, &D->ChunkBrickSzs, ChunkAddress, Log2Ceil(Idx2.BricksPerChunks[Iter])); // TODO: check for error
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
+/*
+Given a brick address, read the chunk associated with the brick and cache the chunk. The chunk is
+claimed (Loading) under the cache lock, read and parsed without it, then published under the lock
+(as in ReadChunksAhead). */
 static expected<const chunk_cache*, idx2_file_err_code>
 ReadChunk(const idx2_file& Idx2, decode_data* D, u64 Brick, i8 Iter, i8 Level, i16 BitPlane) {
+  decode_data* M = D->Main;
   file_id FileId = ConstructFilePath(Idx2, Brick, Iter, Level, BitPlane);
-  auto FileCacheIt = Lookup(&D->FcTable.FileCaches, FileId.Id);
-  if (!FileCacheIt) {
-    auto ReadFileOk = ReadFile(D, &FileCacheIt, FileId);
-    if (!ReadFileOk) idx2_PropagateError(ReadFileOk);
-  }
+  lock CacheLock(&M->Mutex);
+  hash_table<u64, file_cache>::iterator FileCacheIt;
+  auto ReadFileOk = ReadFile(D, &FileCacheIt, FileId);
+  if (!ReadFileOk) idx2_PropagateError(ReadFileOk);
   if (!FileCacheIt) return idx2_Error(idx2_file_err_code::FileNotFound);
 
-  /* find the appropriate chunk */
+  /* find the appropriate chunk (which stays in place even if FileCaches grows, unlike FileCache) */
   u64 ChunkAddress = GetChunkAddress(Idx2, Brick, Iter, Level, BitPlane);
   file_cache* FileCache = FileCacheIt.Val;
-  decltype(FileCache->ChunkCaches)::iterator ChunkCacheIt;
-  ChunkCacheIt = Lookup(&FileCache->ChunkCaches, ChunkAddress);
+  auto ChunkCacheIt = Lookup(&FileCache->ChunkCaches, ChunkAddress);
   if (!ChunkCacheIt) return idx2_Error(idx2_file_err_code::ChunkNotFound);
   chunk_cache* ChunkCache = ChunkCacheIt.Val;
+  i32 ChunkPos = ChunkCache->ChunkPos;
+  i64 ChunkOffset = ChunkPos > 0 ? FileCache->ChunkSizes[ChunkPos - 1] : 0;
+  i64 ChunkSize = FileCache->ChunkSizes[ChunkPos] - ChunkOffset;
+  while (ChunkCache->Loading)
+    Wait(&M->Loaded, &M->Mutex);
   if (Size(ChunkCache->ChunkStream.Stream) == 0) {
-    timer IOTimer;
-    StartTimer(&IOTimer);
-    idx2_RAII(FILE*, Fp = fopen(FileId.Name.ConstPtr, "rb"), , if (Fp) fclose(Fp));
-    i32 ChunkPos = ChunkCache->ChunkPos;
-    i64 ChunkOffset = ChunkPos > 0 ? FileCache->ChunkSizes[ChunkPos - 1] : 0;
-    i64 ChunkSize = FileCache->ChunkSizes[ChunkPos] - ChunkOffset;
-    idx2_FSeek(Fp, ChunkOffset, SEEK_SET);
-    bitstream ChunkStream; InitWrite(&ChunkStream, ChunkSize); // NOTE: not a memory leak since we will keep track of this in ChunkCache
-    ReadBuffer(Fp, &ChunkStream.Stream);
-    BytesData_ += Size(ChunkStream.Stream);
-    DecodeIOTime_ += ElapsedTime(&IOTimer);
-    DecompressChunk(&ChunkStream, ChunkCache, ChunkAddress, Log2Ceil(Idx2.BricksPerChunks[Iter])); // TODO: check for error
-//    PushBack(&D->RequestedChunks, t2<u64, u64>{ChunkAddress, FileId.Id});
-  }
-  return ChunkCacheIt.Val;
-}
-
-/* decode the subband of a brick */
-// TODO: we can detect the precision and switch to the avx2 version that uses float for better
-// performance
+    bitstream ChunkStream;
+    if (!M->MapFiles)
+      InitWrite(&ChunkStream, ChunkSize, M->CacheAlloc); // NOTE: not a memory leak since we will keep track of this in ChunkCache
+    ChunkCache->Loading = true;
+    Unlock(&M->Mutex);
+    auto ReadOk = LoadChunk(Idx2, D, FileId, ChunkOffset, ChunkSize, ChunkAddress, Iter, &ChunkStream);
+    Lock(&M->Mutex);
+    ChunkCache->Loading = false;
+    NotifyAll(&M->Loaded);
+    if (!ReadOk) {
+      if (!M->MapFiles)
+        M->CacheAlloc->Dealloc(&ChunkStream.Stream);
+      return ReadOk;
+    }
+    Clone(D->ChunkBricks, &ChunkCache->Bricks);
+    Clone(D->ChunkBrickSzs, &ChunkCache->BrickSzs);
+    ChunkCache->ChunkStream = ChunkStream;
+    Pin(D, cached_chunk{ChunkCache, nullptr});
+    AddToCache(D, cached_chunk{ChunkCache, nullptr});
+  } else {
+    Pin(D, cached_chunk{ChunkCache, nullptr});
+  }
+  return ChunkCache;
+}
+
+static idx2_Inline u64
+GetSubbandKey(i8 Iter, u64 Brick, i8 Level) { return (GetBrickKey(Iter, Brick) << 3) + Level; }
+
+/* Return the block states of a subband (created if they do not exist) */
+static subband_state
+GetSubbandState(decode_data* D, u64 Brick, i8 Iter, i8 Level, int NBlocks) {
+  lock StateLock(&D->Main->Mutex);
+  u64 Key = GetSubbandKey(Iter, Brick, Level);
+  auto StateIt = Lookup(&D->Main->BlockStates, Key);
+  if (!StateIt) {
+    subband_state State;
+    Resize(&State.Blocks, NBlocks);
+    Fill(idx2_Range(State.Blocks), block_state());
+    Insert(&StateIt, Key, State);
+  }
+  return *StateIt.Val; // a copy of the same blocks, which stay in place even if BlockStates grows
+}
+
+/* Return the lowest bit plane in the block states of a subband (or the max i16 if there is no state) */
+static i16
+GetLowestBitPlane(decode_data* D, u64 Brick, i8 Iter, i8 Level) {
+  lock StateLock(&D->Main->Mutex);
+  auto StateIt = Lookup(&D->Main->BlockStates, GetSubbandKey(Iter, Brick, Level));
+  return StateIt ? StateIt.Val->LowestBp : traits<i16>::Max;
+}
+
+static void
+SetLowestBitPlane(decode_data* D, u64 Brick, i8 Iter, i8 Level, i16 LowestBp) {
+  lock StateLock(&D->Main->Mutex);
+  auto StateIt = Lookup(&D->Main->BlockStates, GetSubbandKey(Iter, Brick, Level));
+  idx2_Assert(StateIt);
+  StateIt.Val->LowestBp = Min(StateIt.Val->LowestBp, LowestBp);
+}
+
+/* decode the subband of a brick (whose samples are of type t) */
 // TODO: if a block does not decode any bit plane, no need to copy data afterwards
-static error<idx2_file_err_code>
+idx2_T(t) static error<idx2_file_err_code>
 DecodeSubband(const idx2_file& Idx2, decode_data* D, f64 Accuracy, const grid& SbGrid, volume* BVol) {
+  idx2_CleanUp(UnpinAll(D)); // the chunks read for this subband can be evicted once it is decoded
   u64 Brick = D->Brick[D->Iter];
   v3i SbDims3 = Dims(SbGrid);
   v3i NBlocks3 = (SbDims3 + Idx2.BlockDims3 - 1) / Idx2.BlockDims3;
@@ -2030,36 +3021,80 @@ DecodeSubband(const idx2_file& Idx2, decode_data* D, f64 Accuracy, const grid& S
   SeekToByte(&BrickExpsStream, BrickExpOffset);
   u32 LastBlock = EncodeMorton3(v3<u32>(NBlocks3 - 1));
   const i8 NBitPlanes = idx2_BitSizeOf(u64);
+  /* continue from the bit planes decoded by earlier decodes, if their states are kept */
+  block_state* States = nullptr;
+  if (D->Main->KeepBlockStates)
+    States = Begin(GetSubbandState(D, Brick, D->Iter, D->Level, Prod(NBlocks3)).Blocks);
+  int BlockIdx = 0;
   /* gather the streams (for the different bit planes) */
+  const i16 BpBase = i16(Exponent(Accuracy) + NBitPlanes - 7); // the lowest bit plane decoded (see the bit plane loop)
+  /* the distances between neighboring samples of the subband in the brick */
+  v3i BrickDims3 = Dims(*BVol), SbFrom3 = From(SbGrid), SbStrd3 = Strd(SbGrid);
+  v3<i64> SampleStrd3(SbStrd3.X, i64(SbStrd3.Y) * BrickDims3.X, i64(SbStrd3.Z) * BrickDims3.X * BrickDims3.Y);
+  i64 DataMovementTime = 0; // added to DataMovementTime_ once per subband
+  /* the full blocks with bit planes are inverse transformed Zfp.BatchSize at a time */
+  u64 BatchUInts[ZfpMaxBatchSize * 64] = {};
+  i64 BatchInts[ZfpMaxBatchSize * 64];
+  i16 BatchEMaxes[ZfpMaxBatchSize];
+  v3i BatchD3s[ZfpMaxBatchSize];
+  int NBatch = 0;
+  auto DecodeBatch = [&]() {
+    if (NBatch == 0) return;
+    Zfp.InverseZfpBatch(BatchUInts, BatchInts);
+    const int Prec = NBitPlanes - 1 - 3;
+    idx2_For(int, I, 0, NBatch) {
+      f64 BlockFloats[4 * 4 * 4]; // dequantized in f64 whatever the type of the brick
+      buffer_t BufFloats(BlockFloats, 64);
+      buffer_t BufInts(&BatchInts[I * 64], 64);
+      Dequantize(BatchEMaxes[I], Prec, BufInts, &BufFloats);
+      timer DataTimer;
+      StartTimer(&DataTimer);
+      ScatterBlock(BlockFloats, SampleStrd3, &BVol->At<t>(SbFrom3, SbStrd3, BatchD3s[I]));
+      DataMovementTime += ElapsedTime(&DataTimer);
+    }
+    NBatch = 0;
+  };
   auto& Streams = D->Streams;
-  Clear(&Streams);
+  idx2_ForEach(SlotIt, D->StreamSlots) Streams[*SlotIt] = bitstream();
+  Clear(&D->StreamSlots);
   idx2_InclusiveFor(u32, Block, 0, LastBlock) { // zfp block loop
     v3i Z3(DecodeMorton3(Block));
     idx2_NextMorton(Block, Z3, NBlocks3);
+    block_state* State = States ? &States[BlockIdx++] : nullptr;
     v3i D3 = Z3 * Idx2.BlockDims3;
     v3i BlockDims3 = Min(Idx2.BlockDims3, SbDims3 - D3);
     const int NDims = NumDims(BlockDims3);
     const int NVals = 1 << (2 * NDims);
     const int Prec = NBitPlanes - 1 - NDims;
-    f64 BlockFloats[4 * 4 * 4];
-    buffer_t BufFloats(BlockFloats, NVals);
-    buffer_t BufInts((i64*)BlockFloats, NVals);
-    u64 BlockUInts [4 * 4 * 4] = {}; buffer_t BufUInts (BlockUInts , Prod(BlockDims3));
     bool CodedInNextIter = D->Level == 0 && D->Iter + 1 < Idx2.NLevels && BlockDims3 == Idx2.BlockDims3;
     if (CodedInNextIter) continue;
+    bool FullBlock = BlockDims3 == v3i(4);
+    u64 PartialUInts[4 * 4 * 4];
+    u64* BlockUInts = FullBlock ? &BatchUInts[NBatch * 64] : PartialUInts; // decoded into the batch directly
+    memset(BlockUInts, 0, sizeof(PartialUInts));
     i16 EMax = SizeOf(Idx2.DType) > 4 ? (i16)Read(&BrickExpsStream, 16) - traits<f64>::ExpBias
                                     : (i16)Read(&BrickExpsStream, traits<f32>::ExpBits) - traits<f32>::ExpBias;
     i8 N = 0;
     i8 EndBitPlane = Min(i8(BitSizeOf(Idx2.DType) + (24 + NDims)), NBitPlanes);
     int NBitPlanesDecoded = Exponent(Accuracy) - 6 - EMax + 1;
     i8 NBps = 0;
-    idx2_InclusiveForBackward(i8, Bp, NBitPlanes - 1, NBitPlanes - EndBitPlane) { // bit plane loop
+    i8 NBpsBefore = State ? State->NBps : 0; // the bit planes decoded by earlier decodes
+    if (NBpsBefore > 0) {
+      memcpy(BlockUInts, State->UInts, sizeof(PartialUInts));
+      N = State->N;
+    }
+    /* decoding bit plane by bit plane and then transposing is faster when there are many bit planes,
+    but the new bit planes of a block that has a state are added to the coefficients directly */
+    bool Transpose = NBitPlanesDecoded > 8 && NBpsBefore == 0;
+    idx2_InclusiveForBackward(i8, Bp, NBitPlanes - 1 - NBpsBefore, NBitPlanes - EndBitPlane) { // bit plane loop
       i16 RealBp = Bp + EMax;
       if (NBitPlanes - 6 > RealBp - Exponent(Accuracy) + 1) break;
       if (RealBp < MinBitPlane) break;
-      auto StreamIt = Lookup(&Streams, RealBp);
-      bitstream* Stream = nullptr;
-      if (!StreamIt) { // first block in the brick
+      i32 Slot = RealBp - BpBase;
+      if (Slot >= Size(Streams))
+        Resize(&Streams, Slot + 1);
+      bitstream* Stream = &Streams[Slot];
+      if (!Stream->Stream.Data) { // first block in the brick
         auto ReadChunkResult = ReadChunk(Idx2, D, Brick, D->Iter, D->Level, RealBp);
         if (!ReadChunkResult) { idx2_Assert(false); return Error(ReadChunkResult); }
         const chunk_cache* ChunkCache = Value(ReadChunkResult);
@@ -2070,72 +3105,119 @@ DecodeSubband(const idx2_file& Idx2, decode_data* D, f64 Accuracy, const grid& S
         idx2_Assert(BrickInChunk < Size(ChunkCache->BrickSzs));
         i64 BrickOffset = BrickInChunk == 0 ? 0 : ChunkCache->BrickSzs[BrickInChunk - 1];
         BrickOffset += Size(ChunkCache->ChunkStream);
-        Insert(&StreamIt, RealBp, ChunkCache->ChunkStream);
-        Stream = StreamIt.Val;
+        *Stream = ChunkCache->ChunkStream;
+        PushBack(&D->StreamSlots, Slot);
         SeekToByte(Stream, BrickOffset);
-      } else {
-        Stream = StreamIt.Val;
       }
       /* zfp decode */
       ++NBps;
 //      timer Timer; StartTimer(&Timer);
-      if (NBitPlanesDecoded <= 8)
-        Decode(BlockUInts, NVals, Bp, N, Stream);
+      if (!Transpose)
+        Zfp.Decode(BlockUInts, NVals, Bp, N, Stream);
       else
-        DecodeTest(&BlockUInts[NBitPlanes - 1 - Bp], NVals, N, Stream);
+        Zfp.DecodeTest(&BlockUInts[NBitPlanes - 1 - Bp], NVals, N, Stream);
 //      DecodeTime_ += Seconds(ElapsedTime(&Timer));
     } // end bit plane loop
-    if (NBitPlanesDecoded > 8) {
+    if (Transpose) {
 //      timer Timer; StartTimer(&Timer);
-      TransposeRecursive(BlockUInts, NBps);
+      Zfp.TransposeRecursive(BlockUInts, NBps);
 //      DecodeTime_ += Seconds(ElapsedTime(&Timer));
     }
-    if (NBps > 0) {
-      InverseShuffle(BlockUInts, (i64*)BlockFloats, NDims);
-      InverseZfp((i64*)BlockFloats, NDims);
+    if (State) {
+      memcpy(State->UInts, BlockUInts, sizeof(PartialUInts));
+      State->N = N;
+      State->NBps = NBpsBefore + NBps;
+    }
+    if (NBpsBefore + NBps == 0) continue;
+    if (FullBlock) {
+      BatchEMaxes[NBatch] = EMax;
+      BatchD3s[NBatch] = D3;
+      if (++NBatch == Zfp.BatchSize) DecodeBatch();
+    } else { // partial block
+      f64 BlockFloats[4 * 4 * 4];
+      i64 BlockInts[4 * 4 * 4];
+      buffer_t BufFloats(BlockFloats, NVals);
+      buffer_t BufInts(BlockInts, NVals);
+      Zfp.InverseShuffle(BlockUInts, BlockInts, NDims);
+      Zfp.InverseZfp(BlockInts, NDims);
       Dequantize(EMax, Prec, BufInts, &BufFloats);
-      v3i S3;
-      int J = 0;
-      v3i From3 = From(SbGrid), Strd3 = Strd(SbGrid);
       timer DataTimer;
       StartTimer(&DataTimer);
+      v3i S3;
+      int J = 0;
       idx2_BeginFor3(S3, v3i(0), BlockDims3, v3i(1)) { // sample loop
         idx2_Assert(D3 + S3 < SbDims3);
-        BVol->At<f64>(From3, Strd3, D3 + S3) = BlockFloats[J++];
+        BVol->At<t>(SbFrom3, SbStrd3, D3 + S3) = t(BlockFloats[J++]);
       } idx2_EndFor3 // end sample loop
-      DataMovementTime_ += ElapsedTime(&DataTimer);
+      DataMovementTime += ElapsedTime(&DataTimer);
     }
   }
+  DecodeBatch();
+  DataMovementTime_ += DataMovementTime;
+  if (States) // the bit planes that the blocks stop at (independent of the block exponents)
+    SetLowestBitPlane(D, Brick, D->Iter, D->Level, (i16)Max(NBitPlanes - 7 + Exponent(Accuracy), MinBitPlane));
   return idx2_Error(idx2_file_err_code::NoError);
 }
 
+/* Return the mask of the subbands to decode given the mask of the requested subbands */
+static u8
+GetDecodeSubbandMask(u8 Mask) {
+  // TODO: test this logic
+  u8 DecodeSbMask = Mask; // TODO: need change if we support more than one transform pass per brick
+  idx2_For(u8, Sb, 0, 8) {
+    if (!BitSet(Mask, Sb)) continue;
+    idx2_For(u8, S, 0, 8) if ((Sb | S) <= Sb) DecodeSbMask = SetBit(DecodeSbMask, S);
+  } // end subband loop
+  return DecodeSbMask;
+}
+
+/* Where DecodeBrick puts a brick of the output level: the samples in SGrid of the brick go to DGrid of
+Vol, after the inverse lifting passes in Passes (see GetOutputLiftPasses) */
+struct brick_output {
+  const array<lift_pass>* Passes = nullptr;
+  grid SGrid;
+  grid DGrid;
+  volume* Vol = nullptr;
+};
+
+/* The inverse lifting passes of a brick of the output level, whose samples are output on the grid of
+OutMask (see GetGrid). Along an axis where no subband of OutMask is high, the output skips the odd
+samples, and the coefficients there are all zeros, so the inverse lifting along that axis leaves the
+even samples as they are: the passes along that axis are dropped, and the other passes are only done
+on the even samples of that axis. */
 static void
-DecodeBrick(const idx2_file& Idx2, const params& P, decode_data* D, u8 Mask, f64 Accuracy) {
+GetOutputLiftPasses(const idx2_file& Idx2, u8 OutMask, array<lift_pass>* Passes) {
+  const transform_details& Td = Idx2.Td;
+  v3i M3 = Idx2.BrickDimsExt3;
+  PushInversePasses(Td, M3, Passes);
+  if (Td.NPasses != 1) // GetGrid assumes one transform pass per level
+    return;
+  v3i Div = GetHighAxes(OutMask, Idx2.Subbands);
+  i64 N = 0;
+  idx2_ForEach(PassIt, *Passes) {
+    if (Div[PassIt->Axis] == 0) continue;
+    lift_pass L = *PassIt;
+    v3i D3 = Dims(L.Grid), S3 = Strd(L.Grid);
+    idx2_For(int, D, 0, 3) if (Div[D] == 0) { D3[D] = (D3[D] + 1) >> 1; S3[D] <<= 1; }
+    SetDims(&L.Grid, D3);
+    SetStrd(&L.Grid, S3);
+    (*Passes)[N++] = L;
+  }
+  Resize(Passes, N);
+}
+
+idx2_T(t) static error<idx2_file_err_code>
+DecodeBrick(const idx2_file& Idx2, const params& P, decode_data* D, u8 Mask, f64 Accuracy, volume* BrickVol, const brick_output* Out = nullptr) {
+  error<idx2_file_err_code> Result = idx2_Error(idx2_file_err_code::NoError);
   i8 Iter = D->Iter;
   u64 Brick = D->Brick[Iter];
-//  if ((Brick >> Idx2.BricksPerChunks[Iter]) != D->LastTile) {
-//    idx2_ForEach(It, D->RequestedChunks) {
-//      auto& FileCache = D->FcTable.FileCaches[It->Second];
-//      auto ChunkCacheIt = Lookup(&FileCache.ChunkCaches, It->First);
-//      Dealloc(ChunkCacheIt.Val);
-//      Delete(&FileCache.ChunkCaches, It->First); // TODO: write a delete that works on iterator
-//    }
-//    Clear(&D->RequestedChunks);
-//    D->LastTile = Brick >> Idx2.BricksPerChunks[Iter];
-//  }
 //  printf("level %d brick " idx2_PrStrV3i " %llu\n", Iter, idx2_PrV3i(D->Bricks3[Iter]), Brick);
-  auto BrickIt = Lookup(&D->BrickPool, GetBrickKey(Iter, Brick));
-  idx2_Assert(BrickIt);
-  volume& BVol = BrickIt.Val->Vol;
+  (void)Brick;
+  volume& BVol = *BrickVol;
 
   /* construct a list of subbands to decode */
-  // TODO: test this logic
   idx2_Assert(Size(Idx2.Subbands) <= 8);
-  u8 DecodeSbMask = Mask; // TODO: need change if we support more than one transform pass per brick
-  idx2_For(u8, Sb, 0, 8) {
-    if (!BitSet(Mask, Sb)) continue;
-    idx2_For(u8, S, 0, 8) if ((Sb | S) <= Sb) DecodeSbMask = SetBit(DecodeSbMask, S);
-  } // end subband loop
+  u8 DecodeSbMask = GetDecodeSubbandMask(Mask);
 
   /* recursively decode the brick, one subband at a time */
   idx2_Assert(Size(Idx2.Subbands) == 8);
@@ -2150,47 +3232,308 @@ DecodeBrick(const idx2_file& Idx2, const params& P, decode_data* D, u8 Mask, f64
       v3i PBrick3 = (D->Bricks3[NextIter] = Brick3 / Idx2.GroupBrick3);
       u64 PBrick = (D->Brick[NextIter] = GetLinearBrick(Idx2, NextIter, PBrick3));
       u64 PKey = GetBrickKey(NextIter, PBrick);
-      auto PbIt = Lookup(&D->BrickPool, PKey);
-      idx2_Assert(PbIt);
       // TODO: problem: here we will need access to D->LinearChunkInFile/D->LinearBrickInChunk for
       // the parent, which won't be computed correctly by the outside code, so for now we have to
       // stick to decoding from higher level down
-      /* copy data from the parent's to my buffer */
-      if (PbIt.Val->NChildren == 0) {
-        v3i From3 = (Brick3 / Idx2.GroupBrick3) * Idx2.GroupBrick3;
-        v3i NChildren3 = Dims(Crop(extent(From3, Idx2.GroupBrick3), extent(Idx2.NBricks3s[Iter])));
-        PbIt.Val->NChildrenMax = (i8)Prod(NChildren3);
+      /* the parent is complete since a level is only decoded after the coarser level is done */
+      brick_volume* PBVol = nullptr;
+      {
+        lock PoolLock(&D->Main->Mutex);
+        auto PbIt = Lookup(&D->Main->BrickPool, PKey);
+        idx2_Assert(PbIt);
+        PBVol = PbIt.Val;
+        if (PBVol->NChildrenMax == 0) {
+          v3i From3 = (Brick3 / Idx2.GroupBrick3) * Idx2.GroupBrick3;
+          v3i NChildren3 = Dims(Crop(extent(From3, Idx2.GroupBrick3), extent(Idx2.NBricks3s[Iter])));
+          PBVol->NChildrenMax = (i8)Prod(NChildren3);
+        }
       }
-      ++PbIt.Val->NChildren;
+      /* copy data from the parent's to my buffer */
       v3i LocalBrickPos3 = Brick3 % Idx2.GroupBrick3;
       grid SbGridNonExt = S.Grid; SetDims(&SbGridNonExt, SbDimsNonExt3);
       extent ToGrid(LocalBrickPos3 * SbDimsNonExt3, SbDimsNonExt3);
-      CopyExtentGrid<f64, f64>(ToGrid, PbIt.Val->Vol, SbGridNonExt, &BVol);
-      if (PbIt.Val->NChildren == PbIt.Val->NChildrenMax) { // last child
-        Dealloc(&PbIt.Val->Vol);
-        Delete(&D->BrickPool, PKey);
+      CopyExtentGrid<t, t>(ToGrid, PBVol->Vol, SbGridNonExt, &BVol);
+      /* count the child only after the copy, so that the parent outlives concurrent siblings */
+      lock PoolLock(&D->Main->Mutex);
+      if (++PBVol->NChildren == PBVol->NChildrenMax) { // last child
+        Dealloc(&PBVol->Vol);
+        Delete(&D->Main->BrickPool, PKey);
       }
     }
     D->Level = Sb;
     if (Sb == 0 || Iter >= D->EffIter) { // NOTE: the check for Sb == 0 prevents the output volume from having blocking artifacts
-      if      (Idx2.Version == v2i(0, 0)) DecodeSubbandV0_0(Idx2, D, S.Grid, &BVol);
-      else if (Idx2.Version == v2i(0, 1)) DecodeSubbandV0_1(Idx2, D, S.Grid, &BVol);
-      else if (Idx2.Version == v2i(1, 0)) DecodeSubband(Idx2, D, Accuracy, S.Grid, &BVol);
+      error<idx2_file_err_code> SbResult = idx2_Error(idx2_file_err_code::NoError);
+      if      (Idx2.Version == v2i(0, 0)) SbResult = DecodeSubbandV0_0(Idx2, D, S.Grid, &BVol);
+      else if (Idx2.Version == v2i(0, 1)) SbResult = DecodeSubbandV0_1(Idx2, D, S.Grid, &BVol);
+      else if (Idx2.Version == v2i(1, 0)) SbResult = DecodeSubband<t>(Idx2, D, Accuracy, S.Grid, &BVol);
+      if (!SbResult && Result) // keep the first error, the other subbands (and the parent bookkeeping) still go on
+        Result = SbResult;
     }
   } // end subband loop
-  // TODO: inverse transform only to the necessary level
-  if (!P.WaveletOnly) {
-//    printf("inverting\n");
-    if (Iter + 1 < Idx2.NLevels)
-      InverseCdf53(Idx2.BrickDimsExt3, D->Iter, Idx2.Subbands, Idx2.Td, &BVol, false);
-    else
-      InverseCdf53(Idx2.BrickDimsExt3, D->Iter, Idx2.Subbands, Idx2.Td, &BVol, true);
+  if (P.WaveletOnly) {
+    if (Out)
+      CopyGridGrid(Out->SGrid, BVol, Out->DGrid, Out->Vol);
+    return Result;
   }
+  bool LastIter = Iter + 1 >= Idx2.NLevels;
+  if (Out) { // the last pass writes to the output
+    DenormalizeCdf53(Idx2.BrickDimsExt3, D->Iter, Idx2.Subbands, Idx2.Td, &BVol, LastIter, DecodeSbMask);
+    LiftCdf53(*Out->Passes, &BVol, Out->SGrid, Out->DGrid, Out->Vol);
+  } else {
+    InverseCdf53(Idx2.BrickDimsExt3, D->Iter, Idx2.Subbands, Idx2.Td, &BVol, LastIter);
+  }
+  return Result;
 }
 
-/* TODO: dealloc chunks after we are done with them */
-void
-Decode(const idx2_file& Idx2, const params& P, buffer* OutBuf) {
+/* A brick recorded by the traversal of a level, to be decoded later (possibly on another thread) */
+struct brick_task {
+  v3i Brick3;
+  u64 Brick = 0;
+  i32 ChunkInFile = 0;
+  i32 BrickInChunk = 0;
+};
+
+/* Call Visit on each brick of level Iter that intersects the extent Ext (in samples), in the order
+the bricks are stored (file by file, chunk by chunk) */
+idx2_T(visitor) static void
+TraverseBricks(const idx2_file& Idx2, const extent& Ext, i8 Iter, const visitor& Visit) {
+  v3i BrickDims3 = Idx2.BrickDims3 * Pow(Idx2.GroupBrick3, Iter);
+  v3i BrickFirst3 = From(Ext) / BrickDims3;
+  v3i BrickLast3 = Last(Ext) / BrickDims3;
+  extent ExtentInBricks(BrickFirst3, BrickLast3 - BrickFirst3 + 1);
+  v3i ChunkDims3 = Idx2.BricksPerChunk3s[Iter] * BrickDims3;
+  v3i ChunkFirst3 = From(Ext) / ChunkDims3;
+  v3i ChunkLast3 = Last(Ext) /  ChunkDims3;
+  extent ExtentInChunks(ChunkFirst3, ChunkLast3 - ChunkFirst3 + 1);
+  v3i FileDims3 = ChunkDims3 * Idx2.ChunksPerFile3s[Iter];
+  v3i FileFirst3 = From(Ext) / FileDims3;
+  v3i FileLast3 = Last(Ext) / FileDims3;
+  extent ExtentInFiles(FileFirst3, FileLast3 - FileFirst3 + 1);
+  extent VolExt(Idx2.Dims3);
+  v3i VolBrickFirst3 = From(VolExt) / BrickDims3;
+  v3i VolBrickLast3 = Last(VolExt)  / BrickDims3;
+  extent VolExtentInBricks(VolBrickFirst3, VolBrickLast3 - VolBrickFirst3 + 1);
+  v3i VolChunkFirst3 = From(VolExt) / ChunkDims3;
+  v3i VolChunkLast3 = Last(VolExt) / ChunkDims3;
+  extent VolExtentInChunks(VolChunkFirst3, VolChunkLast3 - VolChunkFirst3 + 1);
+  v3i VolFileFirst3 = From(VolExt) / FileDims3;
+  v3i VolFileLast3 = Last(VolExt) / FileDims3;
+  extent VolExtentInFiles(VolFileFirst3, VolFileLast3 - VolFileFirst3 + 1);
+  idx2_FileTraverse(
+//      u64 FileAddr = FileTop.Address;
+//      idx2_Assert(FileAddr == GetLinearFile(Idx2, Iter, FileTop.FileFrom3));
+    idx2_ChunkTraverse(
+//        u64 ChunkAddr = (FileAddr * Idx2.ChunksPerFiles[Iter]) + ChunkTop.Address;
+//        idx2_Assert(ChunkAddr == GetLinearChunk(Idx2, Iter, ChunkTop.ChunkFrom3));
+      idx2_BrickTraverse(
+//          u64 BrickAddr = (ChunkAddr * Idx2.BricksPerChunks[Iter]) + Top.Address;
+//          idx2_Assert(BrickAddr == GetLinearBrick(Idx2, Iter, Top.BrickFrom3));
+        brick_task Task;
+        Task.Brick3 = Top.BrickFrom3;
+        Task.Brick = GetLinearBrick(Idx2, Iter, Top.BrickFrom3);
+        Task.ChunkInFile = ChunkTop.ChunkInFile;
+        Task.BrickInChunk = Top.BrickInChunk;
+        Visit(Task);
+        , 64
+        , Idx2.BrickOrderChunks[Iter]
+        , ChunkTop.ChunkFrom3 * Idx2.BricksPerChunk3s[Iter]
+        , Idx2.BricksPerChunk3s[Iter]
+        , ExtentInBricks
+        , VolExtentInBricks
+      );
+      , 64
+      , Idx2.ChunkOrderFiles[Iter]
+      , FileTop.FileFrom3 * Idx2.ChunksPerFile3s[Iter]
+      , Idx2.ChunksPerFile3s[Iter]
+      , ExtentInChunks
+      , VolExtentInChunks
+    );
+    , 64
+    , Idx2.FileOrders[Iter]
+    , v3i(0)
+    , Idx2.NFiles3s[Iter]
+    , ExtentInFiles
+    , VolExtentInFiles
+  );
+}
+
+/* A (file, chunk) pair needed by a brick, the chunk address is without the bit plane */
+struct planned_file_chunk {
+  u64 FileAddr = 0;
+  u64 ChunkAddr = 0;
+  u64 Brick = 0;
+  i8 Level = 0;
+  i16 LowestBp = traits<i16>::Max; // the bit planes >= LowestBp are in the block states of the brick
+  bool operator<(const planned_file_chunk& Other) const {
+    return FileAddr < Other.FileAddr || (FileAddr == Other.FileAddr && ChunkAddr < Other.ChunkAddr);
+  }
+};
+
+/* A chunk to read from a file */
+struct planned_read {
+  i64 Offset = 0;
+  i64 Bytes = 0;
+  u64 ChunkAddr = 0;
+  chunk_cache* ChunkCache = nullptr;
+};
+
+/*
+Read, before the bricks Tasks[First, Last) of level Iter are decoded, the exponent chunks and the
+chunks they will need. The chunks of each file are sorted by offset and chunks at most MaxGap bytes
+apart are read with one read, instead of one small read per chunk the first time a bit plane is
+decoded. Only files that group bit planes are planned (otherwise which bit plane files exist is not
+known beforehand). The rdo truncation points are not applied, so a few chunks may be read that are
+not decoded. The chunks are claimed (Loading) and the cache lock is not held while reading, so this
+can run on a prefetch thread while other threads decode (and wait for the chunks they need).
+With MaxBytes > 0, the chunks that would take the bytes read past MaxBytes are left out (and false
+is returned); NBytes is set to the bytes of the chunks read. */
+static bool
+ReadChunksAhead(const idx2_file& Idx2, const params& P, decode_data* D, i8 Iter, f64 Accuracy, const array<brick_task>& Tasks, i64 First, i64 Last, i64 MaxBytes = 0, i64* NBytes = nullptr) {
+  i64 PlannedBytes = 0;
+  bool Fits = true;
+  idx2_CleanUp(if (NBytes) *NBytes = PlannedBytes);
+  if (Idx2.Version != v2i(1, 0))
+    return Fits;
+  const i64 MaxGap = 64 * 1024;
+  const i64 MaxReadBytes = 16 * 1024 * 1024;
+  const i8 NBitPlanes = idx2_BitSizeOf(u64);
+  decode_data* M = D->Main;
+  u8 Mask = Iter == P.DecodeLevel ? P.DecodeMask : (Iter < P.DecodeLevel ? 0x1 : 0xFF);
+  u8 DecodeSbMask = GetDecodeSubbandMask(Mask);
+
+  /* read the exponent chunks, and collect the chunks (without their bit planes) needed by the bricks */
+  idx2_RAII(array<planned_file_chunk>, FileChunks, Reserve(&FileChunks, (Last - First) * 8));
+  idx2_For(i64, T, First, Last) {
+    const brick_task& Task = Tasks[T];
+    D->ChunkInFile = Task.ChunkInFile;
+    idx2_For(i8, Sb, 0, (i8)Size(Idx2.Subbands)) {
+      if (!BitSet(DecodeSbMask, Sb) || !(Sb == 0 || Iter >= M->EffIter)) continue;
+      ReadChunkExponents(Idx2, D, Task.Brick, Iter, Sb); // an error is reported when the brick is decoded
+      planned_file_chunk Fc;
+      Fc.FileAddr = GetFileAddress(Idx2, Task.Brick, Iter, Sb, 0);
+      Fc.ChunkAddr = GetChunkAddress(Idx2, Task.Brick, Iter, Sb, 0);
+      Fc.Brick = Task.Brick;
+      Fc.Level = Sb;
+      if (M->KeepBlockStates)
+        Fc.LowestBp = GetLowestBitPlane(D, Task.Brick, Iter, Sb);
+      PushBack(&FileChunks, Fc);
+    }
+  }
+  UnpinAll(D);
+  if (!Idx2.GroupBitPlanes || M->MapFiles)
+    return Fits;
+  std::sort(Begin(FileChunks), End(FileChunks));
+
+  idx2_RAII(array<u64>, ChunkAddrs, Reserve(&ChunkAddrs, 64));
+  idx2_RAII(array<i16>, ChunkLowestBps, Reserve(&ChunkLowestBps, 64));
+  idx2_RAII(array<planned_read>, Reads, Reserve(&Reads, 64));
+  idx2_RAII(buffer, ReadBuf, , if (ReadBuf.Data) DeallocBuf(&ReadBuf));
+  for (i64 I = 0; I < Size(FileChunks);) {
+    /* the chunks needed from this file */
+    i64 J = I;
+    Clear(&ChunkAddrs);
+    Clear(&ChunkLowestBps);
+    for (; J < Size(FileChunks) && FileChunks[J].FileAddr == FileChunks[I].FileAddr; ++J) {
+      if (Size(ChunkAddrs) == 0 || Back(ChunkAddrs) != FileChunks[J].ChunkAddr) {
+        PushBack(&ChunkAddrs, FileChunks[J].ChunkAddr);
+        PushBack(&ChunkLowestBps, FileChunks[J].LowestBp);
+      } else { // a bit plane is needed if a brick of the chunk does not have it in its state
+        Back(ChunkLowestBps) = Max(Back(ChunkLowestBps), FileChunks[J].LowestBp);
+      }
+    }
+    file_id FileId = ConstructFilePath(Idx2, FileChunks[I].Brick, Iter, FileChunks[I].Level, 0);
+    I = J;
+
+    /* find the chunks of the file that are needed and not in memory */
+    Clear(&Reads);
+    {
+      lock CacheLock(&M->Mutex);
+      hash_table<u64, file_cache>::iterator FileCacheIt;
+      if (!ReadFile(D, &FileCacheIt, FileId))
+        continue; // the error is reported when the brick is decoded
+      if (!FileCacheIt)
+        continue;
+      file_cache* FileCache = FileCacheIt.Val;
+      idx2_ForEach(ChunkCacheIt, FileCache->ChunkCaches) {
+        u64 ChunkAddr = *ChunkCacheIt.Key;
+        auto AddrIt = BinarySearch(idx2_Range(ChunkAddrs), ChunkAddr & ~u64(0xFFF));
+        if (AddrIt == End(ChunkAddrs) || *AddrIt != (ChunkAddr & ~u64(0xFFF))) continue;
+        i16 RealBp = i16(ChunkAddr & 0xFFF);
+        if (RealBp >= 0x800) RealBp -= 0x1000; // the bit plane is stored as a 12-bit signed integer
+        if (NBitPlanes - 6 > RealBp - Exponent(Accuracy) + 1) continue; // same test as in DecodeSubband
+        if (RealBp >= ChunkLowestBps[AddrIt - Begin(ChunkAddrs)]) continue; // already decoded
+        chunk_cache* ChunkCache = ChunkCacheIt.Val; // stays at the same address even if FcTable grows
+        if (ChunkCache->Loading || Size(ChunkCache->ChunkStream.Stream) > 0) continue;
+        i32 ChunkPos = ChunkCache->ChunkPos;
+        planned_read Read;
+        Read.Offset = ChunkPos > 0 ? FileCache->ChunkSizes[ChunkPos - 1] : 0;
+        Read.Bytes = FileCache->ChunkSizes[ChunkPos] - Read.Offset;
+        Read.ChunkAddr = ChunkAddr;
+        Read.ChunkCache = ChunkCache;
+        if (MaxBytes > 0 && PlannedBytes + Read.Bytes > MaxBytes) {
+          Fits = false;
+          continue;
+        }
+        PlannedBytes += Read.Bytes;
+        ChunkCache->Loading = true; // decoding threads that need the chunk wait for it
+        PushBack(&Reads, Read);
+      }
+    }
+    if (Size(Reads) == 0) continue;
+    std::sort(Begin(Reads), End(Reads), [](const planned_read& A, const planned_read& B) { return A.Offset < B.Offset; });
+
+    /* merge nearby chunks into large reads */
+    read_file F;
+    if (!Open(D, FileId, &F)) { // the chunks are read again (and the error reported) when they are decoded
+      lock CacheLock(&M->Mutex);
+      idx2_ForEach(ReadIt, Reads) ReadIt->ChunkCache->Loading = false;
+      NotifyAll(&M->Loaded);
+      continue;
+    }
+    for (i64 K = 0; K < Size(Reads);) {
+      i64 L = K + 1;
+      i64 ReadFrom = Reads[K].Offset, ReadTo = ReadFrom + Reads[K].Bytes;
+      while (L < Size(Reads) && Reads[L].Offset - ReadTo <= MaxGap && Reads[L].Offset + Reads[L].Bytes - ReadFrom <= MaxReadBytes) {
+        ReadTo = Reads[L].Offset + Reads[L].Bytes;
+        ++L;
+      }
+      timer IOTimer;
+      StartTimer(&IOTimer);
+      if (Size(ReadBuf) < ReadTo - ReadFrom) {
+        if (ReadBuf.Data) DeallocBuf(&ReadBuf);
+        AllocBuf(&ReadBuf, ReadTo - ReadFrom);
+      }
+      bool ReadOk = ReadAt(F.File, ReadFrom, ReadBuf.Data, ReadTo - ReadFrom);
+      AddIOTime(D, ElapsedTime(&IOTimer));
+      BytesData_ += ReadTo - ReadFrom;
+      /* the chunks are copied out of ReadBuf under the lock since they are allocated with M->CacheAlloc;
+      if the read failed, the chunks are read again (and the error reported) when they are decoded */
+      lock CacheLock(&M->Mutex);
+      ++M->NPlannedReads;
+      M->NPlannedReadBytes += ReadTo - ReadFrom;
+      for (; K < L; ++K) {
+        M->NPlannedBytes += Reads[K].Bytes;
+        ++M->NPlannedChunks;
+        chunk_cache* ChunkCache = Reads[K].ChunkCache;
+        ChunkCache->Loading = false;
+        if (!ReadOk) continue;
+        bitstream ChunkStream; InitWrite(&ChunkStream, Reads[K].Bytes, M->CacheAlloc);
+        memcpy(ChunkStream.Stream.Data, ReadBuf.Data + (Reads[K].Offset - ReadFrom), Reads[K].Bytes);
+        memset(ChunkStream.Stream.Data + Reads[K].Bytes, 0, Size(ChunkStream.Stream) - Reads[K].Bytes);
+        DecompressChunk(&ChunkStream, &ChunkCache->Bricks, &ChunkCache->BrickSzs, Reads[K].ChunkAddr, Log2Ceil(Idx2.BricksPerChunks[Iter]));
+        ChunkCache->ChunkStream = ChunkStream; // kept in the chunk cache
+        ChunkCache->LastUse = ++M->CacheClock; // about to be used, so not the first to be evicted
+        AddToCache(D, cached_chunk{ChunkCache, nullptr});
+      }
+      NotifyAll(&M->Loaded);
+    }
+    Close(D, &F);
+  }
+  return Fits;
+}
+
+error<idx2_file_err_code>
+Decode(const idx2_file& Idx2, const params& P, decode_data* D, buffer* OutBuf) {
   timer DecodeTimer; StartTimer(&DecodeTimer);
   // TODO: we should add a --effective-mask
   u8 OutMask = P.DecodeLevel == P.OutputLevel ? P.DecodeMask : 128;
@@ -2216,110 +3559,380 @@ Decode(const idx2_file& Idx2, const params& P, buffer* OutBuf) {
     SetDims(&OutVolMem, Dims(OutGrid));
     OutVolMem.Type = Idx2.DType;
   }
-  const int BrickBytes = Prod(Idx2.BrickDimsExt3) * sizeof(f64);
-  BrickAlloc_ = free_list_allocator(BrickBytes);
-  // TODO: move the decode_data into idx2_file itself
-  idx2_RAII(decode_data, D, Init(&D, &BrickAlloc_));
-//  D.QualityLevel = Dw->GetQuality();
-  D.EffIter = P.DecodeLevel; // effective level (levels smaller than this won't be decoded)
+  /* the caches in D may be warm from previous calls, the rest of the state is per call */
+  D->MapFiles = P.MapFiles;
+  D->MaxCacheBytes = P.CacheBytes;
+  D->FdCache.MaxOpenFiles = Max(P.MaxOpenFiles, 1);
+  D->KeepBlockStates = P.KeepBlockStates;
+//  D->QualityLevel = Dw->GetQuality();
+  D->EffIter = P.DecodeLevel; // effective level (levels smaller than this won't be decoded)
   f64 Accuracy = Max(Idx2.Accuracy, P.DecodeAccuracy);
+  dtype BrickType = GetDecodeBrickType(Idx2, P);
+  const i64 BrickBytes = Prod<i64>(Idx2.BrickDimsExt3) * SizeOf(BrickType);
+  if (D->BrickBlocks.BlockBytes == 0)
+    Init(&D->BrickBlocks, BrickBytes);
+  /* if D first decoded with float32 bricks, the float64 bricks do not fit in the blocks of the pool
+  and are allocated outside of it (see pool_allocator) */
+  idx2_Assert(2 * D->BrickBlocks.BlockBytes >= BrickBytes, "D is used with another field");
+  /* the bricks of a level are independent of one another, so they can be decoded in parallel, as
+  long as their parents (in the coarser level) are all decoded first */
+  int NThreads = Idx2.Version == v2i(1, 0) ? P.NThreads : 1; // v0.x decoders keep file offsets in D
+  const i64 MaxTasks = 4096; // the maximum number of bricks to record before decoding them
+  idx2_RAII(array<brick_task>, Tasks, Reserve(&Tasks, MaxTasks));
+  idx2_RAII(array<lift_pass>, OutPasses, GetOutputLiftPasses(Idx2, OutMask, &OutPasses));
+  volume* Out = P.OutMode == params::out_mode::WriteToFile ? &OutVol.Vol
+              : P.OutMode == params::out_mode::KeepInMemory ? &OutVolMem : nullptr;
+  error<idx2_file_err_code> Result = idx2_Error(idx2_file_err_code::NoError); // the first error of any brick
 //  i64 CountZeroes = 0;
   idx2_InclusiveForBackward(i8, Iter, Idx2.NLevels - 1, 0) {
     if (Iter < P.OutputLevel) break;
-    extent Ext = P.DecodeExtent; // this is in unit of samples
     v3i BrickDims3 = Idx2.BrickDims3 * Pow(Idx2.GroupBrick3, Iter);
-    v3i BrickFirst3 = From(Ext) / BrickDims3;
-    v3i BrickLast3 = Last(Ext) / BrickDims3;
-    extent ExtentInBricks(BrickFirst3, BrickLast3 - BrickFirst3 + 1);
-    v3i ChunkDims3 = Idx2.BricksPerChunk3s[Iter] * BrickDims3;
-    v3i ChunkFirst3 = From(Ext) / ChunkDims3;
-    v3i ChunkLast3 = Last(Ext) /  ChunkDims3;
-    extent ExtentInChunks(ChunkFirst3, ChunkLast3 - ChunkFirst3 + 1);
-    v3i FileDims3 = ChunkDims3 * Idx2.ChunksPerFile3s[Iter];
-    v3i FileFirst3 = From(Ext) / FileDims3;
-    v3i FileLast3 = Last(Ext) / FileDims3;
-    extent ExtentInFiles(FileFirst3, FileLast3 - FileFirst3 + 1);
-    extent VolExt(Idx2.Dims3);
-    v3i VolBrickFirst3 = From(VolExt) / BrickDims3;
-    v3i VolBrickLast3 = Last(VolExt)  / BrickDims3;
-    extent VolExtentInBricks(VolBrickFirst3, VolBrickLast3 - VolBrickFirst3 + 1);
-    v3i VolChunkFirst3 = From(VolExt) / ChunkDims3;
-    v3i VolChunkLast3 = Last(VolExt) / ChunkDims3;
-    extent VolExtentInChunks(VolChunkFirst3, VolChunkLast3 - VolChunkFirst3 + 1);
-    v3i VolFileFirst3 = From(VolExt) / FileDims3;
-    v3i VolFileLast3 = Last(VolExt) / FileDims3;
-    extent VolExtentInFiles(VolFileFirst3, VolFileLast3 - VolFileFirst3 + 1);
-    idx2_FileTraverse(
-//      u64 FileAddr = FileTop.Address;
-//      idx2_Assert(FileAddr == GetLinearFile(Idx2, Iter, FileTop.FileFrom3));
-      idx2_ChunkTraverse(
-//        u64 ChunkAddr = (FileAddr * Idx2.ChunksPerFiles[Iter]) + ChunkTop.Address;
-//        idx2_Assert(ChunkAddr == GetLinearChunk(Idx2, Iter, ChunkTop.ChunkFrom3));
-        D.ChunkInFile = ChunkTop.ChunkInFile;
-        idx2_BrickTraverse(
-          D.BrickInChunk = Top.BrickInChunk;
-//          u64 BrickAddr = (ChunkAddr * Idx2.BricksPerChunks[Iter]) + Top.Address;
-//          idx2_Assert(BrickAddr == GetLinearBrick(Idx2, Iter, Top.BrickFrom3));
-          brick_volume BVol;
-          Resize(&BVol.Vol, Idx2.BrickDimsExt3, dtype::float64, D.Alloc);
-          // TODO: for progressive decompression, copy the data from BrickTable to BrickVol
-          Fill(idx2_Range(f64, BVol.Vol), 0.0);
-          D.Iter = Iter;
-          D.Bricks3[Iter] = Top.BrickFrom3;
-          D.Brick[Iter] = GetLinearBrick(Idx2, Iter, Top.BrickFrom3);
-          u64 BrickKey = GetBrickKey(Iter, D.Brick[Iter]);
-          Insert(&D.BrickPool, BrickKey, BVol);
-          u8 Mask = Iter == P.DecodeLevel ? P.DecodeMask : (Iter < P.DecodeLevel ? 0x1 : 0xFF);
-          DecodeBrick(Idx2, P, &D, Mask, Accuracy);
-          if (Iter == P.OutputLevel) {
-            grid BrickGrid(Top.BrickFrom3 * BrickDims3, Idx2.BrickDims3, v3i(1 << Iter)); // TODO: the 1 << Iter is only true for 1 transform pass per level
-            grid OutBrickGrid = Crop(OutGrid, BrickGrid);
-            grid BrickGridLocal = Relative(OutBrickGrid, BrickGrid);
-            if (P.OutMode == params::out_mode::WriteToFile) {
-              if (OutVol.Vol.Type == dtype::float32)
-                (CopyGridGrid<f64, f32>(BrickGridLocal, BVol.Vol, Relative(OutBrickGrid, OutGrid), &OutVol.Vol));
-              else if (OutVol.Vol.Type == dtype::float64)
-                (CopyGridGrid<f64, f64>(BrickGridLocal, BVol.Vol, Relative(OutBrickGrid, OutGrid), &OutVol.Vol));
-//              CountZeroes += CopyGridGridCountZeroes(BrickGridLocal, BVol.Vol, Relative(OutBrickGrid, OutGrid), &OutVol.Vol);
-            } else if (P.OutMode == params::out_mode::KeepInMemory) {
-              if (OutVolMem.Type == dtype::float32)
-                (CopyGridGrid<f64, f32>(BrickGridLocal, BVol.Vol, Relative(OutBrickGrid, OutGrid), &OutVolMem));
-              else if (OutVolMem.Type == dtype::float64)
-                (CopyGridGrid<f64, f64>(BrickGridLocal, BVol.Vol, Relative(OutBrickGrid, OutGrid), &OutVolMem));
+    auto DecodeTask = [&](decode_data* W, const brick_task& Task) {
+      W->Iter = Iter;
+      W->Bricks3[Iter] = Task.Brick3;
+      W->Brick[Iter] = Task.Brick;
+      W->ChunkInFile = Task.ChunkInFile;
+      W->BrickInChunk = Task.BrickInChunk;
+      volume OutBVol; // bricks at the output level are not parents of any brick, so they are not pooled
+      volume* BVol = &OutBVol;
+      if (Iter == P.OutputLevel) { // from the cache of this thread, so no locking is needed
+        Resize(BVol, Idx2.BrickDimsExt3, BrickType, W->Alloc);
+      } else {
+        lock PoolLock(&D->Mutex);
+        auto BrickIt = Lookup(&D->BrickPool, GetBrickKey(Iter, Task.Brick));
+        idx2_Assert(BrickIt);
+        BVol = &BrickIt.Val->Vol;
+      }
+      /* a brick of the output level is written to the output by DecodeBrick, with its last inverse
+      lifting pass; the output grids of different bricks do not overlap so no locking is needed */
+      brick_output BOut;
+      if (Iter == P.OutputLevel && Out) {
+        grid BrickGrid(Task.Brick3 * BrickDims3, Idx2.BrickDims3, v3i(1 << Iter)); // TODO: the 1 << Iter is only true for 1 transform pass per level
+        grid OutBrickGrid = Crop(OutGrid, BrickGrid);
+        BOut = brick_output{ &OutPasses, Relative(OutBrickGrid, BrickGrid), Relative(OutBrickGrid, OutGrid), Out };
+      }
+      /* with P.KeepBlockStates, DecodeSubband rebuilds the coefficients from the kept block states */
+      u8 Mask = Iter == P.DecodeLevel ? P.DecodeMask : (Iter < P.DecodeLevel ? 0x1 : 0xFF);
+      error<idx2_file_err_code> BrickResult;
+      if (BrickType == dtype::float32) {
+        Fill(idx2_Range(f32, *BVol), 0.0f);
+        BrickResult = DecodeBrick<f32>(Idx2, P, W, Mask, Accuracy, BVol, BOut.Vol ? &BOut : nullptr);
+      } else {
+        Fill(idx2_Range(f64, *BVol), 0.0);
+        BrickResult = DecodeBrick<f64>(Idx2, P, W, Mask, Accuracy, BVol, BOut.Vol ? &BOut : nullptr);
+      }
+      if (Iter == P.OutputLevel)
+        Dealloc(BVol);
+      if (!BrickResult) {
+        lock ResultLock(&D->Mutex);
+        if (Result) Result = BrickResult;
+      }
+    };
+    /* decode the recorded bricks, the first thread uses D itself, the others use their own decode_data */
+    std::atomic<i64> NextTask = 0;
+    auto DecodeTasks = [&]() {
+      NextTask = 0;
+      /* with a prefetch depth, a separate thread reads the chunks of the next PrefetchDepth bricks
+      while the bricks before them are decoded; otherwise the chunks of all the bricks are read first.
+      With a cache limit, the chunks read ahead must fit in half of the cache (the other half holds the
+      chunks of the bricks being decoded), or they would be evicted before they are decoded and read
+      again: the depth is halved whenever the chunks of a window do not fit in their share of the
+      budget, and prefetching stops when those of a single brick do not */
+      const i64 MaxAheadBytes = D->MaxCacheBytes / 2;
+      std::thread Prefetcher;
+      mutex PrefetchMutex;
+      condition_variable TaskTaken; // signalled when NextTask advances (or when the prefetcher must stop)
+      bool StopPrefetch = false; // under PrefetchMutex
+      if (P.PrefetchDepth > 0) {
+        Prefetcher = std::thread([&]() {
+          decode_data W;
+          InitWorker(&W, D);
+          W.IsPrefetcher = true;
+          i64 Depth = P.PrefetchDepth;
+          i64 Window = Max(Depth / 4, i64(1));
+          for (i64 First = 0; First < Size(Tasks);) {
+            {
+              lock PrefetchLock(&PrefetchMutex);
+              while (!StopPrefetch && First >= NextTask + Depth)
+                Wait(&TaskTaken, &PrefetchMutex);
+              if (StopPrefetch) break;
+            }
+            First = Max(First, i64(NextTask)); // bricks already being decoded are not prefetched
+            i64 Last = Min(First + Window, Size(Tasks));
+            if (First >= Last) break;
+            if (!ReadChunksAhead(Idx2, P, &W, Iter, Accuracy, Tasks, First, Last, MaxAheadBytes * Window / Depth)) {
+              if (Window == 1) break;
+              Depth = Max(Depth / 2, i64(1));
+              Window = Max(Depth / 4, i64(1));
             }
-            Dealloc(&BVol.Vol);
-            Delete(&D.BrickPool, BrickKey); // TODO: also delete the parent bricks once we are done
+            First = Last;
           }
-          , 64
-          , Idx2.BrickOrderChunks[Iter]
-          , ChunkTop.ChunkFrom3 * Idx2.BricksPerChunk3s[Iter]
-          , Idx2.BricksPerChunk3s[Iter]
-          , ExtentInBricks
-          , VolExtentInBricks
-        );
-        , 64
-        , Idx2.ChunkOrderFiles[Iter]
-        , FileTop.FileFrom3 * Idx2.ChunksPerFile3s[Iter]
-        , Idx2.ChunksPerFile3s[Iter]
-        , ExtentInChunks
-        , VolExtentInChunks
-      );
-      , 64
-      , Idx2.FileOrders[Iter]
-      , v3i(0)
-      , Idx2.NFiles3s[Iter]
-      , ExtentInFiles
-      , VolExtentInFiles
-    );
+          Dealloc(&W);
+        });
+      } else if (P.CoalesceReads) {
+        ReadChunksAhead(Idx2, P, D, Iter, Accuracy, Tasks, 0, Size(Tasks), MaxAheadBytes);
+      }
+      ParallelRun(NThreads, [&](int ThreadId) {
+        decode_data W;
+        decode_data* WPtr = D;
+        if (ThreadId > 0) {
+          InitWorker(&W, D);
+          WPtr = &W;
+        }
+        for (i64 I = NextTask++; I < Size(Tasks); I = NextTask++) {
+          if (P.PrefetchDepth > 0) {
+            lock PrefetchLock(&PrefetchMutex);
+            NotifyAll(&TaskTaken);
+          }
+          DecodeTask(WPtr, Tasks[I]);
+        }
+        if (ThreadId > 0)
+          Dealloc(&W);
+      });
+      if (Prefetcher.joinable()) {
+        {
+          lock PrefetchLock(&PrefetchMutex);
+          StopPrefetch = true;
+          NotifyAll(&TaskTaken);
+        }
+        Prefetcher.join();
+      }
+      Clear(&Tasks);
+    };
+    TraverseBricks(Idx2, P.DecodeExtent, Iter, [&](const brick_task& Task) {
+      if (Iter != P.OutputLevel) { // the brick will be a parent when decoding the next level
+        brick_volume BVol;
+        Resize(&BVol.Vol, Idx2.BrickDimsExt3, BrickType, D->Alloc);
+        Insert(&D->BrickPool, GetBrickKey(Iter, Task.Brick), BVol);
+      }
+      PushBack(&Tasks, Task);
+      if (Size(Tasks) == MaxTasks)
+        DecodeTasks();
+    });
+    if (Size(Tasks) > 0)
+      DecodeTasks();
+    if (!Result) break; // the finer levels would be decoded from incomplete bricks
   } // end level loop
 //  printf("count zeroes        = %lld\n", CountZeroes);
   printf("total decode time   = %f\n", Seconds(ElapsedTime(&DecodeTimer)));
   printf("io time             = %f\n", Seconds(DecodeIOTime_));
+  printf("prefetch io time    = %f (hidden)\n", Seconds(PrefetchIOTime_));
+  printf("open file hits      = %" PRIi64 " misses = %" PRIi64 "\n", D->FdCache.NHits, D->FdCache.NMisses);
+  printf("peak cache size     = %" PRIi64 " bytes (%" PRIi64 " evictions)\n", D->PeakCacheBytes, D->NEvictions);
+  printf("read-ahead chunks   = %" PRIi64 " (%" PRIi64 " bytes) in %" PRIi64 " reads (%" PRIi64 " bytes), %" PRIi64 " reads saved\n",
+         D->NPlannedChunks, D->NPlannedBytes, D->NPlannedReads, D->NPlannedReadBytes, D->NPlannedChunks - D->NPlannedReads);
   printf("data movement time  = %f\n", Seconds(DataMovementTime_));
-  printf("rdo   bytes read    = %" PRIi64 "\n", BytesRdos_);
-  printf("exp   bytes read    = %" PRIi64 "\n", BytesExps_);
-  printf("data  bytes read    = %" PRIi64 "\n", BytesData_);
+  printf("rdo   bytes read    = %" PRIi64 "\n", BytesRdos_.load());
+  printf("exp   bytes read    = %" PRIi64 "\n", BytesExps_.load());
+  printf("data  bytes read    = %" PRIi64 "\n", BytesData_.load());
   printf("total bytes read    = %" PRIi64 "\n", BytesRdos_ + BytesExps_ + BytesData_);
+  if (D->CacheAlloc == &D->Arena)
+    printf("arena allocations   = %" PRIi64 " in %" PRIi64 " blocks\n", D->Arena.NAllocs, D->Arena.NBlocks);
+  /* parents whose children are outside of the decode extent are still in the pool */
+  idx2_ForEach(BrickVolIt, D->BrickPool) Dealloc(&BrickVolIt.Val->Vol);
+  Clear(&D->BrickPool);
+  return Result;
+}
+
+/* The files and chunks already counted by EstimateDecodeCost, keyed by file id and chunk address */
+struct cost_tables {
+  hash_table<u64, i64> Files, ExpFiles;
+  hash_table<u64, i64> Chunks, ExpChunks;
+  hash_table<i16, i64> BitPlanes; // the bit planes of the current subband that are counted
+};
+
+/* Count the index of the data file FileId (reading it if needed) and the chunk ChunkAddr in it */
+static error<idx2_file_err_code>
+CountChunk(decode_data* D, const file_id& FileId, u64 ChunkAddr, cost_tables* Tables, decode_cost* Cost) {
+  lock CacheLock(&D->Main->Mutex);
+  hash_table<u64, file_cache>::iterator FileCacheIt;
+  u64 BytesBefore = BytesData_;
+  idx2_PropagateIfError(ReadFile(D, &FileCacheIt, FileId)); // nothing is read if the file is in the cache
+  Cost->IndexBytes += BytesData_ - BytesBefore;
+  if (!FileCacheIt) return idx2_Error(idx2_file_err_code::FileNotFound);
+  if (!Lookup(&Tables->Files, FileId.Id)) {
+    Insert(&Tables->Files, FileId.Id, i64(0));
+    ++Cost->NFiles;
+  }
+  file_cache* FileCache = FileCacheIt.Val;
+  auto ChunkCacheIt = Lookup(&FileCache->ChunkCaches, ChunkAddr);
+  if (!ChunkCacheIt) return idx2_Error(idx2_file_err_code::ChunkNotFound);
+  i32 ChunkPos = ChunkCacheIt.Val->ChunkPos;
+  i64 ChunkSize = FileCache->ChunkSizes[ChunkPos] - (ChunkPos > 0 ? FileCache->ChunkSizes[ChunkPos - 1] : 0);
+  Insert(&Tables->Chunks, ChunkAddr, ChunkSize);
+  ++Cost->NChunks;
+  Cost->ChunkBytes += ChunkSize;
+  if (Size(ChunkCacheIt.Val->ChunkStream.Stream) > 0)
+    Cost->ResidentChunkBytes += ChunkSize;
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
+/* Same as DecodeSubband, except that the bit plane chunks are counted instead of decoded */
+static error<idx2_file_err_code>
+EstimateSubbandCost(const idx2_file& Idx2, decode_data* D, f64 Accuracy, const grid& SbGrid, cost_tables* Tables, decode_cost* Cost) {
+  idx2_CleanUp(UnpinAll(D));
+  u64 Brick = D->Brick[D->Iter];
+  v3i SbDims3 = Dims(SbGrid);
+  v3i NBlocks3 = (SbDims3 + Idx2.BlockDims3 - 1) / Idx2.BlockDims3;
+  int MinBitPlane = traits<i16>::Min;
+  if (Size(Idx2.RdoLevels) > 0 && D->QualityLevel >= 0) {
+    auto ReadChunkRdoResult = ReadChunkRdos(Idx2, D, Brick, D->Iter);
+    if (!ReadChunkRdoResult) return Error(ReadChunkRdoResult);
+    const chunk_rdo_cache* ChunkRdoCache = Value(ReadChunkRdoResult);
+    int Ql = Min(D->QualityLevel, (int)Size(Idx2.RdoLevels) - 1);
+    MinBitPlane = ChunkRdoCache->TruncationPoints[D->Level * Size(Idx2.RdoLevels) + Ql];
+  }
+  if (MinBitPlane == traits<i16>::Max) return idx2_Error(idx2_file_err_code::NoError);
+  int BlockCount = Prod(NBlocks3);
+  if (D->Level == 0 && D->Iter + 1 < Idx2.NLevels)
+    BlockCount -= Prod(SbDims3 / Idx2.BlockDims3);
+
+  /* count (and read) the exponent chunk */
+  file_id ExpFileId = ConstructFilePathExponents(Idx2, Brick, D->Iter, D->Level);
+  {
+    lock CacheLock(&D->Main->Mutex);
+    hash_table<u64, file_exp_cache>::iterator FileExpCacheIt;
+    u64 BytesBefore = BytesExps_;
+    idx2_PropagateIfError(ReadFileExponents(D, &FileExpCacheIt, ExpFileId)); // nothing is read if the file is in the cache
+    Cost->IndexBytes += BytesExps_ - BytesBefore;
+    if (!FileExpCacheIt) return idx2_Error(idx2_file_err_code::FileNotFound);
+    if (!Lookup(&Tables->ExpFiles, ExpFileId.Id)) {
+      Insert(&Tables->ExpFiles, ExpFileId.Id, i64(0));
+      ++Cost->NExpFiles;
+    }
+    u64 ExpChunkAddr = GetChunkAddress(Idx2, Brick, D->Iter, D->Level, 0);
+    if (!Lookup(&Tables->ExpChunks, ExpChunkAddr)) {
+      const array<i32>& ChunkExpSzs = FileExpCacheIt.Val->ChunkExpSzs;
+      idx2_Assert(D->ChunkInFile < Size(ChunkExpSzs));
+      i64 ChunkExpSize = ChunkExpSzs[D->ChunkInFile] - (D->ChunkInFile > 0 ? ChunkExpSzs[D->ChunkInFile - 1] : 0);
+      Insert(&Tables->ExpChunks, ExpChunkAddr, ChunkExpSize);
+      ++Cost->NExpChunks;
+      Cost->ExpBytes += ChunkExpSize;
+    }
+  }
+  auto ReadChunkExpResult = ReadChunkExponents(Idx2, D, Brick, D->Iter, D->Level);
+  if (!ReadChunkExpResult) return Error(ReadChunkExpResult);
+  const chunk_exp_cache* ChunkExpCache = Value(ReadChunkExpResult);
+  i32 BrickExpOffset = (D->BrickInChunk * BlockCount) * (SizeOf(Idx2.DType) > 4 ? 2 : 1);
+  bitstream BrickExpsStream = ChunkExpCache->BrickExpsStream;
+  SeekToByte(&BrickExpsStream, BrickExpOffset);
+
+  /* count the chunks of the bit planes that the blocks decode */
+  u32 LastBlock = EncodeMorton3(v3<u32>(NBlocks3 - 1));
+  const i8 NBitPlanes = idx2_BitSizeOf(u64);
+  i16 LowestBp = D->Main->KeepBlockStates ? GetLowestBitPlane(D, Brick, D->Iter, D->Level) : traits<i16>::Max;
+  Clear(&Tables->BitPlanes);
+  idx2_InclusiveFor(u32, Block, 0, LastBlock) { // zfp block loop
+    v3i Z3(DecodeMorton3(Block));
+    idx2_NextMorton(Block, Z3, NBlocks3);
+    v3i D3 = Z3 * Idx2.BlockDims3;
+    v3i BlockDims3 = Min(Idx2.BlockDims3, SbDims3 - D3);
+    const int NDims = NumDims(BlockDims3);
+    bool CodedInNextIter = D->Level == 0 && D->Iter + 1 < Idx2.NLevels && BlockDims3 == Idx2.BlockDims3;
+    if (CodedInNextIter) continue;
+    i16 EMax = SizeOf(Idx2.DType) > 4 ? (i16)Read(&BrickExpsStream, 16) - traits<f64>::ExpBias
+                                    : (i16)Read(&BrickExpsStream, traits<f32>::ExpBits) - traits<f32>::ExpBias;
+    i8 EndBitPlane = Min(i8(BitSizeOf(Idx2.DType) + (24 + NDims)), NBitPlanes);
+    idx2_InclusiveForBackward(i8, Bp, NBitPlanes - 1, NBitPlanes - EndBitPlane) { // bit plane loop
+      i16 RealBp = Bp + EMax;
+      if (NBitPlanes - 6 > RealBp - Exponent(Accuracy) + 1) break;
+      if (RealBp < MinBitPlane) break;
+      if (RealBp >= LowestBp) continue; // decoded before, the block state has it
+      if (Lookup(&Tables->BitPlanes, RealBp)) continue;
+      Insert(&Tables->BitPlanes, RealBp, i64(0));
+      u64 ChunkAddr = GetChunkAddress(Idx2, Brick, D->Iter, D->Level, RealBp);
+      if (Lookup(&Tables->Chunks, ChunkAddr)) continue; // counted for another brick
+      file_id FileId = ConstructFilePath(Idx2, Brick, D->Iter, D->Level, RealBp);
+      idx2_PropagateIfError(CountChunk(D, FileId, ChunkAddr, Tables, Cost));
+    } // end bit plane loop
+  }
+  return idx2_Error(idx2_file_err_code::NoError);
+}
+
+error<idx2_file_err_code>
+EstimateDecodeCost(const idx2_file& Idx2, const params& P, decode_data* D, decode_cost* Cost) {
+  if (Idx2.Version != v2i(1, 0))
+    return idx2_Error(idx2_file_err_code::NotSupportedInVersion);
+  *Cost = decode_cost();
+  u8 OutMask = P.DecodeLevel == P.OutputLevel ? P.DecodeMask : 128;
+  Cost->OutGrid = GetGrid(P.DecodeExtent, P.OutputLevel, OutMask, Idx2.Subbands);
+  Cost->OutputBytes = Prod<i64>(Dims(Cost->OutGrid)) * SizeOf(Idx2.DType);
+  D->MapFiles = P.MapFiles;
+  D->MaxCacheBytes = P.CacheBytes;
+  D->FdCache.MaxOpenFiles = Max(P.MaxOpenFiles, 1);
+  D->KeepBlockStates = P.KeepBlockStates;
+  D->EffIter = P.DecodeLevel;
+  f64 Accuracy = Max(Idx2.Accuracy, P.DecodeAccuracy);
+  cost_tables Tables;
+  Init(&Tables.Files, 8); Init(&Tables.ExpFiles, 8);
+  Init(&Tables.Chunks, 10); Init(&Tables.ExpChunks, 10);
+  Init(&Tables.BitPlanes, 7);
+  idx2_CleanUp(
+    Dealloc(&Tables.Files); Dealloc(&Tables.ExpFiles);
+    Dealloc(&Tables.Chunks); Dealloc(&Tables.ExpChunks);
+    Dealloc(&Tables.BitPlanes);
+  );
+  error<idx2_file_err_code> Result = idx2_Error(idx2_file_err_code::NoError);
+  idx2_InclusiveForBackward(i8, Iter, Idx2.NLevels - 1, 0) {
+    if (Iter < P.OutputLevel) break;
+    u8 Mask = Iter == P.DecodeLevel ? P.DecodeMask : (Iter < P.DecodeLevel ? 0x1 : 0xFF);
+    u8 DecodeSbMask = GetDecodeSubbandMask(Mask);
+    TraverseBricks(Idx2, P.DecodeExtent, Iter, [&](const brick_task& Task) {
+      if (!Result) return;
+      ++Cost->NBricks;
+      D->Iter = Iter;
+      D->Bricks3[Iter] = Task.Brick3;
+      D->Brick[Iter] = Task.Brick;
+      D->ChunkInFile = Task.ChunkInFile;
+      D->BrickInChunk = Task.BrickInChunk;
+      idx2_For(i8, Sb, 0, (i8)Size(Idx2.Subbands)) {
+        if (!BitSet(DecodeSbMask, Sb) || !(Sb == 0 || Iter >= D->EffIter)) continue;
+        D->Level = Sb;
+        Result = EstimateSubbandCost(Idx2, D, Accuracy, Idx2.Subbands[Sb].Grid, &Tables, Cost);
+        if (!Result) return;
+      }
+    });
+    if (!Result) return Result;
+  }
+  return Result;
+}
+
+error<idx2_file_err_code>
+Decode(const idx2_file& Idx2, const params& P, buffer* OutBuf) {
+  /* evicted chunks would stay in the arena, so a cache limit turns the arena off */
+  idx2_RAII(decode_data, D, Init(&D, P.MaxOpenFiles, P.CacheBytes > 0 ? 0 : P.ArenaBytes));
+  return Decode(Idx2, P, &D, OutBuf);
+}
+
+void
+ClearBlockStates(decode_data* D) {
+  idx2_Assert(D->Main == D);
+  idx2_ForEach(StateIt, D->BlockStates) Dealloc(&StateIt.Val->Blocks);
+  Clear(&D->BlockStates);
+}
+
+void
+ClearCaches(decode_data* D) {
+  idx2_Assert(D->Main == D);
+  Dealloc(&D->FcTable);
+  Init(&D->FcTable, D->CacheAlloc);
+  Clear(&D->ResidentChunks);
+  D->CacheBytes = 0;
+  int MaxOpenFiles = D->FdCache.MaxOpenFiles;
+  Dealloc(&D->FdCache);
+  Init(&D->FdCache, MaxOpenFiles);
+  idx2_ForEach(MappedIt, D->MappedFiles) UnmapFile(MappedIt.Val);
+  Clear(&D->MappedFiles);
+  ClearBlockStates(D);
+}
+
+void
+TrimCaches(decode_data* D, i64 MaxBytes) {
+  idx2_Assert(D->Main == D);
+  EvictChunks(D, MaxBytes);
+  /* the memory of the bricks of previous calls */
+  D->BrickCache.DeallocAll();
+  Trim(&D->BrickBlocks);
 }
 
 } // namespace idx2
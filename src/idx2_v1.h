@@ -5,9 +5,14 @@
 #include "idx2_bitstream.h"
 #include "idx2_dataset.h"
 #include "idx2_error.h"
+#include "idx2_fd_cache.h"
 #include "idx2_hashtable.h"
+#include "idx2_mutex.h"
+#include "idx2_pool_allocator.h"
+#include "idx2_stats.h"
 #include "idx2_wavelet.h"
 #include "idx2_volume.h"
+#include "idx2_write_cache.h"
 
 idx2_Enum(action, u8, Encode, Decode)
 idx2_Enum(idx2_file_err_code, u8, idx2_CommonErrs,
@@ -58,6 +63,17 @@ struct params {
   bool GroupSubLevels = true;
   array<int> RdoLevels;
   int DecodeLevel = 0;
+  int NThreads = 1; // number of threads that encode (or decode the bricks of a level) concurrently
+  bool StreamInput = false; // read the input in slabs instead of mapping it (see EncodeStream)
+  int MaxOpenFiles = 256; // maximum number of files the decoder keeps open
+  bool MapFiles = false; // decode from memory-mapped files instead of reading them
+  i64 CacheBytes = 0; // the decoder evicts chunks to stay under this many bytes (0 means no limit)
+  i64 ArenaBytes = 0; // if > 0, a one-shot decode allocates its chunk caches in blocks of this size (see arena_allocator)
+  bool CoalesceReads = true; // read the chunks of a batch of bricks ahead of decoding, merging nearby chunks
+  int PrefetchDepth = 0; // if > 0, read the chunks of up to this many bricks ahead on a separate thread
+  bool DryRun = false; // only estimate the cost of the decode (see EstimateDecodeCost)
+  bool KeepBlockStates = false; // keep the zfp state of the decoded blocks so that later decodes only refine them
+  bool Float32Bricks = false; // decode float32 fields with float32 bricks (see GetDecodeBrickType)
   bool WaveletOnly = false;
 //  bool WaveletOnly = true;
 };
@@ -218,11 +234,19 @@ struct brick_volume {
 idx2_Inline i64 Size(const brick_volume& B) { return Prod(Dims(B.Vol)) * SizeOf(B.Vol.Type); }
 
 // Each channel corresponds to one (iteration, subband, bit plane) tuple
+/* A byte stream stored in fixed-size segments, so that appending never moves the bytes already written */
+struct segmented_stream {
+  static constexpr i64 SegBytes = 16384;
+  array<buffer> Segs;
+  i64 Bytes = 0; // the bytes written, which span the first (Bytes + SegBytes - 1) / SegBytes segments
+};
+idx2_Inline i64 Size(const segmented_stream& Ss) { return Ss.Bytes; }
+
 struct channel {
   /* brick-related streams, to be reset once per chunk */
   bitstream BrickDeltasStream; // store data for many bricks
   bitstream BrickSzsStream; // store data for many bricks
-  bitstream BrickStream; // store data for many bricks
+  segmented_stream BrickStream; // store data for many bricks
   /* block-related streams, to be reset once per brick */
   bitstream BlockStream; // store data for many blocks
   u64 LastChunk = 0; // current chunk
@@ -254,9 +278,24 @@ struct block_sig {
   i16 BitPlane = 0;
 };
 
+/* The state of one bit plane of the subband being encoded (see EncodeSubband) */
+struct channel_slot {
+  channel* Channel = nullptr; // valid if Gen == encode_data::ChannelGen
+  u32 Gen = 0;
+  i32 Sig = -1; // index into encode_data::BlockSigs
+};
+
+/* The first error of a unit of bricks that a thread encodes (see EncodeLevels). The message of an
+error is formatted in a thread_local buffer (see idx2_Error), so it is copied here by that thread,
+and the error is made again by the thread that reports it. */
+struct unit_error {
+  idx2_file_err_code Code = idx2_file_err_code::NoError;
+  char Msg[256] = {};
+};
+
 /* We use this to pass data between different stages of the encoder */
 struct encode_data {
-  allocator* Alloc = nullptr;
+  allocator* Alloc = nullptr; // the cache (see pool_allocator) of the thread that encodes the bricks
   hash_table<u64, brick_volume> BrickPool;
   hash_table<u32, channel> Channels; // each corresponds to (bit plane, iteration, level)
   hash_table<u16, sub_channel> SubChannels; // only consider level and iteration
@@ -268,19 +307,39 @@ struct encode_data {
   hash_table<u64, bitstream> ChunkEMaxesMeta; // map from file address to a stream of chunk emax sizes
   bitstream CpresEMaxes;
   bitstream CpresChunkAddrs;
-  bitstream ChunkStream;
+  bitstream ChunkStream; // the header of a chunk (see WriteChunk)
+  array<buffer> ChunkParts; // the parts of a chunk, in order
   /* block emaxes related */
   bitstream ChunkEMaxesStream;
   array<block_sig> BlockSigs;
+  /* [bit plane - lowest bit plane encoded] -> slot, reset for each subband; this saves a lookup in
+  Channels and a search in BlockSigs per block per bit plane */
+  array<channel_slot> ChannelSlots;
+  u32 ChannelGen = 1; // incremented whenever a channel is inserted (which can move the channels)
   array<i16> EMaxes;
   bitstream BlockStream; // only used by v0.1
   array<t2<u32, channel*>> SortedChannels;
   array<rdo_chunk> ChunkRDOs; // list of chunks and their sizes, sorted by bit plane
   hash_table<u64, u32> ChunkRDOLengths;
+  array<u32> ChannelOrder; // channel keys in the order the channels are created
+  v2d ValueRange = v2d(traits<f64>::Max, traits<f64>::Min); // of the samples encoded so far
+  dtype BrickType = dtype::float64; // the type of the bricks (see GetEncodeBrickType)
+  bool OneLevel = false; // the parent bricks are left in the brick pool instead of being encoded (see EncodeLevels)
+  unit_error Error; // the first error of the unit of bricks this encode_data encodes, if any
+  write_cache Writer; // all appends to the data, exponent and rdo files go through this
+  hash_table<u64, array<lift_pass>> BrickLiftPasses; // keyed by the dims of a brick (see GetBrickLiftPasses)
+  /* book-keeping stuffs */
+  stat BrickDeltasStat, BrickSzsStat, BrickStreamStat, ChunkStreamStat;
+  stat BrickEMaxesStat, ChunkEMaxesStat, ChunkEMaxSzsStat;
+  stat BlockStat, BlockEMaxStat;
+  stat CpresChunkAddrsStat, ChunkAddrsStat, ChunkSzsStat;
 };
 
 struct chunk_exp_cache {
   bitstream BrickExpsStream;
+  u64 LastUse = 0;
+  i32 NUsers = 0; // a chunk in use is never evicted
+  bool Loading = false; // being read by a thread (without the cache lock), other threads wait for it
 };
 idx2_Inline i64 Size(const chunk_exp_cache& ChunkExpCache) { return Size(ChunkExpCache.BrickExpsStream.Stream); }
 struct chunk_rdo_cache {
@@ -290,6 +349,9 @@ idx2_Inline i64 Size(const chunk_rdo_cache& ChunkRdoCache) { return Size(ChunkRd
 
 struct chunk_cache {
   i32 ChunkPos; // chunk position in the file
+  i32 NUsers = 0; // a chunk in use is never evicted
+  bool Loading = false; // being read by a thread (without the cache lock), other threads wait for it
+  u64 LastUse = 0;
   array<u64> Bricks;
   array<i32> BrickSzs;
   bitstream ChunkStream;
@@ -298,6 +360,7 @@ idx2_Inline i64 Size(const chunk_cache& C) { return Size(C.Bricks) * sizeof(u64)
 struct file_exp_cache {
   array<chunk_exp_cache> ChunkExpCaches;
   array<i32> ChunkExpSzs;
+  bool Loading = false; // an empty placeholder while a thread reads the file
 };
 idx2_Inline i64 Size(const file_exp_cache& F) {
   i64 Result = 0;
@@ -307,6 +370,7 @@ idx2_Inline i64 Size(const file_exp_cache& F) {
 }
 struct file_rdo_cache {
   array<chunk_rdo_cache> TileRdoCaches;
+  bool Loading = false; // an empty placeholder while a thread reads the file
 };
 idx2_Inline i64 Size(const file_rdo_cache& F) {
   i64 Result = 0;
@@ -316,6 +380,7 @@ idx2_Inline i64 Size(const file_rdo_cache& F) {
 struct file_cache {
   array<i64> ChunkSizes; // TODO: 32-bit to store chunk sizes?
   hash_table<u64, chunk_cache> ChunkCaches; // [chunk address] -> chunk cache
+  bool Loading = false; // an empty placeholder while a thread reads the file
 };
 idx2_Inline i64 Size(const file_cache& F) {
   i64 Result = 0;
@@ -335,10 +400,63 @@ idx2_Inline i64 Size(const file_cache_table& F) {
   idx2_ForEach(It, F.FileRdoCaches) Result += Size(*It.Val);
   return Result;
 }
+/* A chunk (or exponent chunk) that is in memory */
+struct cached_chunk {
+  chunk_cache* Chunk = nullptr;
+  chunk_exp_cache* ChunkExp = nullptr;
+};
+idx2_Inline i64 Size(const cached_chunk& C) { return C.Chunk ? Size(*C.Chunk) : Size(*C.ChunkExp); }
+
+/* The zfp decoder state of a block after the bit planes decoded so far */
+struct block_state {
+  u64 UInts[4 * 4 * 4] = {}; // the negabinary coefficients
+  i8 N = 0; // the number of coefficients that are significant
+  i8 NBps = 0; // the number of bit planes decoded, starting from the most significant one
+};
+/*
+The block states of a subband of a brick. A decode that continues from these states reads and
+decodes only the bit planes below LowestBp, which were not needed by the earlier decodes. */
+struct subband_state {
+  array<block_state> Blocks; // in the order in which the blocks are decoded
+  i16 LowestBp = traits<i16>::Max; // all bit planes >= LowestBp are in Blocks
+};
+
 struct decode_data {
-  allocator* Alloc = nullptr;
+  allocator* Alloc = nullptr; // &BrickCache, where the bricks are allocated
+  block_pool BrickBlocks; // the memory of the bricks of the main decode_data (see Main)
+  pool_allocator BrickCache; // the cache of BrickBlocks of Main that this decode_data allocates from
   file_cache_table FcTable;
+  /* FcTable and the chunks in it are allocated with CacheAlloc, which is either Mallocator() or, for
+  a one-shot decode with P.ArenaBytes, Arena (which is only accessed under Mutex, and freed at once) */
+  allocator* CacheAlloc = &Mallocator();
+  arena_allocator Arena;
+  /* the chunks in FcTable that are in memory, the least recently used of which are evicted when
+  CacheBytes exceeds MaxCacheBytes (0 means no limit) */
+  array<cached_chunk> ResidentChunks;
+  i64 CacheBytes = 0;
+  i64 PeakCacheBytes = 0;
+  i64 MaxCacheBytes = 0;
+  i64 NEvictions = 0;
+  u64 CacheClock = 0;
+  /* chunks read ahead of decoding, and the (fewer, larger) reads they were merged into */
+  i64 NPlannedChunks = 0;
+  i64 NPlannedBytes = 0;
+  i64 NPlannedReads = 0;
+  i64 NPlannedReadBytes = 0;
+  array<cached_chunk> PinnedChunks; // chunks in use by the subband being decoded (per thread)
+  fd_cache FdCache; // files opened for reading
+  bool MapFiles = false; // if true, files are mapped (once) instead of read through FdCache
+  hash_table<u64, mmap_file> MappedFiles; // [hash of the file path] -> mapped file
   hash_table<u64, brick_volume> BrickPool;
+  bool KeepBlockStates = false;
+  hash_table<u64, subband_state> BlockStates; // [brick key, subband] -> block states
+  /* when decoding with multiple threads, each thread has its own decode_data whose Main points to
+  the decode_data that owns FcTable (and its resident chunks), FdCache, MappedFiles, BrickPool,
+  BlockStates and BrickBlocks (these are only accessed under Mutex, except FdCache which has its own
+  lock, and BrickBlocks which is lock-free) */
+  decode_data* Main = nullptr;
+  mutex Mutex;
+  condition_variable Loaded; // signalled when a file or a chunk that was Loading is in FcTable (or failed to be read)
   i8 Iter = 0;
   i8 Level = 0;
   stack_array<u64, idx2_file::MaxLevels> Brick;
@@ -347,16 +465,58 @@ struct decode_data {
   i32 BrickInChunk = 0;
   stack_array<u64, idx2_file::MaxLevels> Offsets = {{}}; // used by v0.0 only
   bitstream BlockStream; // used only by v0.1
-  hash_table<i16, bitstream> Streams;
+  array<bitstream> Streams; // [bit plane - lowest bit plane decoded] -> stream, for the subband being decoded
+  array<i32> StreamSlots; // the entries of Streams in use (the others have no Stream.Data)
   buffer CompressedChunkExps;
+  bitstream ChunkExpStream; // an exponent chunk decompressed without the cache lock
+  array<u64> ChunkBricks; // the bricks of a chunk read without the cache lock
+  array<i32> ChunkBrickSzs;
   bitstream ChunkEMaxSzsStream;
   bitstream ChunkAddrsStream;
   bitstream ChunkSzsStream;
-//  array<t2<u64, u64>> RequestedChunks; // is cleared after each tile
   int QualityLevel = -1;
   int EffIter = 0;
   u64 LastTile = 0;
+  bool IsPrefetcher = false; // the io time of a prefetch thread is hidden behind decoding
 };
+/* What a decode would read and produce, computed without decoding (see EstimateDecodeCost) */
+struct decode_cost {
+  grid OutGrid; // the output grid
+  i64 OutputBytes = 0; // the size of the output volume
+  i64 NBricks = 0; // the number of bricks decoded (over all levels)
+  i64 NFiles = 0; // the number of data files touched
+  i64 NChunks = 0; // the number of bit plane chunks read
+  i64 ChunkBytes = 0; // the compressed size of these chunks
+  i64 ResidentChunkBytes = 0; // the part of ChunkBytes already in the chunk cache (not read again)
+  i64 NExpFiles = 0; // the number of exponent files touched
+  i64 NExpChunks = 0; // the number of exponent chunks read
+  i64 ExpBytes = 0; // the compressed size of these chunks
+  i64 IndexBytes = 0; // the size of the chunk indices of the files that are not yet cached
+};
+
+/* With P.Float32Bricks, the bricks of float32 fields are decoded in float32, which halves the memory
+traffic and the size of the brick pool. The inverse lifting then rounds the coefficients to float32,
+which can add an error of a few float32 ulps of the largest values of the field (this only shows when
+the tolerance is close to the precision of float32). By default the bricks are decoded in float64. */
+idx2_Inline dtype GetDecodeBrickType(const idx2_file& Idx2, const params& P) {
+  bool F32 = P.Float32Bricks && Idx2.Version == v2i(1, 0) && Idx2.DType == dtype::float32;
+  return F32 ? dtype::float32 : dtype::float64;
+}
+
+/* The smallest tolerance, relative to the largest absolute value of a field, at which the encoder
+transforms the bricks of a float32 field in float32 */
+constexpr f64 MinF32BrickAccuracy = 1024 * FLT_EPSILON;
+
+/* The bricks of a float32 field can be transformed in float32, which halves the memory traffic and
+the size of the brick pool. The lifting then rounds the coefficients to float32, which adds an error
+of a few float32 ulps of the largest values of the field, so this is only done when the tolerance
+is far above that. MaxAbs is the largest absolute value of the field, or a negative number if it is
+not known (the bricks are then transformed in float64). */
+idx2_Inline dtype GetEncodeBrickType(const idx2_file& Idx2, f64 MaxAbs) {
+  bool F32 = Idx2.Version == v2i(1, 0) && Idx2.DType == dtype::float32 && MaxAbs >= 0 &&
+             Idx2.Accuracy >= MinF32BrickAccuracy * MaxAbs;
+  return F32 ? dtype::float32 : dtype::float64;
+}
 idx2_Inline i64 SizeBrickPool(const decode_data& D) {
   i64 Result = 0;
   idx2_ForEach(It, D.BrickPool) Result += Size(*It.Val);
@@ -411,7 +571,36 @@ void WriteMetaFile(const idx2_file& Idx2, cstr FileName);
 
 // TODO: return an error code?
 error<idx2_file_err_code> Encode(idx2_file* Idx2, const params& P, const volume& Vol);
-void Decode(const idx2_file& Idx2, const params& P, buffer* OutBuf = nullptr);
+/*
+Encode the samples read from Fp (a raw file or a pipe, X varies fastest) in Z slabs one brick thick,
+so the field does not have to fit in memory. The bricks of a slab are copied into the brick pools
+of their level-0 units (which cover whole files, see GetLog2LevelUnit) and the slab buffer is reused
+for the next slab. A unit is encoded (on up to P.NThreads threads) and its files written as soon as
+all of its bricks are read, and so is a unit of a coarser level once its bricks are all filled, so
+only the bricks of the units that straddle the current slab are kept. A level stored in a single
+file is kept until the last slab. The output is the same as that of Encode. With grouped levels or
+v0.x the bricks cannot be split into units, and all of them are kept until the last slab. */
+error<idx2_file_err_code> EncodeStream(idx2_file* Idx2, const params& P, FILE* Fp);
+error<idx2_file_err_code> Decode(const idx2_file& Idx2, const params& P, buffer* OutBuf = nullptr);
+/*
+Decode with the caches of D, which are kept for the next call (D must have been initialized with Init).
+The bricks are all decoded even if some of them fail, and the first error is returned. */
+error<idx2_file_err_code> Decode(const idx2_file& Idx2, const params& P, decode_data* D, buffer* OutBuf);
+/* The bricks are allocated from a pool that D owns (D->BrickBlocks), with a cache per thread.
+With ArenaBytes > 0, the chunk caches are allocated in an arena and freed only by Dealloc, so D
+should be used for a single decode without a cache limit. */
+void Init(decode_data* D, int MaxOpenFiles = 256, i64 ArenaBytes = 0);
+void Dealloc(decode_data* D);
+/*
+Compute what decoding with P would read, without reading any bit plane chunk (only the chunk indices
+of the files and the exponent chunks are read, and they stay in the caches of D) */
+error<idx2_file_err_code> EstimateDecodeCost(const idx2_file& Idx2, const params& P, decode_data* D, decode_cost* Cost);
+/* Drop all the cached file information, chunks and block states of D and close its files */
+void ClearCaches(decode_data* D);
+/* Drop the block states kept by the decodes with P.KeepBlockStates */
+void ClearBlockStates(decode_data* D);
+/* Evict the least recently used chunks of D until at most MaxBytes are cached, and free unused brick memory */
+void TrimCaches(decode_data* D, i64 MaxBytes);
 void EncodeSubbandV0_0(idx2_file* Idx2, encode_data* E, const grid& SbGrid, volume* BrickVol);
 error<idx2_file_err_code> DecodeSubbandV0_0(const idx2_file& Idx2, decode_data* D, const grid& SbGrid, volume* BVol);
 void EncodeSubbandV0_1(idx2_file* Idx2, encode_data* E, const grid& SbGrid, volume* BrickVol);
@@ -0,0 +1,151 @@
+#include "idx2_test.h"
+#include "idx2_common.h"
+#include "idx2_filesystem.h"
+#include "idx2_v1.h"
+
+using namespace idx2;
+
+static void
+SetUp(const params& P, idx2_file* Idx2) {
+  SetName(Idx2, P.Meta.Name);
+  SetField(Idx2, P.Meta.Field);
+  SetVersion(Idx2, P.Version);
+  SetDimensions(Idx2, P.Meta.Dims3);
+  SetDataType(Idx2, P.Meta.DType);
+  SetBrickSize(Idx2, P.BrickDims3);
+  SetBricksPerChunk(Idx2, P.BricksPerChunk);
+  SetChunksPerFile(Idx2, P.ChunksPerFile);
+  SetNumIterations(Idx2, (i8)P.NLevels);
+  SetAccuracy(Idx2, P.Accuracy);
+  SetFilesPerDirectory(Idx2, P.FilesPerDir);
+  SetDir(Idx2, P.OutDir);
+}
+
+/* Encode a field whose dims are not multiples of the brick dims, then decode it in full (on one and
+on several threads, and for float32 with float32 bricks), and return the largest error */
+static f64
+EncodeDecode(dtype DType, f64 Accuracy) {
+  params P;
+  snprintf(P.Meta.Name, sizeof(P.Meta.Name), "test");
+  stref TypeStr = ToString(DType);
+  snprintf(P.Meta.Field, sizeof(P.Meta.Field), "%.*s", TypeStr.Size, TypeStr.ConstPtr);
+  P.Meta.Dims3 = v3i(70, 50, 45);
+  P.Meta.DType = DType;
+  P.BrickDims3 = v3i(16);
+  P.NLevels = 2;
+  P.Accuracy = Accuracy;
+  P.OutDir = "idx2_test_out";
+  volume Vol(P.Meta.Dims3, P.Meta.DType);
+  idx2_CleanUp(Dealloc(&Vol));
+  v3i P3;
+  idx2_BeginFor3(P3, v3i(0), P.Meta.Dims3, v3i(1)) {
+    f64 Val = sin(P3.X * 0.05) * cos(P3.Y * 0.07) + 0.5 * sin(P3.Z * 0.03 + P3.X * 0.01);
+    if (DType == dtype::float64)
+      Vol.At<f64>(P3) = Val;
+    else
+      Vol.At<f32>(P3) = (f32)Val;
+  } idx2_EndFor3
+  if (DirExists(P.OutDir))
+    RemoveDir(P.OutDir);
+
+  /* encode */
+  {
+    idx2_file Idx2;
+    idx2_CleanUp(Dealloc(&Idx2));
+    SetUp(P, &Idx2);
+    auto Ok = Finalize(&Idx2);
+    idx2_Assert(Ok);
+    Ok = Encode(&Idx2, P, Vol);
+    idx2_Assert(Ok);
+  }
+
+  /* decode */
+  idx2_file Idx2;
+  idx2_CleanUp(Dealloc(&Idx2));
+  SetDir(&Idx2, P.OutDir);
+  auto Ok = ReadMetaFile(&Idx2, idx2_PrintScratch("%s/%s/%s.idx", P.OutDir, P.Meta.Name, P.Meta.Field));
+  idx2_Assert(Ok);
+  Ok = Finalize(&Idx2);
+  idx2_Assert(Ok);
+  params Q;
+  Q.DecodeExtent = extent(P.Meta.Dims3);
+  Q.DecodeAccuracy = P.Accuracy;
+  volume Out1(P.Meta.Dims3, P.Meta.DType), OutN(P.Meta.Dims3, P.Meta.DType), OutF(P.Meta.Dims3, P.Meta.DType);
+  idx2_CleanUp(Dealloc(&Out1); Dealloc(&OutN); Dealloc(&OutF));
+  Ok = Decode(Idx2, Q, &Out1.Buffer);
+  idx2_Assert(Ok);
+  Q.NThreads = 3;
+  Ok = Decode(Idx2, Q, &OutN.Buffer);
+  idx2_Assert(Ok);
+  Q.Float32Bricks = true; // only used by float32 fields
+  Ok = Decode(Idx2, Q, &OutF.Buffer);
+  idx2_Assert(Ok);
+  f64 MaxErr = 0;
+  idx2_BeginFor3(P3, v3i(0), P.Meta.Dims3, v3i(1)) {
+    if (DType == dtype::float64) {
+      MaxErr = Max(MaxErr, fabs(Out1.At<f64>(P3) - Vol.At<f64>(P3)));
+      idx2_Assert(Out1.At<f64>(P3) == OutN.At<f64>(P3));
+    } else {
+      MaxErr = Max(MaxErr, (f64)fabs(Out1.At<f32>(P3) - Vol.At<f32>(P3)));
+      idx2_Assert(Out1.At<f32>(P3) == OutN.At<f32>(P3));
+      /* the float32 lifting is off by a few float32 ulps of the largest values (about 1.5) */
+      idx2_Assert(fabs(OutF.At<f32>(P3) - Out1.At<f32>(P3)) <= 16 * FLT_EPSILON);
+    }
+  } idx2_EndFor3
+  RemoveDir(P.OutDir);
+  return MaxErr;
+}
+
+/* A float32 field decodes to the same error as a float64 one (up to the precision of f32), both at a
+tolerance close to the precision of f32, where its bricks are transformed in f64, and at a larger one,
+where they are transformed in f32 (see GetEncodeBrickType) */
+void
+TestEncodeDecode() {
+  const f64 Accuracies[] = { 1e-5, 1e-3 };
+  idx2_For(int, I, 0, 2) {
+    f64 Err64 = EncodeDecode(dtype::float64, Accuracies[I]);
+    f64 Err32 = EncodeDecode(dtype::float32, Accuracies[I]);
+    idx2_Assert(Err64 <= 4 * Accuracies[I], "max error is %g", Err64);
+    idx2_Assert(Err32 <= Err64 + 1e-6, "max error is %g (%g for float64)", Err32, Err64);
+  }
+}
+
+idx2_RegisterTest(TestEncodeDecode)
+
+/* An encode that cannot write its files returns FileWriteFailed (on one and on several threads) */
+void
+TestEncodeWriteError() {
+  params P;
+  snprintf(P.Meta.Name, sizeof(P.Meta.Name), "test");
+  snprintf(P.Meta.Field, sizeof(P.Meta.Field), "error");
+  P.Meta.Dims3 = v3i(70, 50, 45);
+  P.Meta.DType = dtype::float64;
+  P.BrickDims3 = v3i(16);
+  P.BricksPerChunk = 2;
+  P.ChunksPerFile = 1;
+  P.NLevels = 2;
+  P.OutDir = "idx2_test_out";
+  volume Vol(P.Meta.Dims3, P.Meta.DType);
+  idx2_CleanUp(Dealloc(&Vol));
+  Fill(idx2_Range(f64, Vol), 1.0);
+  idx2_For(int, NThreads, 1, 3) {
+    if (DirExists(P.OutDir))
+      RemoveDir(P.OutDir);
+    /* a file where the directory of the brick data should be */
+    CreateFullDir(idx2_PrintScratch("%s/%s/%s", P.OutDir, P.Meta.Name, P.Meta.Field));
+    FILE* Fp = fopen(idx2_PrintScratch("%s/%s/%s/BrickData", P.OutDir, P.Meta.Name, P.Meta.Field), "w");
+    idx2_Assert(Fp);
+    fclose(Fp);
+    P.NThreads = NThreads;
+    idx2_file Idx2;
+    idx2_CleanUp(Dealloc(&Idx2));
+    SetUp(P, &Idx2);
+    auto Ok = Finalize(&Idx2);
+    idx2_Assert(Ok);
+    auto Err = Encode(&Idx2, P, Vol);
+    idx2_Assert(Err.Code == idx2_file_err_code::FileWriteFailed);
+  }
+  RemoveDir(P.OutDir);
+}
+
+idx2_RegisterTest(TestEncodeWriteError)
@@ -115,6 +115,22 @@ Dealloc(volume* Vol) {
   DeallocBuf(&Vol->Buffer);
 }
 
+void
+CopyGridGrid(const grid& SGrid, const volume& SVol, const grid& DGrid, volume* DVol) {
+  idx2_Assert(IsFloatingPoint(SVol.Type) && IsFloatingPoint(DVol->Type), "type not supported");
+  if (SVol.Type == dtype::float32) {
+    if (DVol->Type == dtype::float32)
+      CopyGridGrid<f32, f32>(SGrid, SVol, DGrid, DVol);
+    else
+      CopyGridGrid<f32, f64>(SGrid, SVol, DGrid, DVol);
+  } else {
+    if (DVol->Type == dtype::float32)
+      CopyGridGrid<f64, f32>(SGrid, SVol, DGrid, DVol);
+    else
+      CopyGridGrid<f64, f64>(SGrid, SVol, DGrid, DVol);
+  }
+}
+
 void
 Clone(const volume& Src, volume* Dst, allocator* Alloc) {
   Clone(Src.Buffer, &Dst->Buffer, Alloc);
@@ -691,6 +691,9 @@ CopyGridGrid(const grid& SGrid, const volume& SVol, const grid& DGrid, volume* D
   } idx2_EndFor3
 }
 
+/* CopyGridGrid between volumes of type f32 or f64, converting the type if needed */
+void CopyGridGrid(const grid& SGrid, const volume& SVol, const grid& DGrid, volume* DVol);
+
 idx2_TT(stype, dtype) void
 CopyExtentExtent(const extent& SGrid, const volume& SVol, const extent& DGrid, volume* DVol) {
   idx2_Assert(Dims(SGrid) == Dims(DGrid));
@@ -679,19 +679,183 @@ ExtrapolateCdf53(const v3i& Dims3, u64 TransformOrder, volume* Vol) {
   InverseCdf53(N3, M3, 0, NLevels, TransformOrder, Vol);
 }
 
+/*
+Define the lifting kernels of an isa: FLiftCdf53X/ILiftCdf53X and FLiftCdf53Tiled/ILiftCdf53Tiled
+instantiated for f32 and f64 and compiled for the isa (as in idx2_ZfpKernels) */
+#define idx2_Cdf53Kernels(Suffix, Isa, Target)\
+idx2_T(t) Target static void \
+FLiftX##Suffix(const grid& G, const v3i& M3, lift_option Opt, volume* Vol) { FLiftCdf53X<t>(G, M3, Opt, Vol); }\
+idx2_T(t) Target static void \
+FLiftY##Suffix(const grid& G, const v3i& M3, lift_option Opt, volume* Vol) { FLiftCdf53Tiled<t>(1, G, M3, Opt, Vol); }\
+idx2_T(t) Target static void \
+FLiftZ##Suffix(const grid& G, const v3i& M3, lift_option Opt, volume* Vol) { FLiftCdf53Tiled<t>(2, G, M3, Opt, Vol); }\
+idx2_T(t) Target static void \
+ILiftX##Suffix(const grid& G, const v3i& M3, lift_option Opt, volume* Vol) { ILiftCdf53X<t>(G, M3, Opt, Vol); }\
+idx2_T(t) Target static void \
+ILiftY##Suffix(const grid& G, const v3i& M3, lift_option Opt, volume* Vol) { ILiftCdf53Tiled<t>(1, G, M3, Opt, Vol); }\
+idx2_T(t) Target static void \
+ILiftZ##Suffix(const grid& G, const v3i& M3, lift_option Opt, volume* Vol) { ILiftCdf53Tiled<t>(2, G, M3, Opt, Vol); }\
+static const cdf53_kernels Cdf53Kernels##Suffix = {\
+  Isa,\
+  { { FLiftX##Suffix<f32>, FLiftX##Suffix<f64> },\
+    { FLiftY##Suffix<f32>, FLiftY##Suffix<f64> },\
+    { FLiftZ##Suffix<f32>, FLiftZ##Suffix<f64> } },\
+  { { ILiftX##Suffix<f32>, ILiftX##Suffix<f64> },\
+    { ILiftY##Suffix<f32>, ILiftY##Suffix<f64> },\
+    { ILiftZ##Suffix<f32>, ILiftZ##Suffix<f64> } }\
+};
+
+idx2_Cdf53Kernels(Scalar, isa::scalar, idx2_TargetScalar)
+#if defined(idx2_X86)
+idx2_Cdf53Kernels(Avx2, isa::avx2, idx2_TargetAvx2)
+idx2_Cdf53Kernels(Avx512, isa::avx512, idx2_TargetAvx512)
+#endif
+
+const cdf53_kernels&
+GetCdf53Kernels(isa Isa) {
+#if defined(idx2_X86)
+  if (Isa == isa::avx512)
+    return Cdf53KernelsAvx512;
+  if (Isa == isa::avx2)
+    return Cdf53KernelsAvx2;
+#endif
+  (void)Isa;
+  return Cdf53KernelsScalar;
+}
+
+cdf53_kernels Cdf53 = GetCdf53Kernels(DetectIsa());
+
+/* Forward lifting along axis D (0 = X, 1 = Y, 2 = Z), with the kernels of Cdf53 for f32 and f64 */
+static void
+FLiftCdf53(int D, const grid& Grid, const v3i& M3, lift_option Opt, volume* Vol) {
+  idx2_Assert(D >= 0 && D < 3);
+  if (Vol->Type == dtype::float32 || Vol->Type == dtype::float64) {
+    Cdf53.FLift[D][Vol->Type == dtype::float64](Grid, M3, Opt, Vol);
+    return;
+  }
+  #define Body(type)\
+  switch (D) {\
+    case 0: FLiftCdf53X<type>(Grid, M3, Opt, Vol); break;\
+    case 1: FLiftCdf53Y<type>(Grid, M3, Opt, Vol); break;\
+    case 2: FLiftCdf53Z<type>(Grid, M3, Opt, Vol); break;\
+    default: idx2_Assert(false); break;\
+  };
+  idx2_DispatchOnType(Vol->Type);
+  #undef Body
+}
+
+/* Inverse lifting along axis D (0 = X, 1 = Y, 2 = Z) of a f32 or f64 volume */
+static void
+ILiftCdf53(int D, const grid& Grid, const v3i& M3, lift_option Opt, volume* Vol) {
+  idx2_Assert(D >= 0 && D < 3);
+  idx2_Assert(Vol->Type == dtype::float32 || Vol->Type == dtype::float64, "type not supported");
+  Cdf53.ILift[D][Vol->Type == dtype::float64](Grid, M3, Opt, Vol);
+}
+
+/* The axis along which LiftCdf53 cuts the volume into slices to fuse two passes along Axis (the
+slices of the X and Y passes are XY planes, and those of the Z passes are XZ planes) */
+static int
+SliceAxis(int Axis) { return Axis == 2 ? 1 : 2; }
+
+/* Whether the slices of a pass are lifted independently of each other (none is clamped by M3 to another) */
+static bool
+CanSlice(const lift_pass& L) {
+  int O = SliceAxis(L.Axis);
+  v3i P = From(L.Grid), D = Dims(L.Grid), S = Strd(L.Grid);
+  return P[O] + S[O] * (D[O] - 1) <= L.M3[O];
+}
+
+/* Slice K of Grid along axis O */
+static grid
+GetSlice(const grid& Grid, int O, int K) {
+  v3i P = From(Grid), D = Dims(Grid);
+  P[O] += K * Strd(Grid)[O];
+  D[O] = 1;
+  return grid(P, D, Strd(Grid));
+}
+
+bool
+CanFuse(const lift_pass& A, const lift_pass& B) {
+  return A.Axis == B.Axis && A.Grid == B.Grid && CanSlice(A) && CanSlice(B);
+}
+
+static void
+Lift(const lift_pass& L, const grid& Grid, volume* Vol) {
+  if (L.Inverse)
+    ILiftCdf53(L.Axis, Grid, L.M3, lift_option::Normal, Vol);
+  else
+    FLiftCdf53(L.Axis, Grid, L.M3, lift_option::Normal, Vol);
+}
+
+void
+PushForwardPasses(const transform_details& Td, const v3i& M3, array<lift_pass>* Passes) {
+  idx2_For(int, I, 0, Td.StackSize)
+    PushBack(Passes, lift_pass{ Td.StackGrids[I], M3, i8(Td.StackAxes[I]), false });
+}
+
+void
+PushInversePasses(const transform_details& Td, const v3i& M3, array<lift_pass>* Passes) {
+  int I = Td.StackSize;
+  while (I-- > 0)
+    PushBack(Passes, lift_pass{ Td.StackGrids[I], M3, i8(Td.StackAxes[I]), true });
+}
+
+/* Do the first NPasses passes */
+static void
+LiftCdf53(const array<lift_pass>& Passes, i64 NPasses, volume* Vol) {
+  for (i64 I = 0; I < NPasses; ++I) {
+    const lift_pass& A = Passes[I];
+    if (I + 1 < NPasses && CanFuse(A, Passes[I + 1])) {
+      const lift_pass& B = Passes[++I];
+      int O = SliceAxis(A.Axis);
+      idx2_For(int, K, 0, Dims(A.Grid)[O]) {
+        grid Slice = GetSlice(A.Grid, O, K);
+        Lift(A, Slice, Vol);
+        Lift(B, Slice, Vol);
+      }
+    } else {
+      Lift(A, A.Grid, Vol);
+    }
+  }
+}
+
+void
+LiftCdf53(const array<lift_pass>& Passes, volume* Vol) { LiftCdf53(Passes, Size(Passes), Vol); }
+
+void
+LiftCdf53(const array<lift_pass>& Passes, volume* Vol, const grid& SGrid, const grid& DGrid, volume* OutVol) {
+  i64 N = Size(Passes);
+  if (N == 0 || !CanSlice(Passes[N - 1])) {
+    LiftCdf53(Passes, N, Vol);
+    CopyGridGrid(SGrid, *Vol, DGrid, OutVol);
+    return;
+  }
+  LiftCdf53(Passes, N - 1, Vol);
+  const lift_pass& L = Passes[N - 1];
+  int O = SliceAxis(L.Axis);
+  int P = From(L.Grid)[O], D = Dims(L.Grid)[O], S = Strd(L.Grid)[O];
+  int SP = From(SGrid)[O], SD = Dims(SGrid)[O], SS = Strd(SGrid)[O];
+  idx2_For(int, K, 0, D) {
+    Lift(L, GetSlice(L.Grid, O, K), Vol);
+    int Pos = P + K * S;
+    if (Pos >= SP && (Pos - SP) % SS == 0 && (Pos - SP) / SS < SD) {
+      int J = (Pos - SP) / SS;
+      CopyGridGrid(GetSlice(SGrid, O, J), *Vol, GetSlice(DGrid, O, J), OutVol);
+    }
+  }
+  /* the slices of SGrid that the last pass does not touch */
+  idx2_For(int, J, 0, SD) {
+    int Pos = SP + J * SS;
+    if (!(Pos >= P && (Pos - P) % S == 0 && (Pos - P) / S < D))
+      CopyGridGrid(GetSlice(SGrid, O, J), *Vol, GetSlice(DGrid, O, J), OutVol);
+  }
+}
+
 void
 ForwardCdf53(const v3i& M3, const transform_details& Td, volume* Vol) {
   idx2_For(int, I, 0, Td.StackSize) {
     int D = Td.StackAxes[I];
-    #define Body(type)\
-    switch (D) {\
-      case 0: FLiftCdf53X<type>(Td.StackGrids[I], M3, lift_option::Normal, Vol); break;\
-      case 1: FLiftCdf53Y<type>(Td.StackGrids[I], M3, lift_option::Normal, Vol); break;\
-      case 2: FLiftCdf53Z<type>(Td.StackGrids[I], M3, lift_option::Normal, Vol); break;\
-      default: idx2_Assert(false); break;\
-    };
-    idx2_DispatchOnType(Vol->Type);
-    #undef Body
+    FLiftCdf53(D, Td.StackGrids[I], M3, lift_option::Normal, Vol);
   }
 }
 
@@ -700,15 +864,7 @@ InverseCdf53(const v3i& M3, const transform_details& Td, volume* Vol) {
   int I = Td.StackSize;
   while (I-- > 0) {
     int D = Td.StackAxes[I];
-    #define Body(type)\
-    switch (D) {\
-      case 0: ILiftCdf53X<f64>(Td.StackGrids[I], M3, lift_option::Normal, Vol); break;\
-      case 1: ILiftCdf53Y<f64>(Td.StackGrids[I], M3, lift_option::Normal, Vol); break;\
-      case 2: ILiftCdf53Z<f64>(Td.StackGrids[I], M3, lift_option::Normal, Vol); break;\
-      default: idx2_Assert(false); break;\
-    };
-    idx2_DispatchOnType(Vol->Type);
-    #undef Body
+    ILiftCdf53(D, Td.StackGrids[I], M3, lift_option::Normal, Vol);
   }
 }
 
@@ -749,15 +905,8 @@ ForwardCdf53(const v3i& Dims3, const v3i& M3, int Iter, int NLevels, u64 TformOr
       R3 = D3;
       ++Level;
     } else {
-      #define Body(type)\
-      switch (D) {\
-        case 0: idx2_Assert(Dims3.X > 1); FLiftCdf53X<type>(G, M3, lift_option::Normal, Vol); break;\
-        case 1: idx2_Assert(Dims3.Y > 1); FLiftCdf53Y<type>(G, M3, lift_option::Normal, Vol); break;\
-        case 2: idx2_Assert(Dims3.Z > 1); FLiftCdf53Z<type>(G, M3, lift_option::Normal, Vol); break;\
-        default: idx2_Assert(false); break;\
-      };
-      idx2_DispatchOnType(Vol->Type);
-      #undef Body
+      idx2_Assert(Dims3[D] > 1);
+      FLiftCdf53(D, G, M3, lift_option::Normal, Vol);
       R3[D] = D3[D] + IsEven(D3[D]);
       SetDims(&G, R3);
       D3[D] = (R3[D] + 1) >> 1;
@@ -789,18 +938,13 @@ void
 ForwardCdf53(const v3i& M3, int Iter, const array<subband>& Subbands, const transform_details& Td, volume* Vol, bool LastIter) {
   idx2_For(int, I, 0, Td.StackSize) {
     int D = Td.StackAxes[I];
-    #define Body(type)\
-    switch (D) {\
-      case 0: FLiftCdf53X<type>(Td.StackGrids[I], M3, lift_option::Normal, Vol); break;\
-      case 1: FLiftCdf53Y<type>(Td.StackGrids[I], M3, lift_option::Normal, Vol); break;\
-      case 2: FLiftCdf53Z<type>(Td.StackGrids[I], M3, lift_option::Normal, Vol); break;\
-      default: idx2_Assert(false); break;\
-    };
-    idx2_DispatchOnType(Vol->Type);
-    #undef Body
+    FLiftCdf53(D, Td.StackGrids[I], M3, lift_option::Normal, Vol);
   }
+  NormalizeCdf53(M3, Iter, Subbands, Td, Vol, LastIter);
+}
 
-  /* Optionally normalize */
+void
+NormalizeCdf53(const v3i& M3, int Iter, const array<subband>& Subbands, const transform_details& Td, volume* Vol, bool LastIter) {
   idx2_Assert(IsFloatingPoint(Vol->Type));
   for (int I = 0; I < Size(Subbands); ++I) {
     if (I == 0 && !LastIter) continue; // do not normalize subband 0
@@ -818,10 +962,21 @@ ForwardCdf53(const v3i& M3, int Iter, const array<subband>& Subbands, const tran
 }
 void
 InverseCdf53(const v3i& M3, int Iter, const array<subband>& Subbands, const transform_details& Td, volume* Vol, bool LastIter) {
-  /* inverse normalize if required */
+  DenormalizeCdf53(M3, Iter, Subbands, Td, Vol, LastIter);
+  /* perform the inverse transform */
+  int I = Td.StackSize;
+  while (I-- > 0) {
+    int D = Td.StackAxes[I];
+    ILiftCdf53(D, Td.StackGrids[I], M3, lift_option::Normal, Vol);
+  }
+}
+
+void
+DenormalizeCdf53(const v3i& M3, int Iter, const array<subband>& Subbands, const transform_details& Td, volume* Vol, bool LastIter, u8 SbMask) {
   idx2_Assert(IsFloatingPoint(Vol->Type));
   for (int I = 0; I < Size(Subbands); ++I) {
     if (I == 0 && !LastIter) continue; // do not normalize subband 0
+    if (!BitSet(SbMask, I)) continue;
     subband& S = Subbands[I];
     f64 Wx = M3.X == 1 ? 1 : (S.LowHigh3.X == 0 ? Td.BasisNorms.ScalNorms[Iter * Td.NPasses + S.Level3Rev.X - 1] : Td.BasisNorms.WaveNorms[Iter * Td.NPasses + S.Level3Rev.X]);
     f64 Wy = M3.Y == 1 ? 1 : (S.LowHigh3.Y == 0 ? Td.BasisNorms.ScalNorms[Iter * Td.NPasses + S.Level3Rev.Y - 1] : Td.BasisNorms.WaveNorms[Iter * Td.NPasses + S.Level3Rev.Y]);
@@ -833,21 +988,6 @@ InverseCdf53(const v3i& M3, int Iter, const array<subband>& Subbands, const tran
     idx2_DispatchOnType(Vol->Type);
     #undef Body
   }
-
-  /* perform the inverse transform */
-  int I = Td.StackSize;
-  while (I-- > 0) {
-    int D = Td.StackAxes[I];
-    #define Body(type)\
-    switch (D) {\
-      case 0: ILiftCdf53X<f64>(Td.StackGrids[I], M3, lift_option::Normal, Vol); break;\
-      case 1: ILiftCdf53Y<f64>(Td.StackGrids[I], M3, lift_option::Normal, Vol); break;\
-      case 2: ILiftCdf53Z<f64>(Td.StackGrids[I], M3, lift_option::Normal, Vol); break;\
-      default: idx2_Assert(false); break;\
-    };
-    idx2_DispatchOnType(Vol->Type);
-    #undef Body
-  }
 }
 
 void
@@ -908,15 +1048,7 @@ InverseCdf53(const v3i& Dims3, const v3i& M3, int Iter, int NLevels, u64 TformOr
   /* perform the inverse transform */
   while (Iteration-- > 0) {
     int D = StackAxes[Iteration];
-    #define Body(type)\
-    switch (D) {\
-      case 0: ILiftCdf53X<f64>(StackGrids[Iteration], M3, lift_option::Normal, Vol); break;\
-      case 1: ILiftCdf53Y<f64>(StackGrids[Iteration], M3, lift_option::Normal, Vol); break;\
-      case 2: ILiftCdf53Z<f64>(StackGrids[Iteration], M3, lift_option::Normal, Vol); break;\
-      default: idx2_Assert(false); break;\
-    };
-    idx2_DispatchOnType(Vol->Type);
-    #undef Body
+    ILiftCdf53(D, StackGrids[Iteration], M3, lift_option::Normal, Vol);
   }
 }
 
@@ -2,6 +2,7 @@
 
 #include "idx2_common.h"
 #include "idx2_array.h"
+#include "idx2_cpu.h"
 #include "idx2_volume.h"
 
 namespace idx2 {
@@ -76,6 +77,25 @@ idx2_T(t) void ILiftCdf53X(const grid& Grid, const v3i& M3, lift_option Opt, vol
 idx2_T(t) void ILiftCdf53Y(const grid& Grid, const v3i& M3, lift_option Opt, volume* Vol);
 idx2_T(t) void ILiftCdf53Z(const grid& Grid, const v3i& M3, lift_option Opt, volume* Vol);
 
+/* Y (Axis = 1) and Z (Axis = 2) lifting with the same results as FLiftCdf53Y/Z and ILiftCdf53Y/Z,
+but the lines next to each other in X are lifted together (in tiles that fit in the L2 cache), so
+that every step of the lifting is vectorized across the lines */
+idx2_T(t) void FLiftCdf53Tiled(int Axis, const grid& Grid, const v3i& M3, lift_option Opt, volume* Vol);
+idx2_T(t) void ILiftCdf53Tiled(int Axis, const grid& Grid, const v3i& M3, lift_option Opt, volume* Vol);
+
+/*
+The lifting of f32 (Lift[Axis][0]) and f64 (Lift[Axis][1]) volumes along each axis, in one version
+per isa (see zfp_kernels). The X kernels are FLiftCdf53X/ILiftCdf53X, and the Y and Z kernels are
+FLiftCdf53Tiled/ILiftCdf53Tiled. SetIsa also sets the kernels of Cdf53. */
+using lift_kernel = void (*)(const grid& Grid, const v3i& M3, lift_option Opt, volume* Vol);
+struct cdf53_kernels {
+  isa Isa = isa::scalar;
+  lift_kernel FLift[3][2];
+  lift_kernel ILift[3][2];
+};
+extern cdf53_kernels Cdf53;
+const cdf53_kernels& GetCdf53Kernels(isa Isa);
+
 /* "In-place" extrapolate a volume to size 2^L+1, which is assumed to be the
 dims of Vol. The original volume is stored in the D3 sub-volume of Vol. */
 void Extrapolate(v3i D3, volume* Vol);
@@ -102,7 +122,33 @@ void ExtrapolateCdf53(const transform_details& Td, volume* Vol);
 void ForwardCdf53(const v3i& Dims3, const v3i& M3, int Iter, int NLevels, u64 TformOrder, volume* Vol, bool Normalize = false);
 void InverseCdf53(const v3i& Dims3, const v3i& M3, int Iter, int NLevels, u64 TformOrder, volume* Vol, bool Normalize = false);
 void ForwardCdf53(const v3i& M3, int Iter, const array<subband>& Subbands, const transform_details& Td, volume* Vol, bool Normalize = false);
+/* A lifting pass (with lift_option::Normal) along Axis of Grid */
+struct lift_pass {
+  grid Grid;
+  v3i M3;
+  i8 Axis = 0;
+  bool Inverse = false;
+};
+/* Whether two lifting passes can be done together, one slice of the volume at a time (see LiftCdf53) */
+bool CanFuse(const lift_pass& A, const lift_pass& B);
+/* The normalization of the subbands that ForwardCdf53(M3, Iter, Subbands, Td, Vol, LastIter) does after the lifting */
+void NormalizeCdf53(const v3i& M3, int Iter, const array<subband>& Subbands, const transform_details& Td, volume* Vol, bool LastIter);
+/* Append the lifting passes of ForwardCdf53(M3, Td, Vol) (or InverseCdf53(M3, Td, Vol)) to Passes */
+void PushForwardPasses(const transform_details& Td, const v3i& M3, array<lift_pass>* Passes);
+void PushInversePasses(const transform_details& Td, const v3i& M3, array<lift_pass>* Passes);
+/* Do the lifting passes in order. Two passes in a row on the same grid and axis (where a transform
+ends and the next one starts, e.g. the inverse transform of an extrapolation and the forward
+transform that follows it) are fused into a single sweep through the volume: both are done on a
+slice of the volume (which stays in the cache) before the next slice. */
+void LiftCdf53(const array<lift_pass>& Passes, volume* Vol);
+/* Do the lifting passes as above, then copy the samples in SGrid of Vol to DGrid of OutVol (f32 or
+f64). The copy is fused with the last pass: a slice of SGrid is copied as soon as the last pass is
+done on it. */
+void LiftCdf53(const array<lift_pass>& Passes, volume* Vol, const grid& SGrid, const grid& DGrid, volume* OutVol);
 void InverseCdf53(const v3i& M3, int Iter, const array<subband>& Subbands, const transform_details& Td, volume* Vol, bool Normalize = false);
+/* The inverse normalization that InverseCdf53(M3, Iter, Subbands, Td, Vol, LastIter) does before the
+lifting, skipping the subbands not in SbMask (which must be all zeros) */
+void DenormalizeCdf53(const v3i& M3, int Iter, const array<subband>& Subbands, const transform_details& Td, volume* Vol, bool LastIter, u8 SbMask = 0xFF);
 void ForwardCdf53Old(volume* Vol, int NLevels);
 void InverseCdf53Old(volume* Vol, int NLevels);
 void ForwardCdf53Ext(const extent& Ext, volume* Vol);
@@ -516,6 +562,153 @@ idx2_ILiftCdf53(Z, Y, X) // X inverse lifting
 idx2_ILiftCdf53(Z, X, Y) // Y inverse lifting
 idx2_ILiftCdf53(Y, X, Z) // Z inverse lifting
 
+/* The steps of the lifting on the samples of three rows of lines (see FLiftCdf53Lines) */
+idx2_TIi(t, Unit) void
+Cdf53Predict(t* idx2_Restrict C, const t* idx2_Restrict A, const t* idx2_Restrict B, i64 NS, int Sl) {
+  for (i64 I = 0; I < NS; I += (Unit ? 1 : Sl)) C[I] -= (A[I] + B[I]) / 2;
+}
+idx2_TIi(t, Unit) void
+Cdf53InversePredict(t* idx2_Restrict C, const t* idx2_Restrict A, const t* idx2_Restrict B, i64 NS, int Sl) {
+  for (i64 I = 0; I < NS; I += (Unit ? 1 : Sl)) C[I] += (A[I] + B[I]) / 2;
+}
+idx2_TIi(t, Unit) void
+Cdf53Update(t* idx2_Restrict A, t* idx2_Restrict B, const t* idx2_Restrict V, i64 NS, int Sl) {
+  for (i64 I = 0; I < NS; I += (Unit ? 1 : Sl)) { A[I] += V[I] / 4; B[I] += V[I] / 4; }
+}
+idx2_TIi(t, Unit) void
+Cdf53InverseUpdate(t* idx2_Restrict A, t* idx2_Restrict B, const t* idx2_Restrict V, i64 NS, int Sl) {
+  for (i64 I = 0; I < NS; I += (Unit ? 1 : Sl)) { A[I] -= V[I] / 4; B[I] -= V[I] / 4; }
+}
+
+/*
+Lift NL lines at once: the samples of a line are Rs apart, the lines are Sl apart (Sl is 1 if
+Unit), and F points to the first sample of the first line. P, D, S, M are From, Dims, Strd and M3
+along the lifting axis. Each step of FLiftCdf53##x is done on all the lines before the next one,
+which gives the same results, but the loops over the lines vectorize. */
+idx2_TI(t, Unit) void
+FLiftCdf53Lines(t* F, i64 Rs, int Sl, int NL, int P, int D, int S, int M, lift_option Opt) {
+  if (Unit) Sl = 1;
+  i64 NS = i64(NL) * Sl;
+  int x0 = Min(P + S * D, M); /* extrapolated position */
+  int x1 = Min(P + S * (D - 1), M); /* last position */
+  int x2 = P + S * (D - 2); /* second last position */
+  int x3 = P + S * (D - 3); /* third last position */
+  bool Ext = IsEven(D);
+  if (Ext) { /* x0 and x1 can be the same row */
+    const t* A = F + x2 * Rs; const t* B = F + x1 * Rs; t* C = F + x0 * Rs;
+    for (i64 I = 0; I < NS; I += Sl) C[I] = 2 * B[I] - A[I];
+  }
+  /* predict (excluding last odd position) */
+  for (int x = P + S; x < x2; x += 2 * S)
+    Cdf53Predict<t, Unit>(F + x * Rs, F + (x - S) * Rs, F + (x + S) * Rs, NS, Sl);
+  if (!Ext) {
+    Cdf53Predict<t, Unit>(F + x2 * Rs, F + x1 * Rs, F + x3 * Rs, NS, Sl);
+  } else if (x1 < M) {
+    t* C = F + x1 * Rs;
+    for (i64 I = 0; I < NS; I += Sl) C[I] = 0;
+  }
+  /* update (excluding last odd position) */
+  if (Opt == lift_option::NoUpdate)
+    return;
+  for (int x = P + S; x < x2; x += 2 * S)
+    Cdf53Update<t, Unit>(F + (x - S) * Rs, F + (x + S) * Rs, F + x * Rs, NS, Sl);
+  if (!Ext) {
+    if (Opt == lift_option::Normal) {
+      Cdf53Update<t, Unit>(F + x3 * Rs, F + x1 * Rs, F + x2 * Rs, NS, Sl);
+    } else {
+      t* A = F + x3 * Rs; t* B = F + x1 * Rs; const t* V = F + x2 * Rs;
+      for (i64 I = 0; I < NS; I += Sl) A[I] += V[I] / 4;
+      if (Opt == lift_option::PartialUpdateLast)
+        for (i64 I = 0; I < NS; I += Sl) B[I] = V[I] / 4;
+    }
+  }
+}
+
+/* The inverse of FLiftCdf53Lines, in the same way as ILiftCdf53##x */
+idx2_TI(t, Unit) void
+ILiftCdf53Lines(t* F, i64 Rs, int Sl, int NL, int P, int D, int S, int M, lift_option Opt) {
+  if (Unit) Sl = 1;
+  i64 NS = i64(NL) * Sl;
+  int x0 = Min(P + S * D, M); /* extrapolated position */
+  int x1 = Min(P + S * (D - 1), M); /* last position */
+  int x2 = P + S * (D - 2); /* second last position */
+  int x3 = P + S * (D - 3); /* third last position */
+  bool Ext = IsEven(D);
+  /* inverse update (excluding last odd position) */
+  if (Opt != lift_option::NoUpdate) {
+    for (int x = P + S; x < x2; x += 2 * S)
+      Cdf53InverseUpdate<t, Unit>(F + (x - S) * Rs, F + (x + S) * Rs, F + x * Rs, NS, Sl);
+    if (!Ext) {
+      if (Opt == lift_option::Normal) {
+        Cdf53InverseUpdate<t, Unit>(F + x3 * Rs, F + x1 * Rs, F + x2 * Rs, NS, Sl);
+      } else {
+        t* A = F + x3 * Rs; const t* V = F + x2 * Rs;
+        for (i64 I = 0; I < NS; I += Sl) A[I] -= V[I] / 4;
+      }
+    } else { /* x0 and x1 can be the same row */
+      const t* A = F + x0 * Rs; const t* B = F + x2 * Rs; t* C = F + x1 * Rs;
+      for (i64 I = 0; I < NS; I += Sl) C[I] = (A[I] + B[I]) / 2;
+    }
+  }
+  /* inverse predict (excluding last odd position) */
+  for (int x = P + S; x < x2; x += 2 * S)
+    Cdf53InversePredict<t, Unit>(F + x * Rs, F + (x - S) * Rs, F + (x + S) * Rs, NS, Sl);
+  if (!Ext)
+    Cdf53InversePredict<t, Unit>(F + x2 * Rs, F + x1 * Rs, F + x3 * Rs, NS, Sl);
+}
+
+/* The number of lines that FLiftCdf53Tiled and ILiftCdf53Tiled lift together, so that the D rows of
+a tile take about Cdf53TileBytes (a tile is lifted a few times, once per step) */
+constexpr i64 Cdf53TileBytes = i64(128) << 10;
+idx2_T(t) int
+Cdf53TileLines(int D, int Sl) {
+  i64 RowBytes = Min(i64(Sl) * i64(sizeof(t)), i64(64)); /* each line takes at most a cache line */
+  i64 Lines = Cdf53TileBytes / (i64(D) * RowBytes);
+  return int(Max(i64(8), Min(Lines, i64(1024))) & ~i64(7));
+}
+
+/* The lines along Y (Axis = 1) or Z (Axis = 2) that have the same z (or y) are lifted in tiles of
+lines adjacent in X with FLiftCdf53Lines (or ILiftCdf53Lines). The lines whose x is clamped to M.X
+all lift the same samples, so they are lifted one by one, after the others, in the order of
+FLiftCdf53##x. */
+#define idx2_LiftCdf53Tiled(Name, Lines)\
+idx2_T(t) void \
+Name(int Axis, const grid& Grid, const v3i& M, lift_option Opt, volume* Vol) {\
+  v3i P = From(Grid), D = Dims(Grid), S = Strd(Grid), N = Dims(*Vol);\
+  int A = Axis, O = 3 - Axis; /* the lifting axis and the outer axis */\
+  idx2_Assert(A == 1 || A == 2);\
+  if (D[A] == 1) return;\
+  idx2_Assert(M[A] <= N[A]);\
+  idx2_Assert(IsPow2(S.X) && IsPow2(S.Y) && IsPow2(S.Z));\
+  idx2_Assert(D[A] >= 2);\
+  idx2_Assert(IsEven(P[A]));\
+  idx2_Assert(P[A] + S[A] * (D[A] - 2) < M[A]);\
+  idx2_Assert(!IsEven(D[A]) || M[A] < N[A]);\
+  buffer_t<t> Buf(Vol->Buffer);\
+  t* F = Buf.Data;\
+  i64 Rs = A == 1 ? i64(N.X) : i64(N.X) * N.Y;\
+  i64 Os = O == 1 ? i64(N.X) : i64(N.X) * N.Y;\
+  int NLines = P.X > M.X ? 0 : Min(D.X, (M.X - P.X) / S.X + 1); /* the lines not clamped */\
+  int Tile = Cdf53TileLines<t>(D[A], S.X);\
+  for (int z = P[O]; z < P[O] + S[O] * D[O]; z += S[O]) {\
+    t* Fz = F + Min(z, M[O]) * Os;\
+    for (int I = 0; I < NLines; I += Tile) {\
+      t* Fl = Fz + P.X + i64(I) * S.X;\
+      int NL = Min(Tile, NLines - I);\
+      if (S.X == 1)\
+        Lines<t, true>(Fl, Rs, 1, NL, P[A], D[A], S[A], M[A], Opt);\
+      else\
+        Lines<t, false>(Fl, Rs, S.X, NL, P[A], D[A], S[A], M[A], Opt);\
+    }\
+    for (int I = NLines; I < D.X; ++I)\
+      Lines<t, true>(Fz + M.X, Rs, 1, 1, P[A], D[A], S[A], M[A], Opt);\
+  }\
+}
+
+idx2_LiftCdf53Tiled(FLiftCdf53Tiled, FLiftCdf53Lines)
+idx2_LiftCdf53Tiled(ILiftCdf53Tiled, ILiftCdf53Lines)
+#undef idx2_LiftCdf53Tiled
+
 idx2_FLiftCdf53Old(Z, Y, X) // X forward lifting
 idx2_FLiftCdf53Old(Z, X, Y) // Y forward lifting
 idx2_FLiftCdf53Old(Y, X, Z) // Z forward lifting
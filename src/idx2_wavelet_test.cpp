@@ -1,11 +1,13 @@
 #include "idx2_test.h"
 #include "idx2_array.h"
 #include "idx2_common.h"
+#include "idx2_cpu.h"
 #include "idx2_function.h"
 #include "idx2_random.h"
 #include "idx2_timer.h"
 #include "idx2_wavelet.h"
 #include "idx2_volume.h"
+#include "idx2_zfp.h"
 #include <math.h>
 #include <string.h>
 
@@ -1040,6 +1042,147 @@ TestWaveletNormalize2() {
   }
 }
 
+/* The lifting kernels of every isa give the same results as FLiftCdf53X/Y/Z and ILiftCdf53X/Y/Z, on
+the grids of the transform of volumes whose dims are odd or even (so that some are extrapolated) */
+void
+TestCdf53Kernels() {
+  pcg32 Pcg;
+  Seed(&Pcg, 4321);
+  isa Best = DetectIsa();
+  const v3i DimsList[] = { v3i(17, 9, 33), v3i(16, 9, 30), v3i(33, 32, 19), v3i(5, 33, 32), v3i(3, 12, 17) };
+  const cstr Orders[] = { "XYZ++", "ZYX++", "YZX++", "XZY++" };
+  lift_option Opts[] = { lift_option::Normal, lift_option::PartialUpdateLast, lift_option::NoUpdateLast, lift_option::NoUpdate };
+  for (const v3i& Dims3 : DimsList) {
+    v3i N3(NextPow2(Dims3.X - 1) + 1, NextPow2(Dims3.Y - 1) + 1, NextPow2(Dims3.Z - 1) + 1);
+    v3i M3 = N3 - 1;
+    for (cstr Order : Orders) {
+      transform_details Td;
+      ComputeTransformDetails(&Td, Dims3, 2, EncodeTransformOrder(Order));
+      idx2_For(int, T, 0, 2) {
+        dtype Type = T == 0 ? dtype::float32 : dtype::float64;
+        idx2_For(int, I, 0, Td.StackSize) {
+          int D = Td.StackAxes[I];
+          const grid& G = Td.StackGrids[I];
+          lift_option Opt = Opts[NextUInt(&Pcg, 4)];
+          idx2_RAII(volume, Ref, Ref = volume(N3, Type));
+          #define Body(type)\
+          idx2_For(i64, J, 0, Prod<i64>(N3)) ((type*)Ref.Buffer.Data)[J] = type(NextDouble(&Pcg) * 1000 - 500);
+          idx2_DispatchOnFloat(Type)
+          #undef Body
+          idx2_RAII(volume, Src, Clone(Ref, &Src));
+          idx2_RAII(volume, Fwd, Clone(Ref, &Fwd));
+          idx2_RAII(volume, Inv, Clone(Ref, &Inv));
+          #define Body(type)\
+          switch (D) {\
+            case 0: FLiftCdf53X<type>(G, M3, Opt, &Fwd); ILiftCdf53X<type>(G, M3, Opt, &Inv); break;\
+            case 1: FLiftCdf53Y<type>(G, M3, Opt, &Fwd); ILiftCdf53Y<type>(G, M3, Opt, &Inv); break;\
+            case 2: FLiftCdf53Z<type>(G, M3, Opt, &Fwd); ILiftCdf53Z<type>(G, M3, Opt, &Inv); break;\
+          };
+          idx2_DispatchOnFloat(Type)
+          #undef Body
+          idx2_InclusiveFor(u8, K, u8(isa::scalar), u8(Best)) {
+            SetIsa(isa(K));
+            MemCopy(Src.Buffer, &Ref.Buffer);
+            Cdf53.FLift[D][T](G, M3, Opt, &Ref);
+            idx2_Assert(memcmp(Ref.Buffer.Data, Fwd.Buffer.Data, Ref.Buffer.Bytes) == 0);
+            MemCopy(Src.Buffer, &Ref.Buffer);
+            Cdf53.ILift[D][T](G, M3, Opt, &Ref);
+            idx2_Assert(memcmp(Ref.Buffer.Data, Inv.Buffer.Data, Ref.Buffer.Bytes) == 0);
+          }
+        }
+      }
+    }
+  }
+  SetIsa(Best);
+}
+
+/* LiftCdf53 (which fuses some passes) gives the same results as the passes one after the other, on
+the passes of the extrapolation and transform of bricks of different dims (see GetBrickLiftPasses) */
+void
+TestLiftCdf53Fused() {
+  pcg32 Pcg;
+  Seed(&Pcg, 8765);
+  isa Best = DetectIsa();
+  v3i B3(17), M3(16);
+  u64 Order = EncodeTransformOrder("XYZ++");
+  const v3i DimsList[] = { v3i(16, 16, 16), v3i(6, 16, 9), v3i(16, 3, 11) };
+  for (const v3i& Dims3 : DimsList) {
+    array<lift_pass> Passes;
+    idx2_CleanUp(Dealloc(&Passes));
+    transform_details Td;
+    ComputeTransformDetails(&Td, Dims3, Log2Floor(Max(Max(Dims3.X, Dims3.Y), Dims3.Z)), Order);
+    PushForwardPasses(Td, M3, &Passes);
+    PushInversePasses(Td, M3, &Passes);
+    ComputeTransformDetails(&Td, Dims3, 4, Order);
+    PushForwardPasses(Td, M3, &Passes);
+    ComputeTransformDetails(&Td, B3, 4, Order);
+    PushInversePasses(Td, M3, &Passes);
+    ComputeTransformDetails(&Td, B3, 2, Order);
+    PushForwardPasses(Td, B3, &Passes);
+    int NFused = 0;
+    idx2_For(i64, I, 0, Size(Passes) - 1) NFused += CanFuse(Passes[I], Passes[I + 1]);
+    idx2_Assert(NFused >= 3);
+    idx2_For(int, T, 0, 2) {
+      dtype Type = T == 0 ? dtype::float32 : dtype::float64;
+      idx2_RAII(volume, Src, Src = volume(B3, Type));
+      #define Body(type)\
+      idx2_For(i64, J, 0, Prod<i64>(B3)) ((type*)Src.Buffer.Data)[J] = type(NextDouble(&Pcg) * 1000 - 500);
+      idx2_DispatchOnFloat(Type)
+      #undef Body
+      idx2_RAII(volume, Ref, Clone(Src, &Ref));
+      idx2_For(i64, I, 0, Size(Passes)) {
+        const lift_pass& L = Passes[I];
+        #define Body(type)\
+        switch (L.Axis) {\
+          case 0: L.Inverse ? ILiftCdf53X<type>(L.Grid, L.M3, lift_option::Normal, &Ref) : FLiftCdf53X<type>(L.Grid, L.M3, lift_option::Normal, &Ref); break;\
+          case 1: L.Inverse ? ILiftCdf53Y<type>(L.Grid, L.M3, lift_option::Normal, &Ref) : FLiftCdf53Y<type>(L.Grid, L.M3, lift_option::Normal, &Ref); break;\
+          case 2: L.Inverse ? ILiftCdf53Z<type>(L.Grid, L.M3, lift_option::Normal, &Ref) : FLiftCdf53Z<type>(L.Grid, L.M3, lift_option::Normal, &Ref); break;\
+        };
+        idx2_DispatchOnFloat(Type)
+        #undef Body
+      }
+      idx2_InclusiveFor(u8, K, u8(isa::scalar), u8(Best)) {
+        SetIsa(isa(K));
+        idx2_RAII(volume, Vol, Clone(Src, &Vol));
+        LiftCdf53(Passes, &Vol);
+        idx2_Assert(memcmp(Vol.Buffer.Data, Ref.Buffer.Data, Ref.Buffer.Bytes) == 0);
+      }
+    }
+  }
+  SetIsa(Best);
+}
+
+/* LiftCdf53 with an output gives the same output as LiftCdf53 followed by CopyGridGrid */
+void
+TestLiftCdf53Output() {
+  pcg32 Pcg;
+  Seed(&Pcg, 4321);
+  v3i B3(17), M3(16), N3(20);
+  transform_details Td;
+  ComputeTransformDetails(&Td, B3, 1, EncodeTransformOrder("XYZ++"));
+  array<lift_pass> Passes;
+  idx2_CleanUp(Dealloc(&Passes));
+  PushInversePasses(Td, M3, &Passes);
+  const grid SGrids[] = { grid(v3i(0), v3i(16), v3i(1)), grid(v3i(0, 1, 2), v3i(8, 16, 7), v3i(2, 1, 2)) };
+  idx2_For(int, T, 0, 2) {
+    dtype OutType = T == 0 ? dtype::float32 : dtype::float64;
+    for (const grid& SGrid : SGrids) {
+      grid DGrid(v3i(3, 2, 1), Dims(SGrid), v3i(1));
+      idx2_RAII(volume, Src, Src = volume(B3, dtype::float64));
+      idx2_For(i64, J, 0, Prod<i64>(B3)) ((f64*)Src.Buffer.Data)[J] = NextDouble(&Pcg) * 1000 - 500;
+      idx2_RAII(volume, Ref, Clone(Src, &Ref));
+      idx2_RAII(volume, RefOut, RefOut = volume(N3, OutType));
+      Fill(RefOut.Buffer.Data, RefOut.Buffer.Data + RefOut.Buffer.Bytes, byte(0));
+      LiftCdf53(Passes, &Ref);
+      CopyGridGrid(SGrid, Ref, DGrid, &RefOut);
+      idx2_RAII(volume, Out, Out = volume(N3, OutType));
+      Fill(Out.Buffer.Data, Out.Buffer.Data + Out.Buffer.Bytes, byte(0));
+      LiftCdf53(Passes, &Src, SGrid, DGrid, &Out);
+      idx2_Assert(memcmp(Out.Buffer.Data, RefOut.Buffer.Data, RefOut.Buffer.Bytes) == 0);
+    }
+  }
+}
+
 idx2_RegisterTest(TestWavelet)
 // idx2_RegisterTest(TestWaveletBlock)
 idx2_RegisterTest(TestWavGrid)
@@ -1052,4 +1195,7 @@ idx2_RegisterTest(TestDecodeTransformOrderFull)
 //idx2_RegisterTest(TestWaveletQuantize)
 idx2_RegisterTest(TestWaveletMatrices)
 idx2_RegisterTest(TestWaveletRangeExpansion)
+idx2_RegisterTest(TestCdf53Kernels)
+idx2_RegisterTest(TestLiftCdf53Fused)
+idx2_RegisterTest(TestLiftCdf53Output)
 //idx2_RegisterTest(TestWaveletExtrapolation)
@@ -0,0 +1,241 @@
+#include "idx2_write_cache.h"
+#include "idx2_algorithm.h"
+#include "idx2_fd_cache.h"
+#include "idx2_filesystem.h"
+#include "idx2_math.h"
+#if defined(__CYGWIN__) || defined(__linux__) || defined(__APPLE__)
+#include <sys/uio.h>
+#endif
+
+namespace idx2 {
+
+static bool
+OpenForAppend(cstr FileName, file_handle* File) {
+#if defined(_WIN32)
+  *File = CreateFileA(FileName, FILE_APPEND_DATA, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  return *File != INVALID_HANDLE_VALUE;
+#elif defined(__CYGWIN__) || defined(__linux__) || defined(__APPLE__)
+  *File = open(FileName, O_WRONLY | O_CREAT | O_APPEND, 0666);
+  return *File != -1;
+#endif
+}
+
+static void
+CloseFile(file_handle File) {
+#if defined(_WIN32)
+  CloseHandle(File);
+#elif defined(__CYGWIN__) || defined(__linux__) || defined(__APPLE__)
+  close(File);
+#endif
+}
+
+static bool
+WriteAll(file_handle File, const byte* Ptr, i64 Bytes) {
+#if defined(_WIN32)
+  while (Bytes > 0) {
+    DWORD Written = 0;
+    if (!::WriteFile(File, Ptr, DWORD(Min(Bytes, i64(1) << 30)), &Written, NULL) || Written == 0)
+      return false;
+    Ptr += Written; Bytes -= Written;
+  }
+#elif defined(__CYGWIN__) || defined(__linux__) || defined(__APPLE__)
+  while (Bytes > 0) {
+    ssize_t Written = write(File, Ptr, size_t(Bytes));
+    if (Written <= 0)
+      return false;
+    Ptr += Written; Bytes -= Written;
+  }
+#endif
+  return true;
+}
+
+/* Write the concatenation of NParts buffers */
+static bool
+WriteAll(file_handle File, const buffer* Parts, int NParts) {
+#if defined(_WIN32)
+  idx2_For(int, I, 0, NParts) {
+    if (!WriteAll(File, Parts[I].Data, Parts[I].Bytes))
+      return false;
+  }
+#elif defined(__CYGWIN__) || defined(__linux__) || defined(__APPLE__)
+  constexpr int MaxIovs = 64;
+  iovec Iovs[MaxIovs];
+  int I = 0; // the first part not fully written
+  i64 Skip = 0; // the bytes of Parts[I] already written
+  ssize_t Written = 0;
+  while (true) {
+    /* skip the parts that are fully written */
+    while (I < NParts && Written >= Parts[I].Bytes - Skip) {
+      Written -= Parts[I].Bytes - Skip;
+      Skip = 0;
+      ++I;
+    }
+    Skip += Written;
+    if (I == NParts)
+      break;
+    int NIovs = 0;
+    for (int J = I; J < NParts && NIovs < MaxIovs; ++J) {
+      i64 Offset = J == I ? Skip : 0;
+      Iovs[NIovs].iov_base = Parts[J].Data + Offset;
+      Iovs[NIovs].iov_len = size_t(Parts[J].Bytes - Offset);
+      ++NIovs;
+    }
+    Written = writev(File, Iovs, NIovs);
+    if (Written <= 0)
+      return false;
+  }
+#endif
+  return true;
+}
+
+void
+Init(write_cache* Wc, int MaxOpenFiles) {
+  Init(&Wc->Files, 8);
+  Init(&Wc->Dirs, 6);
+  Wc->MaxOpenFiles = Max(MaxOpenFiles, 1);
+  Wc->NOpenFiles = 0;
+  Wc->Bytes = 0;
+  Wc->Clock = 0;
+  Wc->NWrites = Wc->NOpens = 0;
+}
+
+/* Open the file of an entry, closing the least recently used open file if too many are open */
+static bool
+Open(write_cache* Wc, write_entry* Entry) {
+  if (Wc->NOpenFiles >= Wc->MaxOpenFiles) {
+    write_entry* Lru = nullptr;
+    idx2_ForEach(It, Wc->Files) {
+      if (It.Val->IsOpen && (!Lru || It.Val->LastUse < Lru->LastUse))
+        Lru = It.Val;
+    }
+    idx2_Assert(Lru);
+    CloseFile(Lru->File);
+    Lru->IsOpen = false;
+    --Wc->NOpenFiles;
+  }
+  stref Dir = GetDirName(Entry->Path);
+  u64 DirKey = FdKey(ToString(Dir));
+  if (!Lookup(&Wc->Dirs, DirKey)) {
+    CreateFullDir(Dir);
+    Insert(&Wc->Dirs, DirKey, true);
+  }
+  if (!OpenForAppend(Entry->Path, &Entry->File))
+    return false;
+  Entry->IsOpen = true;
+  ++Wc->NOpenFiles;
+  ++Wc->NOpens;
+  return true;
+}
+
+/* Write the buffer of an entry to its file, then free the buffer (most files are written only a
+few times, so keeping the buffers would hold on to memory) */
+static bool
+Flush(write_cache* Wc, write_entry* Entry) {
+  if (Entry->Size == 0)
+    return true;
+  if (!Entry->IsOpen && !Open(Wc, Entry))
+    return false;
+  Entry->LastUse = ++Wc->Clock;
+  bool Ok = WriteAll(Entry->File, Entry->Buf.Data, Entry->Size);
+  ++Wc->NWrites;
+  Wc->Bytes -= Entry->Size;
+  Entry->Size = 0;
+  DeallocBuf(&Entry->Buf);
+  return Ok;
+}
+
+bool
+Flush(write_cache* Wc) {
+  bool Ok = true;
+  idx2_ForEach(It, Wc->Files) {
+    Ok = Flush(Wc, It.Val) && Ok;
+    if (It.Val->IsOpen) {
+      CloseFile(It.Val->File);
+      It.Val->IsOpen = false;
+      --Wc->NOpenFiles;
+    }
+  }
+  idx2_Assert(Wc->NOpenFiles == 0);
+  return Ok;
+}
+
+void
+Dealloc(write_cache* Wc) {
+  Flush(Wc);
+  idx2_ForEach(It, Wc->Files) {
+    if (It.Val->Buf.Data)
+      DeallocBuf(&It.Val->Buf);
+  }
+  Dealloc(&Wc->Files);
+  Dealloc(&Wc->Dirs);
+}
+
+void
+Discard(write_cache* Wc) {
+  idx2_ForEach(It, Wc->Files) {
+    if (It.Val->Buf.Data)
+      DeallocBuf(&It.Val->Buf);
+    It.Val->Size = 0;
+    if (It.Val->IsOpen) {
+      CloseFile(It.Val->File);
+      It.Val->IsOpen = false;
+      --Wc->NOpenFiles;
+    }
+  }
+  Wc->Bytes = 0;
+}
+
+bool
+Append(write_cache* Wc, const stref& FileName, const void* Data, i64 Bytes) {
+  buffer Part((const byte*)Data, Bytes);
+  return Append(Wc, FileName, &Part, 1);
+}
+
+bool
+Append(write_cache* Wc, const stref& FileName, const buffer* Parts, int NParts) {
+  u64 Key = FdKey(ToString(FileName));
+  auto It = Lookup(&Wc->Files, Key);
+  if (!It) {
+    write_entry Entry;
+    idx2_Assert(FileName.Size < (int)sizeof(Entry.Path));
+    snprintf(Entry.Path, sizeof(Entry.Path), "%.*s", FileName.Size, FileName.ConstPtr);
+    Insert(&It, Key, Entry);
+  }
+  write_entry* Entry = It.Val;
+  i64 Bytes = 0;
+  idx2_For(int, I, 0, NParts) Bytes += Parts[I].Bytes;
+  /* large appends bypass the buffer */
+  if (Entry->Size == 0 && Bytes >= Wc->FlushBytes) {
+    if (!Entry->IsOpen && !Open(Wc, Entry))
+      return false;
+    Entry->LastUse = ++Wc->Clock;
+    ++Wc->NWrites;
+    return WriteAll(Entry->File, Parts, NParts);
+  }
+  /* grow the buffer geometrically */
+  if (Entry->Size + Bytes > Entry->Buf.Bytes) {
+    buffer NewBuf;
+    AllocBuf(&NewBuf, Max(Max(Entry->Buf.Bytes * 2, Entry->Size + Bytes), i64(4096)));
+    if (Entry->Size > 0)
+      memcpy(NewBuf.Data, Entry->Buf.Data, size_t(Entry->Size));
+    if (Entry->Buf.Data)
+      DeallocBuf(&Entry->Buf);
+    Entry->Buf = NewBuf;
+  }
+  idx2_For(int, I, 0, NParts) {
+    if (Parts[I].Bytes > 0)
+      memcpy(Entry->Buf.Data + Entry->Size, Parts[I].Data, size_t(Parts[I].Bytes));
+    Entry->Size += Parts[I].Bytes;
+  }
+  Wc->Bytes += Bytes;
+  if (Entry->Size >= Wc->FlushBytes)
+    return Flush(Wc, Entry);
+  if (Wc->Bytes > Wc->MaxBytes) {
+    bool Ok = true;
+    idx2_ForEach(FIt, Wc->Files) Ok = Flush(Wc, FIt.Val) && Ok;
+    return Ok;
+  }
+  return true;
+}
+
+} // namespace idx2
@@ -0,0 +1,57 @@
+/* A write-back cache of the files that the encoder appends to, keyed by a hash of the file path */
+
+#pragma once
+
+#include "idx2_common.h"
+#include "idx2_hashtable.h"
+#include "idx2_memory.h"
+#include "idx2_memory_map.h"
+
+namespace idx2 {
+
+struct write_entry {
+  char Path[256] = {};
+  buffer Buf; // the bytes not written yet are Buf[0, Size)
+  i64 Size = 0;
+  file_handle File;
+  bool IsOpen = false;
+  u64 LastUse = 0;
+};
+
+/*
+The bytes appended to a file are kept in a buffer of that file, which is written with a single
+write once it holds FlushBytes bytes. If all buffers together hold more than MaxBytes bytes, they
+are all written. At most MaxOpenFiles files are open; opening one more file closes the least
+recently used one. The directory of a file is created (if needed) before the file is first
+opened, once per directory. A write_cache is used by one thread at a time (each unit of the
+encoder has its own, see EncodeLevels). */
+struct write_cache {
+  hash_table<u64, write_entry> Files;
+  hash_table<u64, bool> Dirs; // the directories known to exist, keyed by a hash of the path
+  int MaxOpenFiles = 64;
+  int NOpenFiles = 0;
+  i64 FlushBytes = i64(1) << 20;
+  i64 MaxBytes = i64(64) << 20;
+  i64 Bytes = 0; // the number of bytes in all buffers
+  u64 Clock = 0;
+  i64 NWrites = 0;
+  i64 NOpens = 0;
+};
+
+void Init(write_cache* Wc, int MaxOpenFiles = 64);
+/* Write what is left in the buffers, close all the files, and free the buffers */
+void Dealloc(write_cache* Wc);
+/* Drop what is left in the buffers (after a write failed) and close all the files */
+void Discard(write_cache* Wc);
+
+/* Append Bytes bytes to a file, which is created if it does not exist. Return false if a write fails. */
+bool Append(write_cache* Wc, const stref& FileName, const void* Data, i64 Bytes);
+/* Append the concatenation of NParts buffers. If they add up to at least FlushBytes and nothing of
+the file is buffered, they are written with a single gather write instead of being copied. */
+bool Append(write_cache* Wc, const stref& FileName, const buffer* Parts, int NParts);
+idx2_T(t) idx2_Inline bool
+AppendPOD(write_cache* Wc, const stref& FileName, const t& Val) { return Append(Wc, FileName, &Val, sizeof(t)); }
+/* Write the buffers of all files and close them. Return false if a write fails. */
+bool Flush(write_cache* Wc);
+
+} // namespace idx2
@@ -1,5 +1,6 @@
 #include "idx2_algorithm.h"
 #include "idx2_bitstream.h"
+#include "idx2_wavelet.h"
 #include "idx2_zfp.h"
 
 namespace idx2 {
@@ -157,5 +158,228 @@ Decode(u64* Block, int B, i64 S, i8& N, i8& M, bitstream* Bs) {
   return ((N == 64 && M == N)|| Lb == 0);
 }
 
+/* Gather bit plane B of a block of NVals coefficients (bit I of the result is the bit of coefficient I) */
+idx2_TargetScalar static u64
+GatherBitPlaneScalar(const u64* idx2_Restrict Block, int NVals, int B) {
+  u64 X = 0;
+  for (int I = 0; I < NVals; ++I)
+    X += ((Block[I] >> B) & 1u) << I;
+  return X;
+}
+
+#if defined(idx2_X86)
+/* 4 coefficients at a time: their bit B is shifted into the sign bit, which movemask collects */
+idx2_TargetAvx2 static u64
+GatherBitPlaneAvx2(const u64* idx2_Restrict Block, int NVals, int B) {
+  u64 X = 0;
+  __m128i Shift = _mm_cvtsi32_si128(63 - B);
+  int I = 0;
+  for (; I + 4 <= NVals; I += 4) {
+    __m256i Val = _mm256_sll_epi64(_mm256_loadu_si256((const __m256i*)(Block + I)), Shift);
+    X |= u64(_mm256_movemask_pd(_mm256_castsi256_pd(Val))) << I;
+  }
+  for (; I < NVals; ++I)
+    X += ((Block[I] >> B) & 1u) << I;
+  return X;
+}
+
+/* 8 coefficients at a time, with one test into a mask register */
+idx2_TargetAvx512 static u64
+GatherBitPlaneAvx512(const u64* idx2_Restrict Block, int NVals, int B) {
+  u64 X = 0;
+  __m512i Bit = _mm512_set1_epi64(i64(u64(1) << B));
+  int I = 0;
+  for (; I + 8 <= NVals; I += 8)
+    X |= u64(_mm512_test_epi64_mask(_mm512_loadu_si512(Block + I), Bit)) << I;
+  for (; I < NVals; ++I)
+    X += ((Block[I] >> B) & 1u) << I;
+  return X;
+}
+
+/* Transpose the 4x4 64-bit values in R0, R1, R2, R3 (one row in each) */
+idx2_TargetAvx2 static idx2_Inline void
+Transpose4x4(__m256i& R0, __m256i& R1, __m256i& R2, __m256i& R3) {
+  __m256i T0 = _mm256_unpacklo_epi64(R0, R1), T1 = _mm256_unpackhi_epi64(R0, R1);
+  __m256i T2 = _mm256_unpacklo_epi64(R2, R3), T3 = _mm256_unpackhi_epi64(R2, R3);
+  R0 = _mm256_permute2x128_si256(T0, T2, 0x20);
+  R1 = _mm256_permute2x128_si256(T1, T3, 0x20);
+  R2 = _mm256_permute2x128_si256(T0, T2, 0x31);
+  R3 = _mm256_permute2x128_si256(T1, T3, 0x31);
+}
+
+/* Transpose the 8x8 64-bit values in R0, ..., R7 (one row in each): pairs of values, then 128-bit
+lanes, then pairs of 128-bit lanes. The unmasked intrinsics pass an undefined source to the masked
+builtins in g++, which then warns (-Wuninitialized); the zero-masking forms with a full mask compile
+to the same instructions */
+idx2_TargetAvx512 static idx2_Inline void
+Transpose8x8(__m512i& R0, __m512i& R1, __m512i& R2, __m512i& R3, __m512i& R4, __m512i& R5, __m512i& R6, __m512i& R7) {
+  __m512i T0 = _mm512_maskz_unpacklo_epi64(0xFF, R0, R1), T1 = _mm512_maskz_unpackhi_epi64(0xFF, R0, R1);
+  __m512i T2 = _mm512_maskz_unpacklo_epi64(0xFF, R2, R3), T3 = _mm512_maskz_unpackhi_epi64(0xFF, R2, R3);
+  __m512i T4 = _mm512_maskz_unpacklo_epi64(0xFF, R4, R5), T5 = _mm512_maskz_unpackhi_epi64(0xFF, R4, R5);
+  __m512i T6 = _mm512_maskz_unpacklo_epi64(0xFF, R6, R7), T7 = _mm512_maskz_unpackhi_epi64(0xFF, R6, R7);
+  __m512i U0 = _mm512_maskz_shuffle_i64x2(0xFF, T0, T2, 0x88), U1 = _mm512_maskz_shuffle_i64x2(0xFF, T1, T3, 0x88);
+  __m512i U2 = _mm512_maskz_shuffle_i64x2(0xFF, T0, T2, 0xdd), U3 = _mm512_maskz_shuffle_i64x2(0xFF, T1, T3, 0xdd);
+  __m512i U4 = _mm512_maskz_shuffle_i64x2(0xFF, T4, T6, 0x88), U5 = _mm512_maskz_shuffle_i64x2(0xFF, T5, T7, 0x88);
+  __m512i U6 = _mm512_maskz_shuffle_i64x2(0xFF, T4, T6, 0xdd), U7 = _mm512_maskz_shuffle_i64x2(0xFF, T5, T7, 0xdd);
+  R0 = _mm512_maskz_shuffle_i64x2(0xFF, U0, U4, 0x88); R4 = _mm512_maskz_shuffle_i64x2(0xFF, U0, U4, 0xdd);
+  R1 = _mm512_maskz_shuffle_i64x2(0xFF, U1, U5, 0x88); R5 = _mm512_maskz_shuffle_i64x2(0xFF, U1, U5, 0xdd);
+  R2 = _mm512_maskz_shuffle_i64x2(0xFF, U2, U6, 0x88); R6 = _mm512_maskz_shuffle_i64x2(0xFF, U2, U6, 0xdd);
+  R3 = _mm512_maskz_shuffle_i64x2(0xFF, U3, U7, 0x88); R7 = _mm512_maskz_shuffle_i64x2(0xFF, U3, U7, 0xdd);
+}
+
+/* Row I of the 4x4 (8x8) values to transpose is made of coefficients I, ..., I + 3 (I + 7) of block L */
+idx2_TargetAvx2 static idx2_Inline __m256i
+LoadRow4(const void* Blocks, int L, int I) { return _mm256_loadu_si256((const __m256i*)((const u64*)Blocks + L * 64 + I)); }
+idx2_TargetAvx2 static idx2_Inline void
+StoreRow4(void* Blocks, int L, int I, __m256i R) { _mm256_storeu_si256((__m256i*)((u64*)Blocks + L * 64 + I), R); }
+idx2_TargetAvx512 static idx2_Inline __m512i
+LoadRow8(const void* Blocks, int L, int I) { return _mm512_loadu_si512((const u64*)Blocks + L * 64 + I); }
+idx2_TargetAvx512 static idx2_Inline void
+StoreRow8(void* Blocks, int L, int I, __m512i R) { _mm512_storeu_si512((u64*)Blocks + L * 64 + I, R); }
+
+/* The batched transforms of idx2_zfp.h, with the transposes between one block after another and
+the structure of arrays done 4x4 (8x8) values at a time in registers. V[I] holds coefficient I of
+all the blocks. */
+idx2_TargetAvx2 static void
+ForwardZfp4Blocks(const i64* idx2_Restrict IBlocks, u64* idx2_Restrict UBlocks) {
+  __m256i V[64];
+  for (int I = 0; I < 64; I += 4) {
+    __m256i R0 = LoadRow4(IBlocks, 0, I), R1 = LoadRow4(IBlocks, 1, I), R2 = LoadRow4(IBlocks, 2, I), R3 = LoadRow4(IBlocks, 3, I);
+    Transpose4x4(R0, R1, R2, R3);
+    V[I + 0] = R0; V[I + 1] = R1; V[I + 2] = R2; V[I + 3] = R3;
+  }
+  ForwardZfpSoA<4>((i64*)V);
+  const __m256i Mask = _mm256_set1_epi64x(i64(traits<u64>::NBinaryMask));
+  for (int I = 0; I < 64; I += 4) {
+    __m256i R[4];
+    for (int K = 0; K < 4; ++K) R[K] = _mm256_xor_si256(_mm256_add_epi64(V[Perm3[I + K]], Mask), Mask);
+    Transpose4x4(R[0], R[1], R[2], R[3]);
+    for (int L = 0; L < 4; ++L) StoreRow4(UBlocks, L, I, R[L]);
+  }
+}
+
+idx2_TargetAvx2 static void
+InverseZfp4Blocks(const u64* idx2_Restrict UBlocks, i64* idx2_Restrict IBlocks) {
+  __m256i V[64];
+  const __m256i Mask = _mm256_set1_epi64x(i64(traits<u64>::NBinaryMask));
+  for (int I = 0; I < 64; I += 4) {
+    __m256i R[4];
+    for (int L = 0; L < 4; ++L) R[L] = LoadRow4(UBlocks, L, I);
+    Transpose4x4(R[0], R[1], R[2], R[3]);
+    for (int K = 0; K < 4; ++K) V[Perm3[I + K]] = _mm256_sub_epi64(_mm256_xor_si256(R[K], Mask), Mask);
+  }
+  InverseZfpSoA<4>((i64*)V);
+  for (int I = 0; I < 64; I += 4) {
+    __m256i R0 = V[I + 0], R1 = V[I + 1], R2 = V[I + 2], R3 = V[I + 3];
+    Transpose4x4(R0, R1, R2, R3);
+    StoreRow4(IBlocks, 0, I, R0); StoreRow4(IBlocks, 1, I, R1); StoreRow4(IBlocks, 2, I, R2); StoreRow4(IBlocks, 3, I, R3);
+  }
+}
+
+idx2_TargetAvx512 static void
+ForwardZfp8Blocks(const i64* idx2_Restrict IBlocks, u64* idx2_Restrict UBlocks) {
+  __m512i V[64];
+  for (int I = 0; I < 64; I += 8) {
+    __m512i R[8];
+    for (int L = 0; L < 8; ++L) R[L] = LoadRow8(IBlocks, L, I);
+    Transpose8x8(R[0], R[1], R[2], R[3], R[4], R[5], R[6], R[7]);
+    for (int K = 0; K < 8; ++K) V[I + K] = R[K];
+  }
+  ForwardZfpSoA<8>((i64*)V);
+  const __m512i Mask = _mm512_set1_epi64(i64(traits<u64>::NBinaryMask));
+  for (int I = 0; I < 64; I += 8) {
+    __m512i R[8];
+    for (int K = 0; K < 8; ++K) R[K] = _mm512_xor_si512(_mm512_add_epi64(V[Perm3[I + K]], Mask), Mask);
+    Transpose8x8(R[0], R[1], R[2], R[3], R[4], R[5], R[6], R[7]);
+    for (int L = 0; L < 8; ++L) StoreRow8(UBlocks, L, I, R[L]);
+  }
+}
+
+idx2_TargetAvx512 static void
+InverseZfp8Blocks(const u64* idx2_Restrict UBlocks, i64* idx2_Restrict IBlocks) {
+  __m512i V[64];
+  const __m512i Mask = _mm512_set1_epi64(i64(traits<u64>::NBinaryMask));
+  for (int I = 0; I < 64; I += 8) {
+    __m512i R[8];
+    for (int L = 0; L < 8; ++L) R[L] = LoadRow8(UBlocks, L, I);
+    Transpose8x8(R[0], R[1], R[2], R[3], R[4], R[5], R[6], R[7]);
+    for (int K = 0; K < 8; ++K) V[Perm3[I + K]] = _mm512_sub_epi64(_mm512_xor_si512(R[K], Mask), Mask);
+  }
+  InverseZfpSoA<8>((i64*)V);
+  for (int I = 0; I < 64; I += 8) {
+    __m512i R[8];
+    for (int K = 0; K < 8; ++K) R[K] = V[I + K];
+    Transpose8x8(R[0], R[1], R[2], R[3], R[4], R[5], R[6], R[7]);
+    for (int L = 0; L < 8; ++L) StoreRow8(IBlocks, L, I, R[L]);
+  }
+}
+#endif
+
+/*
+Define the kernels of an isa: the templates of idx2_zfp.h instantiated for 64-bit integers and
+compiled for the isa (Target), except that the bit plane gather of Encode, the bit plane deposit
+of Decode and the transpose of the bit planes decoded by DecodeTest have versions with intrinsics.
+The batched transforms work on BatchSize blocks, as many as the 64-bit lanes of a vector register. */
+#define idx2_ZfpKernels(Suffix, Isa, Target, GatherBitPlane, DepositBitPlane, TransposeBitPlanes, BatchSize, ForwardBatch, InverseBatch)\
+Target static void ForwardZfp##Suffix(i64* P, int D) { ForwardZfp(P, D); }\
+Target static void InverseZfp##Suffix(i64* P, int D) { InverseZfp(P, D); }\
+Target static void ForwardShuffle##Suffix(i64* IBlock, u64* UBlock, int D) { ForwardShuffle(IBlock, UBlock, D); }\
+Target static void InverseShuffle##Suffix(u64* UBlock, i64* IBlock, int D) { InverseShuffle(UBlock, IBlock, D); }\
+Target static void \
+Encode##Suffix(u64* Block, int NVals, int B, i8& N, bitstream* Bs) {\
+  EncodeBitPlane(GatherBitPlane(Block, NVals, B), NVals, N, Bs);\
+}\
+Target static void \
+Decode##Suffix(u64* Block, int NVals, int B, i8& N, bitstream* Bs) {\
+  u64 X = 0;\
+  DecodeTest(&X, NVals, N, Bs);\
+  DepositBitPlane(X, B, Block);\
+}\
+Target static void DecodeTest##Suffix(u64* Block, int NVals, i8& N, bitstream* Bs) { DecodeTest(Block, NVals, N, Bs); }\
+Target static void TransposeRecursive##Suffix(u64* Block, int NBps) { TransposeBitPlanes(Block, NBps); }\
+Target static void \
+ForwardZfpBatch##Suffix(const i64* IBlocks, u64* UBlocks) { ForwardBatch(IBlocks, UBlocks); }\
+Target static void \
+InverseZfpBatch##Suffix(const u64* UBlocks, i64* IBlocks) { InverseBatch(UBlocks, IBlocks); }\
+static_assert(BatchSize <= ZfpMaxBatchSize);\
+static const zfp_kernels ZfpKernels##Suffix = {\
+  Isa, ForwardZfp##Suffix, InverseZfp##Suffix, ForwardShuffle##Suffix, InverseShuffle##Suffix,\
+  Encode##Suffix, Decode##Suffix, DecodeTest##Suffix, TransposeRecursive##Suffix,\
+  BatchSize, ForwardZfpBatch##Suffix, InverseZfpBatch##Suffix\
+};
+
+idx2_ZfpKernels(Scalar, isa::scalar, idx2_TargetScalar, GatherBitPlaneScalar, TransposeNormal, TransposeRecursive, 1,
+                ForwardZfpBatch<1>, InverseZfpBatch<1>)
+#if defined(idx2_X86)
+idx2_ZfpKernels(Avx2, isa::avx2, idx2_TargetAvx2, GatherBitPlaneAvx2, TransposeAvx2, TransposeRecursive, 4,
+                ForwardZfp4Blocks, InverseZfp4Blocks)
+idx2_ZfpKernels(Avx512, isa::avx512, idx2_TargetAvx512, GatherBitPlaneAvx512, TransposeAvx512, TransposeBitPlanesAvx512, 8,
+                ForwardZfp8Blocks, InverseZfp8Blocks)
+#endif
+
+static const zfp_kernels&
+GetZfpKernels(isa Isa) {
+#if defined(idx2_X86)
+  if (Isa == isa::avx512)
+    return ZfpKernelsAvx512;
+  if (Isa == isa::avx2)
+    return ZfpKernelsAvx2;
+#endif
+  (void)Isa;
+  return ZfpKernelsScalar;
+}
+
+zfp_kernels Zfp = GetZfpKernels(DetectIsa());
+
+isa
+SetIsa(isa Isa) {
+  isa Best = DetectIsa();
+  if (Isa == isa::__Invalid__ || u8(Isa) > u8(Best))
+    Isa = Best;
+  Zfp = GetZfpKernels(Isa);
+  Cdf53 = GetCdf53Kernels(Isa);
+  return Isa;
+}
+
 } // namespace idx2
 
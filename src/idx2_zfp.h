@@ -9,7 +9,10 @@
 #include "idx2_assert.h"
 #include "idx2_bitops.h"
 #include "idx2_math.h"
+#include "idx2_cpu.h"
+#if defined(idx2_X86)
 #include <immintrin.h>
+#endif
 //#include <iostream>
 
 namespace idx2 {
@@ -35,12 +38,45 @@ idx2_TT(t, u) void ForwardShuffle(t* IBlock, u* UBlock, int D);
 idx2_TT(t, u) void InverseShuffle(u* UBlock, t* IBlock, int D);
 idx2_TTI(t, u, S) void ForwardShuffle2D(t* IBlock, u* UBlock);
 idx2_TTI(t, u, S) void InverseShuffle2D(u* UBlock, t* IBlock);
+/* ForwardZfp followed by ForwardShuffle (InverseShuffle followed by InverseZfp) of N full 4x4x4
+blocks, stored one after another in IBlocks and UBlocks */
+idx2_I(N) void ForwardZfpBatch(const i64* IBlocks, u64* UBlocks);
+idx2_I(N) void InverseZfpBatch(const u64* UBlocks, i64* IBlocks);
 
 /* Pad partial block of width N < 4 and stride S */
 idx2_T(t) void PadBlock1D(t* P, int N, int S);
 idx2_T(t) void PadBlock2D(t* P, const v2i& N);
 idx2_T(t) void PadBlock3D(t* P, const v3i& N);
 
+/* Copy a full 4x4x4 block between a strided grid of samples and a row-major block. Base points to the
+first sample of the block, and S3 holds the distances (in samples) between neighbors along X, Y, Z.
+The samples are converted if the grid and the block have different types. */
+idx2_TT(t, u) void GatherBlock(const t* Base, const v3<i64>& S3, u* Block);
+idx2_TT(t, u) void ScatterBlock(const u* Block, const v3<i64>& S3, t* Base);
+
+/*
+The kernels of the zfp codec on blocks of 64-bit integers, in one version per isa. Zfp holds the
+versions of the isa chosen with SetIsa (by default, the best isa that the cpu supports). */
+struct zfp_kernels {
+  isa Isa = isa::scalar;
+  void (*ForwardZfp)(i64* P, int D);
+  void (*InverseZfp)(i64* P, int D);
+  void (*ForwardShuffle)(i64* IBlock, u64* UBlock, int D);
+  void (*InverseShuffle)(u64* UBlock, i64* IBlock, int D);
+  void (*Encode)(u64* Block, int NVals, int B, i8& N, bitstream* Bs);
+  void (*Decode)(u64* Block, int NVals, int B, i8& N, bitstream* Bs);
+  void (*DecodeTest)(u64* Block, int NVals, i8& N, bitstream* Bs);
+  void (*TransposeRecursive)(u64* Block, int NBps);
+  int BatchSize; // the number of blocks that ForwardZfpBatch and InverseZfpBatch work on
+  void (*ForwardZfpBatch)(const i64* IBlocks, u64* UBlocks);
+  void (*InverseZfpBatch)(const u64* UBlocks, i64* IBlocks);
+};
+constexpr int ZfpMaxBatchSize = 8;
+extern zfp_kernels Zfp;
+/* Use the kernels of Isa (in Zfp and in Cdf53), or of the best isa the cpu supports if it does not
+support Isa. Return the isa of the kernels used. */
+isa SetIsa(isa Isa);
+
 idx2_T(t) void Encode(t* Block, int NVals, int B, i8& N, bitstream* Bs);
 idx2_T(t) void Decode(t* Block, int NVals, int B, i8& N, bitstream* Bs);
 
@@ -449,6 +485,99 @@ InverseShuffle2D(u* UBlock, t* IBlock) {
     IBlock[perm2<S>::Table[I]] = (t)((UBlock[I] ^ Mask) - Mask);
 }
 
+/*
+The batched transforms first lay the N blocks out as a structure of arrays, where the N values of
+a coefficient (one per block) are next to one another. Every lift then works on N lanes with the
+same instructions, which the compiler turns into vector instructions of width N (4 x 64 bits with
+AVX2, 8 x 64 bits with AVX-512). S is N times the distance between the 4 samples of a lift in a
+block. */
+idx2_Ii(N) void
+FLiftBatch(i64* idx2_Restrict P, int S) {
+  for (int L = 0; L < N; ++L) {
+    i64 X = P[0 * S + L], Y = P[1 * S + L], Z = P[2 * S + L], W = P[3 * S + L];
+    X += W; X >>= 1; W -= X;
+    Z += Y; Z >>= 1; Y -= Z;
+    X += Z; X >>= 1; Z -= X;
+    W += Y; W >>= 1; Y -= W;
+    W += Y >> 1; Y -= W >> 1;
+    P[0 * S + L] = X; P[1 * S + L] = Y; P[2 * S + L] = Z; P[3 * S + L] = W;
+  }
+}
+
+idx2_Ii(N) void
+ILiftBatch(i64* idx2_Restrict P, int S) {
+  for (int L = 0; L < N; ++L) {
+    i64 X = P[0 * S + L], Y = P[1 * S + L], Z = P[2 * S + L], W = P[3 * S + L];
+    Y += W >> 1; W -= Y >> 1;
+    Y += W; W <<= 1; W -= Y;
+    Z += X; X <<= 1; X -= Z;
+    Y += Z; Z <<= 1; Z -= Y;
+    W += X; X <<= 1; X -= W;
+    P[0 * S + L] = X; P[1 * S + L] = Y; P[2 * S + L] = Z; P[3 * S + L] = W;
+  }
+}
+
+/* ForwardZfp of N blocks in the structure-of-arrays layout (coefficient I of block L is P[I * N + L]) */
+idx2_Ii(N) void
+ForwardZfpSoA(i64* idx2_Restrict P) {
+  /* transform along X */
+  for (int Z = 0; Z < 4; ++Z)
+    for (int Y = 0; Y < 4; ++Y)
+      FLiftBatch<N>(P + (4 * Y + 16 * Z) * N, 1 * N);
+  /* transform along Y */
+  for (int X = 0; X < 4; ++X)
+    for (int Z = 0; Z < 4; ++Z)
+      FLiftBatch<N>(P + (16 * Z + 1 * X) * N, 4 * N);
+  /* transform along Z */
+  for (int Y = 0; Y < 4; ++Y)
+    for (int X = 0; X < 4; ++X)
+      FLiftBatch<N>(P + (1 * X + 4 * Y) * N, 16 * N);
+}
+
+idx2_Ii(N) void
+InverseZfpSoA(i64* idx2_Restrict P) {
+  /* transform along Z */
+  for (int Y = 0; Y < 4; ++Y)
+    for (int X = 0; X < 4; ++X)
+      ILiftBatch<N>(P + (1 * X + 4 * Y) * N, 16 * N);
+  /* transform along y */
+  for (int X = 0; X < 4; ++X)
+    for (int Z = 0; Z < 4; ++Z)
+      ILiftBatch<N>(P + (16 * Z + 1 * X) * N, 4 * N);
+  /* transform along X */
+  for (int Z = 0; Z < 4; ++Z)
+    for (int Y = 0; Y < 4; ++Y)
+      ILiftBatch<N>(P + (4 * Y + 16 * Z) * N, 1 * N);
+}
+
+/* The kernels of idx2_zfp.cpp transpose between the two layouts with vector shuffles instead */
+idx2_Ii(N) void
+ForwardZfpBatch(const i64* idx2_Restrict IBlocks, u64* idx2_Restrict UBlocks) {
+  alignas(64) i64 P[64 * N];
+  for (int I = 0; I < 64; ++I)
+    for (int L = 0; L < N; ++L)
+      P[I * N + L] = IBlocks[L * 64 + I];
+  ForwardZfpSoA<N>(P);
+  /* shuffle (and convert to negabinary) back into one block after another */
+  auto Mask = traits<u64>::NBinaryMask;
+  for (int I = 0; I < 64; ++I)
+    for (int L = 0; L < N; ++L)
+      UBlocks[L * 64 + I] = (u64(P[Perm3[I] * N + L]) + Mask) ^ Mask;
+}
+
+idx2_Ii(N) void
+InverseZfpBatch(const u64* idx2_Restrict UBlocks, i64* idx2_Restrict IBlocks) {
+  alignas(64) i64 P[64 * N];
+  auto Mask = traits<u64>::NBinaryMask;
+  for (int I = 0; I < 64; ++I)
+    for (int L = 0; L < N; ++L)
+      P[Perm3[I] * N + L] = i64((UBlocks[L * 64 + I] ^ Mask) - Mask);
+  InverseZfpSoA<N>(P);
+  for (int I = 0; I < 64; ++I)
+    for (int L = 0; L < N; ++L)
+      IBlocks[L * 64 + I] = P[I * N + L];
+}
+
 // TODO: this function is only correct for block size 4
 idx2_T(t) void
 PadBlock1D(t* P, int N, int S) {
@@ -493,6 +622,63 @@ PadBlock2D(t* P, const v2i& N) {
     PadBlock1D(P + X * 1, N.Y, 4);
 }
 
+/* The stride along X is a template argument so that the compiler can turn the rows into vector
+loads (X == 1) or loads and shuffles (X == 2, the finest subbands) */
+idx2_TTI(t, u, X) idx2_Inline void
+GatherBlockX(const t* Base, i64 Sy, i64 Sz, u* Block) {
+  for (int Z = 0; Z < 4; ++Z) {
+    for (int Y = 0; Y < 4; ++Y) {
+      const t* Row = Base + Z * Sz + Y * Sy;
+      u* B = Block + Z * 16 + Y * 4;
+      B[0] = u(Row[0]); B[1] = u(Row[X]); B[2] = u(Row[2 * X]); B[3] = u(Row[3 * X]);
+    }
+  }
+}
+
+idx2_TTi(t, u) void
+GatherBlock(const t* Base, const v3<i64>& S3, u* Block) {
+  if (S3.X == 1) {
+    GatherBlockX<t, u, 1>(Base, S3.Y, S3.Z, Block);
+  } else if (S3.X == 2) {
+    GatherBlockX<t, u, 2>(Base, S3.Y, S3.Z, Block);
+  } else {
+    for (int Z = 0; Z < 4; ++Z) {
+      for (int Y = 0; Y < 4; ++Y) {
+        const t* Row = Base + Z * S3.Z + Y * S3.Y;
+        u* B = Block + Z * 16 + Y * 4;
+        B[0] = u(Row[0]); B[1] = u(Row[S3.X]); B[2] = u(Row[2 * S3.X]); B[3] = u(Row[3 * S3.X]);
+      }
+    }
+  }
+}
+
+idx2_TTI(t, u, X) idx2_Inline void
+ScatterBlockX(const u* Block, i64 Sy, i64 Sz, t* Base) {
+  for (int Z = 0; Z < 4; ++Z) {
+    for (int Y = 0; Y < 4; ++Y) {
+      t* Row = Base + Z * Sz + Y * Sy;
+      const u* B = Block + Z * 16 + Y * 4;
+      Row[0] = t(B[0]); Row[X] = t(B[1]); Row[2 * X] = t(B[2]); Row[3 * X] = t(B[3]);
+    }
+  }
+}
+
+idx2_TTi(t, u) void
+ScatterBlock(const u* Block, const v3<i64>& S3, t* Base) {
+  if (S3.X == 1) {
+    ScatterBlockX<t, u, 1>(Block, S3.Y, S3.Z, Base);
+  } else if (S3.X == 2) {
+    ScatterBlockX<t, u, 2>(Block, S3.Y, S3.Z, Base);
+  } else {
+    for (int Z = 0; Z < 4; ++Z) {
+      for (int Y = 0; Y < 4; ++Y) {
+        t* Row = Base + Z * S3.Z + Y * S3.Y;
+        const u* B = Block + Z * 16 + Y * 4;
+        Row[0] = t(B[0]); Row[S3.X] = t(B[1]); Row[2 * S3.X] = t(B[2]); Row[3 * S3.X] = t(B[3]);
+      }
+    }
+  }
+}
 
 // D is the dimension, K is the size of the block
 idx2_TII(t, D, K) void
@@ -573,15 +759,12 @@ Decode(t* Block, int B, i64 S, i8& N, bitstream* Bs) {
   ++MyCounter;
 }
 
-// NOTE: this is the one being used
-idx2_T(t) void
-Encode(t* idx2_Restrict Block, int NVals, int B, /*i64 S, */i8& N, bitstream* idx2_Restrict BsIn) {
-  static_assert(is_unsigned<t>::Value);
+/* Encode bit plane X (bit I is the bit of coefficient I) of a block of NVals coefficients, the
+first N of which are already significant */
+idx2_Inline void
+EncodeBitPlane(u64 X, int NVals, i8& N, bitstream* idx2_Restrict BsIn) {
   idx2_Assert(NVals <= 64); // e.g. 4x4x4, 4x4, 8x8
   bitstream Bs = *BsIn;
-  u64 X = 0;
-  for (int I = 0; I < NVals; ++I)
-    X += u64((Block[I] >> B) & 1u) << I;
 //  i8 P = (i8)Min((i64)N, S - BitSize(Bs));
   i8 P = N;
   if (P > 0) {
@@ -609,134 +792,86 @@ Encode(t* idx2_Restrict Block, int NVals, int B, /*i64 S, */i8& N, bitstream* id
   *BsIn = Bs;
 }
 
-idx2_Ti(t) void
-TransposeAvx2(u64 X, int B, t* idx2_Restrict Block) {
+// NOTE: this is the one being used (through zfp_kernels::Encode)
+idx2_T(t) void
+Encode(t* idx2_Restrict Block, int NVals, int B, /*i64 S, */i8& N, bitstream* idx2_Restrict BsIn) {
+  static_assert(is_unsigned<t>::Value);
+  idx2_Assert(NVals <= 64); // e.g. 4x4x4, 4x4, 8x8
+  u64 X = 0;
+  for (int I = 0; I < NVals; ++I)
+    X += u64((Block[I] >> B) & 1u) << I;
+  EncodeBitPlane(X, NVals, N, BsIn);
+}
+
+#if defined(idx2_X86)
+/* Add 1 << B to the coefficients whose bits are set in X, 4 coefficients at a time */
+idx2_TargetAvx2 inline void
+TransposeAvx2(u64 X, int B, u64* idx2_Restrict Block) {
   __m256i Minus1 = _mm256_set1_epi64x(-1);
-  __m256i Add = _mm256_set1_epi64x(t(1) << B); // TODO: should be epi64 with t == u64
+  __m256i Add = _mm256_set1_epi64x(i64(u64(1) << B));
   __m256i Mask = _mm256_set_epi64x(0xfffffffffffffff7ll, 0xfffffffffffffffbll, 0xfffffffffffffffdll, 0xfffffffffffffffell);
-  //while (X) {
-    __m256i Val = _mm256_set1_epi64x(X);
+  while (X) {
+    __m256i Val = _mm256_set1_epi64x(i64(X));
     Val = _mm256_or_si256(Val, Mask);
     Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
     _mm256_maskstore_epi64((long long*)Block, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block, Val), Add));
-    //X >>= 4;
-    //Block += 4;
-
-    Val = _mm256_set1_epi64x(X >> 4);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 4, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 4, Val), Add));
-    //X >>= 4;
-    //Block += 4;
-
-    Val = _mm256_set1_epi64x(X >> 8);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 8, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 8, Val), Add));
-
-    Val = _mm256_set1_epi64x(X >> 12);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 12, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 12, Val), Add));
-
-    Val = _mm256_set1_epi64x(X >> 16);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 16, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 16, Val), Add));
-
-    Val = _mm256_set1_epi64x(X >> 20);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 20, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 20, Val), Add));
-
-    Val = _mm256_set1_epi64x(X >> 24);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 24, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 24, Val), Add));
-
-    Val = _mm256_set1_epi64x(X >> 28);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 28, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 28, Val), Add));
-
-    Val = _mm256_set1_epi64x(X >> 32);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 32, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 32, Val), Add));
-
-    Val = _mm256_set1_epi64x(X >> 36);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 36, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 36, Val), Add));
-
-    Val = _mm256_set1_epi64x(X >> 40);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 40, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 40, Val), Add));
-
-    Val = _mm256_set1_epi64x(X >> 44);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 44, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 44, Val), Add));
-
-    Val = _mm256_set1_epi64x(X >> 48);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 48, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 48, Val), Add));
-
-    Val = _mm256_set1_epi64x(X >> 52);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 52, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 52, Val), Add));
-
-    Val = _mm256_set1_epi64x(X >> 56);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 56, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 56, Val), Add));
+    X >>= 4;
+    Block += 4;
+  }
+}
 
-    Val = _mm256_set1_epi64x(X >> 60);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((long long*)Block + 60, Val, _mm256_add_epi64(_mm256_maskload_epi64((long long*)Block + 60, Val), Add));
-  //}
+/* Add 1 << B to the coefficients whose bits are set in X, 8 coefficients at a time */
+idx2_TargetAvx512 inline void
+TransposeAvx512(u64 X, int B, u64* idx2_Restrict Block) {
+  __m512i Add = _mm512_set1_epi64(i64(u64(1) << B));
+  while (X) {
+    __mmask8 M = __mmask8(X & 0xff);
+    __m512i Val = _mm512_maskz_loadu_epi64(M, Block);
+    _mm512_mask_storeu_epi64(Block, M, _mm512_add_epi64(Val, Add));
+    X >>= 8;
+    Block += 8;
+  }
 }
+#endif
 
+/*
+Decode a bit plane of a block of NVals coefficients, the first N of which are already significant,
+into *Block (bit I is the bit of coefficient I). This reads the same bits as EncodeBitPlane writes,
+but the run of zeros before each newly significant coefficient is skipped with a count of trailing
+zeros on the bit buffer instead of one Read per bit. */
 idx2_Inline void
 DecodeTest(u64* idx2_Restrict Block, int NVals, i8& N, bitstream* idx2_Restrict BsIn) {
   idx2_Assert(NVals <= 64); // e.g. 4x4x4, 4x4, 8x8
   bitstream Bs = *BsIn;
-  i8 P = N;
-  u64 X = P > 0 ? ReadLong(&Bs, P) : 0;
-  for (; N < NVals;) {
-    if (Read(&Bs)) {
-      for (; N + 1 < NVals;)
-        if (Read(&Bs)) break; else ++N;
-      X += 1ull << (N++);
-    } else {
+  int I = N; // the first coefficient that is not significant
+  u64 X = I > 0 ? ReadLong(&Bs, I) : 0;
+  while (I < NVals) {
+    if (!Read(&Bs)) // the remaining coefficients are not significant
       break;
+    /* if the coefficients before the last one are all zeros, the last one is not followed by a 1 */
+    int NZeros = NVals - 1 - I; // the most zeros that can precede the significant coefficient
+    while (NZeros > 0) {
+      Refill(&Bs);
+      int NBits = 64 - Bs.BitPos;
+      int Z = Lsb(Bs.BitBuf >> Bs.BitPos, 64);
+      if (Z < NBits && Z < NZeros) { // the 1 that ends the run is in the buffer
+        I += Z;
+        Consume(&Bs, Z + 1);
+        break;
+      }
+      int Skip = Min(NZeros, NBits);
+      I += Skip;
+      Consume(&Bs, Skip);
+      NZeros -= Skip;
     }
+    X += u64(1) << I++;
   }
+  N = i8(I);
   *Block = X;
   *BsIn = Bs;
 }
 
-// NOTE: This is the one being used
+// NOTE: This is the one being used (through zfp_kernels::Decode)
 idx2_T(t) void
 Decode(t* idx2_Restrict Block, int NVals, int B, /*i64 S, */i8& N, bitstream* idx2_Restrict BsIn) {
   static_assert(is_unsigned<t>::Value);
@@ -762,27 +897,13 @@ Decode(t* idx2_Restrict Block, int NVals, int B, /*i64 S, */i8& N, bitstream* id
 //    for (int I = 0; I < K; ++I)
 //      Block[I] += (t)((X >> I) & 1u) << B;
 //  }
-#if defined(idx2_Avx2)
-  __m256i Minus1 = _mm256_set1_epi64x(-1);
-  __m256i Add = _mm256_set1_epi64x(t(1) << B);
-  __m256i Mask = _mm256_set_epi64x(0xfffffffffffffff7ll, 0xfffffffffffffffbll, 0xfffffffffffffffdll, 0xfffffffffffffffell);
-  while (X) {
-    __m256i Val = _mm256_set1_epi64x(X);
-    Val = _mm256_or_si256(Val, Mask);
-    Val = _mm256_cmpeq_epi64(Val, Minus1);
-    //int table[8] ALIGNED(32) = { 1, 2, 3, 4, 5, 6, 7, 8 };
-    _mm256_maskstore_epi64((i64*)Block, Val, _mm256_add_epi64(_mm256_maskload_epi64((i64*)Block, Val), Add));
-    X >>= 4;
-    Block += 4;
-  }
-#else
   for (int I = 0; X; ++I, X >>= 1)
     Block[I] += (t)(X & 1u) << B;
-#endif
   *BsIn = Bs;
 }
 
-idx2_TII(t, D, K) void
+#if defined(idx2_X86)
+idx2_TII(t, D, K) idx2_TargetAvx2 void
 Decode4(t* Block, int B, i64 S, i8& N, bitstream* Bs) {
   static_assert(is_unsigned<t>::Value);
   int NVals = power<int, K>::Table[D];
@@ -823,6 +944,7 @@ Decode4(t* Block, int B, i64 S, i8& N, bitstream* Bs) {
   }
   ++MyCounter;
 }
+#endif
 
 idx2_Ti(t) void
 TransposeNormal(u64 X, int B, t* idx2_Restrict Block) {
@@ -847,6 +969,34 @@ TransposeNormal(u64 X, int B, t* idx2_Restrict Block) {
   } while (0)
 
 
+#if defined(idx2_X86)
+/*
+Same as TransposeRecursive, for the bit planes decoded by DecodeTest (Block[K] is bit plane 63 - K,
+and the bit planes from NBps on are zeros). Each bit plane is broadcast and or-ed into the eight
+vectors of coefficients, under masks that are the bytes of the bit plane. */
+idx2_TargetAvx512 inline void
+TransposeBitPlanesAvx512(u64* idx2_Restrict Block, int NBps) {
+  __m512i C0 = _mm512_setzero_si512(), C1 = C0, C2 = C0, C3 = C0, C4 = C0, C5 = C0, C6 = C0, C7 = C0;
+  for (int K = 0; K < NBps; ++K) {
+    u64 X = Block[K];
+    if (!X) continue;
+    __m512i Bit = _mm512_set1_epi64(i64(u64(1) << (63 - K)));
+    C0 = _mm512_mask_or_epi64(C0, __mmask8(X      ), C0, Bit);
+    C1 = _mm512_mask_or_epi64(C1, __mmask8(X >>  8), C1, Bit);
+    C2 = _mm512_mask_or_epi64(C2, __mmask8(X >> 16), C2, Bit);
+    C3 = _mm512_mask_or_epi64(C3, __mmask8(X >> 24), C3, Bit);
+    C4 = _mm512_mask_or_epi64(C4, __mmask8(X >> 32), C4, Bit);
+    C5 = _mm512_mask_or_epi64(C5, __mmask8(X >> 40), C5, Bit);
+    C6 = _mm512_mask_or_epi64(C6, __mmask8(X >> 48), C6, Bit);
+    C7 = _mm512_mask_or_epi64(C7, __mmask8(X >> 56), C7, Bit);
+  }
+  _mm512_storeu_si512(Block +  0, C0); _mm512_storeu_si512(Block +  8, C1);
+  _mm512_storeu_si512(Block + 16, C2); _mm512_storeu_si512(Block + 24, C3);
+  _mm512_storeu_si512(Block + 32, C4); _mm512_storeu_si512(Block + 40, C5);
+  _mm512_storeu_si512(Block + 48, C6); _mm512_storeu_si512(Block + 56, C7);
+}
+#endif
+
 /* compress sequence of 4^3 = 64 unsigned integers */
 idx2_T(t) void
 TransposeRecursive(t* data, int NBps) {
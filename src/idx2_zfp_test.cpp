@@ -0,0 +1,168 @@
+#include "idx2_test.h"
+#include "idx2_bitstream.h"
+#include "idx2_common.h"
+#include "idx2_cpu.h"
+#include "idx2_random.h"
+#include "idx2_zfp.h"
+
+using namespace idx2;
+
+/* DecodeTest as it was before it skipped the runs of zeros with a count of trailing zeros */
+static void
+DecodeBitPlaneBitByBit(u64* Block, int NVals, i8& N, bitstream* BsIn) {
+  bitstream Bs = *BsIn;
+  i8 P = N;
+  u64 X = P > 0 ? ReadLong(&Bs, P) : 0;
+  for (; N < NVals;) {
+    if (Read(&Bs)) {
+      for (; N + 1 < NVals;)
+        if (Read(&Bs)) break; else ++N;
+      X += 1ull << (N++);
+    } else {
+      break;
+    }
+  }
+  *Block = X;
+  *BsIn = Bs;
+}
+
+/* Random coefficients whose magnitudes span all bit planes, with some zeros */
+static void
+RandomBlock(pcg32* Pcg, u64* Block) {
+  idx2_For(int, I, 0, 64) {
+    u64 Val = (u64(NextUInt(Pcg)) << 32) | NextUInt(Pcg);
+    u32 Shift = NextUInt(Pcg, 72);
+    Block[I] = Shift >= 64 ? 0 : Val >> Shift;
+  }
+}
+
+idx2_Inline u64
+GatherBitPlane(const u64* Block, int NVals, int B) {
+  u64 X = 0;
+  idx2_For(int, I, 0, NVals) X += ((Block[I] >> B) & 1u) << I;
+  return X;
+}
+
+/* Encode all bit planes of random blocks, then decode them bit by bit and with DecodeTest */
+void
+TestZfpDecodeTest() {
+  pcg32 Pcg;
+  Seed(&Pcg, 1234);
+  const int NValsList[] = { 1, 4, 16, 64 };
+  idx2_For(int, Trial, 0, 2000) {
+    int NVals = NValsList[Trial % 4];
+    u64 Block[64];
+    RandomBlock(&Pcg, Block);
+    bitstream Bs;
+    InitWrite(&Bs, 64 * 66 / 8 + 64);
+    i8 N = 0;
+    idx2_InclusiveForBackward(int, Bp, 63, 0) EncodeBitPlane(GatherBitPlane(Block, NVals, Bp), NVals, N, &Bs);
+    Flush(&Bs);
+    bitstream BsRef, BsNew;
+    InitRead(&BsRef, Bs.Stream);
+    InitRead(&BsNew, Bs.Stream);
+    i8 NRef = 0, NNew = 0;
+    idx2_InclusiveForBackward(int, Bp, 63, 0) {
+      u64 XRef = 0, XNew = 0;
+      DecodeBitPlaneBitByBit(&XRef, NVals, NRef, &BsRef);
+      DecodeTest(&XNew, NVals, NNew, &BsNew);
+      idx2_Assert(XRef == GatherBitPlane(Block, NVals, Bp));
+      idx2_Assert(XNew == XRef);
+      idx2_Assert(NNew == NRef);
+      idx2_Assert(BitSize(BsNew) == BitSize(BsRef));
+    }
+    Dealloc(&Bs);
+  }
+}
+
+/* Compare the kernels of every isa the cpu supports with the scalar ones */
+void
+TestZfpKernels() {
+  pcg32 Pcg;
+  Seed(&Pcg, 5678);
+  isa Best = DetectIsa();
+  /* transpose of the bit planes decoded by DecodeTest */
+  idx2_InclusiveFor(int, NBps, 1, 64) {
+    u64 Planes[64] = {};
+    idx2_For(int, K, 0, NBps) Planes[K] = (u64(NextUInt(&Pcg)) << 32) | NextUInt(&Pcg);
+    u64 Expected[64] = {};
+    idx2_For(int, I, 0, 64) {
+      idx2_For(int, K, 0, NBps) Expected[I] |= ((Planes[K] >> I) & 1u) << (63 - K);
+    }
+    u64 Recursive[64];
+    memcpy(Recursive, Planes, sizeof(Planes));
+    TransposeRecursive(Recursive, NBps);
+    idx2_Assert(memcmp(Recursive, Expected, sizeof(Expected)) == 0);
+    idx2_InclusiveFor(u8, I, u8(isa::scalar), u8(Best)) {
+      SetIsa(isa(I));
+      u64 Block[64];
+      memcpy(Block, Planes, sizeof(Planes));
+      Zfp.TransposeRecursive(Block, NBps);
+      idx2_Assert(memcmp(Block, Expected, sizeof(Expected)) == 0);
+    }
+  }
+  /* encoding all bit planes gives the same stream for every isa, and decoding it gives the block back */
+  const int NValsList[] = { 1, 4, 16, 64 };
+  idx2_For(int, Trial, 0, 400) {
+    int NVals = NValsList[Trial % 4];
+    u64 Block[64];
+    RandomBlock(&Pcg, Block);
+    bitstream Ref;
+    idx2_InclusiveFor(u8, I, u8(isa::scalar), u8(Best)) {
+      SetIsa(isa(I));
+      bitstream Bs;
+      InitWrite(&Bs, 64 * 66 / 8 + 64);
+      i8 N = 0;
+      idx2_InclusiveForBackward(int, Bp, 63, 0) Zfp.Encode(Block, NVals, Bp, N, &Bs);
+      Flush(&Bs);
+      if (I == u8(isa::scalar)) {
+        Ref = Bs;
+      } else {
+        idx2_Assert(Size(Bs) == Size(Ref));
+        idx2_Assert(memcmp(Bs.Stream.Data, Ref.Stream.Data, Size(Bs)) == 0);
+      }
+      bitstream In;
+      InitRead(&In, Bs.Stream);
+      u64 Decoded[64] = {};
+      N = 0;
+      idx2_InclusiveForBackward(int, Bp, 63, 0) Zfp.Decode(Decoded, NVals, Bp, N, &In);
+      idx2_Assert(memcmp(Decoded, Block, NVals * sizeof(u64)) == 0);
+      if (I != u8(isa::scalar))
+        Dealloc(&Bs);
+    }
+    Dealloc(&Ref);
+  }
+  /* the batched transforms give the same coefficients as ForwardZfp/ForwardShuffle and
+  InverseShuffle/InverseZfp on one block at a time */
+  idx2_For(int, Trial, 0, 100) {
+    i64 Ints[ZfpMaxBatchSize * 64];
+    idx2_For(int, I, 0, ZfpMaxBatchSize * 64) Ints[I] = i64(u64(NextUInt(&Pcg)) << 28) - (i64(1) << 59);
+    u64 Expected[ZfpMaxBatchSize * 64];
+    idx2_For(int, B, 0, ZfpMaxBatchSize) {
+      i64 Block[64];
+      memcpy(Block, &Ints[B * 64], sizeof(Block));
+      ForwardZfp(Block, 3);
+      ForwardShuffle(Block, &Expected[B * 64], 3);
+    }
+    idx2_InclusiveFor(u8, I, u8(isa::scalar), u8(Best)) {
+      SetIsa(isa(I));
+      for (int B = 0; B < ZfpMaxBatchSize; B += Zfp.BatchSize) {
+        u64 UInts[ZfpMaxBatchSize * 64];
+        Zfp.ForwardZfpBatch(&Ints[B * 64], UInts);
+        idx2_Assert(memcmp(UInts, &Expected[B * 64], Zfp.BatchSize * 64 * sizeof(u64)) == 0);
+        i64 Inverse[ZfpMaxBatchSize * 64];
+        Zfp.InverseZfpBatch(UInts, Inverse);
+        idx2_For(int, J, 0, Zfp.BatchSize) {
+          i64 Block[64];
+          InverseShuffle(&UInts[J * 64], Block, 3);
+          InverseZfp(Block, 3);
+          idx2_Assert(memcmp(&Inverse[J * 64], Block, sizeof(Block)) == 0);
+        }
+      }
+    }
+  }
+  SetIsa(Best);
+}
+
+idx2_RegisterTest(TestZfpDecodeTest)
+idx2_RegisterTest(TestZfpKernels)